@@ -0,0 +1,371 @@
+/** driver.c
+ * @brief Run attis over a generated corpus and record its throughput
+ *
+ * Each case generates a program with the generator, runs attis on it and
+ * records the wall and CPU time, throughput and peak resident set size of the
+ * run, along with what attis reports for each phase with --stats=json. The
+ * results are written one JSON object per line, so runs from different
+ * versions can be compared line by line.
+ *
+ * STATE: options
+ */
+
+#include "error_handling.h"
+
+#include <getopt.h>       // Option parsing
+#include <string.h>       // `strcmp`
+#include <sys/resource.h> // `struct rusage`
+#include <sys/wait.h>     // `wait4`
+#include <time.h>         // `clock_gettime`
+#include <unistd.h>       // `fork`, `execv`
+
+typedef struct driver_options_t
+{
+    char const *attis;       // The attis binary to run
+    char const *generate;    // The generator binary to run
+    char const *size;        // The size of each generated program
+    char const *output;      // Where to write the results
+    char *const *attis_argv; // Extra arguments for attis
+    int attis_argc;
+} driver_options_t;
+
+/**
+ * STATE: The options given to the driver
+ */
+static driver_options_t options = {"./attis", "obj/bench/generate", "16M",
+                                   "bench/results.json", NULL, 0};
+
+/**
+ * @brief A generated program to time attis on
+ */
+typedef struct bench_case_t
+{
+    char const *name;
+    char const *arguments[8]; // Generator arguments besides the size
+} bench_case_t;
+
+static bench_case_t const bench_cases[] = {
+    { "random",               {"--shape", "random", "--depth", "4"}},
+    {"additive", {"--shape", "random", "--operators", "+-", "--depth", "4"}},
+    { "nested",             {"--shape", "nested", "--depth", "256"}},
+    {  "chain",           {"--shape", "chain", "--length", "10000"}},
+    {"literal",           {"--shape", "literal", "--digits", "200"}},
+    {   "tiny",                                 {"--shape", "tiny"}},
+    {   "deep",          {"--shape", "nested", "--depth", "100000"}},
+    {   "long",          {"--shape", "chain", "--length", "1000000"}},
+};
+
+/**
+ * @brief What was measured for one case
+ */
+typedef struct bench_result_t
+{
+    size_t bytes;
+    size_t tokens;
+    size_t statements;
+    double wall_seconds;
+    double user_seconds;
+    double system_seconds;
+    long peak_rss_kb;
+    int exit_status;
+    char *stats; // The line of JSON attis printed for --stats, or NULL
+} bench_result_t;
+
+static char const *short_options = "a:g:s:o:h";
+
+static struct option const long_options[] = {
+    {   "attis", required_argument, 0, 'a'},
+    {"generate", required_argument, 0, 'g'},
+    {    "size", required_argument, 0, 's'},
+    {  "output", required_argument, 0, 'o'},
+    {    "help",       no_argument, 0, 'h'},
+    {         0,                 0, 0,   0}
+};
+
+/**
+ * @brief Print usage and exit
+ * @param[in] program_name The name of the program, pass with argv[0]
+ */
+noreturn static void usage(char const *program_name)
+{
+    printf("Usage: '%s [options] [-- attis options]'\n", program_name);
+    printf("\n"
+           "Time attis on each shape of generated program.\n"
+           "\n"
+           "Options:\n"
+           "    {-a || --attis}      The attis binary (./attis)\n"
+           "    {-g || --generate}   The generator binary "
+           "(obj/bench/generate)\n"
+           "    {-s || --size}       The size of each program (16M)\n"
+           "    {-o || --output}     The results file, one JSON object per "
+           "line\n"
+           "                         (bench/results.json)\n");
+    exit(EXIT_SUCCESS);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Running
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Get the time of a monotonic clock
+ * @return The time in seconds
+ */
+static double get_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Run a program to completion
+ * @param[in] argv The program and its arguments, ending with NULL
+ * @param[in] output The file to send stdout to
+ * @param[in] error The file to send stderr to, or NULL to leave it
+ * @param[out] usage The resources used by the program
+ * @return The exit status of the program
+ */
+static int run_command(char *const argv[], char const *output,
+                       char const *error, struct rusage *usage)
+{
+    fflush(stdout);
+    pid_t pid = fork();
+    ASSERT(pid != -1, "Failed to fork\n");
+    if (pid == 0)
+    {
+        if (freopen(output, "w", stdout) == NULL
+            || (error != NULL && freopen(error, "w", stderr) == NULL))
+        {
+            _exit(127);
+        }
+        execv(argv[0], argv);
+        _exit(127);
+    }
+
+    int status;
+    ASSERT(wait4(pid, &status, 0, usage) == pid, "Failed to wait for '%s'\n",
+           argv[0]);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+/**
+ * @brief Count the bytes, tokens and statements of a program
+ * @param[in] filename The program to count
+ * @param[out] result The counts
+ */
+static void count_program(char const *filename, bench_result_t *result)
+{
+    FILE *file = fopen(filename, "r");
+    ASSERT(file != NULL, "Failed to open '%s'\n", filename);
+    int in_literal = 0;
+    int character;
+    while ((character = getc(file)) != EOF)
+    {
+        result->bytes += 1;
+        int is_digit = character >= '0' && character <= '9';
+        if (is_digit && !in_literal)
+        {
+            result->tokens += 1;
+        }
+        else if (!is_digit && strchr("+-*/%();", character) != NULL)
+        {
+            result->tokens += 1;
+            result->statements += character == ';';
+        }
+        in_literal = is_digit;
+    }
+    fclose(file);
+}
+
+/**
+ * @brief Read the line of JSON attis printed for --stats
+ * @param[in] filename The file attis wrote stderr to
+ * @return The line without its newline, or NULL if there wasn't one
+ */
+static char *read_stats(char const *filename)
+{
+    FILE *file = fopen(filename, "r");
+    ASSERT(file != NULL, "Failed to open '%s'\n", filename);
+    char *line = NULL;
+    size_t reserve_space = 0;
+    ssize_t length;
+    while ((length = getline(&line, &reserve_space, file)) != -1)
+    {
+        if (line[0] == '{')
+        {
+            if (line[length - 1] == '\n')
+            {
+                line[length - 1] = '\0';
+            }
+            fclose(file);
+            return line;
+        }
+        // Anything else is an error message, so pass it on
+        fputs(line, stderr);
+    }
+    free(line);
+    fclose(file);
+    return NULL;
+}
+
+/**
+ * @brief Generate the program for a case and time attis on it
+ * @param[in] bench_case The case to run
+ * @param[in] filename Where to write the program
+ * @param[in] stats_filename Where attis should write its stats
+ * @param[out] result What was measured
+ */
+static void run_case(bench_case_t const *bench_case, char const *filename,
+                     char const *stats_filename, bench_result_t *result)
+{
+    char *generate_argv[16] = {(char *)options.generate, "--size",
+                               (char *)options.size};
+    int generate_argc = 3;
+    for (size_t index = 0; bench_case->arguments[index] != NULL; index++)
+    {
+        generate_argv[generate_argc++] = (char *)bench_case->arguments[index];
+    }
+    struct rusage usage;
+    ASSERT(run_command(generate_argv, filename, NULL, &usage) == 0,
+           "Failed to generate '%s'\n", bench_case->name);
+    count_program(filename, result);
+
+    char **attis_argv
+        = calloc((size_t)options.attis_argc + 4, sizeof(*attis_argv));
+    ASSERT(attis_argv != NULL, "Failed to allocate arguments\n");
+    attis_argv[0] = (char *)options.attis;
+    attis_argv[1] = "--stats=json";
+    for (int index = 0; index < options.attis_argc; index++)
+    {
+        attis_argv[index + 2] = options.attis_argv[index];
+    }
+    attis_argv[options.attis_argc + 2] = (char *)filename;
+
+    double start = get_time();
+    result->exit_status
+        = run_command(attis_argv, "/dev/null", stats_filename, &usage);
+    result->wall_seconds = get_time() - start;
+    free(attis_argv);
+    result->stats = read_stats(stats_filename);
+
+    result->user_seconds
+        = (double)usage.ru_utime.tv_sec + (double)usage.ru_utime.tv_usec / 1e6;
+    result->system_seconds
+        = (double)usage.ru_stime.tv_sec + (double)usage.ru_stime.tv_usec / 1e6;
+    result->peak_rss_kb = usage.ru_maxrss;
+}
+
+/**
+ * @brief Write the result of a case as a line of JSON
+ * @param[in] output The results file
+ * @param[in] name The name of the case
+ * @param[in] result What was measured
+ */
+static void write_result(FILE *output, char const *name,
+                         bench_result_t const *result)
+{
+    fprintf(output, "{\"case\": \"%s\", \"attis_arguments\": \"", name);
+    for (int index = 0; index < options.attis_argc; index++)
+    {
+        fprintf(output, "%s%s", index == 0 ? "" : " ",
+                options.attis_argv[index]);
+    }
+    fprintf(output,
+            "\", \"bytes\": %zu, \"tokens\": %zu, \"statements\": %zu, "
+            "\"wall_seconds\": %.6f, \"user_seconds\": %.6f, "
+            "\"system_seconds\": %.6f, \"mb_per_second\": %.3f, "
+            "\"tokens_per_second\": %.0f, \"statements_per_second\": %.0f, "
+            "\"peak_rss_kb\": %ld, \"exit_status\": %d, \"stats\": %s}\n",
+            result->bytes, result->tokens, result->statements,
+            result->wall_seconds, result->user_seconds, result->system_seconds,
+            (double)result->bytes / 1e6 / result->wall_seconds,
+            (double)result->tokens / result->wall_seconds,
+            (double)result->statements / result->wall_seconds,
+            result->peak_rss_kb, result->exit_status,
+            result->stats == NULL ? "null" : result->stats);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Main
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Main function of the driver
+ * @param[in] argc The number of options passed to the program
+ * @param[in] argv The list of string options passed to the program
+ * @return 0 if attis succeeded on every case
+ */
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt_long(argc, argv, short_options, long_options, 0))
+           != EOF)
+    {
+        switch (opt)
+        {
+        case 'a':
+            options.attis = optarg;
+            break;
+        case 'g':
+            options.generate = optarg;
+            break;
+        case 's':
+            options.size = optarg;
+            break;
+        case 'o':
+            options.output = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+        default:
+            EXIT_ERROR("Bad option, see --help\n");
+        }
+    }
+    options.attis_argv = argv + optind;
+    options.attis_argc = argc - optind;
+
+    char work_directory[] = "/tmp/attis-bench-XXXXXX";
+    ASSERT(mkdtemp(work_directory) != NULL,
+           "Failed to make a work directory\n");
+    char filename[sizeof(work_directory) + 16];
+    snprintf(filename, sizeof(filename), "%s/input.b2", work_directory);
+    char stats_filename[sizeof(work_directory) + 16];
+    snprintf(stats_filename, sizeof(stats_filename), "%s/stats.json",
+             work_directory);
+
+    FILE *output = fopen(options.output, "w");
+    ASSERT(output != NULL, "Failed to open '%s'\n", options.output);
+
+    int exit_code = EXIT_SUCCESS;
+    printf("%-9s %9s %9s %8s %13s %15s %10s\n", "case", "MB", "seconds",
+           "MB/s", "tokens/s", "statements/s", "peak RSS");
+    for (size_t index = 0; index < sizeof(bench_cases) / sizeof(*bench_cases);
+         index++)
+    {
+        bench_result_t result = {0};
+        run_case(&bench_cases[index], filename, stats_filename, &result);
+        remove(filename);
+        remove(stats_filename);
+        write_result(output, bench_cases[index].name, &result);
+        free(result.stats);
+        if (result.exit_status != 0)
+        {
+            fprintf(stderr, "attis failed on '%s' with status %d\n",
+                    bench_cases[index].name, result.exit_status);
+            exit_code = EXIT_FAILURE;
+            continue;
+        }
+        printf("%-9s %9.1f %9.3f %8.1f %13.0f %15.0f %7ld KB\n",
+               bench_cases[index].name, (double)result.bytes / 1e6,
+               result.wall_seconds,
+               (double)result.bytes / 1e6 / result.wall_seconds,
+               (double)result.tokens / result.wall_seconds,
+               (double)result.statements / result.wall_seconds,
+               result.peak_rss_kb);
+    }
+
+    fclose(output);
+    rmdir(work_directory);
+    return exit_code;
+}
@@ -0,0 +1,92 @@
+#!/bin/sh
+# Check that the JIT, and programs compiled with --emit-asm, give the same
+# answers as walking the AST on generated programs, and time them against
+# each other.
+#
+# Usage: bench/eval_compare.sh [attis binary] [generator binary] [size]
+#
+# Single statements from many seeds are compared first, since only the
+# value of the last statement is printed. Each shape is then generated at
+# the given size, compared, and timed. Folding is turned off so that every
+# evaluator sees every node. Compiled programs are assembled with $CC, and
+# only running them is timed.
+
+ATTIS=${1:-./attis}
+GENERATE=${2:-obj/bench/generate}
+SIZE=${3:-16M}
+SEEDS=${SEEDS:-200}
+CC=${CC:-cc}
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+failures=0
+
+# Compile an input to a native program in the work directory
+build_native()
+{
+    "$ATTIS" --no-fold --emit-asm="$WORK_DIR/program.s" "$1" \
+        && "$CC" "$WORK_DIR/program.s" -o "$WORK_DIR/program" -lm
+}
+
+# Check that an output and exit status match walking the AST
+check()
+{
+    if [ "$tree_status" -ne "$2" ] \
+        || ! cmp -s "$WORK_DIR/tree.out" "$WORK_DIR/$1.out"; then
+        echo "Mismatch on $3 with $1"
+        failures=$((failures + 1))
+    fi
+}
+
+# Compare the output and exit status of each evaluator on one input, and
+# leave its native program in the work directory
+compare()
+{
+    "$ATTIS" --no-fold --eval=tree "$1" > "$WORK_DIR/tree.out" 2>&1
+    tree_status=$?
+    "$ATTIS" --no-fold --eval=jit "$1" > "$WORK_DIR/jit.out" 2>&1
+    check jit $? "$2"
+    build_native "$1" || exit 1
+    "$WORK_DIR/program" > "$WORK_DIR/native.out" 2>&1
+    check native $? "$2"
+}
+
+now()
+{
+    date +%s%N
+}
+
+# Time a command, in ms
+time_command()
+{
+    start=$(now)
+    "$@" > /dev/null 2>&1
+    end=$(now)
+    echo $(((end - start) / 1000000))
+}
+
+seed=1
+while [ "$seed" -le "$SEEDS" ]; do
+    "$GENERATE" --shape random --depth $((seed % 12 + 1)) --statements 1 \
+        --seed "$seed" > "$WORK_DIR/input.b2" || exit 1
+    compare "$WORK_DIR/input.b2" "random statement, seed $seed"
+    seed=$((seed + 1))
+done
+
+printf "%-10s %10s %10s %10s\n" shape "tree ms" "jit ms" "native ms"
+for shape in random nested chain literal tiny; do
+    "$GENERATE" --shape "$shape" --size "$SIZE" > "$WORK_DIR/input.b2" \
+        || exit 1
+    compare "$WORK_DIR/input.b2" "$shape"
+    printf "%-10s %10d %10d %10d\n" "$shape" \
+        "$(time_command "$ATTIS" --no-fold --eval=tree \
+            "$WORK_DIR/input.b2")" \
+        "$(time_command "$ATTIS" --no-fold --eval=jit \
+            "$WORK_DIR/input.b2")" \
+        "$(time_command "$WORK_DIR/program")"
+done
+
+if [ "$failures" -ne 0 ]; then
+    echo "$failures mismatches"
+    exit 1
+fi
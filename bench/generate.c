@@ -0,0 +1,357 @@
+/** generate.c
+ * @brief Generate Cybele programs for benchmarking
+ *
+ * Every program generated is valid, and evaluates without dividing by zero,
+ * so the whole pipeline can be timed on it. The same seed always gives the
+ * same program.
+ *
+ * STATE: options, random_state, written
+ */
+
+#include "error_handling.h"
+
+#include <getopt.h> // Option parsing
+#include <string.h> // `strcmp`, `strlen`
+
+//////////////////////////////////////////////////////////////////////////////
+// Options
+//////////////////////////////////////////////////////////////////////////////
+
+typedef enum
+{
+    ShapeRandom,  // Random expressions up to the nesting depth
+    ShapeNested,  // Each statement nested in parenthesis to the depth
+    ShapeChain,   // Each statement a long chain of binary operators
+    ShapeLiteral, // Each statement adds literals with many digits
+    ShapeTiny     // Each statement a single literal
+} shape_enum;
+
+typedef struct generate_options_t
+{
+    size_t size;       // Stop after this many bytes, if not 0
+    size_t statements; // Stop after this many statements, if not 0
+    size_t depth;      // The maximum nesting depth
+    size_t length;     // The operators per statement for chains
+    size_t digits;     // The digits per literal for huge literals
+    char const *operators;
+    shape_enum shape;
+    unsigned long seed;
+} generate_options_t;
+
+/**
+ * STATE: The options given to the generator
+ */
+static generate_options_t options = {0, 0, 4, 10000, 200, "+-*/%",
+                                     ShapeRandom, 1};
+
+/**
+ * STATE: The state of the random number generator
+ */
+static unsigned long random_state = 1;
+
+/**
+ * STATE: The number of bytes written so far
+ */
+static size_t written = 0;
+
+static char const *short_options = "s:n:d:l:D:o:S:r:h";
+
+static struct option const long_options[] = {
+    {      "size", required_argument, 0, 's'},
+    {"statements", required_argument, 0, 'n'},
+    {     "depth", required_argument, 0, 'd'},
+    {    "length", required_argument, 0, 'l'},
+    {    "digits", required_argument, 0, 'D'},
+    { "operators", required_argument, 0, 'o'},
+    {     "shape", required_argument, 0, 'S'},
+    {      "seed", required_argument, 0, 'r'},
+    {      "help",       no_argument, 0, 'h'},
+    {           0,                 0, 0,   0}
+};
+
+/**
+ * @brief Print usage and exit
+ * @param[in] program_name The name of the program, pass with argv[0]
+ */
+noreturn static void usage(char const *program_name)
+{
+    printf("Usage: '%s [options]'\n", program_name);
+    printf("\n"
+           "Write a valid Cybele program to stdout.\n"
+           "\n"
+           "Options:\n"
+           "    {-s || --size}         Stop after this many bytes, with an "
+           "optional\n"
+           "                           K, M or G suffix\n"
+           "    {-n || --statements}   Stop after this many statements\n"
+           "    {-d || --depth}        The maximum nesting depth (4)\n"
+           "    {-l || --length}       Operators per statement for chains "
+           "(10000)\n"
+           "    {-D || --digits}       Digits per literal for literals "
+           "(200)\n"
+           "    {-o || --operators}    The binary operators to use (+-*/%%)\n"
+           "    {-S || --shape}        random, nested, chain, literal or "
+           "tiny\n"
+           "    {-r || --seed}         The random seed (1)\n");
+    exit(EXIT_SUCCESS);
+}
+
+/**
+ * @brief Parse a count, with an optional K, M or G suffix
+ * @param[in] text The text to parse
+ * @return The count
+ */
+static size_t parse_count(char const *text)
+{
+    char *end;
+    unsigned long long count = strtoull(text, &end, 10);
+    ASSERT(end != text, "Bad count '%s'\n", text);
+    switch (*end)
+    {
+    case 'G':
+        count <<= 10;
+        __attribute__((fallthrough));
+    case 'M':
+        count <<= 10;
+        __attribute__((fallthrough));
+    case 'K':
+        count <<= 10;
+        end += 1;
+        break;
+    default:
+        break;
+    }
+    ASSERT(*end == '\0', "Bad count '%s'\n", text);
+    return (size_t)count;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Output
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Write a character of the program
+ */
+static void emit(int character)
+{
+    putchar(character);
+    written += 1;
+}
+
+/**
+ * @brief Get the next random number, by xorshift
+ */
+static unsigned long next_random(void)
+{
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    return random_state;
+}
+
+/**
+ * @brief Get a random number below a bound
+ */
+static size_t random_below(size_t bound)
+{
+    return (size_t)(next_random() % bound);
+}
+
+/**
+ * @brief Write a literal with no leading zeros
+ * @param[in] digits The number of digits
+ */
+static void write_literal(size_t digits)
+{
+    emit('1' + (int)random_below(9));
+    for (size_t index = 1; index < digits; index++)
+    {
+        emit('0' + (int)random_below(10));
+    }
+}
+
+/**
+ * @brief Pick a random binary operator from the operators option
+ */
+static char random_operator(void)
+{
+    return options.operators[random_below(strlen(options.operators))];
+}
+
+static void write_expression(size_t depth);
+
+/**
+ * @brief Write an operand: a literal or parenthesis, maybe negated
+ * @param[in] depth The nesting depth left
+ * @note A unary operator never follows another, which the lexer rejects
+ */
+static void write_operand(size_t depth)
+{
+    if (random_below(4) == 0)
+    {
+        emit(random_below(2) ? '-' : '+');
+    }
+    if (depth > 0 && random_below(3) == 0)
+    {
+        emit('(');
+        write_expression(depth - 1);
+        emit(')');
+    }
+    else
+    {
+        write_literal(1 + random_below(3));
+    }
+}
+
+/**
+ * @brief Write a random expression
+ * @param[in] depth The nesting depth left
+ */
+static void write_expression(size_t depth)
+{
+    write_operand(depth);
+    size_t operator_count = random_below(4);
+    for (size_t index = 0; index < operator_count; index++)
+    {
+        char operator_character = random_operator();
+        emit(operator_character);
+        if (operator_character == '/' || operator_character == '%')
+        {
+            // Anything else might divide by zero
+            write_literal(1);
+        }
+        else
+        {
+            write_operand(depth);
+        }
+    }
+}
+
+/**
+ * @brief Write a single statement in the chosen shape
+ */
+static void write_statement(void)
+{
+    switch (options.shape)
+    {
+    case ShapeRandom:
+        write_expression(options.depth);
+        break;
+    case ShapeNested:
+        // '((1+2)*3)', so every divisor is a literal
+        for (size_t index = 0; index < options.depth; index++)
+        {
+            emit('(');
+        }
+        write_literal(1);
+        for (size_t index = 0; index < options.depth; index++)
+        {
+            emit(random_operator());
+            write_literal(1);
+            emit(')');
+        }
+        break;
+    case ShapeChain:
+        write_literal(1);
+        for (size_t index = 0; index < options.length; index++)
+        {
+            emit(random_operator());
+            write_literal(1);
+        }
+        break;
+    case ShapeLiteral:
+        write_literal(options.digits);
+        emit('+');
+        write_literal(options.digits);
+        break;
+    case ShapeTiny:
+        write_literal(1);
+        break;
+    }
+    emit(';');
+    emit('\n');
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Main
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Main function of the generator
+ * @param[in] argc The number of options passed to the program
+ * @param[in] argv The list of string options passed to the program
+ * @return 0 on success
+ */
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt_long(argc, argv, short_options, long_options, 0))
+           != EOF)
+    {
+        switch (opt)
+        {
+        case 's':
+            options.size = parse_count(optarg);
+            break;
+        case 'n':
+            options.statements = parse_count(optarg);
+            break;
+        case 'd':
+            options.depth = parse_count(optarg);
+            break;
+        case 'l':
+            options.length = parse_count(optarg);
+            break;
+        case 'D':
+            options.digits = parse_count(optarg);
+            ASSERT(options.digits > 0, "Literals need at least one digit\n");
+            break;
+        case 'o':
+            options.operators = optarg;
+            ASSERT(strlen(options.operators) > 0
+                       && strspn(options.operators, "+-*/%")
+                              == strlen(options.operators),
+                   "Operators must be some of +-*/%%\n");
+            break;
+        case 'S':
+            if (strcmp(optarg, "random") == 0)
+                options.shape = ShapeRandom;
+            else if (strcmp(optarg, "nested") == 0)
+                options.shape = ShapeNested;
+            else if (strcmp(optarg, "chain") == 0)
+                options.shape = ShapeChain;
+            else if (strcmp(optarg, "literal") == 0)
+                options.shape = ShapeLiteral;
+            else if (strcmp(optarg, "tiny") == 0)
+                options.shape = ShapeTiny;
+            else
+                EXIT_ERROR("Unknown shape '%s'\n", optarg);
+            break;
+        case 'r':
+            options.seed = parse_count(optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+        default:
+            EXIT_ERROR("Bad option, see --help\n");
+        }
+    }
+    ASSERT(options.size != 0 || options.statements != 0,
+           "Give --size or --statements\n");
+
+    // Zero would stay zero forever
+    random_state = options.seed == 0 ? 1 : options.seed;
+
+    static char buffer[1 << 16];
+    setvbuf(stdout, buffer, _IOFBF, sizeof(buffer));
+
+    for (size_t count = 0;
+         (options.statements == 0 || count < options.statements)
+         && (options.size == 0 || written < options.size);
+         count++)
+    {
+        write_statement();
+    }
+    ASSERT(fflush(stdout) == 0, "Failed to write program\n");
+    return 0;
+}
@@ -0,0 +1,63 @@
+#!/bin/sh
+# Time attis on generated worst-case statements of doubling size, to check
+# that parsing scales linearly with the number of tokens.
+#
+# Usage: bench/parse_scaling.sh [attis binary] [smallest size] [largest size]
+#
+# Each input is a single statement, so the evaluators recurse as deep as the
+# tree and the sizes are capped to stay within the C stack.
+
+ATTIS=${1:-./attis}
+SMALLEST=${2:-16384}
+LARGEST=${3:-262144}
+WORK_DIR=$(mktemp -d)
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+# One long statement alternating priorities, '1+2*3+4*5...', which leans to
+# the right as it is parsed
+generate_chain()
+{
+    awk -v count="$1" 'BEGIN {
+        printf "1";
+        for (i = 1; i < count; i++)
+            printf "%s%d", (i % 2 ? "+" : "*"), i % 9 + 1;
+        print ";";
+    }'
+}
+
+# One statement nested in parenthesis, '1+(2*-(3+(...)))'
+generate_nested()
+{
+    awk -v count="$1" 'BEGIN {
+        for (i = 1; i < count; i++)
+            printf "%d%s(", i % 9 + 1, (i % 2 ? "+" : "*-");
+        printf "1";
+        for (i = 1; i < count; i++)
+            printf ")";
+        print ";";
+    }'
+}
+
+now()
+{
+    date +%s%N
+}
+
+printf "%-8s %10s %10s %12s\n" shape operators ms ns/operator
+for shape in chain nested; do
+    count=$SMALLEST
+    while [ "$count" -le "$LARGEST" ]; do
+        # Deep trees are bounded by the recursive evaluators, not the parser
+        if [ "$shape" = nested ] && [ "$count" -gt 65536 ]; then
+            break
+        fi
+        "generate_$shape" "$count" > "$WORK_DIR/input.b2"
+        start=$(now)
+        "$ATTIS" --no-fold "$WORK_DIR/input.b2" > /dev/null || exit 1
+        end=$(now)
+        elapsed=$((end - start))
+        printf "%-8s %10d %10d %12d\n" "$shape" "$count" \
+            $((elapsed / 1000000)) $((elapsed / count))
+        count=$((count * 2))
+    done
+done
@@ -0,0 +1,218 @@
+/** request.c
+ * @brief Time requests to an attis server from a single process
+ *
+ * Each request connects to the server, sends one input file as --connect
+ * would, and waits for the exit code. Results are sent to /dev/null, so
+ * only the round trip and the compile are timed, without starting a client
+ * process for each request.
+ *
+ * STATE: options
+ */
+
+#include "error_handling.h"
+#include "server.h"
+
+#include <fcntl.h>      // `open`
+#include <getopt.h>     // Option parsing
+#include <string.h>     // `strlen`, `memcpy`
+#include <sys/socket.h> // `socket`, `sendmsg`
+#include <sys/un.h>     // `struct sockaddr_un`
+#include <time.h>       // `clock_gettime`
+#include <unistd.h>     // `close`
+
+typedef struct request_options_t
+{
+    char const *socket;   // The socket the server listens on
+    size_t request_count; // The number of requests to time
+} request_options_t;
+
+/**
+ * STATE: The options given to the benchmark
+ */
+static request_options_t options = {NULL, 1000};
+
+static char const *short_options = "s:n:h";
+
+static struct option const long_options[] = {
+    {  "socket", required_argument, 0, 's'},
+    {"requests", required_argument, 0, 'n'},
+    {    "help",       no_argument, 0, 'h'},
+    {         0,                 0, 0,   0}
+};
+
+/**
+ * @brief Print usage and exit
+ * @param[in] program_name The name of the program, pass with argv[0]
+ */
+noreturn static void usage(char const *program_name)
+{
+    printf("Usage: '%s --socket SOCKET [options] filename...'\n",
+           program_name);
+    printf("\n"
+           "Send requests for each file in turn to a server started with "
+           "--serve, and\n"
+           "print the mean, median and 99th percentile time of a request "
+           "in us.\n"
+           "\n"
+           "Options:\n"
+           "    {-s || --socket}     The socket the server listens on\n"
+           "    {-n || --requests}   The number of requests (1000)\n");
+    exit(EXIT_SUCCESS);
+}
+
+/**
+ * @brief Get the time of a monotonic clock
+ * @return The time in seconds
+ */
+static double get_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Send one request and wait for its answer
+ * @param[in] address The address of the server
+ * @param[in] fd The file descriptors to send with the request
+ * @param[in] filename The file to compile
+ * @return The exit code of the request
+ */
+static int send_one_request(struct sockaddr_un const *address,
+                            int const fd[RequestFdCount],
+                            char const *filename)
+{
+    int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ASSERT(server >= 0, "Failed to open socket\n");
+    ASSERT(connect(server, (struct sockaddr const *)address,
+                   sizeof(*address))
+               == 0,
+           "Failed to connect to '%s'\n", options.socket);
+
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(int) * RequestFdCount)];
+        struct cmsghdr align;
+    } control;
+    size_t argument_size = strlen(filename) + 1;
+    request_header_t header = {REQUEST_MAGIC, 1, (uint32_t)argument_size};
+    struct iovec vector[2] = {
+        {&header, sizeof(header)},
+        {(void *)(uintptr_t)filename, argument_size},
+    };
+    struct msghdr message = {0};
+    message.msg_iov = vector;
+    message.msg_iovlen = 2;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+    struct cmsghdr *item = CMSG_FIRSTHDR(&message);
+    item->cmsg_level = SOL_SOCKET;
+    item->cmsg_type = SCM_RIGHTS;
+    item->cmsg_len = CMSG_LEN(sizeof(int) * RequestFdCount);
+    memcpy(CMSG_DATA(item), fd, sizeof(int) * RequestFdCount);
+    ASSERT(sendmsg(server, &message, MSG_NOSIGNAL)
+               == (ssize_t)(sizeof(header) + argument_size),
+           "Failed to send request\n");
+
+    int32_t exit_code;
+    ssize_t size = recv(server, &exit_code, sizeof(exit_code), MSG_WAITALL);
+    ASSERT(size >= 0, "Failed to receive an answer\n");
+    if (size != (ssize_t)sizeof(exit_code))
+    {
+        EXIT_ERROR("The server closed the connection without an answer\n");
+    }
+    close(server);
+    return exit_code;
+}
+
+/**
+ * @brief Compare two times, for qsort
+ * @param[in] left The first time
+ * @param[in] right The second time
+ * @return The order of the times
+ */
+static int compare_times(void const *left, void const *right)
+{
+    double a = *(double const *)left;
+    double b = *(double const *)right;
+    return (a > b) - (a < b);
+}
+
+/**
+ * @brief Main function of the request benchmark
+ * @param[in] argc The number of options passed to the program
+ * @param[in] argv The list of string options passed to the program
+ * @return 0 if every request succeeded
+ */
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt_long(argc, argv, short_options, long_options, 0))
+           != EOF)
+    {
+        switch (opt)
+        {
+        case 's':
+            options.socket = optarg;
+            break;
+        case 'n':
+            options.request_count = strtoul(optarg, NULL, 10);
+            break;
+        case 'h':
+            usage(argv[0]);
+        default:
+            EXIT_ERROR("Bad option, see --help\n");
+        }
+    }
+    if (options.socket == NULL || optind >= argc
+        || options.request_count == 0)
+    {
+        EXIT_ERROR("A socket, input files and a number of requests are "
+                   "needed, see --help\n");
+    }
+
+    struct sockaddr_un address = {0};
+    if (strlen(options.socket) >= sizeof(address.sun_path))
+    {
+        EXIT_ERROR("Socket path is too long\n");
+    }
+    address.sun_family = AF_UNIX;
+    memcpy(address.sun_path, options.socket, strlen(options.socket) + 1);
+
+    int fd[RequestFdCount];
+    fd[RequestDirectory] = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    fd[RequestOutput] = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    fd[RequestError] = fd[RequestOutput];
+    ASSERT(fd[RequestDirectory] >= 0 && fd[RequestOutput] >= 0,
+           "Failed to open the working directory or /dev/null\n");
+
+    double *times = malloc(options.request_count * sizeof(*times));
+    ASSERT(times != NULL, "Failed to allocate times\n");
+    int exit_code = EXIT_SUCCESS;
+    for (size_t index = 0; index < options.request_count; index++)
+    {
+        char const *filename
+            = argv[optind + (int)(index % (size_t)(argc - optind))];
+        double start = get_time();
+        if (send_one_request(&address, fd, filename) != 0)
+        {
+            exit_code = EXIT_FAILURE;
+        }
+        times[index] = get_time() - start;
+    }
+
+    double total = 0;
+    for (size_t index = 0; index < options.request_count; index++)
+    {
+        total += times[index];
+    }
+    qsort(times, options.request_count, sizeof(*times), compare_times);
+    printf("%.0f %.0f %.0f\n", total / (double)options.request_count * 1e6,
+           times[options.request_count / 2] * 1e6,
+           times[options.request_count * 99 / 100] * 1e6);
+
+    free(times);
+    close(fd[RequestDirectory]);
+    close(fd[RequestOutput]);
+    return exit_code;
+}
@@ -0,0 +1,103 @@
+#!/bin/sh
+# Time many small compiles as fresh processes against the same compiles sent
+# to a server, and check that both print the same output.
+#
+# Usage: bench/serve_latency.sh [attis binary] [generator binary]
+#        [request binary] [size]
+#
+# Each row starts a server with the given options, and compiles the same
+# generated inputs REQUESTS times each way. Requests are sent by a process
+# running attis --connect, which still pays for starting a process, and by
+# the request benchmark from a single process, which shows the latency of
+# the server itself. Times are the mean per request, and the 99th
+# percentile of the single process requests.
+
+ATTIS=${1:-./attis}
+GENERATE=${2:-obj/bench/generate}
+REQUEST=${3:-obj/bench/request}
+SIZE=${4:-4K}
+REQUESTS=${REQUESTS:-500}
+WORK_DIR=$(mktemp -d)
+SOCKET="$WORK_DIR/socket"
+trap 'rm -rf "$WORK_DIR"' EXIT
+
+failures=0
+
+for shape in random nested chain literal tiny; do
+    "$GENERATE" --shape "$shape" --size "$SIZE" > "$WORK_DIR/$shape.b2" \
+        || exit 1
+done
+
+now()
+{
+    date +%s%N
+}
+
+# Run a command on each input in turn until there have been REQUESTS runs,
+# and print the mean time of a run in us
+time_requests()
+{
+    start=$(now)
+    count=0
+    while [ "$count" -lt "$REQUESTS" ]; do
+        for shape in random nested chain literal tiny; do
+            "$@" "$WORK_DIR/$shape.b2" > /dev/null 2>&1
+        done
+        count=$((count + 5))
+    done
+    end=$(now)
+    echo $(((end - start) / count / 1000))
+}
+
+# Start a server with the given options, and wait until it answers
+start_server()
+{
+    "$ATTIS" --serve="$SOCKET" "$@" &
+    server=$!
+    tries=0
+    until "$ATTIS" --connect="$SOCKET" "$WORK_DIR/tiny.b2" > /dev/null 2>&1
+    do
+        tries=$((tries + 1))
+        if [ "$tries" -gt 100 ]; then
+            echo "Server with '$*' didn't start"
+            exit 1
+        fi
+        sleep 0.05
+    done
+}
+
+stop_server()
+{
+    kill "$server"
+    wait "$server"
+}
+
+printf "%-18s %10s %10s %10s %10s\n" options "fresh us" "client us" \
+    "request us" "p99 us"
+for options in "" "-t 4" "--eval=jit" "--cache-dir=$WORK_DIR/cache"; do
+    start_server $options
+    for shape in random nested chain literal tiny; do
+        "$ATTIS" $options "$WORK_DIR/$shape.b2" > "$WORK_DIR/fresh.out" 2>&1
+        "$ATTIS" --connect="$SOCKET" "$WORK_DIR/$shape.b2" \
+            > "$WORK_DIR/server.out" 2>&1
+        if ! cmp -s "$WORK_DIR/fresh.out" "$WORK_DIR/server.out"; then
+            echo "Mismatch on $shape with '$options'"
+            failures=$((failures + 1))
+        fi
+    done
+    fresh=$(time_requests "$ATTIS" $options)
+    client=$(time_requests "$ATTIS" --connect="$SOCKET")
+    request=$("$REQUEST" --socket "$SOCKET" --requests "$REQUESTS" \
+        "$WORK_DIR"/*.b2) || failures=$((failures + 1))
+    stop_server
+    label=$(echo "${options:-default}" | sed "s|$WORK_DIR/||")
+    # The request benchmark prints the mean, median and 99th percentile
+    set -- $request
+    printf "%-18s %10d %10d %10d %10d\n" "$label" "$fresh" "$client" "$1" \
+        "$3"
+done
+
+if [ "$failures" -ne 0 ]; then
+    echo "$failures mismatches"
+    exit 1
+fi
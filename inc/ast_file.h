@@ -0,0 +1,10 @@
+#pragma once
+
+#include "node_pool.h"
+#include "parser.h"
+
+#include <stdio.h> // `FILE`
+
+void write_AST_file(AST_t const *ast, FILE *output);
+node_pool_t *load_AST_file(char const *filename);
+void put_AST_file(void);
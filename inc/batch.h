@@ -0,0 +1,30 @@
+#pragma once
+
+#include "parser.h"
+
+#include <stdio.h> // `FILE`
+
+typedef void (*evaluate_function_t)(AST_t *ast, FILE *output);
+
+typedef struct batch_job_t batch_job_t;
+
+/**
+ * @brief A set of files which are compiled together, each as its own job
+ */
+typedef struct batch_t
+{
+    batch_job_t *job;
+    size_t job_count;
+    size_t reserve_space;
+    int directory; // The directory relative file names are opened in
+    int is_named;  // Nonzero to print each result after its file name
+    int is_read;   // Nonzero to read files into memory rather than map them
+} batch_t;
+
+void add_batch_file(char const *filename);
+int run_batch(evaluate_function_t evaluate);
+void put_batch(void);
+void add_file_to_batch(batch_t *batch, char const *filename);
+int compile_batch(batch_t *batch, evaluate_function_t evaluate, FILE *output,
+                  FILE *error);
+void put_batch_files(batch_t *batch);
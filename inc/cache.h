@@ -0,0 +1,27 @@
+#pragma once
+
+#include "file.h"
+
+#include <stdint.h> // `uint64_t`
+#include <stdio.h>  // `FILE`
+
+#define CACHE_HASH_WORDS 2 // 64-bit words in a key's hash
+
+/**
+ * @brief What a cached result is looked up by
+ */
+typedef struct cache_key_t
+{
+    uint64_t hash[CACHE_HASH_WORDS]; // Of the binary, the options and the
+                                     // file contents
+    uint64_t size;                   // Of the file contents
+} cache_key_t;
+
+void enable_cache(char const *directory, size_t size_limit,
+                  char const *options);
+int is_cache_enabled(void);
+void get_cache_key(cache_key_t *key, input_file_t const *file);
+int load_cached_result(cache_key_t const *key, FILE *output);
+void store_cached_result(cache_key_t const *key, char const *result,
+                         size_t size);
+void put_cache(void);
@@ -0,0 +1,6 @@
+#pragma once
+
+#include "file.h"
+#include "parser.h"
+
+AST_t *parse_file_chunks(input_file_t const *input_file);
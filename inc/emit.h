@@ -0,0 +1,7 @@
+#pragma once
+
+#include "parser.h"
+
+#include <stdio.h> // `FILE`
+
+void emit_assembly(AST_node_t *root, FILE *output);
@@ -1,9 +1,52 @@
 #pragma once
 
-#include <errno.h>  // `errno`
-#include <stdlib.h> // `exit`
-#include <stdint.h> // `uintptr_t`
-#include <stdio.h>  // `fprintf`, `printf`, `stderr`
+#include <errno.h>       // `errno`
+#include <setjmp.h>      // `jmp_buf`
+#include <stdlib.h>      // `exit`
+#include <stdint.h>      // `uintptr_t`
+#include <stdio.h>       // `fprintf`, `printf`, `stderr`
+#include <stdnoreturn.h> // `noreturn`
+
+/**
+ * @brief Somewhere to return to instead of exiting when an error occurs
+ * @note While a trap is set on a thread, errors on that thread longjmp back
+ * to it rather than exiting, so one failing job doesn't end the process
+ */
+typedef struct error_trap_t
+{
+    jmp_buf environment;
+    FILE *output; // Replaces stdout for error messages, if not NULL
+    FILE *error;  // Replaces stderr for error messages, if not NULL
+    int exit_code;
+} error_trap_t;
+
+/**
+ * @brief The outcome of a function run under an error trap
+ */
+typedef struct error_capture_t
+{
+    int failed;
+    int exit_code;
+    char *output; // Error messages for stdout, if the function failed
+    size_t output_size;
+    char *error; // Error messages for stderr, if the function failed
+    size_t error_size;
+} error_capture_t;
+
+typedef void (*trapped_function_t)(void *argument);
+
+extern _Thread_local error_trap_t *error_trap;
+
+FILE *error_output_stream(void);
+FILE *error_message_stream(void);
+noreturn void exit_on_error(int exit_code);
+void capture_errors(error_capture_t *capture, trapped_function_t function,
+                    void *argument);
+void print_captured_errors(error_capture_t const *capture);
+void write_captured_errors(error_capture_t const *capture, FILE *output,
+                           FILE *error);
+void put_error_capture(error_capture_t *capture);
+noreturn void raise_captured_errors(error_capture_t *capture);
 
 /**
  * @brief Assert the truth of the a statement or exit
@@ -11,16 +54,28 @@
  * @param statement The statement to test
  * @param __VA_ARGS__ A variadic argument which will be fed to printf
  */
-#define ASSERT(statement, ...)                                          \
-    do                                                                  \
-    {                                                                   \
-        int temp_err = (int)(uintptr_t)(statement);                     \
-        if (!temp_err)                                                  \
-        {                                                               \
-            fprintf(stderr, "Error on line %d in file %s:\n", __LINE__, \
-                    __FILE__);                                          \
-            fprintf(stderr, __VA_ARGS__);                               \
-            printf("Exiting...\n");                                     \
-            exit(errno ? errno : temp_err);                             \
-        }                                                               \
+#define ASSERT(statement, ...)                                            \
+    do                                                                    \
+    {                                                                     \
+        int temp_err = (int)(uintptr_t)(statement);                       \
+        if (!temp_err)                                                    \
+        {                                                                 \
+            fprintf(error_message_stream(),                               \
+                    "Error on line %d in file %s:\n", __LINE__, __FILE__); \
+            fprintf(error_message_stream(), __VA_ARGS__);                 \
+            fprintf(error_output_stream(), "Exiting...\n");               \
+            exit_on_error(errno ? errno : temp_err);                      \
+        }                                                                 \
+    } while (0)
+
+/**
+ * @brief Print an error message to stdout and exit with EXIT_FAILURE
+ *
+ * @param __VA_ARGS__ A variadic argument which will be fed to printf
+ */
+#define EXIT_ERROR(...)                               \
+    do                                                \
+    {                                                 \
+        fprintf(error_output_stream(), __VA_ARGS__);  \
+        exit_on_error(EXIT_FAILURE);                  \
     } while (0)
@@ -1,6 +1,21 @@
 #pragma once
 
-#include <stdio.h> // `FILE`
+#include "type/intern_t.h"
 
-FILE *get_file(char const *restrict filename, char const *restrict modes);
+#include <stddef.h> // `size_t`
+
+typedef struct input_file_t
+{
+    char const *data; // The file contents, this is not NULL terminated
+    size_t size;
+    int is_mapped; // Nonzero if data is an mmap of the file, else heap memory
+    intern_t filename;
+} input_file_t;
+
+void open_file(input_file_t *file, char const *filename);
+void open_file_at(input_file_t *file, int directory, char const *filename);
+void read_file(input_file_t *file, char const *filename);
+void read_file_at(input_file_t *file, int directory, char const *filename);
+void close_file(input_file_t *file);
+input_file_t *get_file(char const *filename);
 void put_file(void);
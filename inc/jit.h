@@ -0,0 +1,41 @@
+#pragma once
+
+#include "parser.h"
+
+#include <stdint.h> // `uint8_t`
+
+/**
+ * @brief An evaluator for statements the JIT can't compile
+ * @param[in] statement The root of the statement
+ * @return The value of the statement
+ */
+typedef double (*jit_fallback_t)(AST_node_t *statement);
+
+/**
+ * @brief The native code for a program, called with its constant table
+ */
+typedef double (*jit_entry_t)(double const *constant);
+
+/**
+ * @brief A program compiled to x86-64 machine code
+ * @note The code is built in place in its own mapping, which is made
+ * executable but not writable once it is finished, so it is never both
+ */
+typedef struct jit_program_t
+{
+    uint8_t *code; // The mapping holding the code
+    size_t code_size;
+    size_t code_reserve_space; // The size of the mapping
+    double *constant; // The value of each literal, loaded by the code
+    size_t constant_count;
+    size_t constant_reserve_space;
+    jit_entry_t entry;
+    size_t fallback_count; // The statements left to the fallback evaluator
+} jit_program_t;
+
+void compile_jit_statements(jit_program_t *jit, AST_node_t *first,
+                            size_t count, jit_fallback_t fallback);
+void compile_jit(jit_program_t *jit, AST_node_t *root,
+                 jit_fallback_t fallback);
+double run_jit(jit_program_t const *jit);
+void put_jit(jit_program_t *jit);
@@ -1,9 +1,8 @@
 #pragma once
 
-#include "type/string_t.h"
-#include "type/list_t.h"
+#include "file.h"
 
-#include <stdio.h> // `FILE`
+#include <stdint.h> // `uint8_t`, `uint32_t`
 
 typedef enum
 {
@@ -20,17 +19,46 @@ typedef enum
     TokenUnknown
 } token_type_enum;
 
-typedef struct token_list_node_t
+/**
+ * @brief The value of a literal too large for a long, whose text has to be
+ * decoded the slow way
+ * @note Literals are never negative, since a minus sign is its own token
+ */
+#define LITERAL_OVERFLOW (-1L)
+
+/**
+ * @brief A dense token buffer, where token i is made up of element i of each
+ * array
+ */
+typedef struct token_stream_t
 {
-    list_entry_t list;
-    token_type_enum token;
-    string_t string;
-    string_t filename;
-    int column_number;
+    uint8_t *token;   // The token_type_enum of each token
+    size_t *offset;   // Where the token text starts in the input file
+    uint32_t *length; // The length of the token text
+    long *value;      // The value of TokenLiteral tokens, LITERAL_OVERFLOW
+                      // if it doesn't fit, else 0
+    size_t token_count;
+    size_t reserve_space;
+} token_stream_t;
+
+/**
+ * @brief A position in the input file, for diagnostics
+ */
+typedef struct source_location_t
+{
+    size_t offset;
     int line_number;
-} token_list_node_t;
+    int column_number;
+} source_location_t;
 
-#define token_node(ptr) container_of(ptr, token_list_node_t, list)
+#define token_text(input_file, tokens, index) \
+    ((input_file)->data + (tokens)->offset[index])
 
-token_list_node_t *lex_file(FILE *input_file);
-void put_token_node_list(void);
+token_stream_t *lex_file(input_file_t const *input_file);
+void put_token_stream(void);
+void lex_chunk(token_stream_t *tokens, input_file_t const *input_file,
+               size_t begin, size_t end);
+void reset_token_chunk(token_stream_t *tokens);
+void put_token_chunk(token_stream_t *tokens);
+void find_source_location(source_location_t *location,
+                          input_file_t const *input_file, size_t offset);
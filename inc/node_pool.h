@@ -0,0 +1,68 @@
+#pragma once
+
+#include "lexer.h"
+#include "parser.h"
+
+#include <stdint.h> // `uint8_t`, `uint32_t`
+
+/**
+ * @brief The index of no node
+ */
+#define POOL_NONE UINT32_MAX
+
+/**
+ * @brief A node of the compact AST, addressed by its index in the pool
+ * @note Nodes are added as their subtrees are completed, so each statement
+ * is stored in postfix order and ends with its root
+ */
+typedef struct pool_node_t
+{
+    uint8_t type; // The node_type_enum
+    char symbol;  // The operator of NodeUnaryOperator and NodeBinaryOperator
+    uint32_t operand[2]; // The left and right children, with only the right
+                         // for unary operators and parentheses. Literals
+                         // and constants keep their value across both with
+                         // memcpy.
+} pool_node_t;
+
+/**
+ * @brief Where a node came from, for pools loaded without their input file
+ */
+typedef struct pool_location_t
+{
+    uint32_t filename; // The offset of the file's name in the string table
+    int32_t line_number;
+    int32_t column_number;
+} pool_location_t;
+
+/**
+ * @brief An AST of compact nodes in one contiguous array
+ */
+typedef struct node_pool_t
+{
+    pool_node_t *node;
+    size_t *offset; // Side table of where each node's token starts in the
+                    // input file, for diagnostics
+    uint32_t node_count;
+    uint32_t reserve_space;
+    uint32_t *statement; // The root of each statement in order
+    uint32_t statement_count;
+    uint32_t statement_reserve_space;
+    uint32_t root; // The root of a trailing statement with an operator at the
+                   // top, which is evaluated alone, else POOL_NONE
+    size_t stack_size; // The most values evaluation keeps at once
+    size_t node_type_count[NodeUnknown]; // The nodes created of each type
+    input_file_t const *input_file;    // NULL for pools loaded from a file
+    pool_location_t const *location;   // Side table of where each node came
+                                       // from, for pools loaded from a file
+    char const *string;                // The string table of a loaded pool
+} node_pool_t;
+
+node_pool_t *parse_pool(token_stream_t const *tokens,
+                        input_file_t const *input_file);
+void put_node_pool(void);
+double get_pool_literal_value(node_pool_t const *pool, uint32_t index);
+double get_pool_constant_value(node_pool_t const *pool, uint32_t index);
+void get_pool_location(source_location_t *location, node_pool_t const *pool,
+                       uint32_t index);
+double eval_pool(node_pool_t const *pool);
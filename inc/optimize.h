@@ -0,0 +1,11 @@
+#pragma once
+
+#include "parser.h"
+
+typedef struct fold_report_t
+{
+    size_t nodes_before;
+    size_t nodes_after;
+} fold_report_t;
+
+void fold_AST(AST_t *ast, fold_report_t *report);
@@ -1,6 +1,8 @@
 #pragma once
 
 #include "lexer.h"
+#include "type/arena_t.h"
+#include "type/intern_t.h"
 
 typedef enum
 {
@@ -8,6 +10,7 @@ typedef enum
     NodeBinaryOperator,
     NodeParenthesis,
     NodeLiteral,
+    NodeConstant, // A value computed before evaluation, in place of a subtree
     NodeScope,
     NodeUnknown
 } node_type_enum;
@@ -17,13 +20,15 @@ typedef struct AST_node_t
     struct AST_node_t *left;
     struct AST_node_t *right;
     struct AST_node_t *next;
-    struct AST_node_t *parent_node;
+    struct AST_node_t *parent_node; // One of its parents, if it is shared
     struct AST_node_t *parent_scope;
     node_type_enum type;
-    string_t string;
-    string_t filename;
+    intern_t string;   // The operator or scope name, else InternNone
+    intern_t filename; // The file the node was parsed from
     int column_number;
     int line_number;
+    uint32_t shared; // For binary operators with more than one parent,
+                     // their number from 1 in the AST, else 0
     union // This contains extra information that might be relevant to some
           // nodes depending on the node type
     {
@@ -36,13 +41,37 @@ typedef struct AST_node_t
             struct AST_node_t *list_head;
             struct AST_node_t *list_tail;
         };
+        struct // NodeLiteral
+        {
+            long literal; // Decoded by the lexer, or LITERAL_OVERFLOW
+        };
+        struct // NodeConstant
+        {
+            double value;
+        };
     };
 } AST_node_t;
 
 typedef struct AST_t
 {
     AST_node_t *root;
+    AST_node_t *scope;              // The outermost scope
+    arena_t arena;                  // The memory for every node and their
+                                    // strings
+    size_t node_count[NodeUnknown]; // The nodes created of each type
 } AST_t;
 
-AST_t *parse_lex(token_list_node_t *token_list);
+void enable_AST_sharing(void);
+int is_AST_sharing_enabled(void);
+AST_t *parse_lex(token_stream_t const *tokens, input_file_t const *input_file);
+void parse_standalone(AST_t *ast, token_stream_t const *tokens,
+                      input_file_t const *input_file,
+                      source_location_t *location);
+void reset_standalone_AST(AST_t *ast);
+void put_standalone_AST(AST_t *ast);
+AST_t *get_AST(void);
+void parse_chunk(AST_t *chunk, token_stream_t const *tokens,
+                 input_file_t const *input_file, source_location_t *location);
+AST_t *splice_AST_chunk(AST_t *chunk);
 void put_AST(void);
+double get_literal_value(AST_node_t const *node);
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stddef.h> // `size_t`
+#include <stdint.h> // `uint64_t`
+
+#define SCAN_BLOCK_SIZE ((size_t)64)
+
+/**
+ * @brief The class of every byte in a block, where bit i is byte i
+ */
+typedef struct scan_masks_t
+{
+    uint64_t digit;      // '0' to '9'
+    uint64_t arithmetic; // '+', '-', '*', '/' and '%'
+    uint64_t open;       // '('
+    uint64_t close;      // ')'
+    uint64_t semicolon;  // ';'
+    uint64_t newline;    // '\n'
+    uint64_t invalid;    // Anything else
+} scan_masks_t;
+
+typedef enum
+{
+    ScannerAuto, // The fastest the processor supports
+    ScannerScalar,
+    ScannerSSE2,
+    ScannerAVX2
+} scanner_enum;
+
+void select_scanner(scanner_enum scanner);
+void scan_block(char const *data, size_t size, scan_masks_t *masks);
@@ -0,0 +1,42 @@
+#pragma once
+
+#include "batch.h"
+
+#include <stddef.h> // `size_t`
+#include <stdint.h> // `uint32_t`
+
+/**
+ * @brief The first word of a request, so that other programs connecting to
+ * the socket are turned away
+ */
+#define REQUEST_MAGIC ((uint32_t)0x61747401)
+
+#define REQUEST_ARGUMENT_LIMIT ((size_t)1 << 20) // Bytes of arguments
+
+/**
+ * @brief The file descriptors sent with a request, in order
+ */
+typedef enum
+{
+    RequestDirectory, // The working directory of the client
+    RequestOutput,    // The stdout of the client
+    RequestError,     // The stderr of the client
+    RequestFdCount
+} request_fd_enum;
+
+/**
+ * @brief The start of a request, which is followed by its arguments
+ * @note The server answers with the exit code, as an int32_t, once it has
+ * written everything the request prints
+ */
+typedef struct request_header_t
+{
+    uint32_t magic;
+    uint32_t argument_count;
+    uint32_t argument_size; // The bytes of arguments, each ending in '\0'
+} request_header_t;
+
+void serve_requests(char const *socket_path, size_t thread_count,
+                    evaluate_function_t evaluate);
+int send_request(char const *socket_path, int argument_count,
+                 char *const arguments[]);
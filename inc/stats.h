@@ -0,0 +1,38 @@
+#pragma once
+
+#include "parser.h"
+
+#include <stdio.h> // `FILE`
+
+typedef enum
+{
+    PhaseRead,     // Opening and mapping the input file
+    PhaseLex,      // Lexing, including splitting the file into chunks
+    PhaseParse,    // Parsing, including splicing chunks together
+    PhaseFold,     // Folding constants
+    PhaseEvaluate, // Compiling and running, or walking the AST
+    PhaseBatch,    // Compiling every file of a batch
+    PhaseStream,   // Compiling a file a statement at a time
+    PhaseEmit,     // Writing the program as assembly or an AST file
+    PhaseCache,    // Looking up and storing results in the cache
+    PhaseWatch,    // Compiling the statements a change to a file touched
+    PhaseCount
+} phase_enum;
+
+typedef enum
+{
+    StatsOff,
+    StatsText, // A table for people
+    StatsJSON  // A single line of JSON for tools
+} stats_format_enum;
+
+void enable_stats(stats_format_enum format);
+void begin_phase(phase_enum phase);
+void end_phase(phase_enum phase);
+void record_phase_bytes(phase_enum phase, size_t bytes);
+void record_phase_tokens(phase_enum phase, size_t tokens);
+void record_phase_nodes(phase_enum phase, size_t const node_count[]);
+void record_allocation(size_t size);
+void print_stats(FILE *output);
+void reset_stats(void);
+void put_stats(void);
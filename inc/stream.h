@@ -0,0 +1,7 @@
+#pragma once
+
+#include "batch.h"
+#include "file.h"
+
+void stream_file(input_file_t const *input_file, evaluate_function_t evaluate,
+                 FILE *output);
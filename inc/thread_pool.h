@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdatomic.h> // `atomic_size_t`
+#include <stddef.h>    // `size_t`
+
+typedef void (*task_function_t)(void *argument);
+
+typedef struct task_t
+{
+    task_function_t function;
+    void *argument;
+    struct task_group_t *group;
+} task_t;
+
+/**
+ * @brief A set of tasks which can be waited on together
+ */
+typedef struct task_group_t
+{
+    atomic_size_t pending; // The number of tasks not yet finished
+} task_group_t;
+
+void get_thread_pool(size_t thread_count);
+void put_thread_pool(void);
+size_t thread_pool_size(void);
+void submit_task(task_group_t *group, task_function_t function,
+                 void *argument);
+void wait_task_group(task_group_t *group);
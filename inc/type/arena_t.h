@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h> // `size_t`
+
+typedef struct arena_block_t
+{
+    struct arena_block_t *next;
+    size_t size; // Note that this includes the block header
+    size_t used;
+    size_t dirty; // Bytes from used up to here may be left from before a
+                  // reset, and are zeroed as they are handed out again
+} arena_block_t;
+
+typedef struct arena_t
+{
+    arena_block_t *head; // The block currently being allocated from
+} arena_t;
+
+#define ARENA_ALIGNMENT ((size_t)16)
+
+void enable_arena_huge_pages(void);
+void *arena_allocate(arena_t *arena, size_t size);
+void reset_arena(arena_t *arena);
+void merge_arena(arena_t *arena, arena_t *other);
+void put_arena(arena_t *arena);
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stddef.h> // `size_t`
+#include <stdint.h> // `uint32_t`
+
+/**
+ * @brief A handle to an interned string. Equal strings have equal handles.
+ */
+typedef uint32_t intern_t;
+
+/**
+ * @brief Strings which are always interned, so their handles are constants
+ */
+enum
+{
+    InternNone, // No string
+    InternPlus,
+    InternMinus,
+    InternTimes,
+    InternDivide,
+    InternModulo,
+    InternOpenParenthesis,
+    InternCloseParenthesis,
+    InternSemicolon,
+    InternGlobalScope,
+    InternSeedCount
+};
+
+intern_t get_intern(char const *string, size_t length);
+char const *get_intern_string(intern_t handle);
+size_t get_intern_length(intern_t handle);
+void put_intern_table(void);
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "type/arena_t.h"
+
 #include <string.h> // `size_t`
 
 typedef struct string_t
@@ -14,5 +16,7 @@ typedef struct string_t
 void get_string(string_t *input_struct, char const *input_string,
                 size_t reserve_space);
 void put_string(string_t *input_struct);
+void get_arena_string(string_t *input_struct, arena_t *arena,
+                      char const *input_string, size_t input_length);
 void get_string_clone(string_t *input_struct, string_t const *copy_struct);
 void add_character(string_t *string, char character);
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "node_pool.h"
+#include "parser.h"
+
+#include <stdint.h> // `uint8_t`, `uint32_t`
+
+typedef enum
+{
+    OpPush,      // Push the next constant
+    OpNegate,    // Negate the top of the stack
+    OpAdd,       // Replace the top two values with their sum
+    OpSubtract,  // Replace the top two values with their difference
+    OpMultiply,  // Replace the top two values with their product
+    OpDivide,    // Replace the top two values with their quotient
+    OpModulo,    // Replace the top two values with their remainder
+    OpStatement, // Pop the result of a statement
+    OpStore,     // Copy the top of the stack to the next memo slot
+    OpLoad,      // Push the next memo slot
+    OpHalt,      // Stop, returning the result of the last statement
+    OpCount
+} opcode_enum;
+
+/**
+ * @brief A compiled program
+ * @note Constants are used in the order they are pushed, so OpPush doesn't
+ * need an operand. Memo slots are the same for OpStore and OpLoad.
+ */
+typedef struct program_t
+{
+    uint8_t *code; // The opcode_enum of each instruction
+    size_t code_size;
+    size_t code_reserve_space;
+    double *constant; // The value pushed by each OpPush in order
+    size_t constant_count;
+    size_t constant_reserve_space;
+    double *stack;     // The operand stack, allocated once the program is
+                       // compiled
+    size_t stack_size; // The deepest the operand stack gets
+    uint32_t *slot;    // The memo slot of each OpStore and OpLoad in order
+    size_t slot_count;
+    size_t slot_reserve_space;
+    double *memo;     // The values of shared nodes, by their shared number
+    size_t memo_size; // One more than the largest shared number
+} program_t;
+
+void compile_statements(program_t *program, AST_node_t *first, size_t count);
+void compile_program(program_t *program, AST_node_t *root);
+void compile_pool(program_t *program, node_pool_t const *pool);
+double run_program(program_t *program);
+void put_program(program_t *program);
@@ -0,0 +1,46 @@
+#pragma once
+
+#include "parser.h"
+
+/**
+ * @brief The points at which a walk can visit a node, which are also flags
+ * to choose which of them a walk stops at
+ */
+typedef enum
+{
+    WalkPreOrder = 1,  // Before any of its children
+    WalkInOrder = 2,   // Between its two children, for binary operators
+    WalkPostOrder = 4, // After all of its children
+    WalkRightFirst = 8 // Not a visit, but a flag to walk right before left
+} walk_event_enum;
+
+/**
+ * @brief A node being walked, and how far the walk through it has got
+ */
+typedef struct walk_frame_t
+{
+    AST_node_t *node;
+    AST_node_t *child; // The statement being walked, for scopes, or the
+                       // child to walk next in walks only after children
+    int stage;
+} walk_frame_t;
+
+/**
+ * @brief A walk over an AST which keeps its path on an explicit stack, so it
+ * can go as deep as the heap allows
+ * @note Scopes have their statements as children in order, and every other
+ * node has its left then right child
+ */
+typedef struct AST_walk_t
+{
+    walk_frame_t *frame; // The path from the root to the current node
+    size_t frame_count;
+    size_t frame_reserve_space;
+    int events; // The walk_event_enum flags to stop at
+} AST_walk_t;
+
+void get_AST_walk(AST_walk_t *walk, AST_node_t *root, int events);
+void reset_AST_walk(AST_walk_t *walk, AST_node_t *root);
+AST_node_t *next_AST_node(AST_walk_t *walk, walk_event_enum *event);
+void skip_AST_children(AST_walk_t *walk);
+void put_AST_walk(AST_walk_t *walk);
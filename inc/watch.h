@@ -0,0 +1,23 @@
+#pragma once
+
+#include "parser.h"
+
+#include <stdio.h>       // `FILE`
+#include <stdnoreturn.h> // `noreturn`
+
+/**
+ * @brief An evaluator for a single statement
+ * @param[in] statement The root of the statement
+ * @return The value of the statement
+ */
+typedef double (*statement_function_t)(AST_node_t *statement);
+
+/**
+ * @brief A printer for the answer of a file
+ * @param[in] answer The value of the last statement
+ * @param[in] output Where to print it
+ */
+typedef void (*print_answer_function_t)(double answer, FILE *output);
+
+noreturn void watch_file(char const *filename, statement_function_t evaluate,
+                         print_answer_function_t print_answer, FILE *output);
@@ -0,0 +1,534 @@
+/** ast_file.c
+ * @brief Saving an AST to a binary file, and mapping it back in
+ *
+ * The file is a header followed by four tables, each found by its offset
+ * from the start of the file:
+ * - Nodes, laid out as pool_node_t and linked by index, with each statement
+ *   in postfix order ending with its root.
+ * - The root of each statement.
+ * - Where each node came from, as pool_location_t.
+ * - The file names those locations refer to, each ended by a '\0'.
+ *
+ * Nothing in the file is a pointer, so loading it is a single mmap. The
+ * tables are used in place as a node pool, with no fixups and nothing
+ * allocated per node, and evaluated like any other pool. The file is
+ * checked once as it is loaded, so a damaged file is an error rather than
+ * a crash.
+ *
+ * Values are stored in the byte order of the machine that wrote them, which
+ * the header records.
+ *
+ * STATE: AST_file
+ */
+
+#include "ast_file.h"
+#include "error_handling.h"
+#include "walk.h"
+
+#include <fcntl.h>    // `open`
+#include <string.h>   // `memcmp`, `strlen`
+#include <sys/mman.h> // `mmap`, `madvise`, `munmap`
+#include <sys/stat.h> // `fstat`
+#include <unistd.h>   // `close`
+
+/**
+ * @brief Change this whenever the layout of the file changes
+ */
+#define AST_FILE_VERSION 1
+
+#define AST_FILE_BYTE_ORDER ((uint32_t)0x01020304)
+#define AST_FILE_ALIGNMENT ((size_t)8) // Every table starts on a multiple
+
+static char const AST_file_magic[8] = "attisAST";
+
+/**
+ * @brief The start of an AST file
+ */
+typedef struct AST_file_header_t
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order; // AST_FILE_BYTE_ORDER, as the writer stored it
+    uint32_t node_count;
+    uint32_t statement_count;
+    uint32_t root; // As in node_pool_t
+    uint32_t unused;
+    uint64_t stack_size;
+    uint64_t node_type_count[NodeUnknown];
+    uint64_t node_offset; // Where each table starts in the file
+    uint64_t statement_offset;
+    uint64_t location_offset;
+    uint64_t string_offset;
+    uint64_t string_size;
+} AST_file_header_t;
+
+/**
+ * @brief The tables of an AST file, as they are built
+ */
+typedef struct AST_writer_t
+{
+    pool_node_t *node;
+    pool_location_t *location; // One for each node
+    size_t node_count;
+    size_t node_reserve_space;
+    uint32_t *statement;
+    size_t statement_count;
+    size_t statement_reserve_space;
+    uint32_t *operand; // The nodes waiting for their parent, as a stack
+    size_t operand_count;
+    size_t operand_reserve_space;
+    char *string;
+    size_t string_size;
+    size_t string_reserve_space;
+    intern_t filename;        // The last file name added to the strings
+    uint32_t filename_offset; // Where it was added
+    size_t stack_size;
+    size_t node_type_count[NodeUnknown];
+} AST_writer_t;
+
+/**
+ * @brief A mapped AST file and the pool which uses it
+ */
+typedef struct AST_file_t
+{
+    void const *data;
+    size_t size;
+    node_pool_t pool;
+} AST_file_t;
+
+/**
+ * STATE: The loaded AST file
+ */
+static AST_file_t AST_file = {
+    NULL, 0,
+    {NULL, NULL, 0, 0, NULL, 0, 0, POOL_NONE, 0, {0}, NULL, NULL, NULL}
+};
+
+/**
+ * @brief Make room for one more element at the end of an array
+ * @param[in] array The array
+ * @param[in] count The number of elements in use
+ * @param[in,out] reserve_space The space allocated for the array
+ * @param[in] element_size The size of each element
+ * @return The array, which may have moved
+ */
+static void *reserve_element(void *array, size_t count, size_t *reserve_space,
+                             size_t element_size)
+{
+    if (count == *reserve_space)
+    {
+        *reserve_space = *reserve_space == 0 ? 256 : *reserve_space * 2;
+        array = realloc(array, *reserve_space * element_size);
+        ASSERT(array != NULL, "Failed to allocate AST file\n");
+    }
+    return array;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Writing
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Get the offset of a file name in the string table, adding it if
+ * needed
+ * @param[in,out] writer The tables being built
+ * @param[in] filename The interned file name
+ * @return The offset of the name
+ * @note Nodes from the same file come together, so only a change of file
+ * adds a string. A file seen before may be added twice, which is harmless.
+ */
+static uint32_t add_filename(AST_writer_t *writer, intern_t filename)
+{
+    if (filename == writer->filename && writer->string_size > 0)
+    {
+        return writer->filename_offset;
+    }
+    char const *string = get_intern_string(filename);
+    size_t length = get_intern_length(filename) + 1;
+    if (writer->string_size + length >= UINT32_MAX)
+    {
+        EXIT_ERROR("Too many file names for an AST file\n");
+    }
+    if (writer->string_size + length > writer->string_reserve_space)
+    {
+        writer->string_reserve_space = (writer->string_size + length) * 2;
+        writer->string = realloc(writer->string, writer->string_reserve_space);
+        ASSERT(writer->string != NULL, "Failed to allocate AST file\n");
+    }
+    memcpy(writer->string + writer->string_size, string, length - 1);
+    writer->string[writer->string_size + length - 1] = '\0';
+    writer->filename = filename;
+    writer->filename_offset = (uint32_t)writer->string_size;
+    writer->string_size += length;
+    return writer->filename_offset;
+}
+
+/**
+ * @brief Take the node on top of the operand stack
+ */
+static uint32_t pop_operand(AST_writer_t *writer)
+{
+    if (writer->operand_count == 0)
+    {
+        EXIT_ERROR("Missing operand\n");
+    }
+    return writer->operand[--writer->operand_count];
+}
+
+/**
+ * @brief Add a node to the end of the tables, taking its operands from the
+ * operand stack and leaving it there in their place
+ * @param[in,out] writer The tables being built
+ * @param[in] node The node to add, whose children are already added
+ */
+static void add_node(AST_writer_t *writer, AST_node_t const *node)
+{
+    if (writer->node_count >= POOL_NONE)
+    {
+        EXIT_ERROR("Too many nodes for an AST file\n");
+    }
+    size_t reserve_space = writer->node_reserve_space;
+    writer->node = reserve_element(writer->node, writer->node_count,
+                                   &writer->node_reserve_space,
+                                   sizeof(*writer->node));
+    writer->location
+        = reserve_element(writer->location, writer->node_count,
+                          &reserve_space, sizeof(*writer->location));
+
+    uint32_t index = (uint32_t)writer->node_count++;
+    pool_node_t *entry = &writer->node[index];
+    *entry = (pool_node_t){(uint8_t)node->type, 0, {POOL_NONE, POOL_NONE}};
+    switch (node->type)
+    {
+    case NodeBinaryOperator:
+        entry->operand[1] = pop_operand(writer);
+        entry->operand[0] = pop_operand(writer);
+        entry->symbol = get_intern_string(node->string)[0];
+        break;
+    case NodeUnaryOperator:
+        entry->operand[1] = pop_operand(writer);
+        entry->symbol = get_intern_string(node->string)[0];
+        break;
+    case NodeParenthesis:
+        entry->operand[1] = pop_operand(writer);
+        entry->symbol = '(';
+        break;
+    case NodeLiteral:
+        memcpy(entry->operand, &node->literal, sizeof(node->literal));
+        break;
+    case NodeConstant:
+        memcpy(entry->operand, &node->value, sizeof(node->value));
+        break;
+    default:
+        EXIT_ERROR("Unknown AST token in AST file\n");
+    }
+    writer->location[index]
+        = (pool_location_t){add_filename(writer, node->filename),
+                            node->line_number, node->column_number};
+    writer->node_type_count[node->type] += 1;
+
+    writer->operand = reserve_element(writer->operand, writer->operand_count,
+                                      &writer->operand_reserve_space,
+                                      sizeof(*writer->operand));
+    writer->operand[writer->operand_count++] = index;
+    if (writer->operand_count > writer->stack_size)
+    {
+        writer->stack_size = writer->operand_count;
+    }
+}
+
+/**
+ * @brief Add a statement to the end of the tables, in postfix order
+ * @param[in,out] writer The tables being built
+ * @param[in,out] walk A post-order walk to reuse
+ * @param[in] statement The root of the statement
+ * @return The index of the statement's root
+ */
+static uint32_t add_statement(AST_writer_t *writer, AST_walk_t *walk,
+                              AST_node_t *statement)
+{
+    AST_node_t *node;
+    writer->operand_count = 0;
+    reset_AST_walk(walk, statement);
+    while ((node = next_AST_node(walk, NULL)) != NULL)
+    {
+        add_node(writer, node);
+    }
+    return pop_operand(writer);
+}
+
+/**
+ * @brief Write a table, padded to the alignment of the next one
+ * @param[in] output Where to write
+ * @param[in] table The table
+ * @param[in] size The size of the table
+ */
+static void write_table(FILE *output, void const *table, size_t size)
+{
+    static char const padding[AST_FILE_ALIGNMENT] = {0};
+    if (size > 0)
+    {
+        fwrite(table, 1, size, output);
+    }
+    fwrite(padding, 1, -size % AST_FILE_ALIGNMENT, output);
+}
+
+/**
+ * @brief Round a table size up to the alignment of the next table
+ */
+static size_t align_table(size_t size)
+{
+    return size + -size % AST_FILE_ALIGNMENT;
+}
+
+/**
+ * @brief Write an AST to a binary file which load_AST_file can map
+ * @param[in] ast The AST to write
+ * @param[in] output Where to write the file
+ */
+void write_AST_file(AST_t const *ast, FILE *output)
+{
+    AST_writer_t writer = {0};
+    AST_walk_t walk;
+    uint32_t root = POOL_NONE;
+    get_AST_walk(&walk, NULL, WalkPostOrder);
+    if (ast->root->type != NodeScope)
+    {
+        root = add_statement(&writer, &walk, ast->root);
+    }
+    else
+    {
+        for (AST_node_t *statement = ast->root->list_head; statement != NULL;
+             statement = statement->next)
+        {
+            writer.statement = reserve_element(
+                writer.statement, writer.statement_count,
+                &writer.statement_reserve_space, sizeof(*writer.statement));
+            writer.statement[writer.statement_count++]
+                = add_statement(&writer, &walk, statement);
+        }
+    }
+    put_AST_walk(&walk);
+
+    AST_file_header_t header = {{0}, AST_FILE_VERSION, AST_FILE_BYTE_ORDER,
+                                (uint32_t)writer.node_count,
+                                (uint32_t)writer.statement_count, root, 0,
+                                writer.stack_size, {0}, 0, 0, 0, 0,
+                                writer.string_size};
+    memcpy(header.magic, AST_file_magic, sizeof(AST_file_magic));
+    for (size_t type = 0; type < NodeUnknown; type++)
+    {
+        header.node_type_count[type] = writer.node_type_count[type];
+    }
+    size_t node_size = writer.node_count * sizeof(*writer.node);
+    size_t statement_size
+        = writer.statement_count * sizeof(*writer.statement);
+    size_t location_size = writer.node_count * sizeof(*writer.location);
+    header.node_offset = align_table(sizeof(header));
+    header.statement_offset = header.node_offset + align_table(node_size);
+    header.location_offset
+        = header.statement_offset + align_table(statement_size);
+    header.string_offset = header.location_offset + align_table(location_size);
+
+    write_table(output, &header, sizeof(header));
+    write_table(output, writer.node, node_size);
+    write_table(output, writer.statement, statement_size);
+    write_table(output, writer.location, location_size);
+    write_table(output, writer.string, writer.string_size);
+    ASSERT(!ferror(output), "Failed to write AST file\n");
+
+    free(writer.node);
+    free(writer.location);
+    free(writer.statement);
+    free(writer.operand);
+    free(writer.string);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Loading
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Check that a table lies within the file and is aligned
+ * @param[in] offset Where the table starts
+ * @param[in] count The number of elements
+ * @param[in] element_size The size of each element
+ * @param[in] size The size of the file
+ */
+static int is_table_in_file(uint64_t offset, uint64_t count,
+                            size_t element_size, size_t size)
+{
+    return offset % AST_FILE_ALIGNMENT == 0 && offset <= size
+           && count <= (size - offset) / element_size;
+}
+
+/**
+ * @brief Check that evaluating a statement of a pool can't go past the
+ * ends of its stack or nodes
+ * @param[in] pool The pool
+ * @param[in] first The first node of the statement
+ * @param[in] root The root of the statement
+ */
+static void check_statement(node_pool_t const *pool, uint32_t first,
+                            uint32_t root)
+{
+    if (first > root || root >= pool->node_count)
+    {
+        EXIT_ERROR("Corrupt AST file: bad statement\n");
+    }
+    size_t depth = 0;
+    for (uint32_t index = first; index <= root; index++)
+    {
+        pool_node_t const *node = &pool->node[index];
+        size_t operand_count;
+        switch (node->type)
+        {
+        case NodeLiteral:
+        case NodeConstant:
+            if (depth >= pool->stack_size)
+            {
+                EXIT_ERROR("Corrupt AST file: stack too small\n");
+            }
+            depth += 1;
+            continue;
+        case NodeUnaryOperator:
+        case NodeParenthesis:
+            operand_count = 1;
+            break;
+        case NodeBinaryOperator:
+            operand_count = 2;
+            break;
+        default:
+            EXIT_ERROR("Corrupt AST file: unknown node\n");
+        }
+        if (depth < operand_count
+            || (node->operand[0] >= index
+                && (operand_count != 1 || node->operand[0] != POOL_NONE))
+            || node->operand[1] >= index)
+        {
+            EXIT_ERROR("Corrupt AST file: missing operand\n");
+        }
+        depth -= operand_count - 1;
+    }
+    if (depth == 0)
+    {
+        EXIT_ERROR("Corrupt AST file: empty statement\n");
+    }
+}
+
+/**
+ * @brief Check that the statements and locations of a loaded pool stay
+ * within it
+ * @param[in] pool The pool
+ * @param[in] string_size The size of its string table
+ */
+static void check_pool(node_pool_t const *pool, size_t string_size)
+{
+    uint32_t first = 0;
+    for (uint32_t index = 0; index < pool->statement_count; index++)
+    {
+        check_statement(pool, first, pool->statement[index]);
+        first = pool->statement[index] + 1;
+    }
+    if (pool->root != POOL_NONE)
+    {
+        check_statement(pool, first, pool->root);
+    }
+    for (uint32_t index = 0; index < pool->node_count; index++)
+    {
+        if (pool->location[index].filename >= string_size)
+        {
+            EXIT_ERROR("Corrupt AST file: bad file name\n");
+        }
+    }
+    if (string_size != 0 && pool->string[string_size - 1] != '\0')
+    {
+        EXIT_ERROR("Corrupt AST file: bad string table\n");
+    }
+}
+
+/**
+ * @brief Map an AST file written by write_AST_file, and use it as a pool
+ * @param[in] filename The file to load
+ * @return The pool, whose tables are the mapped file
+ * @note The pool is read only, and is released by put_AST_file
+ */
+node_pool_t *load_AST_file(char const *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    ASSERT(fd >= 0, "Failed to open file: '%s'\n", filename);
+    struct stat file_stat;
+    ASSERT(fstat(fd, &file_stat) == 0, "Failed to stat file: '%s'\n",
+           filename);
+    size_t size = (size_t)file_stat.st_size;
+    if (size < sizeof(AST_file_header_t))
+    {
+        close(fd);
+        EXIT_ERROR("Not an AST file: '%s'\n", filename);
+    }
+    void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ASSERT(data != MAP_FAILED, "Failed to map file: '%s'\n", filename);
+    ASSERT(close(fd) == 0, "Failed to close file\n");
+    // This is only a hint, so failure isn't an error
+    (void)madvise(data, size, MADV_SEQUENTIAL);
+    AST_file.data = data;
+    AST_file.size = size;
+
+    AST_file_header_t const *header = data;
+    if (memcmp(header->magic, AST_file_magic, sizeof(AST_file_magic)) != 0)
+    {
+        EXIT_ERROR("Not an AST file: '%s'\n", filename);
+    }
+    if (header->version != AST_FILE_VERSION
+        || header->byte_order != AST_FILE_BYTE_ORDER)
+    {
+        EXIT_ERROR("AST file '%s' was written by another version or "
+                   "machine\n",
+                   filename);
+    }
+    if (!is_table_in_file(header->node_offset, header->node_count,
+                          sizeof(pool_node_t), size)
+        || !is_table_in_file(header->statement_offset,
+                             header->statement_count, sizeof(uint32_t), size)
+        || !is_table_in_file(header->location_offset, header->node_count,
+                             sizeof(pool_location_t), size)
+        || !is_table_in_file(header->string_offset, header->string_size, 1,
+                             size))
+    {
+        EXIT_ERROR("Corrupt AST file: '%s'\n", filename);
+    }
+
+    node_pool_t *pool = &AST_file.pool;
+    char const *base = data;
+    pool->node = (pool_node_t *)(uintptr_t)(base + header->node_offset);
+    pool->node_count = header->node_count;
+    pool->statement = (uint32_t *)(uintptr_t)(base + header->statement_offset);
+    pool->statement_count = header->statement_count;
+    pool->root = header->root;
+    pool->stack_size = (size_t)header->stack_size;
+    for (size_t type = 0; type < NodeUnknown; type++)
+    {
+        pool->node_type_count[type] = (size_t)header->node_type_count[type];
+    }
+    pool->location
+        = (pool_location_t const *)(base + header->location_offset);
+    pool->string = base + header->string_offset;
+    check_pool(pool, (size_t)header->string_size);
+    return pool;
+}
+
+/**
+ * @brief Unmap the loaded AST file
+ */
+void put_AST_file()
+{
+    if (AST_file.data != NULL)
+    {
+        ASSERT(munmap((void *)(uintptr_t)AST_file.data, AST_file.size) == 0,
+               "Failed to unmap file\n");
+    }
+    AST_file = (AST_file_t){
+        NULL, 0,
+        {NULL, NULL, 0, 0, NULL, 0, 0, POOL_NONE, 0, {0}, NULL, NULL, NULL}
+    };
+}
@@ -0,0 +1,386 @@
+/** batch.c
+ * @brief Compiling many input files in one process
+ *
+ * Each file is lexed, parsed and evaluated as an independent job on the
+ * thread pool, with its own file mapping, token stream and AST. Errors in a
+ * job are caught so the rest of the batch carries on, and every result and
+ * error message is printed in the order the files were given. With a cache,
+ * files whose results are cached are only read, and new results are stored.
+ *
+ * Token streams and ASTs live in workspaces which are emptied and handed to
+ * later jobs, so a long running process, such as a server compiling a batch
+ * per request, doesn't map fresh memory for every file.
+ *
+ * STATE: command_line_batch, workspaces
+ */
+
+#include "batch.h"
+#include "cache.h"
+#include "error_handling.h"
+#include "thread_pool.h"
+
+#include <fcntl.h>   // `AT_FDCWD`
+#include <pthread.h> // `pthread_mutex_t`
+#include <string.h>  // `strndup`, `memchr`
+
+/**
+ * @brief The most tokens a workspace keeps room for between jobs, so one
+ * large file doesn't hold on to its token stream for good
+ */
+#define WORKSPACE_TOKEN_LIMIT ((size_t)1 << 16)
+
+/**
+ * @brief The memory a job lexes and parses into
+ */
+typedef struct batch_workspace_t
+{
+    token_stream_t tokens;
+    AST_t ast;
+    struct batch_workspace_t *next; // The next free workspace
+} batch_workspace_t;
+
+typedef struct workspace_list_t
+{
+    pthread_mutex_t lock;
+    batch_workspace_t *head; // Workspaces no job is using
+} workspace_list_t;
+
+struct batch_job_t
+{
+    char *filename;
+    int directory; // The directory the file is opened in
+    int is_read;   // Nonzero to read the file rather than map it
+    evaluate_function_t evaluate;
+    input_file_t input_file;
+    batch_workspace_t *workspace;
+    cache_key_t key; // The job's key in the cache, if there is one
+    int cached;      // Nonzero if the result came from the cache
+    FILE *output;    // Where the job prints its result
+    char *result; // What the job printed, if it succeeded
+    size_t result_size;
+    error_capture_t capture;
+};
+
+/**
+ * STATE: This holds every file in the batch given on the command line
+ */
+static batch_t command_line_batch = {NULL, 0, 0, AT_FDCWD, 1, 0};
+
+/**
+ * STATE: This holds the workspaces of finished jobs, for any batch
+ */
+static workspace_list_t workspaces = {PTHREAD_MUTEX_INITIALIZER, NULL};
+
+//////////////////////////////////////////////////////////////////////////////
+// Adding Files
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Open a file of a batch
+ * @param[out] file Where to store the contents of the file
+ * @param[in] directory The directory a relative filename is found in
+ * @param[in] is_read Nonzero to read the file into memory, so that it being
+ * truncated can't fault, rather than map it
+ * @param[in] filename The name of the file to open
+ */
+static void open_batch_file(input_file_t *file, int directory, int is_read,
+                            char const *filename)
+{
+    if (is_read)
+    {
+        read_file_at(file, directory, filename);
+    }
+    else
+    {
+        open_file_at(file, directory, filename);
+    }
+}
+
+/**
+ * @brief Add a single file to a batch
+ * @param[in,out] batch The batch to add to
+ * @param[in] filename The start of the name of the file
+ * @param[in] length The length of the name
+ */
+static void add_job(batch_t *batch, char const *filename, size_t length)
+{
+    if (batch->job_count == batch->reserve_space)
+    {
+        batch->reserve_space
+            = batch->reserve_space == 0 ? 16 : batch->reserve_space * 2;
+        batch->job = realloc(batch->job,
+                             batch->reserve_space * sizeof(*batch->job));
+        ASSERT(batch->job != NULL, "Failed to allocate batch\n");
+    }
+
+    batch_job_t *job = &batch->job[batch->job_count++];
+    *job = (batch_job_t){0};
+    job->filename = strndup(filename, length);
+    ASSERT(job->filename != NULL, "Failed to allocate batch\n");
+    job->directory = batch->directory;
+    job->is_read = batch->is_read;
+    if (batch->job_count > 1)
+    {
+        batch->is_named = 1;
+    }
+}
+
+/**
+ * @brief Add a file to a batch
+ * @param[in,out] batch The batch to add to, which should be zeroed apart
+ * from its directory and is_read
+ * @param[in] filename The name of the file, or '@' followed by the name of a
+ * file listing one input file per line
+ * @note A batch of one file, which wasn't given by a list, prints its result
+ * as compiling that file on its own would
+ */
+void add_file_to_batch(batch_t *batch, char const *filename)
+{
+    if (filename[0] != '@')
+    {
+        add_job(batch, filename, strlen(filename));
+        return;
+    }
+
+    batch->is_named = 1;
+    input_file_t file_list;
+    open_batch_file(&file_list, batch->directory, batch->is_read,
+                    filename + 1);
+    size_t offset = 0;
+    while (offset < file_list.size)
+    {
+        char const *line = file_list.data + offset;
+        char const *line_end = memchr(line, '\n', file_list.size - offset);
+        size_t length = line_end == NULL ? file_list.size - offset
+                                         : (size_t)(line_end - line);
+        if (length != 0)
+        {
+            add_job(batch, line, length);
+        }
+        offset += length + 1;
+    }
+    close_file(&file_list);
+}
+
+/**
+ * @brief Add a file to the batch given on the command line
+ * @param[in] filename The name of the file, or '@' followed by the name of a
+ * file listing one input file per line
+ */
+void add_batch_file(char const *filename)
+{
+    add_file_to_batch(&command_line_batch, filename);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Workspaces
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Take a free workspace, or make a new one
+ * @return The workspace, which is empty
+ */
+static batch_workspace_t *get_workspace(void)
+{
+    pthread_mutex_lock(&workspaces.lock);
+    batch_workspace_t *workspace = workspaces.head;
+    if (workspace != NULL)
+    {
+        workspaces.head = workspace->next;
+    }
+    pthread_mutex_unlock(&workspaces.lock);
+
+    if (workspace == NULL)
+    {
+        workspace = calloc(1, sizeof(*workspace));
+        ASSERT(workspace != NULL, "Failed to allocate batch workspace\n");
+    }
+    workspace->next = NULL;
+    return workspace;
+}
+
+/**
+ * @brief Empty the token stream of a workspace, releasing it if it is large
+ * @param[in,out] workspace The workspace to empty
+ */
+static void trim_workspace_tokens(batch_workspace_t *workspace)
+{
+    if (workspace->tokens.reserve_space > WORKSPACE_TOKEN_LIMIT)
+    {
+        put_token_chunk(&workspace->tokens);
+    }
+    else
+    {
+        reset_token_chunk(&workspace->tokens);
+    }
+}
+
+/**
+ * @brief Empty a workspace and keep it for later jobs
+ * @param[in,out] workspace The workspace to return
+ * @note The AST keeps only the first block of its arena
+ */
+static void release_workspace(batch_workspace_t *workspace)
+{
+    trim_workspace_tokens(workspace);
+    reset_standalone_AST(&workspace->ast);
+
+    pthread_mutex_lock(&workspaces.lock);
+    workspace->next = workspaces.head;
+    workspaces.head = workspace;
+    pthread_mutex_unlock(&workspaces.lock);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Running Jobs
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Lex, parse and evaluate the file for a job, unless its result is
+ * cached
+ * @param[in,out] argument The batch_job_t to run
+ */
+static void compile_job(void *argument)
+{
+    batch_job_t *job = argument;
+    batch_workspace_t *workspace = job->workspace;
+    source_location_t location = {0, 0, 0};
+    open_batch_file(&job->input_file, job->directory, job->is_read,
+                    job->filename);
+    if (is_cache_enabled())
+    {
+        get_cache_key(&job->key, &job->input_file);
+        job->cached = load_cached_result(&job->key, job->output);
+        if (job->cached)
+        {
+            return;
+        }
+    }
+    lex_chunk(&workspace->tokens, &job->input_file, 0, job->input_file.size);
+    parse_standalone(&workspace->ast, &workspace->tokens, &job->input_file,
+                     &location);
+    trim_workspace_tokens(workspace);
+    job->evaluate(&workspace->ast, job->output);
+}
+
+/**
+ * @brief Run a job, and release everything but its output
+ * @param[in,out] argument The batch_job_t to run
+ */
+static void compile_job_task(void *argument)
+{
+    batch_job_t *job = argument;
+    job->workspace = get_workspace();
+    job->output = open_memstream(&job->result, &job->result_size);
+    ASSERT(job->output != NULL, "Failed to open result stream\n");
+    capture_errors(&job->capture, compile_job, job);
+    fclose(job->output);
+    job->output = NULL;
+    if (is_cache_enabled() && !job->capture.failed && !job->cached)
+    {
+        store_cached_result(&job->key, job->result, job->result_size);
+    }
+
+    release_workspace(job->workspace);
+    job->workspace = NULL;
+    if (job->input_file.data != NULL)
+    {
+        close_file(&job->input_file);
+    }
+}
+
+/**
+ * @brief Compile every file in a batch on the thread pool, and print the
+ * results
+ * @param[in,out] batch The batch to compile
+ * @param[in] evaluate The function to evaluate each file's AST with
+ * @param[in] output Where results and messages meant for stdout go
+ * @param[in] error Where messages meant for stderr go
+ * @return EXIT_SUCCESS, the exit code of a single file which failed, or
+ * EXIT_FAILURE if any of several files failed
+ * @note This is safe to call for different batches on different threads
+ */
+int compile_batch(batch_t *batch, evaluate_function_t evaluate, FILE *output,
+                  FILE *error)
+{
+    task_group_t group = {0};
+    for (size_t index = 0; index < batch->job_count; index++)
+    {
+        batch->job[index].evaluate = evaluate;
+        submit_task(&group, compile_job_task, &batch->job[index]);
+    }
+    wait_task_group(&group);
+
+    int exit_code = EXIT_SUCCESS;
+    for (size_t index = 0; index < batch->job_count; index++)
+    {
+        batch_job_t *job = &batch->job[index];
+        if (!batch->is_named)
+        { // What was printed before an error is kept, as it would be alone
+            fwrite(job->result, 1, job->result_size, output);
+            if (job->capture.failed)
+            {
+                fflush(output); // Keep errors in order with the output
+                write_captured_errors(&job->capture, output, error);
+                exit_code = job->capture.exit_code;
+            }
+        }
+        else if (job->capture.failed)
+        {
+            fflush(output); // Keep errors in order with earlier results
+            fprintf(error, "Failed to compile '%s':\n", job->filename);
+            fflush(error);
+            write_captured_errors(&job->capture, output, error);
+            exit_code = EXIT_FAILURE;
+        }
+        else
+        {
+            fprintf(output, "%s: ", job->filename);
+            fwrite(job->result, 1, job->result_size, output);
+        }
+    }
+    return exit_code;
+}
+
+/**
+ * @brief Compile every file in the batch given on the command line
+ * @param[in] evaluate The function to evaluate each file's AST with
+ * @return EXIT_SUCCESS, or EXIT_FAILURE if any file failed
+ */
+int run_batch(evaluate_function_t evaluate)
+{
+    return compile_batch(&command_line_batch, evaluate, stdout, stderr);
+}
+
+/**
+ * @brief Deallocate the files of a batch, keeping its directory and how
+ * files are opened
+ * @param[in,out] batch The batch to empty
+ */
+void put_batch_files(batch_t *batch)
+{
+    for (size_t index = 0; index < batch->job_count; index++)
+    {
+        free(batch->job[index].filename);
+        free(batch->job[index].result);
+        put_error_capture(&batch->job[index].capture);
+    }
+    free(batch->job);
+    *batch = (batch_t){NULL, 0, 0, batch->directory, 0, batch->is_read};
+}
+
+/**
+ * @brief Deallocate the batch given on the command line, and the workspaces
+ */
+void put_batch()
+{
+    put_batch_files(&command_line_batch);
+    while (workspaces.head != NULL)
+    {
+        batch_workspace_t *workspace = workspaces.head;
+        workspaces.head = workspace->next;
+        put_token_chunk(&workspace->tokens);
+        put_standalone_AST(&workspace->ast);
+        free(workspace);
+    }
+}
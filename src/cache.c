@@ -0,0 +1,499 @@
+/** cache.c
+ * @brief A content-addressed cache of results on disk, shared between runs
+ *
+ * A result is what compiling a file printed. It is stored under a 128-bit
+ * hash of the file contents, seeded with a hash of the attis binary and the
+ * options which change what is printed, so a hit needs no lexing, parsing or
+ * evaluation. Any rebuild of attis starts a fresh set of keys. The whole
+ * hash and the file size are checked on a hit.
+ * Entries are written to a temporary file and renamed into place, so any
+ * number of processes can share a directory and never see half an entry.
+ *
+ * Using an entry updates its modification time. Once a run has stored
+ * something, the least recently used entries are removed until the
+ * directory fits in its size limit again. This happens at exit, and also
+ * whenever an eighth of the limit has been stored since the last trim, so a
+ * long running server keeps to the limit too.
+ *
+ * STATE: cache, stored_count, stored_size, temp_count
+ */
+
+#include "cache.h"
+#include "error_handling.h"
+
+#include <dirent.h>    // `fdopendir`, `readdir`
+#include <fcntl.h>     // `open`, `openat`
+#include <stdatomic.h> // `atomic_size_t`
+#include <string.h>    // `memcmp`, `strlen`
+#include <sys/stat.h>  // `fstat`, `futimens`, `mkdir`
+#include <time.h>      // `time`
+#include <unistd.h>    // `close`, `read`, `write`, `getpid`
+
+#define CACHE_NAME_LENGTH 16         // Hex digits in an entry's name
+#define CACHE_TEMP_MAX_AGE (60 * 60) // Seconds before a temp file is stale
+#define CACHE_TRIM_FRACTION 8 // Trim after storing this part of the limit
+
+/**
+ * @brief The start of every entry, followed by the result
+ */
+typedef struct cache_header_t
+{
+    char magic[8];
+    uint64_t hash[CACHE_HASH_WORDS];
+    uint64_t size;
+    uint64_t result_size;
+} cache_header_t;
+
+/**
+ * @brief An entry found while trimming the cache
+ */
+typedef struct cache_entry_t
+{
+    char name[CACHE_NAME_LENGTH + 1];
+    struct timespec used; // When the entry was last stored or loaded
+    size_t size;
+} cache_entry_t;
+
+typedef struct cache_t
+{
+    int directory_fd; // The cache directory, or -1 if there is no cache
+    size_t size_limit;
+    uint64_t seed[CACHE_HASH_WORDS]; // The hash of the binary and options
+} cache_t;
+
+static char const cache_magic[8] = "attis\0c3";
+
+/**
+ * STATE: The cache directory and what every key is seeded with
+ */
+static cache_t cache = {-1, 0, {0}};
+
+/**
+ * STATE: The entries stored by this process
+ */
+static atomic_size_t stored_count = 0;
+
+/**
+ * STATE: The bytes of entries stored by this process since the last trim
+ */
+static atomic_size_t stored_size = 0;
+
+/**
+ * STATE: The temporary files made by this process, for their names
+ */
+static atomic_size_t temp_count = 0;
+
+//////////////////////////////////////////////////////////////////////////////
+// Hashing
+//////////////////////////////////////////////////////////////////////////////
+
+#define HASH_PRIME_1 ((uint64_t)0x9e3779b97f4a7c15)
+#define HASH_PRIME_2 ((uint64_t)0xc2b2ae3d27d4eb4f)
+#define HASH_PRIME_3 ((uint64_t)0x165667b19e3779f9)
+#define HASH_PRIME_4 ((uint64_t)0x85ebca77c2b2ae63)
+#define HASH_LANES 4 // Independent lanes, so multiplies overlap
+
+/**
+ * @brief Scramble the bits of a word, so each bit affects every other
+ */
+static uint64_t mix_hash(uint64_t value)
+{
+    value ^= value >> 30;
+    value *= 0xbf58476d1ce4e5b9;
+    value ^= value >> 27;
+    value *= 0x94d049bb133111eb;
+    return value ^ (value >> 31);
+}
+
+/**
+ * @brief Add a word to a lane of the hash
+ * @param[in,out] lane The two halves of the lane, which are mixed with
+ * different primes so each half is its own 64-bit hash
+ * @param[in] word The word to add
+ */
+static void add_hash_word(uint64_t lane[CACHE_HASH_WORDS], uint64_t word)
+{
+    lane[0] ^= word * HASH_PRIME_2;
+    lane[0] = ((lane[0] << 31) | (lane[0] >> 33)) * HASH_PRIME_1;
+    lane[1] ^= word * HASH_PRIME_4;
+    lane[1] = ((lane[1] << 27) | (lane[1] >> 37)) * HASH_PRIME_3;
+}
+
+/**
+ * @brief Hash bytes, a word at a time in each of several lanes
+ * @param[in] data The bytes to hash
+ * @param[in] size The number of bytes
+ * @param[in] seed Where the hash starts, to hash several pieces in turn
+ * @param[out] hash The hash, which may be the seed
+ */
+static void hash_bytes(char const *data, size_t size,
+                       uint64_t const seed[CACHE_HASH_WORDS],
+                       uint64_t hash[CACHE_HASH_WORDS])
+{
+    uint64_t lane[HASH_LANES][CACHE_HASH_WORDS];
+    uint64_t word;
+    for (size_t index = 0; index < HASH_LANES; index++)
+    {
+        lane[index][0] = seed[0] + HASH_PRIME_1 * (index + 1);
+        lane[index][1] = seed[1] + HASH_PRIME_3 * (index + 1);
+    }
+    size_t offset = 0;
+    for (; offset + sizeof(word) * HASH_LANES <= size;
+         offset += sizeof(word) * HASH_LANES)
+    {
+        for (size_t index = 0; index < HASH_LANES; index++)
+        {
+            memcpy(&word, data + offset + index * sizeof(word),
+                   sizeof(word));
+            add_hash_word(lane[index], word);
+        }
+    }
+    for (; offset + sizeof(word) <= size; offset += sizeof(word))
+    {
+        memcpy(&word, data + offset, sizeof(word));
+        add_hash_word(lane[0], word);
+    }
+    word = 0;
+    memcpy(&word, data + offset, size - offset);
+    add_hash_word(lane[1], word);
+
+    for (size_t half = 0; half < CACHE_HASH_WORDS; half++)
+    {
+        hash[half] = size + half * HASH_PRIME_2;
+        for (size_t index = 0; index < HASH_LANES; index++)
+        {
+            hash[half] = mix_hash(hash[half] ^ lane[index][half]);
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Reading and Writing Entries
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Get the name of the entry for a key
+ * @param[out] name Where to put the name
+ * @param[in] key The key of the entry
+ */
+static void get_entry_name(char name[CACHE_NAME_LENGTH + 1],
+                           cache_key_t const *key)
+{
+    snprintf(name, CACHE_NAME_LENGTH + 1, "%016llx",
+             (unsigned long long)key->hash[0]);
+}
+
+/**
+ * @brief Check whether a name is the name of an entry
+ */
+static int is_entry_name(char const *name)
+{
+    size_t length = strspn(name, "0123456789abcdef");
+    return length == CACHE_NAME_LENGTH && name[length] == '\0';
+}
+
+/**
+ * @brief Read exactly size bytes from a file
+ * @return Nonzero if all of them were read
+ */
+static int read_all(int fd, void *data, size_t size)
+{
+    ssize_t read_size;
+    while (size > 0 && (read_size = read(fd, data, size)) > 0)
+    {
+        data = (char *)data + read_size;
+        size -= (size_t)read_size;
+    }
+    return size == 0;
+}
+
+/**
+ * @brief Write exactly size bytes to a file
+ * @return Nonzero if all of them were written
+ */
+static int write_all(int fd, void const *data, size_t size)
+{
+    ssize_t write_size;
+    while (size > 0 && (write_size = write(fd, data, size)) > 0)
+    {
+        data = (char const *)data + write_size;
+        size -= (size_t)write_size;
+    }
+    return size == 0;
+}
+
+/**
+ * @brief Read an entry's result, if the entry is whole and for this key
+ * @param[in] fd The open entry
+ * @param[in] key The key the entry should have
+ * @param[out] result_size The size of the result
+ * @return The result, to be freed, or NULL if the entry is no good
+ */
+static char *read_entry(int fd, cache_key_t const *key, size_t *result_size)
+{
+    cache_header_t header;
+    struct stat entry_stat;
+    if (!read_all(fd, &header, sizeof(header)) || fstat(fd, &entry_stat) != 0
+        || memcmp(header.magic, cache_magic, sizeof(cache_magic)) != 0
+        || header.hash[0] != key->hash[0] || header.hash[1] != key->hash[1]
+        || header.size != key->size
+        || (uint64_t)entry_stat.st_size != sizeof(header) + header.result_size)
+    {
+        return NULL;
+    }
+    *result_size = (size_t)header.result_size;
+    char *result = malloc(*result_size + 1); // Results can be empty
+    ASSERT(result != NULL, "Failed to allocate cached result\n");
+    if (!read_all(fd, result, *result_size))
+    {
+        free(result);
+        return NULL;
+    }
+    return result;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Trimming
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Order entries from least to most recently used
+ */
+static int compare_entry_use(void const *first, void const *second)
+{
+    struct timespec const *a = &((cache_entry_t const *)first)->used;
+    struct timespec const *b = &((cache_entry_t const *)second)->used;
+    if (a->tv_sec != b->tv_sec)
+    {
+        return a->tv_sec < b->tv_sec ? -1 : 1;
+    }
+    return (a->tv_nsec > b->tv_nsec) - (a->tv_nsec < b->tv_nsec);
+}
+
+/**
+ * @brief Remove the least recently used entries until the cache fits in its
+ * size limit, along with stale temporary files
+ * @note Other processes may be trimming at the same time, so entries which
+ * have already gone are skipped
+ */
+static void trim_cache()
+{
+    // A dup would share the directory's read position, so that a second
+    // trim would find nothing left to read
+    int fd = openat(cache.directory_fd, ".", O_RDONLY | O_DIRECTORY);
+    DIR *directory = fd < 0 ? NULL : fdopendir(fd);
+    if (directory == NULL)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        errno = 0;
+        return;
+    }
+
+    cache_entry_t *entries = NULL;
+    size_t entry_count = 0;
+    size_t reserve_space = 0;
+    size_t total_size = 0;
+    time_t now = time(NULL);
+    struct dirent *file;
+    while ((file = readdir(directory)) != NULL)
+    {
+        struct stat entry_stat;
+        if (fstatat(cache.directory_fd, file->d_name, &entry_stat, 0) != 0
+            || !S_ISREG(entry_stat.st_mode))
+        {
+            continue;
+        }
+        if (strncmp(file->d_name, "tmp.", 4) == 0)
+        {
+            if (now - entry_stat.st_mtim.tv_sec > CACHE_TEMP_MAX_AGE)
+            { // Left by a process which died while storing
+                unlinkat(cache.directory_fd, file->d_name, 0);
+            }
+            continue;
+        }
+        if (!is_entry_name(file->d_name))
+        {
+            continue;
+        }
+        if (entry_count == reserve_space)
+        {
+            reserve_space = reserve_space == 0 ? 256 : reserve_space * 2;
+            entries = realloc(entries, reserve_space * sizeof(*entries));
+            ASSERT(entries != NULL, "Failed to allocate cache entries\n");
+        }
+        cache_entry_t *entry = &entries[entry_count++];
+        memcpy(entry->name, file->d_name, sizeof(entry->name));
+        entry->used = entry_stat.st_mtim;
+        entry->size = (size_t)entry_stat.st_size;
+        total_size += entry->size;
+    }
+    closedir(directory);
+
+    if (total_size > cache.size_limit)
+    {
+        qsort(entries, entry_count, sizeof(*entries), compare_entry_use);
+        for (size_t index = 0;
+             index < entry_count && total_size > cache.size_limit; index++)
+        {
+            unlinkat(cache.directory_fd, entries[index].name, 0);
+            total_size -= entries[index].size;
+        }
+    }
+    free(entries);
+    errno = 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Using the Cache
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Use a directory as the cache, creating it if needed
+ * @param[in] directory The cache directory
+ * @param[in] size_limit The most bytes of entries to keep
+ * @param[in] options The options which change what compiling prints
+ */
+void enable_cache(char const *directory, size_t size_limit,
+                  char const *options)
+{
+    if (mkdir(directory, 0777) != 0)
+    {
+        ASSERT(errno == EEXIST, "Failed to create cache directory '%s'\n",
+               directory);
+        errno = 0;
+    }
+    cache.directory_fd = open(directory, O_RDONLY | O_DIRECTORY);
+    ASSERT(cache.directory_fd >= 0, "Failed to open cache directory '%s'\n",
+           directory);
+    cache.size_limit = size_limit;
+
+    // Any change to attis could change a result, so the binary itself seeds
+    // every key. It is hashed once, so this costs about a millisecond.
+    input_file_t program;
+    open_file(&program, "/proc/self/exe");
+    hash_bytes(program.data, program.size, cache.seed, cache.seed);
+    close_file(&program);
+    hash_bytes(options, strlen(options), cache.seed, cache.seed);
+}
+
+/**
+ * @brief Check whether results are cached
+ */
+int is_cache_enabled()
+{
+    return cache.directory_fd >= 0;
+}
+
+/**
+ * @brief Get the key for the result of compiling a file
+ * @param[out] key The key
+ * @param[in] file The file being compiled
+ */
+void get_cache_key(cache_key_t *key, input_file_t const *file)
+{
+    hash_bytes(file->data, file->size, cache.seed, key->hash);
+    key->size = file->size;
+}
+
+/**
+ * @brief Print a cached result, if there is one
+ * @param[in] key The key of the result
+ * @param[in] output Where to print the result
+ * @return Nonzero if the result was cached
+ * @note Safe to call on any thread
+ */
+int load_cached_result(cache_key_t const *key, FILE *output)
+{
+    char name[CACHE_NAME_LENGTH + 1];
+    get_entry_name(name, key);
+    int fd = openat(cache.directory_fd, name, O_RDONLY);
+    if (fd < 0)
+    {
+        errno = 0;
+        return 0;
+    }
+    size_t result_size;
+    char *result = read_entry(fd, key, &result_size);
+    if (result != NULL)
+    {
+        fwrite(result, 1, result_size, output);
+        free(result);
+        (void)futimens(fd, NULL); // Only for trimming, so failure is fine
+    }
+    close(fd);
+    errno = 0;
+    return result != NULL;
+}
+
+/**
+ * @brief Store a result in the cache
+ * @param[in] key The key of the result
+ * @param[in] result What compiling printed
+ * @param[in] size The size of the result
+ * @note Safe to call on any thread. The cache is only there to save time,
+ * so failing to store a result isn't an error.
+ */
+void store_cached_result(cache_key_t const *key, char const *result,
+                         size_t size)
+{
+    char name[CACHE_NAME_LENGTH + 1];
+    char temp_name[64];
+    get_entry_name(name, key);
+    snprintf(temp_name, sizeof(temp_name), "tmp.%ld.%zu", (long)getpid(),
+             atomic_fetch_add(&temp_count, 1));
+
+    int fd = openat(cache.directory_fd, temp_name,
+                    O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd < 0)
+    {
+        errno = 0;
+        return;
+    }
+    cache_header_t header
+        = {{0}, {key->hash[0], key->hash[1]}, key->size, size};
+    memcpy(header.magic, cache_magic, sizeof(cache_magic));
+    int written = write_all(fd, &header, sizeof(header))
+                  && write_all(fd, result, size);
+    if (close(fd) != 0 || !written
+        || renameat(cache.directory_fd, temp_name, cache.directory_fd, name)
+               != 0)
+    {
+        unlinkat(cache.directory_fd, temp_name, 0);
+    }
+    else
+    {
+        atomic_fetch_add(&stored_count, 1);
+        size_t threshold = cache.size_limit / CACHE_TRIM_FRACTION;
+        // Only the thread which takes the stored bytes back to 0 trims
+        if (atomic_fetch_add(&stored_size, sizeof(header) + size)
+                    + sizeof(header) + size
+                >= threshold
+            && atomic_exchange(&stored_size, 0) >= threshold)
+        {
+            trim_cache();
+        }
+    }
+    errno = 0;
+}
+
+/**
+ * @brief Trim the cache if anything was stored, and close it
+ */
+void put_cache()
+{
+    if (cache.directory_fd < 0)
+    {
+        return;
+    }
+    if (atomic_load(&stored_count) > 0)
+    {
+        trim_cache();
+    }
+    close(cache.directory_fd);
+    cache = (cache_t){-1, 0, {0}};
+    stored_count = 0;
+    stored_size = 0;
+}
@@ -0,0 +1,368 @@
+/** chunk.c
+ * @brief Lexing and parsing a single file on the thread pool
+ *
+ * The lexer carries no state across a semicolon, and neither does the
+ * parser outside of parenthesis, so a file can be cut just after any top
+ * level semicolon and each piece lexed and parsed on its own. The file is
+ * split into blocks which are measured in parallel, a prefix sum over the
+ * blocks gives the parenthesis depth and line at the start of each one, and
+ * each block is then cut at its first top level semicolon. The statements
+ * from each chunk are spliced into the AST in file order.
+ *
+ * Errors in a chunk are caught with an error trap, and only the first one
+ * in file order is reported, so failures match those of a serial run.
+ */
+
+#include "chunk.h"
+#include "error_handling.h"
+#include "scan.h"
+#include "stats.h"
+#include "thread_pool.h"
+
+#define CHUNK_MINIMUM_SIZE ((size_t)1 << 16)
+#define BLOCKS_PER_THREAD ((size_t)4) // Extra blocks to balance the load
+
+/**
+ * @brief A fixed slice of the file, used to find where to cut it
+ */
+typedef struct file_block_t
+{
+    input_file_t const *input_file;
+    size_t begin;
+    size_t end;
+    long depth;        // The parenthesis depth change over the block, then
+                       // the depth at the start of it
+    size_t line_count; // The newlines in the block, then the newlines before
+                       // the start of it
+    size_t line_start; // The offset just after the last newline in the
+                       // block, or 0, then the same from the file start
+    size_t split;      // Where the block was cut, or SIZE_MAX if it wasn't
+    source_location_t location; // The location of the cut
+} file_block_t;
+
+/**
+ * @brief A run of whole statements, lexed and parsed on its own
+ */
+typedef struct chunk_t
+{
+    input_file_t const *input_file;
+    size_t begin;
+    size_t end;
+    source_location_t location; // The location of begin
+    token_stream_t tokens;
+    AST_t ast;
+    error_capture_t capture; // The outcome of the last phase
+} chunk_t;
+
+//////////////////////////////////////////////////////////////////////////////
+// Splitting
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Find the depth change, newline count and last line of a block
+ * @param[in,out] argument The file_block_t to measure
+ */
+static void measure_block(void *argument)
+{
+    file_block_t *block = argument;
+    char const *data = block->input_file->data;
+
+    long depth = 0;
+    size_t line_count = 0;
+    size_t line_start = 0;
+    for (size_t offset = block->begin; offset < block->end;
+         offset += SCAN_BLOCK_SIZE)
+    {
+        size_t size = block->end - offset < SCAN_BLOCK_SIZE
+                          ? block->end - offset
+                          : SCAN_BLOCK_SIZE;
+        scan_masks_t masks;
+        scan_block(data + offset, size, &masks);
+        depth += __builtin_popcountll(masks.open)
+                 - __builtin_popcountll(masks.close);
+        if (masks.newline != 0)
+        {
+            line_count += (size_t)__builtin_popcountll(masks.newline);
+            line_start
+                = offset + 64 - (size_t)__builtin_clzll(masks.newline);
+        }
+    }
+    block->depth = depth;
+    block->line_count = line_count;
+    block->line_start = line_start;
+}
+
+/**
+ * @brief Find the first top level semicolon in a block, and cut after it
+ * @param[in,out] argument The file_block_t to cut, with its starting depth,
+ * line count and line start
+ */
+static void split_block(void *argument)
+{
+    file_block_t *block = argument;
+    char const *data = block->input_file->data;
+
+    long depth = block->depth;
+    size_t line_count = block->line_count;
+    size_t line_start = block->line_start;
+    block->split = SIZE_MAX;
+    for (size_t offset = block->begin; offset < block->end;
+         offset += SCAN_BLOCK_SIZE)
+    {
+        size_t size = block->end - offset < SCAN_BLOCK_SIZE
+                          ? block->end - offset
+                          : SCAN_BLOCK_SIZE;
+        scan_masks_t masks;
+        scan_block(data + offset, size, &masks);
+
+        // Only blocks with a semicolon need each character in order
+        uint64_t event = masks.semicolon == 0
+                             ? 0
+                             : masks.open | masks.close | masks.semicolon
+                                   | masks.newline;
+        while (event != 0)
+        {
+            size_t index = (size_t)__builtin_ctzll(event);
+            event &= event - 1;
+            switch (data[offset + index])
+            {
+            case '(':
+                depth += 1;
+                break;
+            case ')':
+                depth -= 1;
+                break;
+            case '\n':
+                line_count += 1;
+                line_start = offset + index + 1;
+                break;
+            default: // ';'
+                if (depth == 0)
+                {
+                    size_t split = offset + index + 1;
+                    block->split = split;
+                    block->location.offset = split;
+                    block->location.line_number = (int)line_count + 1;
+                    block->location.column_number
+                        = (int)(split - line_start) + 1;
+                    return;
+                }
+                break;
+            }
+        }
+        if (masks.semicolon == 0)
+        {
+            depth += __builtin_popcountll(masks.open)
+                     - __builtin_popcountll(masks.close);
+            if (masks.newline != 0)
+            {
+                line_count += (size_t)__builtin_popcountll(masks.newline);
+                line_start
+                    = offset + 64 - (size_t)__builtin_clzll(masks.newline);
+            }
+        }
+    }
+}
+
+/**
+ * @brief Cut a file into chunks of whole statements
+ * @param[in] input_file The file to cut
+ * @param[in] block_count The number of pieces to try to cut the file into
+ * @param[out] chunk_count The number of chunks made
+ * @return The chunks, which should be freed by the caller
+ */
+static chunk_t *split_file(input_file_t const *input_file, size_t block_count,
+                           size_t *chunk_count)
+{
+    file_block_t *blocks = calloc(block_count, sizeof(*blocks));
+    ASSERT(blocks != NULL, "Failed to allocate file blocks\n");
+    for (size_t index = 0; index < block_count; index++)
+    {
+        blocks[index].input_file = input_file;
+        blocks[index].begin = input_file->size * index / block_count;
+        blocks[index].end = input_file->size * (index + 1) / block_count;
+    }
+
+    task_group_t group = {0};
+    for (size_t index = 0; index < block_count; index++)
+    {
+        submit_task(&group, measure_block, &blocks[index]);
+    }
+    wait_task_group(&group);
+
+    // Turn the totals for each block into totals before each block
+    long depth = 0;
+    size_t line_count = 0;
+    size_t line_start = 0;
+    for (size_t index = 0; index < block_count; index++)
+    {
+        long block_depth = blocks[index].depth;
+        size_t block_line_count = blocks[index].line_count;
+        size_t block_line_start = blocks[index].line_start;
+        blocks[index].depth = depth;
+        blocks[index].line_count = line_count;
+        blocks[index].line_start = line_start;
+        depth += block_depth;
+        line_count += block_line_count;
+        if (block_line_count != 0)
+        {
+            line_start = block_line_start;
+        }
+    }
+
+    // The first block always starts a chunk, so it needn't be cut
+    for (size_t index = 1; index < block_count; index++)
+    {
+        submit_task(&group, split_block, &blocks[index]);
+    }
+    wait_task_group(&group);
+
+    chunk_t *chunks = calloc(block_count, sizeof(*chunks));
+    ASSERT(chunks != NULL, "Failed to allocate chunks\n");
+    chunks[0].input_file = input_file;
+    chunks[0].begin = 0;
+    *chunk_count = 1;
+    for (size_t index = 1; index < block_count; index++)
+    {
+        if (blocks[index].split >= input_file->size)
+        {
+            continue;
+        }
+        chunks[*chunk_count - 1].end = blocks[index].split;
+        chunks[*chunk_count].input_file = input_file;
+        chunks[*chunk_count].begin = blocks[index].split;
+        chunks[*chunk_count].location = blocks[index].location;
+        *chunk_count += 1;
+    }
+    chunks[*chunk_count - 1].end = input_file->size;
+
+    free(blocks);
+    return chunks;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Chunk Phases
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Lex a chunk
+ * @param[in,out] argument The chunk_t to lex
+ */
+static void lex_chunk_phase(void *argument)
+{
+    chunk_t *chunk = argument;
+    lex_chunk(&chunk->tokens, chunk->input_file, chunk->begin, chunk->end);
+}
+
+/**
+ * @brief Parse a chunk and release its tokens
+ * @param[in,out] argument The chunk_t to parse
+ */
+static void parse_chunk_phase(void *argument)
+{
+    chunk_t *chunk = argument;
+    parse_chunk(&chunk->ast, &chunk->tokens, chunk->input_file,
+                &chunk->location);
+    put_token_chunk(&chunk->tokens);
+}
+
+/**
+ * @brief Lex a chunk, as a task
+ * @param[in,out] argument The chunk_t to lex
+ */
+static void lex_chunk_task(void *argument)
+{
+    chunk_t *chunk = argument;
+    capture_errors(&chunk->capture, lex_chunk_phase, chunk);
+}
+
+/**
+ * @brief Parse a chunk, as a task
+ * @param[in,out] argument The chunk_t to parse
+ */
+static void parse_chunk_task(void *argument)
+{
+    chunk_t *chunk = argument;
+    capture_errors(&chunk->capture, parse_chunk_phase, chunk);
+}
+
+/**
+ * @brief Run a task on every chunk and exit on the first error in the file
+ * @param[in,out] chunks The chunks to run the task on
+ * @param[in] chunk_count The number of chunks
+ * @param[in] task The task to run
+ */
+static void run_chunk_tasks(chunk_t *chunks, size_t chunk_count,
+                            task_function_t task)
+{
+    task_group_t group = {0};
+    for (size_t index = 0; index < chunk_count; index++)
+    {
+        submit_task(&group, task, &chunks[index]);
+    }
+    wait_task_group(&group);
+
+    for (size_t index = 0; index < chunk_count; index++)
+    {
+        if (chunks[index].capture.failed)
+        {
+            print_captured_errors(&chunks[index].capture);
+            exit_on_error(chunks[index].capture.exit_code);
+        }
+    }
+    for (size_t index = 0; index < chunk_count; index++)
+    {
+        put_error_capture(&chunks[index].capture);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Parsing
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Lex and parse a file in chunks on the thread pool
+ * @param[in] input_file The file to parse
+ * @return The AST, which is the same as parse_lex would build
+ * @note Small files are lexed and parsed as a single chunk
+ */
+AST_t *parse_file_chunks(input_file_t const *input_file)
+{
+    size_t block_count = thread_pool_size() * BLOCKS_PER_THREAD;
+    if (block_count > input_file->size / CHUNK_MINIMUM_SIZE)
+    {
+        block_count = input_file->size / CHUNK_MINIMUM_SIZE;
+    }
+    if (block_count <= 1)
+    {
+        return parse_lex(lex_file(input_file), input_file);
+    }
+
+    begin_phase(PhaseLex);
+    size_t chunk_count;
+    chunk_t *chunks = split_file(input_file, block_count, &chunk_count);
+
+    // Every chunk is lexed before any is parsed, so that a lexer error is
+    // reported ahead of a parser error earlier in the file
+    run_chunk_tasks(chunks, chunk_count, lex_chunk_task);
+    record_phase_bytes(PhaseLex, input_file->size);
+    for (size_t index = 0; index < chunk_count; index++)
+    {
+        record_phase_tokens(PhaseLex, chunks[index].tokens.token_count);
+    }
+    end_phase(PhaseLex);
+
+    begin_phase(PhaseParse);
+    AST_t *ast = get_AST();
+    run_chunk_tasks(chunks, chunk_count, parse_chunk_task);
+
+    for (size_t index = 0; index < chunk_count; index++)
+    {
+        ast = splice_AST_chunk(&chunks[index].ast);
+    }
+    free(chunks);
+    record_phase_bytes(PhaseParse, input_file->size);
+    record_phase_nodes(PhaseParse, ast->node_count);
+    end_phase(PhaseParse);
+    return ast;
+}
@@ -0,0 +1,624 @@
+/** emit.c
+ * @brief A compiler from ASTs to x86-64 GNU assembly
+ *
+ * The program becomes a standalone `main` which evaluates each statement in
+ * turn and prints the value of the last one the way the evaluators do.
+ * Before a statement is emitted its nodes are labelled with Sethi-Ullman
+ * numbers, the registers each subtree needs, so the operand needing more is
+ * evaluated first and values are only spilled to the stack when both
+ * operands need every register left. Constants on the right of an operator
+ * are used straight from memory, so they need no register of their own.
+ *
+ * Values are doubles, so there is no integer division to turn into a
+ * multiply and shift. Division by a power of two becomes multiplication by
+ * its reciprocal instead, which gives the same result, and divisors known
+ * before running are checked against zero here rather than in the program.
+ *
+ * The output calls `fmod` and `round`, so it must be linked with libm.
+ */
+
+#include "emit.h"
+#include "error_handling.h"
+#include "walk.h"
+
+#include <inttypes.h> // `PRIx64`
+#include <math.h>     // `frexp`
+#include <string.h>   // `memcpy`
+
+#define EMIT_REGISTER_COUNT 15 // xmm0 to xmm14 hold values
+#define EMIT_SAVE_SIZE 128     // Room to save the values during a call
+
+/**
+ * @brief A node of the statement being emitted, in post-order
+ */
+typedef struct emit_node_t
+{
+    AST_node_t *node;
+    size_t size;   // The number of nodes in its subtree
+    unsigned need; // The registers needed to evaluate it into a register
+} emit_node_t;
+
+/**
+ * @brief The ways the operands of a binary operator can be evaluated
+ */
+typedef enum
+{
+    OrderMemory,     // The left, with the right a constant in memory
+    OrderLeftFirst,  // The left, then the right into the next register
+    OrderRightFirst, // The right, then the left into the next register
+    OrderSpill       // The right, spilled to the stack, then the left
+} operand_order_enum;
+
+/**
+ * @brief A node being emitted, and how far it has got
+ */
+typedef struct emit_frame_t
+{
+    size_t index; // The node's place in the post-order
+    unsigned reg; // The xmm register its value goes in
+    int stage;    // The number of operands emitted
+} emit_frame_t;
+
+/**
+ * @brief A program being emitted
+ */
+typedef struct emitter_t
+{
+    FILE *output;
+    emit_node_t *node; // The statement being emitted, in post-order
+    size_t node_count;
+    size_t node_reserve_space;
+    emit_frame_t *frame; // The path to the node being emitted
+    size_t frame_count;
+    size_t frame_reserve_space;
+    double *constant; // The value of each .LC label
+    size_t constant_count;
+    size_t constant_reserve_space;
+    size_t spill_count; // The spill slots in use
+    size_t spill_size;  // The most spill slots ever in use
+    AST_walk_t walk;
+} emitter_t;
+
+/**
+ * @brief The functions the program calls to print its answer, as the
+ * evaluators do, or to report a division by zero, and their data
+ */
+static char const runtime[]
+    = "attis_print_answer:\n"
+      "\tsubq\t$24, %rsp\n"
+      "\tmovsd\t%xmm0, (%rsp)\n"
+      "\tcall\tround@PLT\n"
+      "\tmovsd\t(%rsp), %xmm1\n"
+      "\tsubsd\t%xmm0, %xmm1\n"
+      "\tandpd\t.Labs_mask(%rip), %xmm1\n"
+      "\tmovsd\t.Ldivisor_limit(%rip), %xmm2\n"
+      "\tucomisd\t%xmm1, %xmm2\n"
+      "\tjbe\t1f\n"
+      "\tcvttsd2si\t(%rsp), %rsi\n"
+      "\tleaq\t.Lwhole(%rip), %rdi\n"
+      "\txorl\t%eax, %eax\n"
+      "\tcall\tprintf@PLT\n"
+      "\taddq\t$24, %rsp\n"
+      "\tret\n"
+      "1:\n"
+      "\tmovsd\t(%rsp), %xmm0\n"
+      "\tleaq\t.Lfraction(%rip), %rdi\n"
+      "\tmovl\t$1, %eax\n"
+      "\tcall\tprintf@PLT\n"
+      "\taddq\t$24, %rsp\n"
+      "\tret\n"
+      "\n"
+      "attis_divide_by_zero:\n" // Jumped or called to, so realign the stack
+      "\tandq\t$-16, %rsp\n"
+      "\tleaq\t.Ldivide_by_zero(%rip), %rdi\n"
+      "\tcall\tputs@PLT\n"
+      "\tmovl\t$1, %edi\n"
+      "\tcall\texit@PLT\n"
+      "\n"
+      "\t.section\t.rodata\n"
+      "\t.balign\t16\n"
+      ".Lsign_mask:\n"
+      "\t.quad\t0x8000000000000000, 0\n"
+      ".Labs_mask:\n"
+      "\t.quad\t0x7fffffffffffffff, 0\n"
+      ".Ldivisor_limit:\n"
+      "\t.quad\t0x3f847ae147ae147b\n" // 0.01
+      ".Lwhole:\n"
+      "\t.string\t\"Answer: %ld\\n\"\n"
+      ".Lfraction:\n"
+      "\t.string\t\"Answer: %f\\n\"\n"
+      ".Ldivide_by_zero:\n"
+      "\t.string\t\"AST divide by 0 error\"\n";
+
+//////////////////////////////////////////////////////////////////////////////
+// Labelling
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Get the node an operand comes down to, past parentheses and unary
+ * plus
+ * @param[in] emitter The program being emitted
+ * @param[in] index The operand's place in the post-order
+ * @return The place of the node which gives the operand its value
+ */
+static size_t get_operand(emitter_t const *emitter, size_t index)
+{
+    AST_node_t const *node = emitter->node[index].node;
+    while (node->type == NodeParenthesis
+           || (node->type == NodeUnaryOperator && node->string == InternPlus))
+    {
+        node = emitter->node[--index].node;
+    }
+    return index;
+}
+
+/**
+ * @brief Check whether an operand is a literal or constant
+ */
+static int is_constant_operand(emitter_t const *emitter, size_t index)
+{
+    node_type_enum type
+        = emitter->node[get_operand(emitter, index)].node->type;
+    return type == NodeLiteral || type == NodeConstant;
+}
+
+/**
+ * @brief Get the value of a literal or constant
+ */
+static double get_constant_value(AST_node_t const *node)
+{
+    return node->type == NodeLiteral ? get_literal_value(node) : node->value;
+}
+
+/**
+ * @brief Label each node of a statement with the size of its subtree and
+ * its Sethi-Ullman number
+ * @param[in,out] emitter The program being emitted
+ * @param[in] statement The root of the statement
+ * @note The right child of a binary operator comes just before it in
+ * post-order, and the left child comes before the right child's subtree
+ */
+static void label_statement(emitter_t *emitter, AST_node_t *statement)
+{
+    AST_node_t *node;
+    emitter->node_count = 0;
+    reset_AST_walk(&emitter->walk, statement);
+    while ((node = next_AST_node(&emitter->walk, NULL)) != NULL)
+    {
+        if (emitter->node_count == emitter->node_reserve_space)
+        {
+            emitter->node_reserve_space = emitter->node_reserve_space == 0
+                                              ? 64
+                                              : emitter->node_reserve_space
+                                                    * 2;
+            emitter->node
+                = realloc(emitter->node, emitter->node_reserve_space
+                                             * sizeof(*emitter->node));
+            ASSERT(emitter->node != NULL, "Failed to allocate emit nodes\n");
+        }
+        size_t index = emitter->node_count++;
+        emit_node_t *label = &emitter->node[index];
+        *label = (emit_node_t){node, 1, 1};
+        switch (node->type)
+        {
+        case NodeUnaryOperator:
+        case NodeParenthesis:
+            label->size += label[-1].size;
+            label->need = label[-1].need;
+            break;
+        case NodeBinaryOperator:
+        {
+            emit_node_t const *right = &label[-1];
+            emit_node_t const *left = right - right->size;
+            unsigned right_need
+                = is_constant_operand(emitter, index - 1) ? 0 : right->need;
+            label->size += left->size + right->size;
+            label->need = left->need == right_need ? left->need + 1
+                          : left->need > right_need ? left->need
+                                                     : right_need;
+            break;
+        }
+        case NodeLiteral:
+        case NodeConstant:
+            break;
+        default:
+            EXIT_ERROR("Unknown AST token in emit\n");
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Emitting
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Add a constant to the end of a program's constant table
+ * @param[in,out] emitter The program to add to
+ * @param[in] value The constant to add
+ * @return The number of the constant's .LC label
+ */
+static size_t add_constant(emitter_t *emitter, double value)
+{
+    if (emitter->constant_count == emitter->constant_reserve_space)
+    {
+        emitter->constant_reserve_space
+            = emitter->constant_reserve_space == 0
+                  ? 256
+                  : emitter->constant_reserve_space * 2;
+        emitter->constant
+            = realloc(emitter->constant, emitter->constant_reserve_space
+                                             * sizeof(*emitter->constant));
+        ASSERT(emitter->constant != NULL, "Failed to allocate constants\n");
+    }
+    emitter->constant[emitter->constant_count] = value;
+    return emitter->constant_count++;
+}
+
+/**
+ * @brief Start emitting a node
+ * @param[in,out] emitter The program being emitted
+ * @param[in] index The node's place in the post-order
+ * @param[in] reg The xmm register its value goes in
+ */
+static void push_frame(emitter_t *emitter, size_t index, unsigned reg)
+{
+    if (emitter->frame_count == emitter->frame_reserve_space)
+    {
+        emitter->frame_reserve_space = emitter->frame_reserve_space == 0
+                                           ? 64
+                                           : emitter->frame_reserve_space
+                                                 * 2;
+        emitter->frame
+            = realloc(emitter->frame, emitter->frame_reserve_space
+                                          * sizeof(*emitter->frame));
+        ASSERT(emitter->frame != NULL, "Failed to allocate emit frames\n");
+    }
+    emitter->frame[emitter->frame_count++] = (emit_frame_t){index, reg, 0};
+}
+
+/**
+ * @brief Check whether dividing by a value is the same as multiplying by
+ * its reciprocal, which holds when the value is a power of two
+ */
+static int has_exact_reciprocal(double value)
+{
+    int exponent;
+    return fabs(frexp(value, &exponent)) == 0.5;
+}
+
+/**
+ * @brief Emit code which exits if a divisor is as close to zero as the
+ * evaluators treat as zero
+ * @param[in,out] emitter The program being emitted
+ * @param[in] divisor The divisor's operand
+ * @param[in] value The divisor's value, if it is known, else NULL
+ */
+static void emit_divisor_check(emitter_t *emitter, char const *divisor,
+                               double const *value)
+{
+    if (value != NULL)
+    {
+        if (*value < 0.01 && *value > -0.01)
+        {
+            fputs("\tcall\tattis_divide_by_zero\n", emitter->output);
+        }
+        return;
+    }
+    fprintf(emitter->output,
+            "\tmovsd\t%s, %%xmm15\n"
+            "\tandpd\t.Labs_mask(%%rip), %%xmm15\n"
+            "\tucomisd\t.Ldivisor_limit(%%rip), %%xmm15\n"
+            "\tjp\t1f\n" // NaN isn't zero
+            "\tjb\tattis_divide_by_zero\n"
+            "1:\n",
+            divisor);
+}
+
+/**
+ * @brief Emit a call to fmod, saving the values which are still needed
+ * @param[in,out] emitter The program being emitted
+ * @param[in] live The registers below this one are saved
+ * @param[in] target The xmm register holding the dividend, which gets the
+ * result
+ * @param[in] divisor The divisor's operand
+ */
+static void emit_modulo(emitter_t *emitter, unsigned live, unsigned target,
+                        char const *divisor)
+{
+    FILE *output = emitter->output;
+    for (unsigned reg = 0; reg < live; reg++)
+    {
+        fprintf(output, "\tmovsd\t%%xmm%u, %u(%%rsp)\n", reg, reg * 8);
+    }
+    if (divisor[0] == '%') // A register, which may be xmm0
+    {
+        fprintf(output, "\tmovapd\t%s, %%xmm15\n", divisor);
+        divisor = "%xmm15";
+    }
+    if (target != 0)
+    {
+        fprintf(output, "\tmovapd\t%%xmm%u, %%xmm0\n", target);
+    }
+    fprintf(output,
+            "\tmovsd\t%s, %%xmm1\n"
+            "\tcall\tfmod@PLT\n",
+            divisor);
+    if (target != 0)
+    {
+        fprintf(output, "\tmovapd\t%%xmm0, %%xmm%u\n", target);
+    }
+    for (unsigned reg = 0; reg < live; reg++)
+    {
+        fprintf(output, "\tmovsd\t%u(%%rsp), %%xmm%u\n", reg * 8, reg);
+    }
+}
+
+/**
+ * @brief Emit a binary operator
+ * @param[in,out] emitter The program being emitted
+ * @param[in] symbol The interned operator
+ * @param[in] live The registers below this one hold values still needed
+ * @param[in] target The xmm register holding the left operand, which gets
+ * the result
+ * @param[in] source The right operand, a register or memory
+ * @param[in] divisor The value of the right operand, if it is known, else
+ * NULL
+ */
+static void emit_operator(emitter_t *emitter, intern_t symbol, unsigned live,
+                          unsigned target, char const *source,
+                          double const *divisor)
+{
+    FILE *output = emitter->output;
+    switch (symbol)
+    {
+    case InternPlus:
+        fprintf(output, "\taddsd\t%s, %%xmm%u\n", source, target);
+        break;
+    case InternMinus:
+        fprintf(output, "\tsubsd\t%s, %%xmm%u\n", source, target);
+        break;
+    case InternTimes:
+        fprintf(output, "\tmulsd\t%s, %%xmm%u\n", source, target);
+        break;
+    case InternDivide:
+        emit_divisor_check(emitter, source, divisor);
+        if (divisor != NULL && has_exact_reciprocal(*divisor))
+        {
+            fprintf(output, "\tmulsd\t.LC%zu(%%rip), %%xmm%u\n",
+                    add_constant(emitter, 1 / *divisor), target);
+        }
+        else
+        {
+            fprintf(output, "\tdivsd\t%s, %%xmm%u\n", source, target);
+        }
+        break;
+    case InternModulo:
+        emit_divisor_check(emitter, source, divisor);
+        emit_modulo(emitter, live, target, source);
+        break;
+    default:
+        EXIT_ERROR("Unknown AST token in emit\n");
+    }
+}
+
+/**
+ * @brief Choose how to evaluate the operands of a binary operator
+ * @param[in] emitter The program being emitted
+ * @param[in] index The operator's place in the post-order
+ * @param[in] reg The xmm register its value goes in
+ * @return The order to evaluate the operands in
+ */
+static operand_order_enum get_operand_order(emitter_t const *emitter,
+                                            size_t index, unsigned reg)
+{
+    emit_node_t const *right = &emitter->node[index - 1];
+    emit_node_t const *left = right - right->size;
+    unsigned free_count = EMIT_REGISTER_COUNT - 1 - reg; // Past the first
+    if (is_constant_operand(emitter, index - 1))
+    {
+        return OrderMemory;
+    }
+    if (right->need > left->need)
+    {
+        return left->need <= free_count ? OrderRightFirst : OrderSpill;
+    }
+    return right->need <= free_count ? OrderLeftFirst : OrderSpill;
+}
+
+/**
+ * @brief Emit the next step of the binary operator being emitted, which is
+ * evaluating an operand or applying the operator
+ * @param[in,out] emitter The program being emitted
+ */
+static void emit_binary_step(emitter_t *emitter)
+{
+    emit_frame_t *frame = &emitter->frame[emitter->frame_count - 1];
+    size_t right = frame->index - 1;
+    size_t left = right - emitter->node[right].size;
+    intern_t symbol = emitter->node[frame->index].node->string;
+    unsigned reg = frame->reg;
+    int stage = frame->stage++;
+    char source[32];
+    switch (get_operand_order(emitter, frame->index, reg))
+    {
+    case OrderMemory:
+    {
+        if (stage == 0)
+        {
+            push_frame(emitter, left, reg);
+            return;
+        }
+        double value
+            = get_constant_value(emitter->node[get_operand(emitter, right)]
+                                     .node);
+        snprintf(source, sizeof(source), ".LC%zu(%%rip)",
+                 add_constant(emitter, value));
+        emit_operator(emitter, symbol, reg, reg, source, &value);
+        break;
+    }
+    case OrderLeftFirst:
+        if (stage < 2)
+        {
+            push_frame(emitter, stage == 0 ? left : right, reg + (unsigned)stage);
+            return;
+        }
+        snprintf(source, sizeof(source), "%%xmm%u", reg + 1);
+        emit_operator(emitter, symbol, reg, reg, source, NULL);
+        break;
+    case OrderRightFirst:
+        if (stage < 2)
+        {
+            push_frame(emitter, stage == 0 ? right : left, reg + (unsigned)stage);
+            return;
+        }
+        snprintf(source, sizeof(source), "%%xmm%u", reg);
+        emit_operator(emitter, symbol, reg, reg + 1, source, NULL);
+        fprintf(emitter->output, "\tmovapd\t%%xmm%u, %%xmm%u\n", reg + 1,
+                reg);
+        break;
+    case OrderSpill:
+        if (stage == 0)
+        {
+            push_frame(emitter, right, reg);
+            return;
+        }
+        if (stage == 1)
+        {
+            fprintf(emitter->output, "\tmovsd\t%%xmm%u, %zu(%%rsp)\n", reg,
+                    EMIT_SAVE_SIZE + emitter->spill_count * 8);
+            emitter->spill_count += 1;
+            if (emitter->spill_count > emitter->spill_size)
+            {
+                emitter->spill_size = emitter->spill_count;
+            }
+            push_frame(emitter, left, reg);
+            return;
+        }
+        emitter->spill_count -= 1;
+        snprintf(source, sizeof(source), "%zu(%%rsp)",
+                 EMIT_SAVE_SIZE + emitter->spill_count * 8);
+        emit_operator(emitter, symbol, reg, reg, source, NULL);
+        break;
+    }
+    emitter->frame_count -= 1;
+}
+
+/**
+ * @brief Emit a statement, leaving its value in xmm0
+ * @param[in,out] emitter The program being emitted
+ * @param[in] statement The root of the statement
+ */
+static void emit_statement(emitter_t *emitter, AST_node_t *statement)
+{
+    label_statement(emitter, statement);
+    emitter->frame_count = 0;
+    push_frame(emitter, emitter->node_count - 1, 0);
+    while (emitter->frame_count > 0)
+    {
+        emit_frame_t *frame = &emitter->frame[emitter->frame_count - 1];
+        AST_node_t const *node = emitter->node[frame->index].node;
+        switch (node->type)
+        {
+        case NodeUnaryOperator:
+            if (node->string == InternPlus)
+            {
+                frame->index -= 1; // Replaced by its operand
+            }
+            else if (node->string != InternMinus)
+            {
+                EXIT_ERROR("Unknown AST token in emit\n");
+            }
+            else if (frame->stage++ == 0)
+            {
+                push_frame(emitter, frame->index - 1, frame->reg);
+            }
+            else
+            {
+                fprintf(emitter->output,
+                        "\txorpd\t.Lsign_mask(%%rip), %%xmm%u\n",
+                        frame->reg);
+                emitter->frame_count -= 1;
+            }
+            break;
+        case NodeBinaryOperator:
+            emit_binary_step(emitter);
+            break;
+        case NodeLiteral:
+        case NodeConstant:
+            fprintf(emitter->output, "\tmovsd\t.LC%zu(%%rip), %%xmm%u\n",
+                    add_constant(emitter, get_constant_value(node)),
+                    frame->reg);
+            emitter->frame_count -= 1;
+            break;
+        case NodeParenthesis:
+            frame->index -= 1; // Replaced by its operand
+            break;
+        default:
+            EXIT_ERROR("Unknown AST token in emit\n");
+        }
+    }
+}
+
+/**
+ * @brief Compile an AST to a standalone x86-64 program in GNU assembly
+ * @param[in] root The root of the AST, usually the global scope
+ * @param[in] output Where to write the assembly
+ * @note The program prints the value of the last statement, or exits with
+ * EXIT_FAILURE on a division by zero
+ */
+void emit_assembly(AST_node_t *root, FILE *output)
+{
+    AST_node_t *first = root;
+    size_t count = 1;
+    if (root->type == NodeScope)
+    {
+        if (root->list_head == NULL)
+        {
+            EXIT_ERROR("No statements to evaluate\n");
+        }
+        first = root->list_head;
+        count = SIZE_MAX;
+    }
+
+    emitter_t emitter = {output, NULL, 0, 0, NULL, 0, 0, NULL, 0, 0, 0, 0,
+                         {0}};
+    get_AST_walk(&emitter.walk, NULL, WalkPostOrder);
+    fputs("\t.text\n"
+          "\t.globl\tmain\n"
+          "\t.type\tmain, @function\n"
+          "main:\n"
+          "\tsubq\t$.Lframe_size, %rsp\n",
+          output);
+    for (AST_node_t *statement = first; statement != NULL && count > 0;
+         statement = statement->next, count--)
+    {
+        emit_statement(&emitter, statement);
+    }
+    // Calls need the stack aligned to 16 bytes, after the return address
+    size_t frame_size = EMIT_SAVE_SIZE + emitter.spill_size * 8;
+    frame_size += frame_size % 16 == 0 ? 8 : 0;
+    fprintf(output,
+            "\tcall\tattis_print_answer\n"
+            "\txorl\t%%eax, %%eax\n"
+            "\taddq\t$.Lframe_size, %%rsp\n"
+            "\tret\n"
+            "\t.size\tmain, .-main\n"
+            "\t.set\t.Lframe_size, %zu\n"
+            "\n",
+            frame_size);
+    fputs(runtime, output);
+    fputs("\t.balign\t8\n", output);
+    for (size_t index = 0; index < emitter.constant_count; index++)
+    {
+        uint64_t bits;
+        memcpy(&bits, &emitter.constant[index], sizeof(bits));
+        fprintf(output, ".LC%zu:\n\t.quad\t0x%016" PRIx64 "\n", index, bits);
+    }
+    fputs("\t.section\t.note.GNU-stack,\"\",@progbits\n", output);
+
+    put_AST_walk(&emitter.walk);
+    free(emitter.node);
+    free(emitter.frame);
+    free(emitter.constant);
+    ASSERT(!ferror(output), "Failed to write assembly\n");
+}
@@ -0,0 +1,136 @@
+/** error_handling.c
+ * @brief Exiting, or unwinding to a trap, on errors
+ *
+ * STATE: error_trap
+ */
+
+#include "error_handling.h"
+
+/**
+ * STATE: The trap for errors on this thread, or NULL to exit on errors
+ */
+_Thread_local error_trap_t *error_trap = NULL;
+
+/**
+ * @brief Get the stream that error messages normally sent to stdout go to
+ */
+FILE *error_output_stream()
+{
+    if (error_trap != NULL && error_trap->output != NULL)
+    {
+        return error_trap->output;
+    }
+    return stdout;
+}
+
+/**
+ * @brief Get the stream that error messages normally sent to stderr go to
+ */
+FILE *error_message_stream()
+{
+    if (error_trap != NULL && error_trap->error != NULL)
+    {
+        return error_trap->error;
+    }
+    return stderr;
+}
+
+/**
+ * @brief Exit the program, or return to this thread's trap if one is set
+ * @param[in] exit_code The code to exit with
+ * @note This function does not return
+ */
+noreturn void exit_on_error(int exit_code)
+{
+    if (error_trap != NULL)
+    {
+        error_trap->exit_code = exit_code;
+        longjmp(error_trap->environment, 1);
+    }
+    exit(exit_code);
+}
+
+/**
+ * @brief Run a function, catching any error it raises instead of exiting
+ * @param[out] capture Whether the function failed, and its error messages
+ * @param[in] function The function to run
+ * @param[in] argument The argument to pass to the function
+ * @note Release the messages with put_error_capture
+ */
+void capture_errors(error_capture_t *capture, trapped_function_t function,
+                    void *argument)
+{
+    error_trap_t trap;
+    *capture = (error_capture_t){0, 0, NULL, 0, NULL, 0};
+    trap.output = open_memstream(&capture->output, &capture->output_size);
+    trap.error = open_memstream(&capture->error, &capture->error_size);
+    ASSERT(trap.output != NULL && trap.error != NULL,
+           "Failed to open error streams\n");
+    trap.exit_code = 0;
+
+    error_trap_t *outer_trap = error_trap;
+    error_trap = &trap;
+    if (setjmp(trap.environment) == 0)
+    {
+        function(argument);
+    }
+    else
+    {
+        capture->failed = 1;
+        capture->exit_code = trap.exit_code;
+    }
+    error_trap = outer_trap;
+
+    fclose(trap.output);
+    fclose(trap.error);
+}
+
+/**
+ * @brief Print the error messages caught by capture_errors
+ * @param[in] capture The messages to print
+ */
+void print_captured_errors(error_capture_t const *capture)
+{
+    write_captured_errors(capture, error_output_stream(),
+                          error_message_stream());
+}
+
+/**
+ * @brief Write the error messages caught by capture_errors to given streams
+ * @param[in] capture The messages to write
+ * @param[in] output Where messages for stdout go
+ * @param[in] error Where messages for stderr go
+ */
+void write_captured_errors(error_capture_t const *capture, FILE *output,
+                           FILE *error)
+{
+    fwrite(capture->error, 1, capture->error_size, error);
+    fwrite(capture->output, 1, capture->output_size, output);
+}
+
+/**
+ * @brief Release the error messages caught by capture_errors
+ * @param[in,out] capture The messages to release
+ */
+void put_error_capture(error_capture_t *capture)
+{
+    free(capture->output);
+    free(capture->error);
+    capture->output = NULL;
+    capture->error = NULL;
+}
+
+/**
+ * @brief Print and release the error messages caught by capture_errors, and
+ * raise the error again
+ * @param[in,out] capture The messages of a function which failed
+ * @note This lets a function release what it allocated under a trap before
+ * passing the error on, to the next trap out or to exit
+ */
+noreturn void raise_captured_errors(error_capture_t *capture)
+{
+    int exit_code = capture->exit_code;
+    print_captured_errors(capture);
+    put_error_capture(capture);
+    exit_on_error(exit_code);
+}
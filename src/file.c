@@ -1,35 +1,282 @@
 /** file.c
  * @brief File IO handling
  *
+ * Regular files are mapped read-only so the lexer can address the input in
+ * place. Anything that can't be mapped (pipes, character devices) is read
+ * through stdio into a heap buffer instead.
+ *
  * STATE: input_file
  */
 
 #include "error_handling.h"
 #include "file.h"
 
+#include <fcntl.h>    // `open`, `openat`
+#include <string.h>   // `strlen`
+#include <sys/mman.h> // `mmap`, `madvise`, `munmap`
+#include <sys/stat.h> // `fstat`
+#include <unistd.h>   // `close`, `read`
+
 /**
  * STATE: This holds the open input file
  */
-static FILE *input_file = NULL;
+static input_file_t input_file = {NULL, 0, 0, InternNone};
 
 /**
- * @brief Open a file for reading 
+ * @brief Close a file descriptor on an error path, keeping errno for the
+ * error which is about to be raised
+ * @param[in] fd The file descriptor to close
+ * @note Errors may be caught by a trap in a long running process, so
+ * nothing opened may be left behind when one is raised
  */
-FILE *get_file(const char *restrict filename, const char *restrict modes)
+static void close_on_error(int fd)
 {
-    input_file = fopen(filename, modes);
-    ASSERT(input_file != NULL, "Failed to open file: '%s'\n", filename);
-    return input_file;
+    int saved_errno = errno;
+    (void)close(fd);
+    errno = saved_errno;
 }
 
 /**
- * @brief Close the open file
+ * @brief Get the status of an open file, closing it if that fails
+ * @param[in] fd The open file
+ * @param[out] file_stat The status of the file
+ * @param[in] filename The name of the file, used for error reporting
  */
-void put_file()
+static void stat_open_file(int fd, struct stat *file_stat,
+                           char const *filename)
+{
+    int is_stat = fstat(fd, file_stat) == 0;
+    if (!is_stat)
+    {
+        close_on_error(fd);
+    }
+    ASSERT(is_stat, "Failed to stat file: '%s'\n", filename);
+}
+
+/**
+ * @brief Read the rest of a stream into a heap buffer
+ * @param[out] file Where to store the contents of the stream
+ * @param[in] fd An open file descriptor, which is closed by this function
+ * @param[in] filename The name of the file, used for error reporting
+ */
+static void read_stream(input_file_t *file, int fd, char const *filename)
+{
+    FILE *stream = fdopen(fd, "r");
+    if (stream == NULL)
+    {
+        close_on_error(fd);
+    }
+    ASSERT(stream != NULL, "Failed to open file: '%s'\n", filename);
+
+    size_t reserve_space = 4096;
+    char *data = malloc(reserve_space);
+    if (data == NULL)
+    {
+        fclose(stream);
+    }
+    ASSERT(data != NULL, "Failed to allocate file buffer\n");
+
+    size_t size = 0;
+    size_t read_size;
+    while ((read_size = fread(data + size, 1, reserve_space - size, stream))
+           != 0)
+    {
+        size += read_size;
+        if (size == reserve_space)
+        {
+            reserve_space *= 2;
+            char *grown = realloc(data, reserve_space);
+            if (grown == NULL)
+            {
+                free(data);
+                fclose(stream);
+            }
+            ASSERT(grown != NULL, "Failed to allocate file buffer\n");
+            data = grown;
+        }
+    }
+    int is_read = !ferror(stream);
+    if (!is_read)
+    {
+        free(data);
+        fclose(stream);
+    }
+    ASSERT(is_read, "Error reading input file\n");
+    ASSERT(fclose(stream) == 0, "Failed to close file\n");
+
+    file->data = data;
+    file->size = size;
+    file->is_mapped = 0;
+}
+
+/**
+ * @brief Read a file, mapping it into memory if possible
+ * @param[out] file Where to store the contents of the file
+ * @param[in] filename The name of the file to open
+ * @note Release the file with close_file. This doesn't touch the open input
+ * file, so it is safe to call on any thread.
+ */
+void open_file(input_file_t *file, char const *filename)
+{
+    open_file_at(file, AT_FDCWD, filename);
+}
+
+/**
+ * @brief Read a file relative to a directory, mapping it into memory if
+ * possible
+ * @param[out] file Where to store the contents of the file
+ * @param[in] directory An open directory which a relative filename is
+ * found in, or AT_FDCWD for the working directory
+ * @param[in] filename The name of the file to open
+ * @note Release the file with close_file. This is safe to call on any
+ * thread.
+ */
+void open_file_at(input_file_t *file, int directory, char const *filename)
+{
+    int fd = openat(directory, filename, O_RDONLY);
+    ASSERT(fd >= 0, "Failed to open file: '%s'\n", filename);
+    file->filename = get_intern(filename, strlen(filename));
+
+    struct stat file_stat;
+    stat_open_file(fd, &file_stat, filename);
+
+    // Empty files can't be mapped, but they also don't need to be read
+    if (S_ISREG(file_stat.st_mode) && file_stat.st_size > 0)
+    {
+        void *data = mmap(NULL, (size_t)file_stat.st_size, PROT_READ,
+                          MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED)
+        {
+            // This is only a hint, so failure isn't an error
+            (void)madvise(data, (size_t)file_stat.st_size, MADV_SEQUENTIAL);
+            ASSERT(close(fd) == 0, "Failed to close file\n");
+
+            file->data = data;
+            file->size = (size_t)file_stat.st_size;
+            file->is_mapped = 1;
+            return;
+        }
+        errno = 0;
+    }
+
+    read_stream(file, fd, filename);
+}
+
+/**
+ * @brief Read a file into a heap buffer, without mapping it
+ * @param[out] file Where to store the contents of the file
+ * @param[in] filename The name of the file to open
+ * @note This is for files which may be rewritten while they are open, which
+ * would change or truncate a mapping under the reader. Release the file with
+ * close_file.
+ */
+void read_file(input_file_t *file, char const *filename)
+{
+    read_file_at(file, AT_FDCWD, filename);
+}
+
+/**
+ * @brief Read a file relative to a directory into a heap buffer, without
+ * mapping it
+ * @param[out] file Where to store the contents of the file
+ * @param[in] directory An open directory which a relative filename is
+ * found in, or AT_FDCWD for the working directory
+ * @param[in] filename The name of the file to open
+ * @note Reading a mapping which is truncated raises SIGBUS, so a long
+ * running process reads files it doesn't control with this. Release the
+ * file with close_file. This is safe to call on any thread.
+ */
+void read_file_at(input_file_t *file, int directory, char const *filename)
+{
+    int fd = openat(directory, filename, O_RDONLY);
+    ASSERT(fd >= 0, "Failed to open file: '%s'\n", filename);
+    file->filename = get_intern(filename, strlen(filename));
+
+    struct stat file_stat;
+    stat_open_file(fd, &file_stat, filename);
+    if (!S_ISREG(file_stat.st_mode))
+    {
+        read_stream(file, fd, filename);
+        return;
+    }
+
+    // The file may still be changing, so the size is only a guess, and a
+    // short read ends it
+    size_t reserve_space = (size_t)file_stat.st_size + 1;
+    char *data = malloc(reserve_space);
+    if (data == NULL)
+    {
+        close_on_error(fd);
+    }
+    ASSERT(data != NULL, "Failed to allocate file buffer\n");
+    size_t size = 0;
+    ssize_t read_size;
+    while ((read_size = read(fd, data + size, reserve_space - size)) > 0)
+    {
+        size += (size_t)read_size;
+        if (size == reserve_space)
+        {
+            reserve_space *= 2;
+            char *grown = realloc(data, reserve_space);
+            if (grown == NULL)
+            {
+                free(data);
+                close_on_error(fd);
+            }
+            ASSERT(grown != NULL, "Failed to allocate file buffer\n");
+            data = grown;
+        }
+    }
+    if (read_size != 0)
+    {
+        free(data);
+        close_on_error(fd);
+    }
+    ASSERT(read_size == 0, "Error reading input file\n");
+    ASSERT(close(fd) == 0, "Failed to close file\n");
+
+    file->data = data;
+    file->size = size;
+    file->is_mapped = 0;
+}
+
+/**
+ * @brief Unmap or free a file read by open_file
+ * @param[in,out] file The file to release
+ */
+void close_file(input_file_t *file)
 {
-    if (input_file != NULL)
+    if (file->is_mapped)
+    {
+        ASSERT(munmap((void *)(uintptr_t)file->data, file->size)
+                   == 0,
+               "Failed to unmap file\n");
+    }
+    else
     {
-        ASSERT(fclose(input_file) == 0, "Failed to close file\n");
+        free((void *)(uintptr_t)file->data);
     }
-    input_file = NULL;
+    file->data = NULL;
+    file->size = 0;
+    file->is_mapped = 0;
+    file->filename = InternNone;
+}
+
+/**
+ * @brief Open the input file
+ * @param[in] filename The name of the file to open
+ * @return The contents of the file
+ */
+input_file_t *get_file(char const *filename)
+{
+    open_file(&input_file, filename);
+    return &input_file;
+}
+
+/**
+ * @brief Unmap or free the open input file
+ */
+void put_file()
+{
+    close_file(&input_file);
 }
@@ -0,0 +1,503 @@
+/** jit.c
+ * @brief A compiler from ASTs to x86-64 machine code
+ *
+ * The whole program becomes one function. Each statement is lowered by a
+ * post-order walk which keeps its intermediate values in SSE registers, the
+ * value at operand depth n in xmm<n>, and leaves its result in xmm0, so the
+ * function returns the value of the last statement. Literals are loaded
+ * from a constant table which the function is passed. Statements which
+ * need more registers than there are, or have nodes the compiler doesn't
+ * know, are left to a fallback evaluator which the code calls instead.
+ *
+ * The code starts with its masks and a stub which reports division by zero,
+ * so everything it refers to is at a fixed offset behind it.
+ */
+
+#define _GNU_SOURCE // `mremap`
+
+#include "error_handling.h"
+#include "jit.h"
+#include "walk.h"
+
+#include <math.h>     // `fmod`
+#include <string.h>   // `memcpy`
+#include <sys/mman.h> // `mmap`, `mremap`, `mprotect`, `munmap`
+
+#define JIT_SIGN_MASK 0      // A double with only the sign bit set
+#define JIT_ABS_MASK 16      // A double with every bit but the sign set
+#define JIT_DIVISOR_LIMIT 32 // The smallest divisor which isn't zero
+#define JIT_ERROR_STUB 48    // Reports division by zero
+#define JIT_REGISTER_COUNT 15 // xmm0 to xmm14 hold values
+#define JIT_SCRATCH 15        // xmm15 is used to check divisors
+#define JIT_SPILL_SIZE 128    // Room to save the values during a call
+#define JIT_CODE_LIMIT ((size_t)1 << 30) // Keeps 32 bit offsets in range
+#define JIT_CONSTANT_LIMIT ((size_t)1 << 28)
+#define JIT_NODE_SIZE 512 // More than the code for any node
+#define JIT_PAGE_SIZE ((size_t)1 << 16)
+
+#define REGISTER_RBX 3
+#define REGISTER_RSP 4
+
+//////////////////////////////////////////////////////////////////////////////
+// Encoding
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Make room at the end of the code
+ * @param[in,out] jit The program to add to
+ * @param[in] count The most bytes that will be added
+ * @return Where to write the bytes. Set code_size to the end of what was
+ * written.
+ * @note The code is built in place in its own mapping, which grows without
+ * copying
+ */
+static uint8_t *reserve_code(jit_program_t *jit, size_t count)
+{
+    if (jit->code_size + count > jit->code_reserve_space)
+    {
+        size_t reserve_space = jit->code_reserve_space;
+        while (jit->code_size + count > reserve_space)
+        {
+            reserve_space = reserve_space == 0 ? JIT_PAGE_SIZE
+                                               : reserve_space * 2;
+        }
+        void *code = jit->code == NULL
+                         ? mmap(NULL, reserve_space,
+                                PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+                         : mremap(jit->code, jit->code_reserve_space,
+                                  reserve_space, MREMAP_MAYMOVE);
+        ASSERT(code != MAP_FAILED, "Failed to map JIT code\n");
+        jit->code = code;
+        jit->code_reserve_space = reserve_space;
+    }
+    return jit->code + jit->code_size;
+}
+
+/**
+ * @brief Write bytes
+ * @param[out] out Where to write
+ * @param[in] bytes The bytes to write
+ * @param[in] count The number of bytes
+ * @return Just past what was written
+ */
+static uint8_t *put_bytes(uint8_t *out, void const *bytes, size_t count)
+{
+    memcpy(out, bytes, count);
+    return out + count;
+}
+
+/**
+ * @brief Write a 32 bit displacement to something already in the code
+ * @param[in] jit The program written to
+ * @param[out] out Where to write, which must end the instruction
+ * @param[in] target The offset in the code to refer to
+ * @return Just past what was written
+ */
+static uint8_t *put_displacement(jit_program_t const *jit, uint8_t *out,
+                                 size_t target)
+{
+    int32_t displacement
+        = (int32_t)((long)target - (long)(out + 4 - jit->code));
+    return put_bytes(out, &displacement, 4);
+}
+
+/**
+ * @brief Write the prefixes and opcode of an SSE instruction
+ * @param[out] out Where to write
+ * @param[in] prefix The mandatory prefix, 0x66 or 0xF2
+ * @param[in] opcode The byte after 0x0F
+ * @param[in] reg The register in the reg field
+ * @param[in] rm The register in the r/m field, or 0 for memory
+ * @return Just past what was written
+ */
+static uint8_t *put_sse_opcode(uint8_t *out, uint8_t prefix, uint8_t opcode,
+                               unsigned reg, unsigned rm)
+{
+    *out++ = prefix;
+    if (reg >= 8 || rm >= 8)
+    {
+        *out++ = (uint8_t)(0x40 | (reg >= 8) << 2 | (rm >= 8));
+    }
+    *out++ = 0x0F;
+    *out++ = opcode;
+    return out;
+}
+
+/**
+ * @brief Write an SSE instruction between two registers
+ * @param[out] out Where to write
+ * @param[in] prefix The mandatory prefix, 0x66 or 0xF2
+ * @param[in] opcode The byte after 0x0F
+ * @param[in] target The xmm register written
+ * @param[in] source The other xmm register
+ * @return Just past what was written
+ */
+static uint8_t *put_sse(uint8_t *out, uint8_t prefix, uint8_t opcode,
+                        unsigned target, unsigned source)
+{
+    out = put_sse_opcode(out, prefix, opcode, target, source);
+    *out++ = (uint8_t)(0xC0 | (target & 7) << 3 | (source & 7));
+    return out;
+}
+
+/**
+ * @brief Write an SSE instruction with a memory operand in the code
+ * @param[in] jit The program written to
+ * @param[out] out Where to write
+ * @param[in] prefix The mandatory prefix, 0x66 or 0xF2
+ * @param[in] opcode The byte after 0x0F
+ * @param[in] reg The xmm register
+ * @param[in] target The offset in the code of the memory operand
+ * @return Just past what was written
+ */
+static uint8_t *put_sse_code(jit_program_t const *jit, uint8_t *out,
+                             uint8_t prefix, uint8_t opcode, unsigned reg,
+                             size_t target)
+{
+    out = put_sse_opcode(out, prefix, opcode, reg, 0);
+    *out++ = (uint8_t)((reg & 7) << 3 | 5); // rip relative
+    return put_displacement(jit, out, target);
+}
+
+/**
+ * @brief Write an SSE instruction with a memory operand relative to rbx or
+ * rsp
+ * @param[out] out Where to write
+ * @param[in] prefix The mandatory prefix, 0x66 or 0xF2
+ * @param[in] opcode The byte after 0x0F
+ * @param[in] reg The xmm register
+ * @param[in] base REGISTER_RBX or REGISTER_RSP
+ * @param[in] offset The offset from the base register
+ * @return Just past what was written
+ */
+static uint8_t *put_sse_memory(uint8_t *out, uint8_t prefix, uint8_t opcode,
+                               unsigned reg, unsigned base, uint32_t offset)
+{
+    out = put_sse_opcode(out, prefix, opcode, reg, 0);
+    *out++ = (uint8_t)(0x80 | (reg & 7) << 3 | base);
+    if (base == REGISTER_RSP)
+    {
+        *out++ = 0x24; // No index
+    }
+    return put_bytes(out, &offset, 4);
+}
+
+/**
+ * @brief Write a call to a function
+ * @param[out] out Where to write
+ * @param[in] function The address of the function
+ * @return Just past what was written
+ */
+static uint8_t *put_call(uint8_t *out, uintptr_t function)
+{
+    uint64_t address = function;
+    out = put_bytes(out, (uint8_t const[]){0x48, 0xB8}, 2); // mov rax, imm64
+    out = put_bytes(out, &address, 8);
+    return put_bytes(out, (uint8_t const[]){0xFF, 0xD0}, 2); // call rax
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Compiling
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Exit on a division by zero, called from compiled code
+ */
+static noreturn void jit_divide_by_zero(void)
+{
+    EXIT_ERROR("AST divide by 0 error\n");
+}
+
+/**
+ * @brief Add the masks and the stub which the code refers to
+ * @param[in,out] jit The program to add to
+ */
+static void add_header(jit_program_t *jit)
+{
+    uint64_t const masks[6] = {0x8000000000000000, 0, 0x7FFFFFFFFFFFFFFF, 0,
+                               0x3F847AE147AE147B, 0}; // 0.01
+    uint8_t *out = reserve_code(jit, JIT_NODE_SIZE);
+    out = put_bytes(out, masks, sizeof(masks));
+    out = put_call(out, (uintptr_t)jit_divide_by_zero);
+    out = put_bytes(out, (uint8_t const[]){0x0F, 0x0B}, 2); // ud2
+    jit->code_size = (size_t)(out - jit->code);
+}
+
+/**
+ * @brief Write code which exits if a divisor is as close to zero as the
+ * other evaluators treat as zero
+ * @param[in] jit The program written to
+ * @param[out] out Where to write
+ * @param[in] divisor The xmm register holding the divisor
+ * @return Just past what was written
+ */
+static uint8_t *put_divisor_check(jit_program_t const *jit, uint8_t *out,
+                                  unsigned divisor)
+{
+    out = put_sse(out, 0x66, 0x28, JIT_SCRATCH, divisor); // movapd
+    out = put_sse_code(jit, out, 0x66, 0x54, JIT_SCRATCH,
+                       JIT_ABS_MASK); // andpd
+    out = put_sse_code(jit, out, 0x66, 0x2E, JIT_SCRATCH,
+                       JIT_DIVISOR_LIMIT); // ucomisd
+    out = put_bytes(out, (uint8_t const[]){0x7A, 0x06}, 2); // jp past, NaN
+    out = put_bytes(out, (uint8_t const[]){0x0F, 0x82}, 2); // jb
+    return put_displacement(jit, out, JIT_ERROR_STUB);
+}
+
+/**
+ * @brief Write a call to fmod, saving the values below its operands
+ * @param[out] out Where to write
+ * @param[in] target The xmm register holding the dividend, which gets the
+ * result, with the divisor in the one after
+ * @return Just past what was written
+ */
+static uint8_t *put_modulo(uint8_t *out, unsigned target)
+{
+    for (unsigned reg = 0; reg < target; reg++)
+    {
+        out = put_sse_memory(out, 0xF2, 0x11, reg, REGISTER_RSP,
+                             reg * 8); // movsd
+    }
+    if (target != 0)
+    {
+        out = put_sse(out, 0x66, 0x28, 0, target);     // movapd
+        out = put_sse(out, 0x66, 0x28, 1, target + 1); // movapd
+    }
+    out = put_call(out, (uintptr_t)fmod);
+    if (target != 0)
+    {
+        out = put_sse(out, 0x66, 0x28, target, 0); // movapd
+    }
+    for (unsigned reg = 0; reg < target; reg++)
+    {
+        out = put_sse_memory(out, 0xF2, 0x10, reg, REGISTER_RSP,
+                             reg * 8); // movsd
+    }
+    return out;
+}
+
+/**
+ * @brief Write code for a binary operator
+ * @param[in] jit The program written to
+ * @param[out] out Where to write
+ * @param[in] symbol The interned operator
+ * @param[in] target The xmm register holding the left operand, which gets
+ * the result, with the right operand in the one after
+ * @return Just past what was written, or NULL for an unknown operator
+ */
+static uint8_t *put_binary(jit_program_t const *jit, uint8_t *out,
+                           intern_t symbol, unsigned target)
+{
+    switch (symbol)
+    {
+    case InternPlus:
+        return put_sse(out, 0xF2, 0x58, target, target + 1); // addsd
+    case InternMinus:
+        return put_sse(out, 0xF2, 0x5C, target, target + 1); // subsd
+    case InternTimes:
+        return put_sse(out, 0xF2, 0x59, target, target + 1); // mulsd
+    case InternDivide:
+        out = put_divisor_check(jit, out, target + 1);
+        return put_sse(out, 0xF2, 0x5E, target, target + 1); // divsd
+    case InternModulo:
+        out = put_divisor_check(jit, out, target + 1);
+        return put_modulo(out, target);
+    default:
+        return NULL;
+    }
+}
+
+/**
+ * @brief Add a constant to the end of a program's constant table
+ * @param[in,out] jit The program to add to
+ * @param[in] value The constant to add
+ */
+static void add_constant(jit_program_t *jit, double value)
+{
+    if (jit->constant_count == jit->constant_reserve_space)
+    {
+        jit->constant_reserve_space = jit->constant_reserve_space == 0
+                                          ? 256
+                                          : jit->constant_reserve_space * 2;
+        jit->constant = realloc(jit->constant, jit->constant_reserve_space
+                                                   * sizeof(*jit->constant));
+        ASSERT(jit->constant != NULL, "Failed to allocate JIT constants\n");
+    }
+    jit->constant[jit->constant_count++] = value;
+}
+
+/**
+ * @brief Lower a statement to machine code, leaving its value in xmm0
+ * @param[in,out] jit The program to add to
+ * @param[in] node The root of the statement
+ * @param[in,out] walk A post-order walk to reuse
+ * @return Nonzero on success, or 0 if the statement can't be compiled, in
+ * which case the code and constants added must be dropped
+ */
+static int compile_jit_expression(jit_program_t *jit, AST_node_t *node,
+                                  AST_walk_t *walk)
+{
+    unsigned depth = 0; // The values in registers after the node
+    reset_AST_walk(walk, node);
+    while ((node = next_AST_node(walk, NULL)) != NULL)
+    {
+        uint8_t *out = reserve_code(jit, JIT_NODE_SIZE);
+        switch (node->type)
+        {
+        case NodeUnaryOperator:
+            if (node->string == InternMinus)
+            {
+                out = put_sse_code(jit, out, 0x66, 0x57, depth - 1,
+                                   JIT_SIGN_MASK); // xorpd
+            }
+            else if (node->string != InternPlus)
+            {
+                return 0;
+            }
+            break;
+        case NodeBinaryOperator:
+            out = put_binary(jit, out, node->string, depth - 2);
+            if (out == NULL)
+            {
+                return 0;
+            }
+            depth -= 1;
+            break;
+        case NodeLiteral:
+        case NodeConstant:
+            if (depth == JIT_REGISTER_COUNT
+                || jit->constant_count == JIT_CONSTANT_LIMIT)
+            {
+                return 0;
+            }
+            out = put_sse_memory(out, 0xF2, 0x10, depth, REGISTER_RBX,
+                                 (uint32_t)(jit->constant_count
+                                            * 8)); // movsd
+            add_constant(jit, node->type == NodeLiteral
+                                  ? get_literal_value(node)
+                                  : node->value);
+            depth += 1;
+            break;
+        case NodeParenthesis:
+            break;
+        default:
+            return 0;
+        }
+        jit->code_size = (size_t)(out - jit->code);
+    }
+    return 1;
+}
+
+/**
+ * @brief Lower a run of top level statements to machine code
+ * @param[out] jit The program to build, which should be zeroed. Deallocate
+ * it with put_jit.
+ * @param[in] first The first statement
+ * @param[in] count The most statements to lower, following next from first
+ * @param[in] fallback The evaluator for statements which can't be compiled
+ */
+void compile_jit_statements(jit_program_t *jit, AST_node_t *first,
+                            size_t count, jit_fallback_t fallback)
+{
+    add_header(jit);
+    size_t entry = jit->code_size;
+    uint8_t *out = reserve_code(jit, JIT_NODE_SIZE);
+    out = put_bytes(out, (uint8_t const[]){
+        0x53,                                      // push rbx
+        0x48, 0x81, 0xEC, JIT_SPILL_SIZE, 0, 0, 0, // sub rsp, spill size
+        0x48, 0x89, 0xFB,                          // mov rbx, rdi
+        0x66, 0x0F, 0x57, 0xC0,                    // xorpd xmm0, xmm0
+    }, 15);
+    jit->code_size = (size_t)(out - jit->code);
+
+    AST_walk_t walk;
+    get_AST_walk(&walk, NULL, WalkPostOrder);
+    for (AST_node_t *statement = first; statement != NULL && count > 0;
+         statement = statement->next, count--)
+    {
+        size_t code_size = jit->code_size;
+        size_t constant_count = jit->constant_count;
+        if (code_size < JIT_CODE_LIMIT
+            && compile_jit_expression(jit, statement, &walk))
+        {
+            continue;
+        }
+
+        jit->code_size = code_size;
+        jit->constant_count = constant_count;
+        jit->fallback_count += 1;
+        uint64_t address = (uintptr_t)statement;
+        out = reserve_code(jit, JIT_NODE_SIZE);
+        out = put_bytes(out, (uint8_t const[]){0x48, 0xBF}, 2); // mov rdi,
+        out = put_bytes(out, &address, 8);                      // imm64
+        out = put_call(out, (uintptr_t)fallback);
+        jit->code_size = (size_t)(out - jit->code);
+    }
+    put_AST_walk(&walk);
+
+    out = reserve_code(jit, JIT_NODE_SIZE);
+    out = put_bytes(out, (uint8_t const[]){
+        0x48, 0x81, 0xC4, JIT_SPILL_SIZE, 0, 0, 0, // add rsp, spill size
+        0x5B,                                      // pop rbx
+        0xC3,                                      // ret
+    }, 9);
+    jit->code_size = (size_t)(out - jit->code);
+
+    // The code stops being writable before it can be run
+    ASSERT(mprotect(jit->code, jit->code_reserve_space,
+                    PROT_READ | PROT_EXEC)
+               == 0,
+           "Failed to make JIT code executable\n");
+    jit->entry = (jit_entry_t)((uintptr_t)jit->code + entry);
+}
+
+/**
+ * @brief Lower an AST to machine code
+ * @param[out] jit The program to build, which should be zeroed. Deallocate
+ * it with put_jit.
+ * @param[in] root The root of the AST, usually the global scope
+ * @param[in] fallback The evaluator for statements which can't be compiled
+ */
+void compile_jit(jit_program_t *jit, AST_node_t *root,
+                 jit_fallback_t fallback)
+{
+    if (root->type != NodeScope)
+    {
+        compile_jit_statements(jit, root, 1, fallback);
+        return;
+    }
+    if (root->list_head == NULL)
+    {
+        EXIT_ERROR("No statements to evaluate\n");
+    }
+    compile_jit_statements(jit, root->list_head, SIZE_MAX, fallback);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Running
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Run a compiled program
+ * @param[in] jit The program to run
+ * @return The value of the last statement
+ */
+double run_jit(jit_program_t const *jit)
+{
+    return jit->entry(jit->constant);
+}
+
+/**
+ * @brief Deallocate a compiled program
+ * @param[in,out] jit The program to deallocate
+ */
+void put_jit(jit_program_t *jit)
+{
+    if (jit->code != NULL)
+    {
+        munmap(jit->code, jit->code_reserve_space);
+    }
+    free(jit->constant);
+    *jit = (jit_program_t){NULL, 0, 0, NULL, 0, 0, NULL, 0};
+}
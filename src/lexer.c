@@ -1,96 +1,124 @@
 /** lexer.c
  * @brief Utilities for lexing a file input
  *
- * STATE: token_list
+ * STATE: token_stream
  */
 
 #include "error_handling.h"
 #include "lexer.h"
+#include "scan.h"
+#include "stats.h"
 
-#include <ctype.h>
-
-#define FALL_THROUGH __attribute__((fallthrough));
+#include <string.h> // `memcpy`
 
 //////////////////////////////////////////////////////////////////////////////
-// Token List Structures Definition
+// Token Stream Structures Definition
 //////////////////////////////////////////////////////////////////////////////
 
 /**
- * STATE: This holds the token list for lexing
+ * STATE: This holds the token stream for lexing
  */
-static list_t token_list = {NULL, NULL};
+static token_stream_t token_stream = {NULL, NULL, NULL, NULL, 0, 0};
 
 /**
- * @brief Allocate and return a new token node
- * @param[in] input_string The string to copy into the new struct
- * @param[in] reserve_space The ammound of memory to allocate for the
- * string
- * @param[in] type The type of the new token
- * @return The newly allocated node
+ * @brief Reallocate every array in a token stream
+ * @param[in,out] tokens The stream to reallocate
+ * @param[in] reserve_space The number of tokens to make room for
  */
-static token_list_node_t *get_token_node(char const *input_string,
-                                         size_t reserve_space,
-                                         token_type_enum type,
-                                         int column_number, int line_number)
+static void reserve_tokens(token_stream_t *tokens, size_t reserve_space)
 {
-    // Allocate our node and space for the string
-    token_list_node_t *return_node = malloc(sizeof(*return_node));
-    ASSERT(return_node != NULL, "Failed to allocate token node\n");
-
-    return_node->list.next = NULL;
-    return_node->list.prev = NULL;
-    return_node->token = type;
-    get_string(&return_node->string, input_string, reserve_space);
-    return_node->column_number = column_number;
-    return_node->line_number = line_number;
-
-    return return_node;
+    tokens->token
+        = realloc(tokens->token, reserve_space * sizeof(*tokens->token));
+    tokens->offset
+        = realloc(tokens->offset, reserve_space * sizeof(*tokens->offset));
+    tokens->length
+        = realloc(tokens->length, reserve_space * sizeof(*tokens->length));
+    tokens->value
+        = realloc(tokens->value, reserve_space * sizeof(*tokens->value));
+    ASSERT(tokens->token != NULL && tokens->offset != NULL
+               && tokens->length != NULL && tokens->value != NULL,
+           "Failed to allocate token stream\n");
+    tokens->reserve_space = reserve_space;
 }
 
 /**
- * @brief Allocate and add a token_node to the tail of the list
- * @param[in] input_string The string to copy into the new struct
- * @param[in] reserve_space The ammound of memory to allocate for the string
+ * @brief Add a single character token to the end of a stream
+ * @param[in,out] tokens The stream to add to
+ * @param[in] offset The offset of the token text in the input file
  * @param[in] type The type of token to add
  */
-static void add_new_token_node(char const *input_string, size_t reserve_space,
-                               token_type_enum type, int column_number,
-                               int line_number)
+static void add_token(token_stream_t *tokens, size_t offset,
+                      token_type_enum type)
 {
-    add_element_to_end(&get_token_node(input_string, reserve_space, type,
-                                       column_number, line_number)
-                            ->list,
-                       &token_list);
+    if (tokens->token_count == tokens->reserve_space)
+    {
+        reserve_tokens(tokens, tokens->reserve_space * 2);
+    }
+    size_t index = tokens->token_count++;
+    tokens->token[index] = (uint8_t)type;
+    tokens->offset[index] = offset;
+    tokens->length[index] = 1;
+    tokens->value[index] = 0;
 }
 
 /**
- * @brief Removes and frees a member of the list
- * @param[in] old_token_node The node to remove and free
+ * @brief Deallocate a token stream made by lex_chunk
+ * @param[in,out] tokens The stream to deallocate
  */
-static void put_token_node(token_list_node_t *old_token_node)
+void put_token_chunk(token_stream_t *tokens)
 {
-    ASSERT(old_token_node, "Attempting to put NULL\n");
-
-    remove_element(&old_token_node->list, &token_list);
+    free(tokens->token);
+    free(tokens->offset);
+    free(tokens->length);
+    free(tokens->value);
+    *tokens = (token_stream_t){NULL, NULL, NULL, NULL, 0, 0};
+}
 
-    if (old_token_node->string.string != NULL)
-    {
-        put_string(&old_token_node->string);
-    }
+/**
+ * @brief Empty a token stream made by lex_chunk, keeping its memory so it
+ * can be passed to lex_chunk again
+ * @param[in,out] tokens The stream to empty
+ */
+void reset_token_chunk(token_stream_t *tokens)
+{
+    tokens->token_count = 0;
+}
 
-    free(old_token_node);
+/**
+ * @brief Deallocate the token stream
+ */
+void put_token_stream()
+{
+    put_token_chunk(&token_stream);
 }
 
 /**
- * @brief Deallocate the entire token node list
+ * @brief Find the line and column of an offset in the input file
+ * @param[in,out] location A previously found location, which is moved to the
+ * new offset. Zero it before the first call.
+ * @param[in] input_file The file the offset refers to
+ * @param[in] offset The offset to find
+ * @note Moving forwards from the last location only scans the new text, so
+ * finding locations in order is linear in the size of the file
  */
-void put_token_node_list()
+void find_source_location(source_location_t *location,
+                          input_file_t const *input_file, size_t offset)
 {
-    token_list_node_t *elem, *temp;
-    elem = token_node(token_list.head);
-    for_each_element_from(elem, temp, token_list_node_t, list)
+    if (location->line_number == 0 || offset < location->offset)
     {
-        put_token_node(elem);
+        *location = (source_location_t){0, 1, 1};
+    }
+    for (; location->offset < offset; location->offset++)
+    {
+        if (input_file->data[location->offset] == '\n')
+        {
+            location->line_number += 1;
+            location->column_number = 1;
+        }
+        else
+        {
+            location->column_number += 1;
+        }
     }
 }
 
@@ -99,143 +127,303 @@ void put_token_node_list()
 //////////////////////////////////////////////////////////////////////////////
 
 /**
- * @brief Generate a token list for a given file
- * @param[in] input_file An open file to read from
- * @return The token list head
+ * @brief The classes of character the lexer state machine tells apart
+ */
+typedef enum
+{
+    ClassOther, // Never looked up, the scanner stops at these first
+    ClassDigit,
+    ClassSign,    // '+' and '-', which may be unary or binary
+    ClassProduct, // '*', '/' and '%'
+    ClassOpen,
+    ClassClose,
+    ClassSemicolon,
+    ClassEOF, // The end of the chunk, which has no character
+    ClassCount
+} lex_class_enum;
+
+/**
+ * @brief What the lexer does on a character
+ */
+typedef struct lex_action_t
+{
+    uint8_t token;     // The token_type_enum to add, which is the new state
+    char const *error; // The error to raise instead, or NULL
+} lex_action_t;
+
+/**
+ * @brief The lex_class_enum of every byte
+ */
+static uint8_t const lex_class[256] = {
+    ['0' ... '9'] = ClassDigit, ['+'] = ClassSign,    ['-'] = ClassSign,
+    ['*'] = ClassProduct,       ['/'] = ClassProduct, ['%'] = ClassProduct,
+    ['('] = ClassOpen,          [')'] = ClassClose,   [';'] = ClassSemicolon,
+};
+
+#define LEX_TOKEN(token) {token, NULL}
+#define LEX_ERROR(message) {TokenUnknown, message}
+#define LEX_UNKNOWN LEX_ERROR("Unknown Character\n")
+
+/**
+ * @brief The action for each class of character, by the last token added,
+ * with TokenUnknown as the start of a chunk
+ * @note Rows for tokens which are never added are left empty
+ */
+static lex_action_t const lex_table[TokenUnknown + 1][ClassCount] = {
+    [TokenUnknown] = {
+        [ClassOther] = LEX_UNKNOWN,
+        [ClassDigit] = LEX_TOKEN(TokenLiteral),
+        [ClassSign] = LEX_TOKEN(TokenUnaryOperator),
+        [ClassProduct] = LEX_ERROR("Bad binary operator\n"),
+        [ClassOpen] = LEX_TOKEN(TokenOpenParenthesis),
+        [ClassClose] = LEX_ERROR("Bad closed parenthesis\n"),
+        [ClassSemicolon] = LEX_TOKEN(TokenSemicolon),
+        [ClassEOF] = LEX_TOKEN(TokenEOF),
+    },
+    [TokenUnaryOperator] = {
+        [ClassOther] = LEX_UNKNOWN,
+        [ClassDigit] = LEX_TOKEN(TokenLiteral),
+        [ClassSign] = LEX_ERROR("Bad binary operator\n"),
+        [ClassProduct] = LEX_ERROR("Bad binary operator\n"),
+        [ClassOpen] = LEX_TOKEN(TokenOpenParenthesis),
+        [ClassClose] = LEX_ERROR("Bad closed parenthesis\n"),
+        [ClassSemicolon] = LEX_ERROR("Bad semicolon\n"),
+        [ClassEOF] = LEX_ERROR("Invalid EOF\n"),
+    },
+    [TokenBinaryOperator] = {
+        [ClassOther] = LEX_UNKNOWN,
+        [ClassDigit] = LEX_TOKEN(TokenLiteral),
+        [ClassSign] = LEX_TOKEN(TokenUnaryOperator),
+        [ClassProduct] = LEX_ERROR("Bad binary operator\n"),
+        [ClassOpen] = LEX_TOKEN(TokenOpenParenthesis),
+        [ClassClose] = LEX_ERROR("Bad closed parenthesis\n"),
+        [ClassSemicolon] = LEX_ERROR("Bad semicolon\n"),
+        [ClassEOF] = LEX_ERROR("Invalid EOF\n"),
+    },
+    [TokenOpenParenthesis] = {
+        [ClassOther] = LEX_UNKNOWN,
+        [ClassDigit] = LEX_TOKEN(TokenLiteral),
+        [ClassSign] = LEX_TOKEN(TokenUnaryOperator),
+        [ClassProduct] = LEX_ERROR("Bad binary operator\n"),
+        [ClassOpen] = LEX_TOKEN(TokenOpenParenthesis),
+        [ClassClose] = LEX_ERROR("Bad closed parenthesis\n"),
+        [ClassSemicolon] = LEX_ERROR("Bad semicolon\n"),
+        [ClassEOF] = LEX_ERROR("Invalid EOF\n"),
+    },
+    [TokenCloseParenthesis] = {
+        [ClassOther] = LEX_UNKNOWN,
+        [ClassDigit] = LEX_ERROR("No operator before number\n"),
+        [ClassSign] = LEX_TOKEN(TokenBinaryOperator),
+        [ClassProduct] = LEX_TOKEN(TokenBinaryOperator),
+        [ClassOpen] = LEX_ERROR("Bad open parenthesis\n"),
+        [ClassClose] = LEX_TOKEN(TokenCloseParenthesis),
+        [ClassSemicolon] = LEX_TOKEN(TokenSemicolon),
+        [ClassEOF] = LEX_TOKEN(TokenEOF),
+    },
+    [TokenLiteral] = {
+        [ClassOther] = LEX_UNKNOWN,
+        [ClassDigit] = LEX_TOKEN(TokenLiteral),
+        [ClassSign] = LEX_TOKEN(TokenBinaryOperator),
+        [ClassProduct] = LEX_TOKEN(TokenBinaryOperator),
+        [ClassOpen] = LEX_ERROR("Bad open parenthesis\n"),
+        [ClassClose] = LEX_TOKEN(TokenCloseParenthesis),
+        [ClassSemicolon] = LEX_TOKEN(TokenSemicolon),
+        [ClassEOF] = LEX_TOKEN(TokenEOF),
+    },
+    [TokenSemicolon] = {
+        [ClassOther] = LEX_UNKNOWN,
+        [ClassDigit] = LEX_TOKEN(TokenLiteral),
+        [ClassSign] = LEX_TOKEN(TokenUnaryOperator),
+        [ClassProduct] = LEX_ERROR("Bad binary operator\n"),
+        [ClassOpen] = LEX_TOKEN(TokenOpenParenthesis),
+        [ClassClose] = LEX_ERROR("Bad closed parenthesis\n"),
+        [ClassSemicolon] = LEX_TOKEN(TokenSemicolon),
+        [ClassEOF] = LEX_TOKEN(TokenEOF),
+    },
+};
+
+#undef LEX_TOKEN
+#undef LEX_ERROR
+#undef LEX_UNKNOWN
+
+/**
+ * @brief Count the set bits at the bottom of a mask
+ */
+static size_t count_trailing_ones(uint64_t mask)
+{
+    return mask == UINT64_MAX ? 64 : (size_t)__builtin_ctzll(~mask);
+}
+
+/**
+ * @brief Decode eight ASCII digits at once
+ * @param[in] digits The digits, most significant first
+ * @return The value of the digits
+ * @note Adjacent digits are combined in pairs, then pairs of pairs, inside a
+ * single 64 bit word, which relies on x86 being little endian
+ */
+static uint64_t decode_eight_digits(char const *digits)
+{
+    uint64_t chunk;
+    memcpy(&chunk, digits, sizeof(chunk));
+    chunk -= 0x3030303030303030;
+    chunk = (chunk * 10 + (chunk >> 8)) & 0x00FF00FF00FF00FF;
+    chunk = (chunk * 100 + (chunk >> 16)) & 0x0000FFFF0000FFFF;
+    return (chunk * 10000 + (chunk >> 32)) & 0x00000000FFFFFFFF;
+}
+
+/**
+ * @brief Add digits to the value of the last token, a literal
+ * @param[in,out] tokens The stream whose last token is the literal
+ * @param[in] digits The digits to add
+ * @param[in] length The number of digits
+ * @note Once the value doesn't fit in a long it becomes LITERAL_OVERFLOW
  */
-token_list_node_t *lex_file(FILE *input_file)
+static void add_digits(token_stream_t *tokens, char const *digits,
+                       size_t length)
 {
-    int current_character = EOF;
-    int column_number = 0;
-    int line_number = 1;
+    size_t index = tokens->token_count - 1;
+    long value = tokens->value[index];
+    tokens->length[index] += (uint32_t)length;
+    if (value == LITERAL_OVERFLOW)
+    {
+        return;
+    }
+
+    size_t digit_index = 0;
+    for (; length - digit_index >= 8; digit_index += 8)
+    {
+        if (__builtin_mul_overflow(value, 100000000L, &value)
+            || __builtin_add_overflow(
+                value, (long)decode_eight_digits(digits + digit_index),
+                &value))
+        {
+            tokens->value[index] = LITERAL_OVERFLOW;
+            return;
+        }
+    }
+    for (; digit_index < length; digit_index++)
+    {
+        if (__builtin_mul_overflow(value, 10L, &value)
+            || __builtin_add_overflow(value, digits[digit_index] - '0',
+                                      &value))
+        {
+            tokens->value[index] = LITERAL_OVERFLOW;
+            return;
+        }
+    }
+    tokens->value[index] = value;
+}
 
+/**
+ * @brief Generate a token stream for part of a file
+ * @param[out] tokens The stream to fill, which should be zeroed or emptied
+ * with reset_token_chunk. Deallocate it with put_token_chunk.
+ * @param[in] input_file An open file to read from
+ * @param[in] begin The offset to start lexing from, which must be the start
+ * of the file or just after a semicolon
+ * @param[in] end The offset to stop lexing at
+ * @note The file is classified a block at a time, so whole runs of digits
+ * are taken at once and newlines are skipped without visiting them
+ */
+void lex_chunk(token_stream_t *tokens, input_file_t const *input_file,
+               size_t begin, size_t end)
+{
     ASSERT(input_file != NULL, "Lexer given invalid file input\n");
 
-    for (;;)
+    // Most tokens are a single character, and most files are about half
+    // operators and half literals
+    size_t reserve_space = (end - begin) / 2 + 16;
+    if (reserve_space > tokens->reserve_space)
     {
-        current_character = getc(input_file);
-        column_number += 1;
-        // Return is EOF either if the end of the file was reached or there was
-        // an error
-        if (current_character == EOF)
+        reserve_tokens(tokens, reserve_space);
+    }
+
+    // The last token added, kept here rather than read back from the stream
+    token_type_enum state = TokenUnknown;
+    if (tokens->token_count != 0)
+    {
+        state = (token_type_enum)tokens->token[tokens->token_count - 1];
+    }
+
+    uint64_t carry = 0; // 1 if the last block ended in a digit
+    for (size_t offset = begin; offset < end; offset += SCAN_BLOCK_SIZE)
+    {
+        size_t size = end - offset < SCAN_BLOCK_SIZE ? end - offset
+                                                     : SCAN_BLOCK_SIZE;
+        scan_masks_t masks;
+        scan_block(input_file->data + offset, size, &masks);
+
+        uint64_t digit = masks.digit;
+        uint64_t symbol
+            = masks.arithmetic | masks.open | masks.close | masks.semicolon;
+        if (masks.invalid != 0)
         {
-            ASSERT(!errno, "Error reading input file\n");
-            break;
+            // Nothing past the first bad character is lexed
+            uint64_t before
+                = ((uint64_t)1 << __builtin_ctzll(masks.invalid)) - 1;
+            digit &= before;
+            symbol &= before;
         }
-        // printf("Lex %c\n", current_character);
-        if (isdigit(current_character))
+
+        // Digits at the start of the block may continue the last literal
+        if (carry && (digit & 1))
         {
-            // Check to see if we're appending characters or making a new token
-            if (token_list.tail == NULL
-                || token_node(token_list.tail)->token != TokenLiteral)
-            {
-                ASSERT(token_node(token_list.tail)->token
-                           != TokenCloseParenthesis,
-                       "No operator before number\n");
-                add_new_token_node(NULL, 3, TokenLiteral, column_number,
-                                   line_number);
-            }
-            add_character(&token_node(token_list.tail)->string,
-                          (char)current_character);
-            continue;
+            add_digits(tokens, input_file->data + offset,
+                       count_trailing_ones(digit));
         }
-        // Parse the token associated with the current character
-        switch (current_character)
+
+        // Visit each token in order, with a whole run of digits at once
+        uint64_t token_start = symbol | (digit & ~((digit << 1) | carry));
+        while (token_start != 0)
         {
-        case '\r':
-            printf("CR not supported\n");
-            exit(EXIT_FAILURE);
-        case '\n':
-            line_number += 1;
-            column_number = 0;
-            break;
-        case '-':
-        case '+':
-            // We need a special case if this is a negative/plus sign
-            if (token_list.tail == NULL
-                || token_node(token_list.tail)->token == TokenBinaryOperator
-                || token_node(token_list.tail)->token == TokenOpenParenthesis
-                || token_node(token_list.tail)->token == TokenSemicolon)
+            size_t index = (size_t)__builtin_ctzll(token_start);
+            token_start &= token_start - 1;
+            unsigned char current_character
+                = (unsigned char)input_file->data[offset + index];
+            lex_action_t const *action
+                = &lex_table[state][lex_class[current_character]];
+            ASSERT(action->error == NULL, "%s", action->error);
+
+            state = (token_type_enum)action->token;
+            add_token(tokens, offset + index, state);
+            if (state == TokenLiteral)
             {
-                if (token_list.tail)
-                {
-                    ASSERT(token_node(token_list.tail)->token
-                               != TokenUnaryOperator,
-                           "Bad unary operator\n");
-                }
-                add_new_token_node(NULL, 2, TokenUnaryOperator, column_number,
-                                   line_number);
-                add_character(&token_node(token_list.tail)->string,
-                              (char)current_character);
-                break;
+                tokens->length[tokens->token_count - 1] = 0;
+                add_digits(tokens, input_file->data + offset + index,
+                           count_trailing_ones(digit >> index));
             }
-            // If it isn't a negative sign, it's a simple subtraction/add sign.
-            FALL_THROUGH
-        case '*':
-        case '/':
-        case '%':
-            // Check that we're coming after a number or expression
-            ASSERT(
-                token_node(token_list.tail) != NULL
-                    && (token_node(token_list.tail)->token
-                            == TokenCloseParenthesis
-                        || token_node(token_list.tail)->token == TokenLiteral),
-                "Bad binary operator\n");
-            add_new_token_node(NULL, 2, TokenBinaryOperator, column_number,
-                               line_number);
-            add_character(&token_node(token_list.tail)->string,
-                          (char)current_character);
-            break;
-        case '(':
-            if (token_list.tail != NULL)
+        }
+
+        if (masks.invalid != 0)
+        {
+            int current_character = (unsigned char)
+                input_file->data[offset + (size_t)__builtin_ctzll(
+                                              masks.invalid)];
+            if (current_character == '\r')
             {
-                ASSERT(
-                    token_node(token_list.tail)->token != TokenCloseParenthesis
-                        && token_node(token_list.tail)->token != TokenLiteral,
-                    "Bad open parenthesis\n");
+                EXIT_ERROR("CR not supported\n");
             }
-            add_new_token_node(NULL, 2, TokenOpenParenthesis, column_number,
-                               line_number);
-            add_character(&token_node(token_list.tail)->string,
-                          (char)current_character);
-            break;
-        case ')':
-            ASSERT(
-                token_list.tail != NULL
-                    && (token_node(token_list.tail)->token
-                            == TokenCloseParenthesis
-                        || token_node(token_list.tail)->token == TokenLiteral),
-                "Bad closed parenthesis\n");
-            add_new_token_node(NULL, 2, TokenCloseParenthesis, column_number,
-                               line_number);
-            add_character(&token_node(token_list.tail)->string,
-                          (char)current_character);
-            break;
-        case ';':
-            ASSERT(token_list.tail == NULL
-                       || token_node(token_list.tail)->token
-                              == TokenCloseParenthesis
-                       || token_node(token_list.tail)->token == TokenLiteral
-                       || token_node(token_list.tail)->token == TokenSemicolon,
-                   "Bad semicolon\n");
-            add_new_token_node(NULL, 2, TokenSemicolon, column_number,
-                               line_number);
-            add_character(&token_node(token_list.tail)->string,
-                          (char)current_character);
-            break;
-        default:
-            printf("Unknown Character %c\n", current_character);
-            exit(EXIT_FAILURE);
+            EXIT_ERROR("Unknown Character %c\n", current_character);
         }
+        carry = size == SCAN_BLOCK_SIZE ? digit >> 63 : 0;
     }
 
-    if (token_list.tail != NULL)
-    {
-        ASSERT(token_node(token_list.tail)->token == TokenCloseParenthesis
-                   || token_node(token_list.tail)->token == TokenLiteral
-                   || token_node(token_list.tail)->token == TokenSemicolon,
-               "Invalid EOF\n");
-    }
+    lex_action_t const *action = &lex_table[state][ClassEOF];
+    ASSERT(action->error == NULL, "%s", action->error);
+}
 
-    return token_node(token_list.head);
+/**
+ * @brief Generate a token stream for a given file
+ * @param[in] input_file An open file to read from
+ * @return The token stream
+ */
+token_stream_t *lex_file(input_file_t const *input_file)
+{
+    ASSERT(input_file != NULL, "Lexer given invalid file input\n");
+    begin_phase(PhaseLex);
+    lex_chunk(&token_stream, input_file, 0, input_file->size);
+    record_phase_bytes(PhaseLex, input_file->size);
+    record_phase_tokens(PhaseLex, token_stream.token_count);
+    end_phase(PhaseLex);
+    return &token_stream;
 }
@@ -4,13 +4,32 @@
  * STATE: program arguments
  */
 
+#include "ast_file.h"
+#include "batch.h"
+#include "cache.h"
+#include "chunk.h"
+#include "emit.h"
 #include "error_handling.h"
 #include "file.h"
+#include "jit.h"
 #include "lexer.h"
+#include "node_pool.h"
+#include "optimize.h"
 #include "parser.h"
+#include "scan.h"
+#include "server.h"
+#include "stats.h"
+#include "stream.h"
+#include "thread_pool.h"
+#include "type/arena_t.h"
+#include "type/intern_t.h"
+#include "vm.h"
+#include "walk.h"
+#include "watch.h"
 
 #include <ctype.h>       // `isprint`
 #include <getopt.h>      // Option parsing
+#include <string.h>      // `memset`, `strcmp`
 #include <stdnoreturn.h> // `noreturn`
 
 //////////////////////////////////////////////////////////////////////////////
@@ -22,14 +41,153 @@
  */
 static char const *short_options = "t:h";
 
+/**
+ * @brief Values for the CLI options that don't have a short form
+ */
+enum
+{
+    OptionHugePages = 256,
+    OptionEval,
+    OptionNoFold,
+    OptionFoldReport,
+    OptionStats,
+    OptionStream,
+    OptionScanner,
+    OptionAST,
+    OptionEmitAsm,
+    OptionCacheDir,
+    OptionCacheSize,
+    OptionEmitAST,
+    OptionLoadAST,
+    OptionShare,
+    OptionWatch,
+    OptionServe,
+    OptionConnect,
+};
+
+/**
+ * @brief The ways a program can be evaluated
+ */
+typedef enum
+{
+    EvaluateTree, // Walk the AST directly
+    EvaluateVM,   // Compile to bytecode and run that
+    EvaluateJIT   // Compile to machine code and run that
+} evaluator_enum;
+
+/**
+ * @brief The ways an AST can be stored
+ */
+typedef enum
+{
+    ASTTree, // Nodes linked by pointers, allocated from an arena
+    ASTPool  // Compact nodes in one array, linked by index
+} AST_form_enum;
+
+/**
+ * STATE: The number of threads to lex, parse and evaluate with
+ */
+static size_t thread_count = 1;
+
+/**
+ * STATE: How to evaluate the program
+ */
+static evaluator_enum evaluator = EvaluateVM;
+
+/**
+ * STATE: How to store the AST
+ */
+static AST_form_enum AST_form = ASTTree;
+
+/**
+ * STATE: Nonzero to fold constants before evaluating
+ */
+static int fold = 1;
+
+/**
+ * STATE: Nonzero to print the number of nodes before and after folding
+ */
+static int fold_report = 0;
+
+/**
+ * STATE: How to print the time and resources each phase took, if at all
+ */
+static stats_format_enum stats_format = StatsOff;
+
+/**
+ * STATE: Nonzero to evaluate a statement at a time as the file is read
+ */
+static int stream = 0;
+
+/**
+ * STATE: Where to write the program as assembly instead of evaluating it,
+ * or NULL to evaluate it
+ */
+static char const *emit_path = NULL;
+
+/**
+ * STATE: Where to write the AST as a binary file instead of evaluating it,
+ * or NULL to evaluate it
+ */
+static char const *emit_AST_path = NULL;
+
+/**
+ * STATE: An AST file to evaluate in place of input files, or NULL to read
+ * input files
+ */
+static char const *load_AST_path = NULL;
+
+/**
+ * STATE: The directory to cache results in, or NULL to not cache them
+ */
+static char const *cache_directory = NULL;
+
+/**
+ * STATE: The most bytes of results to keep in the cache
+ */
+static size_t cache_size_limit = (size_t)256 << 20;
+
+/**
+ * STATE: Nonzero to compile the file again each time it changes
+ */
+static int watch = 0;
+
+/**
+ * STATE: The socket to compile requests from as a server, or NULL
+ */
+static char const *serve_path = NULL;
+
+/**
+ * STATE: The socket of a server to send the input files to, or NULL to
+ * compile them here
+ */
+static char const *connect_path = NULL;
+
 /**
  * @brief Long CLI options
  * @note long arg, argument requirements, flags (0), short arg
  */
 static struct option const long_options[] = {
-    {"threads", required_argument, 0, 't'},
-    {   "help",       no_argument, 0, 'h'},
-    {        0,                 0, 0,   0}
+    {    "threads", required_argument, 0,              't'},
+    { "huge-pages",       no_argument, 0,  OptionHugePages},
+    {       "eval", required_argument, 0,       OptionEval},
+    {    "no-fold",       no_argument, 0,     OptionNoFold},
+    {"fold-report",       no_argument, 0, OptionFoldReport},
+    {      "stats", optional_argument, 0,      OptionStats},
+    {     "stream",       no_argument, 0,     OptionStream},
+    {    "scanner", required_argument, 0,    OptionScanner},
+    {        "ast", required_argument, 0,        OptionAST},
+    {   "emit-asm", required_argument, 0,    OptionEmitAsm},
+    {  "cache-dir", required_argument, 0,   OptionCacheDir},
+    { "cache-size", required_argument, 0,  OptionCacheSize},
+    {   "emit-ast", required_argument, 0,    OptionEmitAST},
+    {   "load-ast", required_argument, 0,    OptionLoadAST},
+    {      "share",       no_argument, 0,      OptionShare},
+    {      "watch",       no_argument, 0,      OptionWatch},
+    {      "serve", required_argument, 0,      OptionServe},
+    {    "connect", required_argument, 0,    OptionConnect},
+    {       "help",       no_argument, 0,              'h'},
+    {            0,                 0, 0,                0}
 };
 
 /**
@@ -39,16 +197,183 @@ static struct option const long_options[] = {
  */
 noreturn static void usage(char const *program_name)
 {
-    printf("Usage: '%s [options] filename'\n", program_name);
+    printf("Usage: '%s [options] filename...'\n", program_name);
     printf("\n"
            "attis is a compiler for the language Cybele.\n"
            "\n"
+           "Given more than one file, or '@filelist' to read file names one "
+           "per line\n"
+           "from filelist, each file is compiled as an independent job and "
+           "the results\n"
+           "are printed in order.\n"
+           "\n"
            "Options:\n"
            "    {-h || --help}      Show usage\n"
-           "    {-t || --threads}   The maximum number of threads\n");
+           "    {-t || --threads}   The maximum number of threads. A single "
+           "file is lexed,\n"
+           "                        parsed and its statements evaluated "
+           "across them\n"
+           "    {--huge-pages}      Back lexer and parser memory with huge "
+           "pages\n"
+           "    {--eval=NAME}       Evaluate by walking the AST (tree), by "
+           "compiling to\n"
+           "                        bytecode first (vm, default), or by "
+           "compiling to\n"
+           "                        x86-64 machine code first (jit)\n"
+           "    {--no-fold}         Evaluate the AST as parsed, without "
+           "folding constants\n"
+           "    {--fold-report}     Print the number of AST nodes before "
+           "and after folding\n"
+           "    {--stats[=json]}    Print the time, memory and counters for "
+           "each phase to\n"
+           "                        stderr, as a table or a line of JSON. "
+           "Hardware\n"
+           "                        counters only count the main thread\n"
+           "    {--stream}          Evaluate and print each statement as it "
+           "is read, in\n"
+           "                        memory bounded by the largest "
+           "statement\n"
+           "    {--scanner=NAME}    Classify input with auto (default), "
+           "scalar, sse2 or\n"
+           "                        avx2 instructions\n"
+           "    {--ast=tree||pool}  Parse into a tree of pointers (default), "
+           "or into a\n"
+           "                        compact pool of nodes, which is "
+           "evaluated without\n"
+           "                        folding. Pools need a single file and "
+           "thread\n"
+           "    {--emit-asm=FILE}   Write the program to FILE, or stdout for "
+           "'-', as x86-64\n"
+           "                        GNU assembly for a standalone program "
+           "instead of\n"
+           "                        evaluating it. Link it with libm, as in "
+           "'cc FILE -lm'\n"
+           "    {--cache-dir=DIR}   Keep the result of each file in DIR, "
+           "keyed by its\n"
+           "                        contents, and reuse it without lexing "
+           "or parsing\n"
+           "                        while the file is unchanged. Many runs "
+           "can share DIR\n"
+           "    {--cache-size=SIZE} The most bytes of results to keep in "
+           "the cache, with\n"
+           "                        an optional K, M or G suffix. The least "
+           "recently\n"
+           "                        used are removed first (default 256M)\n"
+           "    {--emit-ast=FILE}   Write the AST to FILE, or stdout for "
+           "'-', in a binary\n"
+           "                        form which --load-ast maps without "
+           "parsing, instead\n"
+           "                        of evaluating it\n"
+           "    {--load-ast=FILE}   Evaluate an AST written by --emit-ast, "
+           "in place of\n"
+           "                        input files. It is evaluated as a pool "
+           "of nodes\n"
+           "    {--share}           Parse identical subtrees into one "
+           "shared node, which is\n"
+           "                        evaluated once. This implies "
+           "--no-fold, and a single\n"
+           "                        file is parsed on one thread\n"
+           "    {--watch}           Print the answer, then print it again "
+           "each time the file\n"
+           "                        is written. Only the statements a "
+           "change touches are\n"
+           "                        compiled again, on one thread\n"
+           "    {--serve=SOCKET}    Compile the files of each request sent "
+           "with --connect,\n"
+           "                        until interrupted. Up to -t requests "
+           "are compiled at\n"
+           "                        once, with the other options given "
+           "here\n"
+           "    {--connect=SOCKET}  Send the input files to a server "
+           "started with --serve,\n"
+           "                        which prints to this process's "
+           "output. No other\n"
+           "                        options can be given\n");
     exit(EXIT_SUCCESS);
 }
 
+//////////////////////////////////////////////////////////////////////////////
+// Compiling
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Fold the constants of an AST, unless folding is turned off
+ * @param[in,out] ast The AST to fold
+ * @param[in] output Where to print the fold report
+ */
+static void fold_program(AST_t *ast, FILE *output)
+{
+    if (fold)
+    {
+        fold_report_t report;
+        begin_phase(PhaseFold);
+        fold_AST(ast, &report);
+        end_phase(PhaseFold);
+        if (fold_report)
+        {
+            fprintf(output, "Folded %zu AST nodes to %zu\n",
+                    report.nodes_before, report.nodes_after);
+        }
+    }
+}
+
+/**
+ * @brief Open a file to write a compiled program to
+ * @param[in] path The file, or "-" for stdout
+ * @return The open file
+ */
+static FILE *open_output(char const *path)
+{
+    FILE *output = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    ASSERT(output != NULL, "Failed to open %s\n", path);
+    setvbuf(output, NULL, _IOFBF, (size_t)1 << 20);
+    return output;
+}
+
+/**
+ * @brief Finish writing a file opened by open_output
+ * @param[in] output The open file
+ * @param[in] path The file, for errors
+ */
+static void close_output(FILE *output, char const *path)
+{
+    ASSERT(fflush(output) == 0, "Failed to write %s\n", path);
+    if (output != stdout)
+    {
+        ASSERT(fclose(output) == 0, "Failed to write %s\n", path);
+    }
+}
+
+/**
+ * @brief Optimize an AST and write it to emit_path as assembly
+ * @param[in,out] ast The AST to compile
+ */
+static void emit_program(AST_t *ast)
+{
+    FILE *output = open_output(emit_path);
+    fold_program(ast, output == stdout ? stderr : stdout);
+
+    begin_phase(PhaseEmit);
+    emit_assembly(ast->root, output);
+    close_output(output, emit_path);
+    end_phase(PhaseEmit);
+}
+
+/**
+ * @brief Optimize an AST and write it to emit_AST_path as an AST file
+ * @param[in,out] ast The AST to save
+ */
+static void save_AST_program(AST_t *ast)
+{
+    FILE *output = open_output(emit_AST_path);
+    fold_program(ast, output == stdout ? stderr : stdout);
+
+    begin_phase(PhaseEmit);
+    write_AST_file(ast, output);
+    close_output(output, emit_AST_path);
+    end_phase(PhaseEmit);
+}
+
 //////////////////////////////////////////////////////////////////////////////
 // This section is only for testing
 //////////////////////////////////////////////////////////////////////////////
@@ -56,81 +381,544 @@ noreturn static void usage(char const *program_name)
 #include <features.h>
 #include <math.h>
 
-static double TEST_eval_AST_node(AST_node_t *node)
+/**
+ * @brief The values of the shared nodes of an AST found so far
+ */
+typedef struct eval_memo_t
+{
+    struct
+    {
+        double value;
+        int is_known;
+    } *entry; // Indexed by shared number
+    size_t reserve_space;
+} eval_memo_t;
+
+/**
+ * @brief The memory for evaluating by walking ASTs
+ */
+typedef struct tree_eval_t
 {
-    long ret;
+    AST_walk_t walk; // Post-order, or also pre-order with a memo
+    double *stack;   // The values of finished subtrees
+    size_t reserve_space;
+    eval_memo_t memo; // The values of shared nodes, if the AST has any
+} tree_eval_t;
+
+/**
+ * @brief A run of top level statements to evaluate under a trap, with what
+ * evaluating it allocates
+ * @note Errors in an evaluator jump straight to the trap, so everything is
+ * kept here for the caller to release
+ */
+typedef struct eval_job_t
+{
+    evaluator_enum evaluator;
+    AST_node_t *first; // The first statement
+    size_t count;      // The most statements to evaluate
+    program_t program;
+    jit_program_t jit;
+    tree_eval_t tree;
+    double answer; // The value of the last statement
+} eval_job_t;
+
+/**
+ * @brief Find the memo entry of a shared node, making room for it
+ * @param[in,out] memo The values found so far
+ * @param[in] node A node which is shared
+ * @return The index of the entry
+ */
+static size_t TEST_get_memo_entry(eval_memo_t *memo, AST_node_t const *node)
+{
+    if (node->shared >= memo->reserve_space)
+    {
+        size_t count = memo->reserve_space;
+        memo->reserve_space = (size_t)node->shared * 2;
+        memo->entry = realloc(memo->entry,
+                              memo->reserve_space * sizeof(*memo->entry));
+        ASSERT(memo->entry != NULL, "Failed to allocate eval memo\n");
+        memset(memo->entry + count, 0,
+               (memo->reserve_space - count) * sizeof(*memo->entry));
+    }
+    return node->shared;
+}
+
+/**
+ * @brief Evaluate an expression by walking its AST
+ * @param[in] node The root of the expression
+ * @param[in,out] tree The memory to evaluate with, whose stack is grown as
+ * needed
+ * @param[in,out] memo The values of shared nodes, or NULL if the AST has
+ * none
+ * @return The value of the expression
+ * @note Each shared node is evaluated the first time it is reached. After
+ * that its children are skipped, and its value is taken from the memo.
+ */
+static double TEST_eval_expression(AST_node_t *node, tree_eval_t *tree,
+                                   eval_memo_t *memo)
+{
+    AST_walk_t *walk = &tree->walk;
+    double **stack = &tree->stack;
+    size_t *reserve_space = &tree->reserve_space;
+    double *value = *stack; // One past the top of the stack
     double temp;
-    if (node->type == NodeUnaryOperator)
+    walk_event_enum event;
+    reset_AST_walk(walk, node);
+    while ((node = next_AST_node(walk, &event)) != NULL)
     {
-        switch (node->string.string[0])
+        if ((size_t)(value - *stack) == *reserve_space)
         {
-        case '+':
-            return TEST_eval_AST_node(node->right);
-        case '-':
-            return -TEST_eval_AST_node(node->right);
-        default:
-            printf("Unknown AST token in eval\n");
-            exit(EXIT_FAILURE);
+            size_t count = *reserve_space;
+            *reserve_space = count == 0 ? 64 : count * 2;
+            *stack = realloc(*stack, *reserve_space * sizeof(**stack));
+            ASSERT(*stack != NULL, "Failed to allocate eval stack\n");
+            value = *stack + count;
         }
-    }
-    else if (node->type == NodeBinaryOperator)
-    {
-        switch (node->string.string[0])
+        if (memo != NULL && node->shared != 0)
         {
-        case '+':
-            return TEST_eval_AST_node(node->left)
-                   + TEST_eval_AST_node(node->right);
-        case '-':
-            return TEST_eval_AST_node(node->left)
-                   - TEST_eval_AST_node(node->right);
-        case '*':
-            return TEST_eval_AST_node(node->left)
-                   * TEST_eval_AST_node(node->right);
-        case '/':
-            temp = TEST_eval_AST_node(node->right);
-            if (temp < 0.01 && temp > -0.01)
+            size_t entry = TEST_get_memo_entry(memo, node);
+            if (memo->entry[entry].is_known)
             {
-                printf("AST divide by 0 error\n");
-                exit(EXIT_FAILURE);
+                if (event == WalkPreOrder)
+                {
+                    skip_AST_children(walk);
+                }
+                else
+                {
+                    *value++ = memo->entry[entry].value;
+                }
+                continue;
             }
-            return TEST_eval_AST_node(node->left) / temp;
-        case '%':
-            temp = TEST_eval_AST_node(node->right);
-            if (temp < 0.01 && temp > -0.01)
+        }
+        if (event == WalkPreOrder)
+        {
+            continue;
+        }
+        switch (node->type)
+        {
+        case NodeUnaryOperator:
+            switch (node->string)
             {
-                printf("AST divide by 0 error\n");
-                exit(EXIT_FAILURE);
+            case InternPlus:
+                break;
+            case InternMinus:
+                value[-1] = -value[-1];
+                break;
+            default:
+                EXIT_ERROR("Unknown AST token in eval\n");
             }
-            return fmod(TEST_eval_AST_node(node->left), temp);
+            break;
+        case NodeBinaryOperator:
+            temp = *--value;
+            switch (node->string)
+            {
+            case InternPlus:
+                value[-1] += temp;
+                break;
+            case InternMinus:
+                value[-1] -= temp;
+                break;
+            case InternTimes:
+                value[-1] *= temp;
+                break;
+            case InternDivide:
+                if (temp < 0.01 && temp > -0.01)
+                {
+                    EXIT_ERROR("AST divide by 0 error\n");
+                }
+                value[-1] /= temp;
+                break;
+            case InternModulo:
+                if (temp < 0.01 && temp > -0.01)
+                {
+                    EXIT_ERROR("AST divide by 0 error\n");
+                }
+                value[-1] = fmod(value[-1], temp);
+                break;
+            default:
+                EXIT_ERROR("Unknown AST token in eval\n");
+            }
+            break;
+        case NodeLiteral:
+            *value++ = get_literal_value(node);
+            break;
+        case NodeConstant:
+            *value++ = node->value;
+            break;
+        case NodeParenthesis:
+            break;
         default:
-            printf("Unknown AST token in eval\n");
-            exit(EXIT_FAILURE);
+            EXIT_ERROR("Unknown AST token in eval\n");
+        }
+        if (memo != NULL && node->shared != 0)
+        {
+            size_t entry = TEST_get_memo_entry(memo, node);
+            memo->entry[entry].value = value[-1];
+            memo->entry[entry].is_known = 1;
+        }
+    }
+    return value[-1];
+}
+
+/**
+ * @brief Evaluate a run of top level statements by walking their ASTs
+ * @param[in,out] tree The memory to evaluate with, which should be zeroed.
+ * Deallocate it with TEST_put_tree_eval.
+ * @param[in] first The first statement
+ * @param[in] count The most statements to evaluate, following next from
+ * first
+ * @return The value of the last statement
+ */
+static double TEST_eval_statements(tree_eval_t *tree, AST_node_t *first,
+                                   size_t count)
+{
+    double temp = 0;
+    int is_shared = is_AST_sharing_enabled();
+    get_AST_walk(&tree->walk, NULL,
+                 is_shared ? WalkPreOrder | WalkPostOrder : WalkPostOrder);
+    for (AST_node_t *statement = first; statement != NULL && count > 0;
+         statement = statement->next, count--)
+    {
+        temp = TEST_eval_expression(statement, tree,
+                                    is_shared ? &tree->memo : NULL);
+    }
+    return temp;
+}
+
+/**
+ * @brief Deallocate the memory of a walking evaluation
+ * @param[in,out] tree The memory to deallocate
+ */
+static void TEST_put_tree_eval(tree_eval_t *tree)
+{
+    put_AST_walk(&tree->walk);
+    free(tree->stack);
+    free(tree->memo.entry);
+    *tree = (tree_eval_t){{NULL, 0, 0, 0}, NULL, 0, {NULL, 0}};
+}
+
+static double TEST_eval_statement(AST_node_t *statement);
+
+/**
+ * @brief Evaluate the statements of a job with its evaluator, as a trapped
+ * function
+ * @param[in,out] argument The eval_job_t to evaluate
+ */
+static void TEST_eval_job(void *argument)
+{
+    eval_job_t *job = argument;
+    if (job->evaluator == EvaluateVM)
+    {
+        compile_statements(&job->program, job->first, job->count);
+        job->answer = run_program(&job->program);
+    }
+    else if (job->evaluator == EvaluateJIT)
+    {
+        compile_jit_statements(&job->jit, job->first, job->count,
+                               TEST_eval_statement);
+        job->answer = run_jit(&job->jit);
+    }
+    else
+    {
+        job->answer = TEST_eval_statements(&job->tree, job->first, job->count);
+    }
+}
+
+/**
+ * @brief Evaluate a run of top level statements
+ * @param[in] chosen The evaluator to use
+ * @param[in] first The first statement
+ * @param[in] count The most statements to evaluate, following next from
+ * first
+ * @return The value of the last statement
+ * @note Evaluation runs under its own trap, so that a long running process
+ * which catches the error doesn't leak the program, walk or stack
+ */
+static double TEST_eval_run(evaluator_enum chosen, AST_node_t *first,
+                            size_t count)
+{
+    eval_job_t job = {0};
+    job.evaluator = chosen;
+    job.first = first;
+    job.count = count;
+    error_capture_t capture;
+    capture_errors(&capture, TEST_eval_job, &job);
+    put_program(&job.program);
+    put_jit(&job.jit);
+    TEST_put_tree_eval(&job.tree);
+    if (capture.failed)
+    {
+        raise_captured_errors(&capture);
+    }
+    put_error_capture(&capture);
+    return job.answer;
+}
+
+/**
+ * @brief Evaluate a single statement by walking its AST, for the JIT to fall
+ * back on
+ * @param[in] statement The root of the statement
+ * @return The value of the statement
+ */
+static double TEST_eval_statement(AST_node_t *statement)
+{
+    return TEST_eval_run(EvaluateTree, statement, 1);
+}
+
+/**
+ * @brief Evaluate an AST with the chosen evaluator
+ * @param[in] root The root of the AST, usually the global scope
+ * @return The value of the last statement
+ */
+static double TEST_eval_AST(AST_node_t *root)
+{
+    if (root->type != NodeScope)
+    {
+        return TEST_eval_run(evaluator, root, 1);
+    }
+    // TODO this will behave differently once scope in implemented
+    if (root->list_head == NULL)
+    {
+        EXIT_ERROR("No statements to evaluate\n");
+    }
+    return TEST_eval_run(evaluator, root->list_head, SIZE_MAX);
+}
+
+#define EVAL_PARTITION_SIZE ((size_t)1 << 14) // Statements per partition
+
+/**
+ * @brief A run of top level statements, evaluated on its own
+ * @note Statements have no side effects yet, so each run can be evaluated
+ * on any thread with its own walk, stack or program
+ */
+typedef struct eval_partition_t
+{
+    AST_node_t *first;
+    size_t count;
+    double answer;           // The value of the last statement
+    error_capture_t capture; // The outcome of evaluating it
+} eval_partition_t;
+
+/**
+ * @brief Evaluate a partition with the chosen evaluator
+ * @param[in,out] argument The eval_partition_t to evaluate
+ */
+static void TEST_eval_partition(void *argument)
+{
+    eval_partition_t *partition = argument;
+    partition->answer
+        = TEST_eval_run(evaluator, partition->first, partition->count);
+}
+
+/**
+ * @brief Evaluate a partition, as a task
+ * @param[in,out] argument The eval_partition_t to evaluate
+ */
+static void TEST_eval_partition_task(void *argument)
+{
+    eval_partition_t *partition = argument;
+    capture_errors(&partition->capture, TEST_eval_partition, partition);
+}
+
+/**
+ * @brief Evaluate the top level statements of an AST in partitions on the
+ * thread pool
+ * @param[in] root The root of the AST, usually the global scope
+ * @return The value of the last statement
+ * @note The partitions are taken in source order, so the answer and the
+ * first error reported match a serial run. ASTs with a single partition
+ * are evaluated serially.
+ */
+static double TEST_eval_AST_partitions(AST_node_t *root)
+{
+    eval_partition_t *partitions = NULL;
+    size_t partition_count = 0;
+    size_t reserve_space = 0;
+    AST_node_t *statement = root->type == NodeScope ? root->list_head : NULL;
+    while (statement != NULL)
+    {
+        if (partition_count == reserve_space)
+        {
+            reserve_space = reserve_space == 0 ? 64 : reserve_space * 2;
+            partitions
+                = realloc(partitions, reserve_space * sizeof(*partitions));
+            ASSERT(partitions != NULL, "Failed to allocate eval partitions\n");
+        }
+        eval_partition_t *partition = &partitions[partition_count++];
+        *partition = (eval_partition_t){statement, 0, 0, {0}};
+        while (statement != NULL && partition->count < EVAL_PARTITION_SIZE)
+        {
+            statement = statement->next;
+            partition->count += 1;
         }
     }
-    else if (node->type == NodeLiteral)
+    if (partition_count <= 1)
     {
-        ret = strtol(node->string.string, NULL, 10);
-        return (double)ret;
+        free(partitions);
+        return TEST_eval_AST(root);
     }
-    else if (node->type == NodeParenthesis)
+
+    task_group_t group = {0};
+    for (size_t index = 0; index < partition_count; index++)
     {
-        return TEST_eval_AST_node(node->right);
+        submit_task(&group, TEST_eval_partition_task, &partitions[index]);
     }
-    else if (node->type == NodeScope)
-    { // TODO this will behave differently once scope in implemented
-        AST_node_t *temp_node = node->list_head;
-        do
+    wait_task_group(&group);
+
+    // The first failure is raised once everything else is released
+    error_capture_t failure = {0, 0, NULL, 0, NULL, 0};
+    for (size_t index = 0; index < partition_count; index++)
+    {
+        if (partitions[index].capture.failed && !failure.failed)
+        {
+            failure = partitions[index].capture;
+        }
+        else
         {
-            temp = TEST_eval_AST_node(temp_node);
-            temp_node = temp_node->next;
-        } while (temp_node != NULL);
-        return temp;
+            put_error_capture(&partitions[index].capture);
+        }
+    }
+    double answer = partitions[partition_count - 1].answer;
+    free(partitions);
+    if (failure.failed)
+    {
+        raise_captured_errors(&failure);
+    }
+    return answer;
+}
+
+/**
+ * @brief Print an answer, as a whole number if it is close to one
+ * @param[in] answer The answer to print
+ * @param[in] output Where to print the answer
+ */
+static void TEST_print_value(double answer, FILE *output)
+{
+    if (fabs(answer - round(answer)) < 0.01)
+    {
+        fprintf(output, "Answer: %ld\n", (long)answer);
     }
     else
     {
-        printf("Unknown AST token in eval\n");
-        exit(EXIT_FAILURE);
+        fprintf(output, "Answer: %f\n", answer);
+    }
+}
+
+/**
+ * @brief Optimize and evaluate an AST and print the answer
+ * @param[in,out] ast The AST to evaluate
+ * @param[in] output Where to print the answer
+ */
+static void TEST_print_answer(AST_t *ast, FILE *output)
+{
+    fold_program(ast, output);
+
+    double answer;
+    begin_phase(PhaseEvaluate);
+    if (thread_pool_size() > 1)
+    {
+        answer = TEST_eval_AST_partitions(ast->root);
+    }
+    else
+    {
+        answer = TEST_eval_AST(ast->root);
     }
+    end_phase(PhaseEvaluate);
+    TEST_print_value(answer, output);
+}
+
+/**
+ * @brief An AST to evaluate under an error trap, and where to print to
+ */
+typedef struct answer_job_t
+{
+    AST_t *ast;
+    FILE *output;
+} answer_job_t;
+
+/**
+ * @brief Optimize and evaluate an AST and print the answer, as a trapped
+ * function
+ * @param[in] argument The answer_job_t to evaluate
+ */
+static void TEST_print_answer_job(void *argument)
+{
+    answer_job_t *job = argument;
+    TEST_print_answer(job->ast, job->output);
+}
+
+/**
+ * @brief Optimize and evaluate an AST, print the answer and store it in the
+ * cache
+ * @param[in,out] ast The AST to evaluate
+ * @param[in] key The key to store the answer under
+ * @param[in] output Where to print the answer
+ * @note Nothing is stored if evaluating fails, but what was printed before
+ * the error still is
+ */
+static void TEST_print_cached_answer(AST_t *ast, cache_key_t const *key,
+                                     FILE *output)
+{
+    char *result = NULL;
+    size_t result_size = 0;
+    error_capture_t capture;
+    answer_job_t job = {ast, open_memstream(&result, &result_size)};
+    ASSERT(job.output != NULL, "Failed to open result stream\n");
+    capture_errors(&capture, TEST_print_answer_job, &job);
+    fclose(job.output);
+    fwrite(result, 1, result_size, output);
+    if (capture.failed)
+    {
+        fflush(output); // Keep errors in order with the output
+        print_captured_errors(&capture);
+        exit_on_error(capture.exit_code);
+    }
+
+    begin_phase(PhaseCache);
+    store_cached_result(key, result, result_size);
+    end_phase(PhaseCache);
+    put_error_capture(&capture);
+    free(result);
+}
+
+/**
+ * @brief Evaluate a single statement with the chosen evaluator, for watching
+ * a file
+ * @param[in] statement The root of the statement
+ * @return The value of the statement
+ * @note A statement is too small to be worth mapping machine code for, so
+ * the JIT walks the AST instead. Constants aren't folded, as each statement
+ * is only evaluated once.
+ */
+static double TEST_eval_watched_statement(AST_node_t *statement)
+{
+    return TEST_eval_run(evaluator == EvaluateVM ? EvaluateVM : EvaluateTree,
+                         statement, 1);
+}
+
+/**
+ * @brief Evaluate a node pool and print the answer
+ * @param[in] pool The pool to evaluate
+ * @param[in] output Where to print the answer
+ */
+static void TEST_print_pool_answer(node_pool_t const *pool, FILE *output)
+{
+    double answer;
+    begin_phase(PhaseEvaluate);
+    if (evaluator == EvaluateVM)
+    {
+        program_t program
+            = {NULL, 0, 0, NULL, 0, 0, NULL, 0, NULL, 0, 0, NULL, 0};
+        compile_pool(&program, pool);
+        answer = run_program(&program);
+        put_program(&program);
+    }
+    else
+    {
+        answer = eval_pool(pool);
+    }
+    end_phase(PhaseEvaluate);
+    TEST_print_value(answer, output);
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -142,9 +930,16 @@ static double TEST_eval_AST_node(AST_node_t *node)
  */
 static void exit_program()
 {
+    put_thread_pool();
+    put_batch();
+    put_cache();
     put_file();
-    put_token_node_list();
+    put_token_stream();
     put_AST();
+    put_node_pool();
+    put_AST_file();
+    put_intern_table();
+    put_stats();
 }
 
 /**
@@ -157,18 +952,154 @@ int main(int argc, char *argv[])
 {
     ASSERT(!atexit(exit_program), "Failed to register atexit\n");
     opterr = 0; // Setting this to 0 prevents getopt_long from printing errors
+    select_scanner(ScannerAuto);
+
+    int option_count = 0;
 
     { // Parse option arguments
         int opt;
         while ((opt = getopt_long(argc, argv, short_options, long_options, 0))
                != EOF)
         {
+            option_count++;
             switch (opt)
             {
             case 't':
-                // TODO
-                fprintf(stderr, "TODO: support multi-threading\n");
-                exit(EXIT_FAILURE);
+            {
+                char *end;
+                long count = strtol(optarg, &end, 10);
+                if (*optarg == '\0' || *end != '\0' || count < 1)
+                {
+                    fprintf(stderr, "-t must be passed a positive number\n");
+                    exit(EXIT_FAILURE);
+                }
+                thread_count = (size_t)count;
+                break;
+            }
+            case OptionHugePages:
+                enable_arena_huge_pages();
+                break;
+            case OptionNoFold:
+                fold = 0;
+                break;
+            case OptionFoldReport:
+                fold_report = 1;
+                break;
+            case OptionStream:
+                stream = 1;
+                break;
+            case OptionScanner:
+                if (strcmp(optarg, "auto") == 0)
+                    select_scanner(ScannerAuto);
+                else if (strcmp(optarg, "scalar") == 0)
+                    select_scanner(ScannerScalar);
+                else if (strcmp(optarg, "sse2") == 0)
+                    select_scanner(ScannerSSE2);
+                else if (strcmp(optarg, "avx2") == 0)
+                    select_scanner(ScannerAVX2);
+                else
+                {
+                    fprintf(stderr, "--scanner must be passed auto, scalar, "
+                                    "sse2 or avx2\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OptionStats:
+                if (optarg == NULL || strcmp(optarg, "text") == 0)
+                {
+                    stats_format = StatsText;
+                }
+                else if (strcmp(optarg, "json") == 0)
+                {
+                    stats_format = StatsJSON;
+                }
+                else
+                {
+                    fprintf(stderr, "--stats must be passed text or json\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OptionAST:
+                if (strcmp(optarg, "tree") == 0)
+                {
+                    AST_form = ASTTree;
+                }
+                else if (strcmp(optarg, "pool") == 0)
+                {
+                    AST_form = ASTPool;
+                }
+                else
+                {
+                    fprintf(stderr, "--ast must be passed tree or pool\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case OptionEmitAsm:
+                emit_path = optarg;
+                break;
+            case OptionCacheDir:
+                cache_directory = optarg;
+                break;
+            case OptionEmitAST:
+                emit_AST_path = optarg;
+                break;
+            case OptionLoadAST:
+                load_AST_path = optarg;
+                break;
+            case OptionWatch:
+                watch = 1;
+                break;
+            case OptionServe:
+                serve_path = optarg;
+                break;
+            case OptionConnect:
+                connect_path = optarg;
+                break;
+            case OptionShare:
+                // Folding rewrites subtrees in place, which would change
+                // every place a shared one is used
+                enable_AST_sharing();
+                fold = 0;
+                break;
+            case OptionCacheSize:
+            {
+                char *end;
+                unsigned long long size = strtoull(optarg, &end, 10);
+                unsigned shift = *end == 'K'   ? 10
+                                 : *end == 'M' ? 20
+                                 : *end == 'G' ? 30
+                                               : 0;
+                end += shift != 0;
+                if (*optarg == '\0' || *optarg == '-' || *end != '\0'
+                    || size > SIZE_MAX >> shift)
+                {
+                    fprintf(stderr, "--cache-size must be passed a size in "
+                                    "bytes, or with K, M or G\n");
+                    exit(EXIT_FAILURE);
+                }
+                cache_size_limit = (size_t)size << shift;
+                break;
+            }
+            case OptionEval:
+                if (strcmp(optarg, "tree") == 0)
+                {
+                    evaluator = EvaluateTree;
+                }
+                else if (strcmp(optarg, "vm") == 0)
+                {
+                    evaluator = EvaluateVM;
+                }
+                else if (strcmp(optarg, "jit") == 0)
+                {
+                    evaluator = EvaluateJIT;
+                }
+                else
+                {
+                    fprintf(stderr,
+                            "--eval must be passed tree, vm or jit\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
             case 'h':
                 usage(argv[0]);
             case '?':
@@ -177,6 +1108,28 @@ int main(int argc, char *argv[])
                 case 't':
                     fprintf(stderr, "-%c must be passed a value\n", optopt);
                     exit(EXIT_FAILURE);
+                case OptionEval:
+                case OptionScanner:
+                case OptionAST:
+                case OptionEmitAsm:
+                case OptionCacheDir:
+                case OptionCacheSize:
+                case OptionEmitAST:
+                case OptionLoadAST:
+                case OptionServe:
+                case OptionConnect:
+                    fprintf(stderr, "--%s must be passed a value\n",
+                            optopt == OptionEval        ? "eval"
+                            : optopt == OptionScanner   ? "scanner"
+                            : optopt == OptionAST       ? "ast"
+                            : optopt == OptionEmitAsm   ? "emit-asm"
+                            : optopt == OptionCacheDir  ? "cache-dir"
+                            : optopt == OptionCacheSize ? "cache-size"
+                            : optopt == OptionEmitAST   ? "emit-ast"
+                            : optopt == OptionLoadAST   ? "load-ast"
+                            : optopt == OptionServe     ? "serve"
+                                                        : "connect");
+                    exit(EXIT_FAILURE);
                 default:
                     if (isprint(optopt))
                         fprintf(stderr, "Unknown option -%c\n", optopt);
@@ -191,46 +1144,240 @@ int main(int argc, char *argv[])
         }
     }
 
-    FILE *input_file = NULL;
+    if (connect_path != NULL && option_count > 1)
+    {
+        fprintf(stderr, "--connect can't be used with other options, which "
+                        "are given to --serve\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (connect_path != NULL)
+    { // Compiling on a server, in place of everything else
+        return send_request(connect_path, argc - optind, argv + optind);
+    }
+
+    if (AST_form == ASTPool
+        && (thread_count > 1 || stream || argc > optind + 1
+            || (argc > optind && argv[optind][0] == '@')))
+    {
+        fprintf(stderr, "--ast=pool needs a single file, without -t or "
+                        "--stream\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (AST_form == ASTPool && evaluator == EvaluateJIT)
+    {
+        fprintf(stderr, "--ast=pool can't be used with --eval=jit\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (AST_form == ASTPool && is_AST_sharing_enabled())
+    {
+        fprintf(stderr, "--ast=pool can't be used with --share\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((emit_path != NULL || emit_AST_path != NULL)
+        && (AST_form == ASTPool || stream || argc > optind + 1
+            || (argc > optind && argv[optind][0] == '@')))
+    {
+        fprintf(stderr, "--emit-asm and --emit-ast need a single file, "
+                        "without --stream or --ast=pool\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (emit_path != NULL && emit_AST_path != NULL)
+    {
+        fprintf(stderr, "--emit-asm and --emit-ast can't be used together\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (cache_directory != NULL
+        && (AST_form == ASTPool || stream || emit_path != NULL
+            || emit_AST_path != NULL))
+    {
+        fprintf(stderr, "--cache-dir can't be used with --stream, --emit-asm, "
+                        "--emit-ast or --ast=pool\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (load_AST_path != NULL
+        && (argc > optind || stream || emit_path != NULL
+            || emit_AST_path != NULL || cache_directory != NULL
+            || evaluator == EvaluateJIT))
+    {
+        fprintf(stderr, "--load-ast can't be used with input files, "
+                        "--stream, --emit-asm, --emit-ast, --cache-dir or "
+                        "--eval=jit\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (watch
+        && (argc != optind + 1 || argv[optind][0] == '@' || stream
+            || emit_path != NULL || emit_AST_path != NULL
+            || load_AST_path != NULL || cache_directory != NULL
+            || AST_form == ASTPool))
+    {
+        fprintf(stderr, "--watch needs a single file, without --stream, "
+                        "--emit-asm, --emit-ast, --load-ast, --cache-dir or "
+                        "--ast=pool\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (serve_path != NULL
+        && (argc > optind || stream || emit_path != NULL
+            || emit_AST_path != NULL || load_AST_path != NULL || watch
+            || AST_form == ASTPool || stats_format != StatsOff))
+    {
+        fprintf(stderr, "--serve can't be used with input files, --stream, "
+                        "--emit-asm, --emit-ast, --load-ast, --watch, "
+                        "--ast=pool or --stats\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (stats_format != StatsOff)
+    {
+        enable_stats(stats_format);
+    }
+
+    if (cache_directory != NULL)
+    { // Only options which change what is printed are part of the key
+        char options[64];
+        snprintf(options, sizeof(options), "fold=%d fold-report=%d", fold,
+                 fold_report);
+        enable_cache(cache_directory, cache_size_limit, options);
+    }
+
+    if (serve_path != NULL)
+    { // Compiling requests from clients, until interrupted
+        serve_requests(serve_path, thread_count, TEST_print_answer);
+        return 0;
+    }
+
+    cache_key_t cache_key = {{0}, 0};
+
+    if (load_AST_path != NULL)
+    { // Evaluation of a saved AST, in place of reading and parsing
+        begin_phase(PhaseRead);
+        node_pool_t *pool = load_AST_file(load_AST_path);
+        record_phase_nodes(PhaseRead, pool->node_type_count);
+        end_phase(PhaseRead);
+        TEST_print_pool_answer(pool, stdout);
+        print_stats(stderr);
+        return 0;
+    }
+
+    if (watch)
+    { // Compiling the file whenever it changes, which never returns
+        watch_file(argv[optind], TEST_eval_watched_statement,
+                   TEST_print_value, stdout);
+    }
+
+    input_file_t *input_file = NULL;
 
     { // Parse file arguments
         ASSERT(argc > optind, "No input files given\n");
 
-        if (argc > optind + 1)
-        {
-            // TODO
-            fprintf(stderr, "TODO: support multiple input files\n");
-            exit(EXIT_FAILURE);
+        if (argc > optind + 1 || argv[optind][0] == '@')
+        { // Compile each file as a job on the thread pool
+            for (int index = optind; index < argc; index++)
+            {
+                add_batch_file(argv[index]);
+            }
+            get_thread_pool(thread_count);
+            begin_phase(PhaseBatch);
+            int exit_code = run_batch(TEST_print_answer);
+            end_phase(PhaseBatch);
+            print_stats(stderr);
+            return exit_code;
         }
 
-        input_file = get_file(argv[optind], "r");
+        begin_phase(PhaseRead);
+        input_file = get_file(argv[optind]);
+        record_phase_bytes(PhaseRead, input_file->size);
+        end_phase(PhaseRead);
     }
 
-    token_list_node_t *token_list = NULL;
+    if (is_cache_enabled())
+    { // A cached result, in place of everything else
+        begin_phase(PhaseCache);
+        get_cache_key(&cache_key, input_file);
+        int is_cached = load_cached_result(&cache_key, stdout);
+        end_phase(PhaseCache);
+        if (is_cached)
+        {
+            print_stats(stderr);
+            return 0;
+        }
+    }
 
-    { // Lexer
-        token_list = lex_file(input_file);
+    if (stream)
+    { // Lexer, parser and evaluation, a statement at a time
+        stream_file(input_file, TEST_print_answer, stdout);
+        print_stats(stderr);
+        return 0;
     }
 
     AST_t *ast = NULL;
 
-    { // Parser
-        ast = parse_lex(token_list);
+    if (thread_count > 1)
+    {
+        get_thread_pool(thread_count);
+    }
+
+    // Chunks would each number their shared nodes from 1, so a shared AST
+    // is parsed on one thread, though it is still evaluated across them
+    if (thread_count > 1 && !is_AST_sharing_enabled())
+    { // Lexer and parser, in chunks across threads
+        ast = parse_file_chunks(input_file);
+    }
+    else
+    {
+        token_stream_t *tokens = NULL;
+
+        { // Lexer
+            tokens = lex_file(input_file);
+        }
+
+        if (AST_form == ASTPool)
+        { // Parser and evaluation, over the compact pool
+            TEST_print_pool_answer(parse_pool(tokens, input_file), stdout);
+            print_stats(stderr);
+            return 0;
+        }
+
+        { // Parser
+            ast = parse_lex(tokens, input_file);
+        }
+    }
+
+    if (emit_path != NULL)
+    { // Compiling to assembly
+        emit_program(ast);
+        print_stats(stderr);
+        return 0;
+    }
+
+    if (emit_AST_path != NULL)
+    { // Saving the AST
+        save_AST_program(ast);
+        print_stats(stderr);
+        return 0;
     }
 
     //////////////////////////////////////////////////////////////////////////
     // This section is only for testing
     //////////////////////////////////////////////////////////////////////////
 
-    double answer = TEST_eval_AST_node(ast->root);
-    if (fabs(answer - round(answer)) < 0.01)
+    if (is_cache_enabled())
     {
-        printf("Answer: %ld\n", (long)answer);
+        TEST_print_cached_answer(ast, &cache_key, stdout);
     }
     else
     {
-        printf("Answer: %f\n", answer);
+        TEST_print_answer(ast, stdout);
     }
+    print_stats(stderr);
 
     return 0;
 }
@@ -0,0 +1,450 @@
+/** node_pool.c
+ * @brief A compact AST, with every node in one array addressed by index
+ *
+ * Nodes are 12 bytes, with the operator and child indices packed together
+ * and no strings. Where each node came from is kept in a side table of file
+ * offsets, which is only read for diagnostics. Nodes are added as each
+ * subtree is completed, so a statement is stored in postfix order and can
+ * be evaluated by a single pass over its nodes.
+ *
+ * STATE: node_pool
+ */
+
+#include "error_handling.h"
+#include "node_pool.h"
+#include "stats.h"
+
+#include <limits.h> // `INT_MIN`, `LONG_MAX`
+#include <math.h>   // `fmod`
+#include <string.h> // `memcpy`
+
+//////////////////////////////////////////////////////////////////////////////
+// Node Pool Structures Definition
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * STATE: This holds the node pool for parsing
+ */
+static node_pool_t node_pool
+    = {NULL, NULL, 0, 0, NULL, 0, 0, POOL_NONE, 0, {0}, NULL, NULL, NULL};
+
+/**
+ * @brief The operators and operands of the statement being parsed
+ * @note Operators are kept as token indices, since their nodes aren't added
+ * until their operands are complete. Open parentheses sit on the operator
+ * stack while they are open.
+ */
+typedef struct pool_stack_t
+{
+    uint32_t *operator;
+    uint32_t operator_count;
+    uint32_t operator_reserve_space;
+    uint32_t *operand;
+    uint32_t operand_count;
+    uint32_t operand_reserve_space;
+} pool_stack_t;
+
+/**
+ * @brief Push an index onto a stack
+ * @param[in,out] stack The stack to push to
+ * @param[in,out] count The number of indices on the stack
+ * @param[in,out] reserve_space The space allocated for the stack
+ * @param[in] index The index to push
+ */
+static void push_index(uint32_t **stack, uint32_t *count,
+                       uint32_t *reserve_space, uint32_t index)
+{
+    if (*count == *reserve_space)
+    {
+        *reserve_space = *reserve_space == 0 ? 64 : *reserve_space * 2;
+        *stack = realloc(*stack, *reserve_space * sizeof(**stack));
+        ASSERT(*stack != NULL, "Failed to allocate node pool stack\n");
+    }
+    (*stack)[(*count)++] = index;
+}
+
+/**
+ * @brief Deallocate the node pool
+ */
+void put_node_pool()
+{
+    free(node_pool.node);
+    free(node_pool.offset);
+    free(node_pool.statement);
+    node_pool = (node_pool_t){
+        NULL, NULL, 0, 0, NULL, 0, 0, POOL_NONE, 0, {0}, NULL, NULL, NULL};
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Node Access
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Add a node to the end of a pool
+ * @param[in,out] pool The pool to add to, which has room for every token
+ * @param[in] type The type of node to add
+ * @param[in] tokens The token stream the node comes from
+ * @param[in] token The token the node comes from
+ * @return The index of the new node, with no children
+ */
+static uint32_t add_pool_node(node_pool_t *pool, node_type_enum type,
+                              token_stream_t const *tokens, uint32_t token)
+{
+    uint32_t index = pool->node_count++;
+    pool->node[index] = (pool_node_t){
+        (uint8_t)type, *token_text(pool->input_file, tokens, token),
+        {POOL_NONE, POOL_NONE}
+    };
+    pool->offset[index] = tokens->offset[token];
+    pool->node_type_count[type] += 1;
+    return index;
+}
+
+/**
+ * @brief Get the value of a literal node
+ * @param[in] pool The pool holding the literal
+ * @param[in] index The literal
+ * @return The value the lexer decoded, or LONG_MAX for a literal too large
+ * for a long, which is what strtol gives for its digits
+ */
+double get_pool_literal_value(node_pool_t const *pool, uint32_t index)
+{
+    long literal;
+    memcpy(&literal, pool->node[index].operand, sizeof(literal));
+    return literal == LITERAL_OVERFLOW ? (double)LONG_MAX : (double)literal;
+}
+
+/**
+ * @brief Get the value of a constant node, which a folded AST may have
+ * @param[in] pool The pool holding the constant
+ * @param[in] index The constant
+ * @return The value of the constant
+ */
+double get_pool_constant_value(node_pool_t const *pool, uint32_t index)
+{
+    double value;
+    memcpy(&value, pool->node[index].operand, sizeof(value));
+    return value;
+}
+
+/**
+ * @brief Find where a node came from in the input file
+ * @param[in,out] location The last location found in the file, which is
+ * moved to the node
+ * @param[in] pool The pool holding the node
+ * @param[in] index The node
+ * @note Pools loaded from a file have no offsets, only lines and columns
+ */
+void get_pool_location(source_location_t *location, node_pool_t const *pool,
+                       uint32_t index)
+{
+    if (pool->location != NULL)
+    {
+        location->offset = 0;
+        location->line_number = pool->location[index].line_number;
+        location->column_number = pool->location[index].column_number;
+        return;
+    }
+    find_source_location(location, pool->input_file, pool->offset[index]);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Parsing
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Return the relative priority of an operator token
+ * @param[in] tokens The token stream holding the operator
+ * @param[in] input_file The file the token stream refers to
+ * @param[in] token The operator
+ * @note These match get_operator_priority in parser.c
+ */
+static int get_pool_priority(token_stream_t const *tokens,
+                             input_file_t const *input_file, uint32_t token)
+{
+    if (tokens->token[token] == TokenUnaryOperator)
+    {
+        return 1000;
+    }
+    switch (*token_text(input_file, tokens, token))
+    {
+    case '*':
+    case '/':
+    case '%':
+        return 100;
+    default:
+        return 10;
+    }
+}
+
+/**
+ * @brief Pop an operand from the parse stack
+ * @param[in,out] stack The parse stack
+ * @return The index of the operand
+ */
+static uint32_t pop_pool_operand(pool_stack_t *stack)
+{
+    ASSERT(stack->operand_count > 0, "Missing operand\n");
+    return stack->operand[--stack->operand_count];
+}
+
+/**
+ * @brief Add the node for the operator on top of the operator stack, taking
+ * its operands
+ * @param[in,out] pool The pool to add to
+ * @param[in,out] stack The parse stack
+ * @param[in] tokens The token stream being parsed
+ */
+static void reduce_pool_operator(node_pool_t *pool, pool_stack_t *stack,
+                                 token_stream_t const *tokens)
+{
+    uint32_t token = stack->operator[--stack->operator_count];
+    int is_binary = tokens->token[token] == TokenBinaryOperator;
+    uint32_t index = add_pool_node(
+        pool, is_binary ? NodeBinaryOperator : NodeUnaryOperator, tokens,
+        token);
+    pool->node[index].operand[1] = pop_pool_operand(stack);
+    if (is_binary)
+    {
+        pool->node[index].operand[0] = pop_pool_operand(stack);
+    }
+    push_index(&stack->operand, &stack->operand_count,
+               &stack->operand_reserve_space, index);
+}
+
+/**
+ * @brief Add the nodes for every operator above the innermost open
+ * parenthesis which binds at least as tightly as a given priority
+ * @param[in,out] pool The pool to add to
+ * @param[in,out] stack The parse stack
+ * @param[in] tokens The token stream being parsed
+ * @param[in] priority The priority to compare against, or INT_MIN for all
+ */
+static void reduce_pool_operators(node_pool_t *pool, pool_stack_t *stack,
+                                  token_stream_t const *tokens, int priority)
+{
+    while (stack->operator_count > 0)
+    {
+        uint32_t top = stack->operator[stack->operator_count - 1];
+        if (tokens->token[top] == TokenOpenParenthesis
+            || get_pool_priority(tokens, pool->input_file, top) < priority)
+        {
+            return;
+        }
+        reduce_pool_operator(pool, stack, tokens);
+    }
+}
+
+/**
+ * @brief Build the node pool from a stream of tokens
+ * @param[in] tokens The stream of tokens to use to build the pool
+ * @param[in] input_file The file the token stream refers to
+ * @return The pool
+ * @note This places operators exactly as parse_lex does, so the pool has
+ * the same nodes as the pointer tree and evaluates to the same answer
+ */
+node_pool_t *parse_pool(token_stream_t const *tokens,
+                        input_file_t const *input_file)
+{
+    ASSERT(tokens->token_count < POOL_NONE, "Too many tokens for a pool\n");
+    begin_phase(PhaseParse);
+    node_pool_t *pool = &node_pool;
+    pool->input_file = input_file;
+
+    // Every node comes from a token, so this is never outgrown
+    pool->reserve_space = (uint32_t)tokens->token_count;
+    pool->node = malloc(pool->reserve_space * sizeof(*pool->node) + 1);
+    pool->offset = malloc(pool->reserve_space * sizeof(*pool->offset) + 1);
+    ASSERT(pool->node != NULL && pool->offset != NULL,
+           "Failed to allocate node pool\n");
+
+    pool_stack_t stack = {NULL, 0, 0, NULL, 0, 0};
+    int parenthesis_depth = 0;
+    uint32_t index;
+    for (uint32_t token = 0; token < tokens->token_count; token++)
+    {
+        switch ((token_type_enum)tokens->token[token])
+        {
+        case TokenUnaryOperator:
+            push_index(&stack.operator, &stack.operator_count,
+                       &stack.operator_reserve_space, token);
+            break;
+        case TokenBinaryOperator:
+            reduce_pool_operators(
+                pool, &stack, tokens,
+                get_pool_priority(tokens, input_file, token));
+            push_index(&stack.operator, &stack.operator_count,
+                       &stack.operator_reserve_space, token);
+            break;
+        case TokenOpenParenthesis:
+            parenthesis_depth += 1;
+            push_index(&stack.operator, &stack.operator_count,
+                       &stack.operator_reserve_space, token);
+            break;
+        case TokenCloseParenthesis:
+            parenthesis_depth -= 1;
+            ASSERT(parenthesis_depth >= 0, "Unbalanced parenthesis\n");
+            reduce_pool_operators(pool, &stack, tokens, INT_MIN);
+            index = add_pool_node(pool, NodeParenthesis, tokens,
+                                  stack.operator[--stack.operator_count]);
+            pool->node[index].operand[1] = pop_pool_operand(&stack);
+            push_index(&stack.operand, &stack.operand_count,
+                       &stack.operand_reserve_space, index);
+            break;
+        case TokenLiteral:
+            index = add_pool_node(pool, NodeLiteral, tokens, token);
+            memcpy(pool->node[index].operand, &tokens->value[token],
+                   sizeof(tokens->value[token]));
+            push_index(&stack.operand, &stack.operand_count,
+                       &stack.operand_reserve_space, index);
+            if (stack.operand_count > pool->stack_size)
+            {
+                pool->stack_size = stack.operand_count;
+            }
+            break;
+        case TokenSemicolon:
+            ASSERT(parenthesis_depth == 0, "Unbalanced parenthesis\n");
+            reduce_pool_operators(pool, &stack, tokens, INT_MIN);
+            if (stack.operand_count == 0)
+            {
+                break; // An empty statement
+            }
+            push_index(&pool->statement, &pool->statement_count,
+                       &pool->statement_reserve_space,
+                       pop_pool_operand(&stack));
+            break;
+        default:
+            EXIT_ERROR("Unknown token in parse_pool\n");
+        }
+    }
+    ASSERT(parenthesis_depth == 0, "Unbalanced parenthesis\n");
+
+    // A trailing statement with no semicolon isn't a statement, but if it
+    // has an operator at the top it becomes the root
+    reduce_pool_operators(pool, &stack, tokens, INT_MIN);
+    if (stack.operand_count > 0)
+    {
+        index = pop_pool_operand(&stack);
+        if (pool->node[index].type == NodeUnaryOperator
+            || pool->node[index].type == NodeBinaryOperator)
+        {
+            pool->root = index;
+        }
+    }
+
+    free(stack.operator);
+    free(stack.operand);
+    record_phase_bytes(PhaseParse, input_file->size);
+    record_phase_nodes(PhaseParse, pool->node_type_count);
+    end_phase(PhaseParse);
+    return pool;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Evaluation
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Evaluate the nodes of a statement in order
+ * @param[in] pool The pool holding the statement
+ * @param[in] first The first node after the previous statement
+ * @param[in] root The root of the statement, which is its last node
+ * @param[out] stack Space for pool->stack_size values
+ * @return The value of the statement
+ * @note Operands left behind by malformed statements may come before the
+ * statement's own nodes. They are pushed and never used.
+ */
+static double eval_pool_statement(node_pool_t const *pool, uint32_t first,
+                                  uint32_t root, double *stack)
+{
+    double *top = stack; // One past the top of the stack
+    for (uint32_t index = first; index <= root; index++)
+    {
+        pool_node_t const *node = &pool->node[index];
+        switch (node->type)
+        {
+        case NodeLiteral:
+            *top++ = get_pool_literal_value(pool, index);
+            break;
+        case NodeConstant:
+            *top++ = get_pool_constant_value(pool, index);
+            break;
+        case NodeUnaryOperator:
+            if (node->symbol == '-')
+            {
+                top[-1] = -top[-1];
+            }
+            break;
+        case NodeBinaryOperator:
+            top -= 1;
+            switch (node->symbol)
+            {
+            case '+':
+                top[-1] += top[0];
+                break;
+            case '-':
+                top[-1] -= top[0];
+                break;
+            case '*':
+                top[-1] *= top[0];
+                break;
+            case '/':
+            case '%':
+                if (top[0] < 0.01 && top[0] > -0.01)
+                {
+                    EXIT_ERROR("AST divide by 0 error\n");
+                }
+                top[-1] = node->symbol == '/' ? top[-1] / top[0]
+                                              : fmod(top[-1], top[0]);
+                break;
+            default:
+                EXIT_ERROR("Unknown AST token in eval\n");
+            }
+            break;
+        case NodeParenthesis:
+            break;
+        default:
+            EXIT_ERROR("Unknown AST token in eval\n");
+        }
+    }
+    return top[-1];
+}
+
+/**
+ * @brief Evaluate a node pool
+ * @param[in] pool The pool to evaluate
+ * @return The value of the root, or of the last statement if there is no
+ * root
+ */
+double eval_pool(node_pool_t const *pool)
+{
+    double *stack = malloc(pool->stack_size * sizeof(*stack) + 1);
+    ASSERT(stack != NULL, "Failed to allocate evaluation stack\n");
+
+    double result;
+    uint32_t first = 0;
+    if (pool->root != POOL_NONE)
+    {
+        if (pool->statement_count > 0)
+        {
+            first = pool->statement[pool->statement_count - 1] + 1;
+        }
+        result = eval_pool_statement(pool, first, pool->root, stack);
+    }
+    else
+    {
+        if (pool->statement_count == 0)
+        {
+            EXIT_ERROR("No statements to evaluate\n");
+        }
+        for (uint32_t index = 0; index < pool->statement_count; index++)
+        {
+            result = eval_pool_statement(pool, first, pool->statement[index],
+                                         stack);
+            first = pool->statement[index] + 1;
+        }
+    }
+
+    free(stack);
+    return result;
+}
@@ -0,0 +1,389 @@
+/** optimize.c
+ * @brief Simplifying the AST before it is evaluated
+ *
+ * Subtrees made only of constants are folded into a single NodeConstant,
+ * parenthesis and unary plus nodes are dropped, double negation cancels and
+ * arithmetic identities are applied. Nodes are rewritten in place, and
+ * nodes which drop out of the tree are left for the AST arena to release.
+ *
+ * Anything which would fail at evaluation, such as a division by zero, is
+ * left in the tree so that it still fails in the same way.
+ */
+
+#include "error_handling.h"
+#include "optimize.h"
+#include "walk.h"
+
+#include <math.h> // `fmod`
+
+/**
+ * @brief How deep folding recurses before it goes on with a walk, which is
+ * slower on the usual shallow trees but doesn't use the C stack
+ */
+#define FOLD_RECURSION_LIMIT 1024
+
+/**
+ * @brief What is known about a subtree once it is folded
+ */
+typedef struct fold_result_t
+{
+    size_t node_count; // The number of nodes left in the subtree
+    int may_fail;      // Nonzero if evaluating the subtree might fail
+} fold_result_t;
+
+/**
+ * @brief Check whether a divisor would fail at evaluation
+ */
+static int is_near_zero(double value)
+{
+    return value < 0.01 && value > -0.01;
+}
+
+/**
+ * @brief Check whether a node is a constant with a given value
+ */
+static int is_constant(AST_node_t const *node, double value)
+{
+    return node->type == NodeConstant && node->value == value;
+}
+
+/**
+ * @brief Turn a node into a constant
+ * @param[in,out] node The node to overwrite
+ * @param[in] value The value of the constant
+ * @return The node
+ */
+static AST_node_t *make_constant(AST_node_t *node, double value)
+{
+    node->type = NodeConstant;
+    node->left = NULL;
+    node->right = NULL;
+    node->value = value;
+    return node;
+}
+
+/**
+ * @brief A folded subtree waiting for its parent to be folded
+ */
+typedef struct fold_entry_t
+{
+    AST_node_t *node; // The root of the folded subtree
+    fold_result_t result;
+} fold_entry_t;
+
+/**
+ * @brief The memory for folding, which is reused between statements
+ */
+typedef struct fold_state_t
+{
+    AST_walk_t walk;     // A post-order walk of the statement
+    fold_entry_t *entry; // The folded subtrees whose parents are unfinished
+    size_t entry_count;
+    size_t entry_reserve_space;
+} fold_state_t;
+
+/**
+ * @brief Fold a unary operator
+ * @param[in,out] node The operator
+ * @param[in] operand The folded operand
+ * @param[in,out] result What is known about the folded operand, which
+ * becomes what is known about the folded subtree
+ * @return The root of the folded subtree
+ */
+static AST_node_t *fold_unary(AST_node_t *node, AST_node_t *operand,
+                              fold_result_t *result)
+{
+    switch (node->string)
+    {
+    case InternPlus:
+        return operand;
+    case InternMinus:
+        if (operand->type == NodeConstant)
+        {
+            return make_constant(node, -operand->value);
+        }
+        if (operand->type == NodeUnaryOperator)
+        {
+            // The operand is already folded, so it must be a negation
+            result->node_count -= 1;
+            return operand->right;
+        }
+        node->right = operand;
+        operand->parent_node = node;
+        result->node_count += 1;
+        return node;
+    default:
+        EXIT_ERROR("Unknown AST token in fold\n");
+    }
+}
+
+/**
+ * @brief Fold a binary operator
+ * @param[in,out] node The operator
+ * @param[in] left_entry The folded left operand and what is known about it
+ * @param[in] right_entry The folded right operand and what is known about
+ * it
+ * @param[out] result What is known about the folded subtree
+ * @return The root of the folded subtree
+ */
+static AST_node_t *fold_binary(AST_node_t *node,
+                               fold_entry_t const *left_entry,
+                               fold_entry_t const *right_entry,
+                               fold_result_t *result)
+{
+    AST_node_t *left = left_entry->node;
+    AST_node_t *right = right_entry->node;
+    fold_result_t left_result = left_entry->result;
+    fold_result_t right_result = right_entry->result;
+    intern_t symbol = node->string;
+
+    if (left->type == NodeConstant && right->type == NodeConstant)
+    {
+        double value;
+        switch (symbol)
+        {
+        case InternPlus:
+            value = left->value + right->value;
+            break;
+        case InternMinus:
+            value = left->value - right->value;
+            break;
+        case InternTimes:
+            value = left->value * right->value;
+            break;
+        case InternDivide:
+            value = left->value / right->value;
+            break;
+        case InternModulo:
+            value = fmod(left->value, right->value);
+            break;
+        default:
+            EXIT_ERROR("Unknown AST token in fold\n");
+        }
+        if ((symbol != InternDivide && symbol != InternModulo)
+            || !is_near_zero(right->value))
+        {
+            *result = (fold_result_t){1, 0};
+            return make_constant(node, value);
+        }
+    }
+
+    // Identities, which mustn't drop a subtree that could fail
+    switch (symbol)
+    {
+    case InternPlus:
+        if (is_constant(right, 0))
+        {
+            *result = left_result;
+            return left;
+        }
+        if (is_constant(left, 0))
+        {
+            *result = right_result;
+            return right;
+        }
+        break;
+    case InternMinus:
+        if (is_constant(right, 0))
+        {
+            *result = left_result;
+            return left;
+        }
+        break;
+    case InternTimes:
+        if (is_constant(right, 1))
+        {
+            *result = left_result;
+            return left;
+        }
+        if (is_constant(left, 1))
+        {
+            *result = right_result;
+            return right;
+        }
+        if ((is_constant(right, 0) && !left_result.may_fail)
+            || (is_constant(left, 0) && !right_result.may_fail))
+        {
+            *result = (fold_result_t){1, 0};
+            return make_constant(node, 0);
+        }
+        break;
+    case InternDivide:
+        if (is_constant(right, 1))
+        {
+            *result = left_result;
+            return left;
+        }
+        break;
+    default:
+        break;
+    }
+
+    node->left = left;
+    node->right = right;
+    left->parent_node = node;
+    right->parent_node = node;
+    result->node_count = left_result.node_count + right_result.node_count + 1;
+    result->may_fail = left_result.may_fail || right_result.may_fail
+                       || symbol == InternDivide || symbol == InternModulo;
+    return node;
+}
+
+/**
+ * @brief Add a folded subtree to the entries of a fold
+ * @param[in,out] state The fold
+ * @param[in] node The root of the folded subtree
+ * @param[in] result What is known about the folded subtree
+ */
+static void push_fold_entry(fold_state_t *state, AST_node_t *node,
+                            fold_result_t result)
+{
+    if (state->entry_count == state->entry_reserve_space)
+    {
+        state->entry_reserve_space = state->entry_reserve_space == 0
+                                         ? 64
+                                         : state->entry_reserve_space * 2;
+        state->entry = realloc(state->entry, state->entry_reserve_space
+                                                 * sizeof(*state->entry));
+        ASSERT(state->entry != NULL, "Failed to allocate fold\n");
+    }
+    state->entry[state->entry_count++] = (fold_entry_t){node, result};
+}
+
+/**
+ * @brief Fold an expression of any depth
+ * @param[in,out] node The root of the expression
+ * @param[in,out] report The node counts to add to
+ * @param[out] result What is known about the folded subtree
+ * @param[in,out] state The memory to fold with
+ * @return The root of the folded subtree, which may not be node
+ * @note Children are folded before their parents by a post-order walk, so
+ * each parent finds its folded operands on top of the entries
+ */
+static AST_node_t *fold_deep_node(AST_node_t *node, fold_report_t *report,
+                                  fold_result_t *result, fold_state_t *state)
+{
+    fold_entry_t *top;
+    state->entry_count = 0;
+    reset_AST_walk(&state->walk, node);
+    while ((node = next_AST_node(&state->walk, NULL)) != NULL)
+    {
+        report->nodes_before += 1;
+        switch (node->type)
+        {
+        case NodeUnaryOperator:
+            top = &state->entry[state->entry_count - 1];
+            top->node = fold_unary(node, top->node, &top->result);
+            break;
+        case NodeBinaryOperator:
+            top = &state->entry[--state->entry_count];
+            top[-1].node = fold_binary(node, &top[-1], top, &top[-1].result);
+            break;
+        case NodeParenthesis:
+            break; // The parenthesis is dropped, leaving its operand
+        case NodeLiteral:
+            push_fold_entry(state,
+                            make_constant(node, get_literal_value(node)),
+                            (fold_result_t){1, 0});
+            break;
+        case NodeConstant:
+            push_fold_entry(state, node, (fold_result_t){1, 0});
+            break;
+        default:
+            EXIT_ERROR("Unknown AST token in fold\n");
+        }
+    }
+    *result = state->entry[0].result;
+    return state->entry[0].node;
+}
+
+/**
+ * @brief Fold an expression
+ * @param[in,out] node The root of the expression
+ * @param[in,out] report The node counts to add to
+ * @param[out] result What is known about the folded subtree
+ * @param[in,out] state The memory to fold deep subtrees with
+ * @param[in] depth The depth of the node in the recursion
+ * @return The root of the folded subtree, which may not be node
+ */
+static AST_node_t *fold_node(AST_node_t *node, fold_report_t *report,
+                             fold_result_t *result, fold_state_t *state,
+                             size_t depth)
+{
+    if (depth == FOLD_RECURSION_LIMIT)
+    {
+        return fold_deep_node(node, report, result, state);
+    }
+
+    fold_entry_t operand[2];
+    report->nodes_before += 1;
+    switch (node->type)
+    {
+    case NodeUnaryOperator:
+        return fold_unary(node,
+                          fold_node(node->right, report, result, state,
+                                    depth + 1),
+                          result);
+    case NodeBinaryOperator:
+        operand[0].node = fold_node(node->left, report, &operand[0].result,
+                                    state, depth + 1);
+        operand[1].node = fold_node(node->right, report, &operand[1].result,
+                                    state, depth + 1);
+        return fold_binary(node, &operand[0], &operand[1], result);
+    case NodeParenthesis:
+        return fold_node(node->right, report, result, state, depth + 1);
+    case NodeLiteral:
+        *result = (fold_result_t){1, 0};
+        return make_constant(node, get_literal_value(node));
+    case NodeConstant:
+        *result = (fold_result_t){1, 0};
+        return node;
+    default:
+        EXIT_ERROR("Unknown AST token in fold\n");
+    }
+}
+
+/**
+ * @brief Fold every statement of an AST
+ * @param[in,out] ast The AST to simplify
+ * @param[out] report The number of nodes before and after folding
+ */
+void fold_AST(AST_t *ast, fold_report_t *report)
+{
+    *report = (fold_report_t){1, 1}; // The global scope
+    fold_result_t result;
+    fold_state_t state = {{NULL, 0, 0, 0}, NULL, 0, 0};
+    get_AST_walk(&state.walk, NULL, WalkPostOrder);
+
+    AST_node_t *previous = NULL;
+    for (AST_node_t *statement = ast->scope->list_head; statement != NULL;
+         statement = statement->next)
+    {
+        AST_node_t *folded = fold_node(statement, report, &result, &state, 0);
+        report->nodes_after += result.node_count;
+        folded->next = statement->next;
+        folded->parent_node = statement->parent_node;
+        if (previous == NULL)
+        {
+            ast->scope->list_head = folded;
+        }
+        else
+        {
+            previous->next = folded;
+        }
+        ast->scope->list_tail = folded;
+        previous = folded;
+    }
+
+    // A trailing statement with no semicolon is the root, not in the list
+    if (ast->root != ast->scope)
+    {
+        AST_node_t *parent = ast->root->parent_node;
+        ast->root = fold_node(ast->root, report, &result, &state, 0);
+        ast->root->parent_node = parent;
+        report->nodes_after += result.node_count;
+    }
+
+    put_AST_walk(&state.walk);
+    free(state.entry);
+}
@@ -1,43 +1,40 @@
-/** lexer.c
+/** parser.c
  * @brief Utilities for parsing file input
  *
- * STATE: AST
+ * With sharing enabled, each subtree is looked up in a hash table as it is
+ * completed, by its type, operator or value and children. A subtree seen
+ * before is replaced by the node made the first time, so the AST becomes a
+ * DAG with each distinct subtree stored once. The duplicate's node is reused
+ * for the next token. A node is only the root of one statement, as it is
+ * linked to the next one, so a repeated statement gets a copy of its root.
+ *
+ * STATE: AST, share_subtrees
  */
 
 #include "error_handling.h"
 #include "lexer.h"
 #include "parser.h"
-#include "type/string_t.h"
+#include "stats.h"
+#include "type/arena_t.h"
+#include "type/intern_t.h"
+#include "walk.h"
+
+#include <limits.h> // `INT_MIN`, `LONG_MAX`
+#include <string.h> // `memcmp`, `memset`
 
 //////////////////////////////////////////////////////////////////////////
 // AST Structures Definition
 //////////////////////////////////////////////////////////////////////////
 
 /**
- * STATE: This holds the AST for parsing
+ * STATE: This holds the AST for parsing, and the memory for every node in it
  */
-static AST_t AST = {NULL};
+static AST_t AST = {NULL, NULL, {NULL}, {0}};
 
 /**
- * @brief Parenthesis and Scope nodes section the root off to the right
- * temporarily to ensure thir children stay in a local scope.
- * @return The effective root node pointer pointer, might be NULL
+ * STATE: Nonzero to share identical subtrees while parsing
  */
-static AST_node_t **get_next_search()
-{
-    if (AST.root != NULL)
-    {
-        if (AST.root->type == NodeParenthesis)
-        {
-            return &AST.root->right;
-        }
-        if (AST.root->type == NodeScope)
-        {
-            return &AST.root->right;
-        }
-    }
-    return &AST.root;
-}
+static int share_subtrees = 0;
 
 //////////////////////////////////////////////////////////////////////////
 // Node placement
@@ -46,115 +43,291 @@ static AST_node_t **get_next_search()
 /**
  * @brief Return the relative priority of an operator
  * @param t The type to evaluate
- * @param s The string to evaluate
+ * @param s The interned operator to evaluate
  * @note Don't rely on the absolute values here, only the relative ones
  */
-static int get_operator_priority(node_type_enum t, string_t const *s)
+static int get_operator_priority(node_type_enum t, intern_t s)
 {
-    // TODO This shouldn't be a character, because operators like '&&' will
-    // need more information.
     switch (t)
     {
     case NodeBinaryOperator:
-        switch (s->string[0])
+        switch (s)
         {
-        case '*':
-        case '/':
-        case '%':
+        case InternTimes:
+        case InternDivide:
+        case InternModulo:
             return 100;
-        case '+':
-        case '-':
+        case InternPlus:
+        case InternMinus:
             return 10;
         default:
             ASSERT(0, "Unknown operator priority\n");
             return -1;
         }
     case NodeUnaryOperator:
-        switch (s->string[0])
+        switch (s)
         {
-        case '+':
-        case '-':
+        case InternPlus:
+        case InternMinus:
             return 1000;
         default:
             ASSERT(0, "Unknown operator priority\n");
             return -1;
         }
     default:
-        ASSERT(0, "Unknown operator priority %s\n", s->string);
+        ASSERT(0, "Unknown operator priority %s\n", get_intern_string(s));
         return -1;
     }
 }
 
 /**
- * @brief Return true if the LHS is lower priority than the RHS
- * @param LHS The node to check if it is lower priority
- * @param RHS The node to check against
+ * @brief A subtree in a share table
+ * @note The hash is kept so most other subtrees are told apart without
+ * reading their nodes
+ */
+typedef struct share_slot_t
+{
+    size_t hash;
+    AST_node_t *node; // NULL for an empty slot
+} share_slot_t;
+
+/**
+ * @brief The subtrees completed so far, for sharing
+ */
+typedef struct share_table_t
+{
+    AST_t *ast;           // The AST being parsed
+    share_slot_t *slot;   // Open addressing, probed linearly
+    size_t slot_count;    // A power of two
+    size_t node_count;    // The slots in use
+    uint32_t shared_count; // The binary operators numbered as shared
+    AST_node_t *free_node; // Duplicates to reuse, linked by next
+} share_table_t;
+
+/**
+ * @brief The operators and operands of the statement being parsed
+ * @note Parenthesis nodes sit on the operator stack while they are open
+ */
+typedef struct parse_stack_t
+{
+    AST_node_t **operator;
+    size_t operator_count;
+    size_t operator_reserve_space;
+    AST_node_t **operand;
+    size_t operand_count;
+    size_t operand_reserve_space;
+    share_table_t *share; // The completed subtrees, or NULL if not sharing
+} parse_stack_t;
+
+//////////////////////////////////////////////////////////////////////////
+// Sharing
+//////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Share identical subtrees of every AST parsed after this call, so
+ * that each is stored and evaluated once
  */
-static int lower_priority(AST_node_t const *LHS, AST_node_t const *RHS)
+void enable_AST_sharing()
 {
-    return get_operator_priority(LHS->type, &LHS->string)
-           < get_operator_priority(RHS->type, &RHS->string);
+    share_subtrees = 1;
 }
 
 /**
- * @brief Place a new operator in the AST
- * @param current_AST_node The node to place
+ * @brief Check whether identical subtrees are shared
  */
-static void find_and_place_operator(AST_node_t *current_AST_node)
+int is_AST_sharing_enabled()
 {
-    AST_node_t **current_root = get_next_search();
-    if (*current_root == NULL)
-    {
-        current_AST_node->parent_node = AST.root;
-        *current_root = current_AST_node;
-        AST.root = current_AST_node;
-    }
-    else
+    return share_subtrees;
+}
+
+/**
+ * @brief Mix every bit of a word into every other
+ */
+static uint64_t mix_bits(uint64_t hash)
+{
+    hash = (hash ^ hash >> 33) * 0xff51afd7ed558ccd;
+    hash = (hash ^ hash >> 33) * 0xc4ceb9fe1a85ec53;
+    return hash ^ hash >> 33;
+}
+
+/**
+ * @brief Hash what makes a node's subtree distinct
+ * @note Children are already shared, so they are compared by address
+ */
+static size_t hash_shared_node(AST_node_t const *node)
+{
+    uint64_t bits; // The literal or constant, else 0
+    memcpy(&bits, &node->literal, sizeof(bits));
+    uint64_t hash = mix_bits((uint64_t)node->type << 32 | node->string);
+    hash = mix_bits(hash ^ (uintptr_t)node->left);
+    hash = mix_bits(hash ^ (uintptr_t)node->right);
+    return (size_t)mix_bits(hash ^ bits);
+}
+
+/**
+ * @brief Check whether two nodes have identical subtrees
+ */
+static int is_same_subtree(AST_node_t const *node, AST_node_t const *other)
+{
+    return node->type == other->type && node->string == other->string
+           && node->left == other->left && node->right == other->right
+           && memcmp(&node->literal, &other->literal, sizeof(node->literal))
+                  == 0;
+}
+
+/**
+ * @brief Double the slots of a share table
+ * @param[in,out] share The table to grow
+ */
+static void grow_share_table(share_table_t *share)
+{
+    share_slot_t *old_slot = share->slot;
+    size_t old_count = share->slot_count;
+    share->slot_count = old_count == 0 ? 1024 : old_count * 2;
+    share->slot = calloc(share->slot_count, sizeof(*share->slot));
+    ASSERT(share->slot != NULL, "Failed to allocate share table\n");
+    for (size_t index = 0; index < old_count; index++)
     {
-        AST_node_t *old_root = *current_root;
-        AST_node_t *prev_root = old_root->parent_node;
-        while (old_root
-               && (old_root->type == NodeBinaryOperator
-                   || old_root->type == NodeUnaryOperator)
-               && lower_priority(old_root, current_AST_node))
+        if (old_slot[index].node == NULL)
         {
-            prev_root = old_root;
-            old_root = old_root->right;
+            continue;
         }
-        current_AST_node->parent_node = prev_root;
-        if (old_root == *current_root)
+        size_t slot = old_slot[index].hash;
+        while (share->slot[slot &= share->slot_count - 1].node != NULL)
         {
-            AST.root = current_AST_node;
+            slot += 1;
         }
-        prev_root->right = current_AST_node;
-        current_AST_node->left = old_root;
+        share->slot[slot] = old_slot[index];
     }
+    free(old_slot);
 }
 
 /**
- * @brief Place a new value in the AST
- * @param current_AST_node The node to place
+ * @brief Replace a completed subtree with an identical one seen before
+ * @param[in,out] share The completed subtrees
+ * @param[in] node The root of the subtree, whose children are shared
+ * @return The node to use for the subtree. If it isn't node, node is kept
+ * to be reused.
  */
-static void find_and_place_value(AST_node_t *current_AST_node)
+static AST_node_t *share_node(share_table_t *share, AST_node_t *node)
 {
-    AST_node_t **current_root = get_next_search();
-    if (*current_root == NULL)
+    if (share->node_count * 2 >= share->slot_count)
     {
-        current_AST_node->parent_node = AST.root;
-        *current_root = current_AST_node;
-        AST.root = current_AST_node;
+        grow_share_table(share);
     }
-    else
+    size_t hash = hash_shared_node(node);
+    size_t slot = hash;
+    AST_node_t *other;
+    while ((other = share->slot[slot &= share->slot_count - 1].node) != NULL)
     {
-        AST_node_t *temp_node = *current_root;
-        while (temp_node->right
-               && (temp_node->right->type == NodeUnaryOperator
-                   || temp_node->right->type == NodeBinaryOperator))
+        if (share->slot[slot].hash == hash && is_same_subtree(node, other))
         {
-            temp_node = temp_node->right;
+            // Anything smaller is as quick to evaluate again as to look up
+            if (other->shared == 0 && other->type == NodeBinaryOperator)
+            {
+                other->shared = ++share->shared_count;
+            }
+            if (node->left != NULL && node->left->parent_node == node)
+            {
+                node->left->parent_node = other;
+            }
+            if (node->right != NULL && node->right->parent_node == node)
+            {
+                node->right->parent_node = other;
+            }
+            share->ast->node_count[node->type] -= 1;
+            node->next = share->free_node;
+            share->free_node = node;
+            return other;
+        }
+        slot += 1;
+    }
+    share->slot[slot] = (share_slot_t){hash, node};
+    share->node_count += 1;
+    return node;
+}
+
+/**
+ * @brief Push a node onto one of the parse stacks
+ * @param[in,out] stack The stack to push to
+ * @param[in,out] count The number of nodes on the stack
+ * @param[in,out] reserve_space The space allocated for the stack
+ * @param[in] node The node to push
+ */
+static void push_node(AST_node_t ***stack, size_t *count,
+                      size_t *reserve_space, AST_node_t *node)
+{
+    if (*count == *reserve_space)
+    {
+        *reserve_space = *reserve_space == 0 ? 64 : *reserve_space * 2;
+        *stack = realloc(*stack, *reserve_space * sizeof(**stack));
+        ASSERT(*stack != NULL, "Failed to allocate parse stack\n");
+    }
+    (*stack)[(*count)++] = node;
+}
+
+/**
+ * @brief Push a completed subtree onto the operand stack
+ * @param[in,out] stack The parse stack
+ * @param[in] node The root of the subtree. If an identical subtree is
+ * shared instead, node is kept to be reused.
+ */
+static void push_operand(parse_stack_t *stack, AST_node_t *node)
+{
+    if (stack->share != NULL)
+    {
+        node = share_node(stack->share, node);
+    }
+    push_node(&stack->operand, &stack->operand_count,
+              &stack->operand_reserve_space, node);
+}
+
+/**
+ * @brief Pop an operand from the parse stack
+ * @param[in,out] stack The parse stack
+ * @param[in] parent The node which takes the operand as a child
+ * @return The operand
+ */
+static AST_node_t *pop_operand(parse_stack_t *stack, AST_node_t *parent)
+{
+    ASSERT(stack->operand_count > 0, "Missing operand\n");
+    AST_node_t *operand = stack->operand[--stack->operand_count];
+    operand->parent_node = parent;
+    return operand;
+}
+
+/**
+ * @brief Apply the operator on top of the operator stack to its operands
+ * @param[in,out] stack The parse stack
+ */
+static void reduce_operator(parse_stack_t *stack)
+{
+    AST_node_t *operator_node = stack->operator[--stack->operator_count];
+    operator_node->right = pop_operand(stack, operator_node);
+    if (operator_node->type == NodeBinaryOperator)
+    {
+        operator_node->left = pop_operand(stack, operator_node);
+    }
+    push_operand(stack, operator_node);
+}
+
+/**
+ * @brief Apply every operator above the innermost open parenthesis which
+ * binds at least as tightly as a given priority
+ * @param[in,out] stack The parse stack
+ * @param[in] priority The priority to compare against, or INT_MIN for all
+ */
+static void reduce_operators(parse_stack_t *stack, int priority)
+{
+    while (stack->operator_count > 0)
+    {
+        AST_node_t const *top = stack->operator[stack->operator_count - 1];
+        if (top->type == NodeParenthesis
+            || get_operator_priority(top->type, top->string) < priority)
+        {
+            return;
         }
-        current_AST_node->parent_node = temp_node;
-        temp_node->right = current_AST_node;
+        reduce_operator(stack);
     }
 }
 
@@ -164,27 +337,54 @@ static void find_and_place_value(AST_node_t *current_AST_node)
 
 /**
  * @brief Allocate an AST node
- * @param node The node to copy from
+ * @param ast The AST whose arena the node and its string come from
+ * @param share The subtrees completed so far, whose unused nodes are taken
+ * first, or NULL
+ * @param tokens The token stream to copy from, or NULL for a scope node
+ * @param index The token to copy from
+ * @param input_file The file the token stream refers to
+ * @param location The last location found in the file, which is moved to
+ * the token
  * @param type The type of node to create
  * @param parent_scope The parent scope of this node
  * @return The new AST node
  */
-static AST_node_t *get_AST_node(token_list_node_t *node, node_type_enum type,
-                                AST_node_t *parent_scope)
+static AST_node_t *get_AST_node(AST_t *ast, share_table_t *share,
+                                token_stream_t const *tokens,
+                                size_t index, input_file_t const *input_file,
+                                source_location_t *location,
+                                node_type_enum type, AST_node_t *parent_scope)
 {
-    // Allocate our node and space for the string
-    AST_node_t *return_node = calloc(1, sizeof(*return_node));
-    ASSERT(return_node != NULL, "Failed to allocate token node\n");
+    AST_node_t *return_node;
+    if (share != NULL && share->free_node != NULL)
+    {
+        return_node = share->free_node;
+        share->free_node = return_node->next;
+        memset(return_node, 0, sizeof(*return_node));
+    }
+    else
+    {
+        return_node = arena_allocate(&ast->arena, sizeof(*return_node));
+    }
+    ast->node_count[type] += 1;
 
-    if (node != NULL)
+    if (tokens != NULL)
     {
-        get_string_clone(&return_node->string, &node->string);
-        return_node->line_number = node->line_number;
-        return_node->column_number = node->column_number;
+        // Literals are known by their value, so their text isn't kept
+        return_node->string
+            = type == NodeLiteral
+                  ? InternNone
+                  : get_intern(token_text(input_file, tokens, index),
+                               tokens->length[index]);
+        return_node->filename = input_file->filename;
+        find_source_location(location, input_file, tokens->offset[index]);
+        return_node->line_number = location->line_number;
+        return_node->column_number = location->column_number;
     }
     else
     {
-        get_string(&return_node->string, "__GLOBAL_SCOPE__", NO_EXTRA_SPACE);
+        return_node->string = InternGlobalScope;
+        return_node->filename = InternNone;
         return_node->line_number = -1;
         return_node->column_number = -1;
     }
@@ -196,63 +396,38 @@ static AST_node_t *get_AST_node(token_list_node_t *node, node_type_enum type,
 }
 
 /**
- * @brief Deallocate an AST node
- * @param current_AST_node The AST node to free, after freeing its children
+ * @brief Print an AST sideways, with the right of each node above it and
+ * the left below
+ * @param root The root of the AST
  */
-static void put_AST_node_and_children(AST_node_t *current_AST_node)
+static void print_AST(AST_node_t *root)
 {
-    if (current_AST_node == NULL)
-    {
-        return;
-    }
-    if (current_AST_node->type == NodeScope)
+    AST_walk_t walk;
+    walk_event_enum event;
+    get_AST_walk(&walk, root, WalkPreOrder | WalkInOrder | WalkRightFirst);
+    while ((root = next_AST_node(&walk, &event)) != NULL)
     {
-        AST_node_t *temp = current_AST_node->list_head;
-        AST_node_t *next;
-        while (temp != NULL)
+        // Scopes are printed above their statements, everything else
+        // between its children
+        if ((root->type == NodeScope) != (event == WalkPreOrder))
         {
-            next = temp->next;
-            put_AST_node_and_children(temp);
-            temp = next;
+            continue;
         }
-    }
-    put_AST_node_and_children(current_AST_node->left);
-    put_AST_node_and_children(current_AST_node->right);
-    put_string(&current_AST_node->string);
-    free(current_AST_node);
-}
-
-static void print_AST(AST_node_t *root, int space)
-{
-    if (root == NULL)
-    {
-        return;
-    }
-
-    // Increase distance between levels
-    space += 2;
-
-    // Process right child first
-    print_AST(root->right, space);
-
-    // Print current node after space
-    // count
-    for (int i = 2; i < space; i++)
-        printf(" ");
-
-    if (root->type == NodeScope)
-    {
-        AST_node_t *temp = root->list_head;
-        while (temp != NULL)
+        printf("%*s", (int)(walk.frame_count - 1) * 2, "");
+        if (root->type == NodeConstant)
+        {
+            printf("%g\n", root->value);
+        }
+        else if (root->type == NodeLiteral)
+        {
+            printf("%ld\n", root->literal);
+        }
+        else
         {
-            print_AST(temp, space);
-            temp = temp->next;
+            printf("%s\n", get_intern_string(root->string));
         }
     }
-    printf("%s\n", root->string.string);
-
-    // Process left child
-    print_AST(root->left, space);
+    put_AST_walk(&walk);
 }
 
 /**
@@ -260,17 +435,22 @@ static void print_AST(AST_node_t *root, int space)
  */
 void put_AST()
 {
-    AST_node_t *temp_AST_node = AST.root;
-    if (temp_AST_node != NULL)
-    {
-        while (temp_AST_node->parent_scope != NULL)
-        {
-            temp_AST_node = temp_AST_node->parent_scope;
-        }
-        // print_AST(temp_AST_node, 0);
-        put_AST_node_and_children(temp_AST_node);
-    }
-    AST.root = NULL;
+    // print_AST(AST.root);
+    // Every node and string lives in the arena, so there's nothing to walk
+    put_arena(&AST.arena);
+    AST = (AST_t){NULL, NULL, {NULL}, {0}};
+}
+
+/**
+ * @brief Get the value of a literal node
+ * @param[in] node The literal
+ * @return The value the lexer decoded, or LONG_MAX for a literal too large
+ * for a long, which is what strtol gives for its digits
+ */
+double get_literal_value(AST_node_t const *node)
+{
+    return node->literal == LITERAL_OVERFLOW ? (double)LONG_MAX
+                                             : (double)node->literal;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -278,86 +458,266 @@ void put_AST()
 //////////////////////////////////////////////////////////////////////////////
 
 /**
- * @brief Build an AST from a list of tokens
- * @param token_list The list of token to use to build the AST
- * @return The root of the AST
+ * @brief Add a stream of tokens to an AST
+ * @param ast The AST to build, whose root must be its scope
+ * @param parent_scope The scope to record as the parent of each new node
+ * @param tokens The stream of tokens to use to build the AST
+ * @param input_file The file the token stream refers to
+ * @param location The location to start finding token locations from
+ * @note Operators are placed by precedence climbing over an explicit stack,
+ * so each token is handled in amortized constant time however deep the
+ * expression is. Operators of equal priority group to the left, and unary
+ * operators bind tightest.
  */
-AST_t *parse_lex(token_list_node_t *token_list)
+static void parse_tokens(AST_t *ast, AST_node_t *parent_scope,
+                         token_stream_t const *tokens,
+                         input_file_t const *input_file,
+                         source_location_t *location)
 {
-    AST.root = get_AST_node(NULL, NodeScope, NULL);
-    AST_node_t *current_AST_node = AST.root;
-    AST_node_t *current_scope = AST.root;
-
-    AST_node_t *temp_AST_node;
+    AST_node_t *current_scope = ast->scope;
+    AST_node_t *current_AST_node;
+    share_table_t share = {ast, NULL, 0, 0, 0, NULL};
+    parse_stack_t stack
+        = {NULL, 0, 0, NULL, 0, 0, share_subtrees ? &share : NULL};
 
     int parenthesis_depth = 0;
 
     // Place each token into an AST in order
-    token_list_node_t *elem, *temp;
-    elem = token_list;
-    for_each_element_from(elem, temp, token_list_node_t, list)
+    for (size_t index = 0; index < tokens->token_count; index++)
     {
-        // printf("Parse %s\n", elem->string.string);
-        switch (elem->token)
+        // printf("Parse %d\n", tokens->token[index]);
+        switch ((token_type_enum)tokens->token[index])
         {
         case TokenUnaryOperator:
+            // Nothing binds tighter than a unary operator, so there is
+            // nothing to reduce before it
             current_AST_node
-                = get_AST_node(elem, NodeUnaryOperator, current_scope);
-            find_and_place_operator(current_AST_node);
+                = get_AST_node(ast, stack.share, tokens, index, input_file,
+                               location, NodeUnaryOperator, parent_scope);
+            push_node(&stack.operator, &stack.operator_count,
+                      &stack.operator_reserve_space, current_AST_node);
             break;
         case TokenBinaryOperator:
             current_AST_node
-                = get_AST_node(elem, NodeBinaryOperator, current_scope);
-            find_and_place_operator(current_AST_node);
+                = get_AST_node(ast, stack.share, tokens, index, input_file,
+                               location, NodeBinaryOperator, parent_scope);
+            reduce_operators(&stack,
+                             get_operator_priority(current_AST_node->type,
+                                                   current_AST_node->string));
+            push_node(&stack.operator, &stack.operator_count,
+                      &stack.operator_reserve_space, current_AST_node);
             break;
         case TokenOpenParenthesis:
             parenthesis_depth += 1;
             current_AST_node
-                = get_AST_node(elem, NodeParenthesis, current_scope);
-            current_AST_node->old_root = AST.root;
-            find_and_place_value(current_AST_node);
-            AST.root = current_AST_node;
+                = get_AST_node(ast, stack.share, tokens, index, input_file,
+                               location, NodeParenthesis, parent_scope);
+            push_node(&stack.operator, &stack.operator_count,
+                      &stack.operator_reserve_space, current_AST_node);
             break;
         case TokenCloseParenthesis:
             parenthesis_depth -= 1;
             ASSERT(parenthesis_depth >= 0, "Unbalanced parenthesis\n");
-            temp_AST_node = AST.root;
-            if (AST.root->type == NodeParenthesis)
-            {
-                AST.root = temp_AST_node->old_root;
-                temp_AST_node->old_root = NULL;
-            }
-            else
-            {
-                AST.root = temp_AST_node->parent_node->old_root;
-                temp_AST_node->parent_node->old_root = NULL;
-            }
+            reduce_operators(&stack, INT_MIN);
+            current_AST_node = stack.operator[--stack.operator_count];
+            current_AST_node->right = pop_operand(&stack, current_AST_node);
+            push_operand(&stack, current_AST_node);
             break;
         case TokenLiteral:
-            current_AST_node = get_AST_node(elem, NodeLiteral, current_scope);
-            find_and_place_value(current_AST_node);
+            current_AST_node
+                = get_AST_node(ast, stack.share, tokens, index, input_file,
+                               location, NodeLiteral, parent_scope);
+            current_AST_node->literal = tokens->value[index];
+            push_operand(&stack, current_AST_node);
             break;
         case TokenSemicolon:
             ASSERT(parenthesis_depth == 0, "Unbalanced parenthesis\n");
+            reduce_operators(&stack, INT_MIN);
+            if (stack.operand_count == 0)
+            {
+                break; // An empty statement
+            }
+            current_AST_node = pop_operand(&stack, current_scope);
+            if (current_AST_node->next != NULL
+                || current_AST_node == current_scope->list_tail)
+            { // Already the root of a statement, which can only be linked
+              // to one next statement
+                AST_node_t *copy
+                    = get_AST_node(ast, stack.share, NULL, 0, NULL, NULL,
+                                   current_AST_node->type, parent_scope);
+                *copy = *current_AST_node;
+                copy->next = NULL;
+                copy->shared = 0;
+                current_AST_node = copy;
+            }
             if (current_scope->list_head == NULL)
             {
-                current_scope->list_head = *get_next_search();
+                current_scope->list_head = current_AST_node;
             }
             else
             {
-                current_scope->list_tail->next = *get_next_search();
+                current_scope->list_tail->next = current_AST_node;
             }
-            current_scope->list_tail = *get_next_search();
-            *get_next_search() = current_scope;
-            current_scope->right = NULL;
+            current_scope->list_tail = current_AST_node;
             break;
         default:
-            printf("TODO handle other tokens in parse_lex\n");
-            exit(EXIT_FAILURE);
+            EXIT_ERROR("TODO handle other tokens in parse_lex\n");
         }
-        // printf("Parse %s\n", elem->string.string);
-        // print_AST(AST.root, 0);
     }
     ASSERT(parenthesis_depth == 0, "Unbalanced parenthesis\n");
+
+    // A trailing statement with no semicolon isn't added to the scope, but
+    // if it has an operator at the top it becomes the root
+    reduce_operators(&stack, INT_MIN);
+    if (stack.operand_count > 0)
+    {
+        current_AST_node = pop_operand(&stack, current_scope);
+        if (current_AST_node->type == NodeUnaryOperator
+            || current_AST_node->type == NodeBinaryOperator)
+        {
+            ast->root = current_AST_node;
+        }
+    }
+
+    free(stack.operator);
+    free(stack.operand);
+    free(share.slot);
+}
+
+/**
+ * @brief Build an AST from a stream of tokens
+ * @param tokens The stream of tokens to use to build the AST
+ * @param input_file The file the token stream refers to
+ * @return The root of the AST
+ */
+AST_t *parse_lex(token_stream_t const *tokens, input_file_t const *input_file)
+{
+    source_location_t location = {0, 0, 0};
+    begin_phase(PhaseParse);
+    get_AST();
+    parse_tokens(&AST, AST.scope, tokens, input_file, &location);
+    record_phase_bytes(PhaseParse, input_file->size);
+    record_phase_nodes(PhaseParse, AST.node_count);
+    end_phase(PhaseParse);
+    return &AST;
+}
+
+/**
+ * @brief Build an AST from a stream of tokens, separate from the global one
+ * @param ast The AST to build, which should be zeroed. Deallocate it with
+ * put_standalone_AST.
+ * @param tokens The stream of tokens to use to build the AST
+ * @param input_file The file the token stream refers to
+ * @param location The last location found in the file, which should be
+ * zeroed for a new file
+ * @note This is safe to call for different files on different threads
+ */
+void parse_standalone(AST_t *ast, token_stream_t const *tokens,
+                      input_file_t const *input_file,
+                      source_location_t *location)
+{
+    ast->scope = get_AST_node(ast, NULL, NULL, 0, NULL, NULL, NodeScope, NULL);
+    ast->root = ast->scope;
+    parse_tokens(ast, ast->scope, tokens, input_file, location);
+}
+
+/**
+ * @brief Empty an AST built by parse_standalone, keeping its memory so it can
+ * be passed to parse_standalone again
+ * @param ast The AST to empty
+ */
+void reset_standalone_AST(AST_t *ast)
+{
+    reset_arena(&ast->arena);
+    *ast = (AST_t){NULL, NULL, ast->arena, {0}};
+}
+
+/**
+ * @brief Deallocate an AST built by parse_standalone
+ * @param ast The AST to deallocate
+ */
+void put_standalone_AST(AST_t *ast)
+{
+    put_arena(&ast->arena);
+    *ast = (AST_t){NULL, NULL, {NULL}, {0}};
+}
+
+/**
+ * @brief Start an empty AST for chunks to be spliced into
+ * @return The AST, whose root is the global scope
+ */
+AST_t *get_AST()
+{
+    AST.scope = get_AST_node(&AST, NULL, NULL, 0, NULL, NULL, NodeScope,
+                             NULL);
+    AST.root = AST.scope;
+    return &AST;
+}
+
+/**
+ * @brief Build a separate AST from one chunk of a file's tokens
+ * @param chunk The AST to build, which should be zeroed. Its memory is
+ * released when it is passed to splice_AST_chunk.
+ * @param tokens The stream of tokens for the chunk, which must start a new
+ * statement
+ * @param input_file The file the token stream refers to
+ * @param location The location of the start of the chunk
+ * @note This is safe to call for different chunks on different threads, as
+ * long as get_AST has already been called
+ */
+void parse_chunk(AST_t *chunk, token_stream_t const *tokens,
+                 input_file_t const *input_file, source_location_t *location)
+{
+    chunk->scope = get_AST_node(chunk, NULL, NULL, 0, NULL, NULL, NodeScope,
+                                NULL);
+    chunk->root = chunk->scope;
+    parse_tokens(chunk, AST.scope, tokens, input_file, location);
+
+    // Statements are placed relative to the chunk's scope, but they belong
+    // to the global one
+    for (AST_node_t *node = chunk->scope->list_head; node != NULL;
+         node = node->next)
+    {
+        node->parent_node = AST.scope;
+    }
+}
+
+/**
+ * @brief Append the statements of a chunk to the AST
+ * @param chunk A chunk built by parse_chunk. Chunks must be spliced in the
+ * order they appear in the file.
+ * @return The AST
+ */
+AST_t *splice_AST_chunk(AST_t *chunk)
+{
+    if (chunk->scope->list_head != NULL)
+    {
+        if (AST.scope->list_head == NULL)
+        {
+            AST.scope->list_head = chunk->scope->list_head;
+        }
+        else
+        {
+            AST.scope->list_tail->next = chunk->scope->list_head;
+        }
+        AST.scope->list_tail = chunk->scope->list_tail;
+    }
+
+    // A trailing statement with no semicolon takes over the root, as it
+    // would in parse_lex
+    if (chunk->root != chunk->scope)
+    {
+        AST.root = chunk->root;
+    }
+
+    // The chunk's own scope is dropped, so it isn't counted
+    chunk->node_count[NodeScope] -= 1;
+    for (size_t index = 0; index < NodeUnknown; index++)
+    {
+        AST.node_count[index] += chunk->node_count[index];
+    }
+
+    merge_arena(&AST.arena, &chunk->arena);
+    *chunk = (AST_t){NULL, NULL, {NULL}, {0}};
     return &AST;
 }
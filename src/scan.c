@@ -0,0 +1,236 @@
+/** scan.c
+ * @brief Classifying a block of input bytes at a time
+ *
+ * A block of up to SCAN_BLOCK_SIZE bytes is turned into one bit mask per
+ * class of character, so callers can skip over runs of digits and count
+ * newlines or parenthesis with bit operations rather than a byte at a time.
+ * There are SSE2 and AVX2 versions along with a scalar fallback, and the
+ * fastest one the processor supports is chosen when the program starts.
+ *
+ * STATE: block_scanner
+ */
+
+#include "error_handling.h"
+#include "scan.h"
+
+#include <string.h> // `memcpy`, `memset`
+
+#if defined(__x86_64__)
+#include <immintrin.h> // SSE2 and AVX2 intrinsics
+#endif
+
+typedef void (*block_scanner_t)(char const *data, scan_masks_t *masks);
+
+typedef enum
+{
+    ClassInvalid,
+    ClassDigit,
+    ClassArithmetic,
+    ClassOpen,
+    ClassClose,
+    ClassSemicolon,
+    ClassNewline
+} scan_class_enum;
+
+/**
+ * @brief The scan_class_enum of every byte
+ */
+static uint8_t const scan_class[256] = {
+    ['0' ... '9'] = ClassDigit, ['+'] = ClassArithmetic,
+    ['-'] = ClassArithmetic,    ['*'] = ClassArithmetic,
+    ['/'] = ClassArithmetic,    ['%'] = ClassArithmetic,
+    ['('] = ClassOpen,          [')'] = ClassClose,
+    [';'] = ClassSemicolon,     ['\n'] = ClassNewline,
+};
+
+/**
+ * @brief Classify a whole block a byte at a time
+ * @param[in] data The block, which must be SCAN_BLOCK_SIZE bytes
+ * @param[out] masks The class of every byte
+ */
+static void scan_block_scalar(char const *data, scan_masks_t *masks)
+{
+    uint64_t mask[ClassNewline + 1] = {0};
+    for (size_t index = 0; index < SCAN_BLOCK_SIZE; index++)
+    {
+        mask[scan_class[(unsigned char)data[index]]] |= (uint64_t)1 << index;
+    }
+    masks->digit = mask[ClassDigit];
+    masks->arithmetic = mask[ClassArithmetic];
+    masks->open = mask[ClassOpen];
+    masks->close = mask[ClassClose];
+    masks->semicolon = mask[ClassSemicolon];
+    masks->newline = mask[ClassNewline];
+    masks->invalid = mask[ClassInvalid];
+}
+
+#if defined(__x86_64__)
+
+/**
+ * @brief Classify a whole block 16 bytes at a time
+ * @param[in] data The block, which must be SCAN_BLOCK_SIZE bytes
+ * @param[out] masks The class of every byte
+ */
+__attribute__((target("sse2"))) static void
+scan_block_SSE2(char const *data, scan_masks_t *masks)
+{
+    *masks = (scan_masks_t){0};
+    for (size_t index = 0; index < SCAN_BLOCK_SIZE; index += 16)
+    {
+        __m128i bytes = _mm_loadu_si128((__m128i const *)(data + index));
+#define SCAN_EQUAL(character) \
+    _mm_cmpeq_epi8(bytes, _mm_set1_epi8(character))
+        // Bytes above 0x7f are negative, so they aren't digits either
+        __m128i digit
+            = _mm_and_si128(_mm_cmpgt_epi8(bytes, _mm_set1_epi8('0' - 1)),
+                            _mm_cmpgt_epi8(_mm_set1_epi8('9' + 1), bytes));
+        __m128i arithmetic = _mm_or_si128(
+            _mm_or_si128(SCAN_EQUAL('+'), SCAN_EQUAL('-')),
+            _mm_or_si128(_mm_or_si128(SCAN_EQUAL('*'), SCAN_EQUAL('/')),
+                         SCAN_EQUAL('%')));
+        __m128i open = SCAN_EQUAL('(');
+        __m128i close = SCAN_EQUAL(')');
+        __m128i semicolon = SCAN_EQUAL(';');
+        __m128i newline = SCAN_EQUAL('\n');
+#undef SCAN_EQUAL
+        __m128i valid = _mm_or_si128(
+            _mm_or_si128(_mm_or_si128(digit, arithmetic),
+                         _mm_or_si128(open, close)),
+            _mm_or_si128(semicolon, newline));
+
+        masks->digit |= (uint64_t)(uint16_t)_mm_movemask_epi8(digit)
+                        << index;
+        masks->arithmetic
+            |= (uint64_t)(uint16_t)_mm_movemask_epi8(arithmetic) << index;
+        masks->open |= (uint64_t)(uint16_t)_mm_movemask_epi8(open) << index;
+        masks->close |= (uint64_t)(uint16_t)_mm_movemask_epi8(close)
+                        << index;
+        masks->semicolon
+            |= (uint64_t)(uint16_t)_mm_movemask_epi8(semicolon) << index;
+        masks->newline |= (uint64_t)(uint16_t)_mm_movemask_epi8(newline)
+                          << index;
+        masks->invalid |= (uint64_t)(uint16_t)~_mm_movemask_epi8(valid)
+                          << index;
+    }
+}
+
+/**
+ * @brief Classify a whole block 32 bytes at a time
+ * @param[in] data The block, which must be SCAN_BLOCK_SIZE bytes
+ * @param[out] masks The class of every byte
+ */
+__attribute__((target("avx2"))) static void
+scan_block_AVX2(char const *data, scan_masks_t *masks)
+{
+    *masks = (scan_masks_t){0};
+    for (size_t index = 0; index < SCAN_BLOCK_SIZE; index += 32)
+    {
+        __m256i bytes = _mm256_loadu_si256((__m256i const *)(data + index));
+#define SCAN_EQUAL(character) \
+    _mm256_cmpeq_epi8(bytes, _mm256_set1_epi8(character))
+        // Bytes above 0x7f are negative, so they aren't digits either
+        __m256i digit = _mm256_and_si256(
+            _mm256_cmpgt_epi8(bytes, _mm256_set1_epi8('0' - 1)),
+            _mm256_cmpgt_epi8(_mm256_set1_epi8('9' + 1), bytes));
+        __m256i arithmetic = _mm256_or_si256(
+            _mm256_or_si256(SCAN_EQUAL('+'), SCAN_EQUAL('-')),
+            _mm256_or_si256(_mm256_or_si256(SCAN_EQUAL('*'), SCAN_EQUAL('/')),
+                            SCAN_EQUAL('%')));
+        __m256i open = SCAN_EQUAL('(');
+        __m256i close = SCAN_EQUAL(')');
+        __m256i semicolon = SCAN_EQUAL(';');
+        __m256i newline = SCAN_EQUAL('\n');
+#undef SCAN_EQUAL
+        __m256i valid = _mm256_or_si256(
+            _mm256_or_si256(_mm256_or_si256(digit, arithmetic),
+                            _mm256_or_si256(open, close)),
+            _mm256_or_si256(semicolon, newline));
+
+        masks->digit |= (uint64_t)(uint32_t)_mm256_movemask_epi8(digit)
+                        << index;
+        masks->arithmetic
+            |= (uint64_t)(uint32_t)_mm256_movemask_epi8(arithmetic) << index;
+        masks->open |= (uint64_t)(uint32_t)_mm256_movemask_epi8(open)
+                       << index;
+        masks->close |= (uint64_t)(uint32_t)_mm256_movemask_epi8(close)
+                        << index;
+        masks->semicolon
+            |= (uint64_t)(uint32_t)_mm256_movemask_epi8(semicolon) << index;
+        masks->newline |= (uint64_t)(uint32_t)_mm256_movemask_epi8(newline)
+                          << index;
+        masks->invalid |= (uint64_t)(uint32_t)~_mm256_movemask_epi8(valid)
+                          << index;
+    }
+}
+
+#endif
+
+/**
+ * STATE: The function which classifies whole blocks
+ */
+static block_scanner_t block_scanner = scan_block_scalar;
+
+/**
+ * @brief Choose how blocks are classified
+ * @param[in] scanner The scanner to use, which the processor must support
+ * @note Call this before any threads are started
+ */
+void select_scanner(scanner_enum scanner)
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (scanner == ScannerAuto)
+    {
+        scanner = __builtin_cpu_supports("avx2")   ? ScannerAVX2
+                  : __builtin_cpu_supports("sse2") ? ScannerSSE2
+                                                   : ScannerScalar;
+    }
+    switch (scanner)
+    {
+    case ScannerAVX2:
+        ASSERT(__builtin_cpu_supports("avx2"), "AVX2 is not supported\n");
+        block_scanner = scan_block_AVX2;
+        return;
+    case ScannerSSE2:
+        ASSERT(__builtin_cpu_supports("sse2"), "SSE2 is not supported\n");
+        block_scanner = scan_block_SSE2;
+        return;
+    default:
+        block_scanner = scan_block_scalar;
+        return;
+    }
+#else
+    ASSERT(scanner == ScannerAuto || scanner == ScannerScalar,
+           "Only the scalar scanner is supported\n");
+    block_scanner = scan_block_scalar;
+#endif
+}
+
+/**
+ * @brief Classify every byte in a block
+ * @param[in] data The start of the block
+ * @param[in] size The size of the block, up to SCAN_BLOCK_SIZE
+ * @param[out] masks The class of every byte, with no bits set past size
+ */
+void scan_block(char const *data, size_t size, scan_masks_t *masks)
+{
+    if (size >= SCAN_BLOCK_SIZE)
+    {
+        block_scanner(data, masks);
+        return;
+    }
+
+    char padded[SCAN_BLOCK_SIZE];
+    memcpy(padded, data, size);
+    memset(padded + size, 0, SCAN_BLOCK_SIZE - size);
+    block_scanner(padded, masks);
+
+    uint64_t in_block = ((uint64_t)1 << size) - 1;
+    masks->digit &= in_block;
+    masks->arithmetic &= in_block;
+    masks->open &= in_block;
+    masks->close &= in_block;
+    masks->semicolon &= in_block;
+    masks->newline &= in_block;
+    masks->invalid &= in_block;
+}
@@ -0,0 +1,495 @@
+/** server.c
+ * @brief Compiling files for other processes over a Unix domain socket
+ *
+ * A server listens on a socket and compiles each request as a batch, on a
+ * thread pool which keeps running between requests along with the cache and
+ * the workspaces batches lex and parse into. A request then costs its
+ * compile, rather than the startup and teardown of a process.
+ *
+ * A client sends the files to compile, with its working directory, stdout
+ * and stderr passed as file descriptors. The server opens the files from
+ * that directory and prints to those streams, so the output is the same as
+ * if the client had compiled the files itself. Then the server sends back
+ * the exit code, which the client exits with.
+ *
+ * Files are read into memory rather than mapped, as a client's file being
+ * truncated mid compile would otherwise fault and take the server down.
+ */
+
+#define _GNU_SOURCE // `accept4`, `MSG_CMSG_CLOEXEC`
+
+#include "error_handling.h"
+#include "server.h"
+#include "thread_pool.h"
+
+#include <fcntl.h>        // `open`
+#include <poll.h>         // `poll`
+#include <signal.h>       // `sigset_t`, `pthread_sigmask`
+#include <stdint.h>       // `uint32_t`, `int32_t`
+#include <string.h>       // `memcpy`, `memchr`, `strlen`
+#include <sys/signalfd.h> // `signalfd`
+#include <sys/socket.h>   // `socket`, `accept4`, `sendmsg`, `recvmsg`
+#include <sys/time.h>     // `struct timeval`
+#include <sys/un.h>       // `struct sockaddr_un`
+#include <unistd.h>       // `close`, `unlink`
+
+#define REQUEST_TIMEOUT_SECONDS 10 // How long a client may take to send
+#define SERVER_BACKLOG 128 // Connections which may wait to be accepted
+
+/**
+ * @brief A client being answered
+ */
+typedef struct server_connection_t
+{
+    int socket;
+    evaluate_function_t evaluate;
+    int fd[RequestFdCount]; // What the client sent, or -1
+    FILE *output;           // The stdout of the client, once it is open
+    FILE *error;            // The stderr of the client, once it is open
+    char *arguments;
+    batch_t batch;
+    int exit_code;
+} server_connection_t;
+
+//////////////////////////////////////////////////////////////////////////////
+// Sockets
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Fill in the address of a socket file
+ * @param[out] address The address to fill in
+ * @param[in] path The path of the socket
+ */
+static void get_socket_address(struct sockaddr_un *address, char const *path)
+{
+    if (strlen(path) >= sizeof(address->sun_path))
+    {
+        EXIT_ERROR("Socket path is too long: '%s'\n", path);
+    }
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    memcpy(address->sun_path, path, strlen(path) + 1);
+}
+
+/**
+ * @brief Send all of a buffer over a socket
+ * @param[in] socket The socket to send on
+ * @param[in] data The buffer to send
+ * @param[in] size The size of the buffer
+ */
+static void send_all(int socket, void const *data, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t sent = send(socket, data, size, MSG_NOSIGNAL);
+        ASSERT(sent > 0, "Failed to send over socket\n");
+        data = (char const *)data + sent;
+        size -= (size_t)sent;
+    }
+}
+
+/**
+ * @brief Check whether a server is listening on a socket file
+ * @param[in] address The address of the socket
+ * @return Nonzero if a connection was accepted
+ */
+static int is_socket_live(struct sockaddr_un const *address)
+{
+    int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ASSERT(probe >= 0, "Failed to open socket\n");
+    int is_live = connect(probe, (struct sockaddr const *)address,
+                          sizeof(*address))
+                  == 0;
+    ASSERT(close(probe) == 0, "Failed to close socket\n");
+    errno = 0;
+    return is_live;
+}
+
+/**
+ * @brief Listen on a socket file, replacing it if no server is using it
+ * @param[in] path The path of the socket
+ * @return The listening socket
+ * @note A server which is killed leaves its socket file behind, so a file
+ * which refuses connections is taken to be left over
+ */
+static int listen_on_socket(char const *path)
+{
+    struct sockaddr_un address;
+    get_socket_address(&address, path);
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ASSERT(listener >= 0, "Failed to open socket\n");
+
+    int is_bound
+        = bind(listener, (struct sockaddr const *)&address, sizeof(address))
+          == 0;
+    if (!is_bound && errno == EADDRINUSE)
+    {
+        errno = 0;
+        if (is_socket_live(&address))
+        {
+            EXIT_ERROR("Another server is listening on '%s'\n", path);
+        }
+        ASSERT(unlink(path) == 0, "Failed to remove '%s'\n", path);
+        is_bound = bind(listener, (struct sockaddr const *)&address,
+                        sizeof(address))
+                   == 0;
+    }
+    ASSERT(is_bound, "Failed to bind socket '%s'\n", path);
+    ASSERT(listen(listener, SERVER_BACKLOG) == 0,
+           "Failed to listen on socket '%s'\n", path);
+    return listener;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Server
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Receive the header and file descriptors of a request
+ * @param[in,out] connection The connection to receive on
+ * @param[out] header Where to store the header
+ * @return Nonzero if there is a request, or 0 if the client closed the
+ * connection without sending one, as a check for a live server does
+ */
+static int receive_header(server_connection_t *connection,
+                           request_header_t *header)
+{
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(int) * RequestFdCount)];
+        struct cmsghdr align;
+    } control;
+    struct iovec vector = {header, sizeof(*header)};
+    struct msghdr message = {0};
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+
+    ssize_t size = recvmsg(connection->socket, &message,
+                           MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    if (size == 0)
+    {
+        return 0;
+    }
+    ASSERT(size >= 0, "Failed to receive request\n");
+    if (size != (ssize_t)sizeof(*header))
+    {
+        EXIT_ERROR("Request was cut short\n");
+    }
+
+    for (struct cmsghdr *item = CMSG_FIRSTHDR(&message); item != NULL;
+         item = CMSG_NXTHDR(&message, item))
+    {
+        if (item->cmsg_level == SOL_SOCKET && item->cmsg_type == SCM_RIGHTS
+            && item->cmsg_len == CMSG_LEN(sizeof(connection->fd)))
+        {
+            memcpy(connection->fd, CMSG_DATA(item), sizeof(connection->fd));
+        }
+    }
+    if ((message.msg_flags & MSG_CTRUNC)
+        || connection->fd[RequestFdCount - 1] < 0)
+    {
+        EXIT_ERROR("Request is missing its file descriptors\n");
+    }
+    if (header->magic != REQUEST_MAGIC)
+    {
+        EXIT_ERROR("Request is not from attis\n");
+    }
+    return 1;
+}
+
+/**
+ * @brief Receive a request, compile its files and print the results to the
+ * client, as a trapped function
+ * @param[in,out] argument The server_connection_t to answer
+ */
+static void answer_request(void *argument)
+{
+    server_connection_t *connection = argument;
+    request_header_t header;
+    if (!receive_header(connection, &header))
+    {
+        return;
+    }
+
+    FILE *output = fdopen(connection->fd[RequestOutput], "w");
+    ASSERT(output != NULL, "Failed to open client stdout\n");
+    connection->fd[RequestOutput] = -1;
+    FILE *error = fdopen(connection->fd[RequestError], "w");
+    if (error == NULL)
+    {
+        fclose(output);
+    }
+    ASSERT(error != NULL, "Failed to open client stderr\n");
+    connection->fd[RequestError] = -1;
+    setvbuf(error, NULL, _IONBF, 0); // As stderr is
+    connection->output = output;
+    connection->error = error;
+
+    if (header.argument_count == 0
+        || header.argument_size > REQUEST_ARGUMENT_LIMIT)
+    {
+        EXIT_ERROR("Request has too few or too many arguments\n");
+    }
+    connection->arguments = malloc(header.argument_size);
+    ASSERT(connection->arguments != NULL, "Failed to allocate request\n");
+    ssize_t size = recv(connection->socket, connection->arguments,
+                        header.argument_size, MSG_WAITALL);
+    ASSERT(size >= 0, "Failed to receive request\n");
+    if (size != (ssize_t)header.argument_size)
+    {
+        EXIT_ERROR("Request was cut short\n");
+    }
+
+    connection->batch.directory = connection->fd[RequestDirectory];
+    connection->batch.is_read = 1;
+    char const *next = connection->arguments;
+    char const *end = connection->arguments + header.argument_size;
+    for (uint32_t index = 0; index < header.argument_count; index++)
+    {
+        char const *terminator = memchr(next, '\0', (size_t)(end - next));
+        if (terminator == NULL)
+        {
+            EXIT_ERROR("Request arguments are malformed\n");
+        }
+        add_file_to_batch(&connection->batch, next);
+        next = terminator + 1;
+    }
+    connection->exit_code = compile_batch(
+        &connection->batch, connection->evaluate, connection->output,
+        connection->error);
+}
+
+/**
+ * @brief Answer a client and close the connection, as a task
+ * @param[in,out] argument The server_connection_t to answer, which is freed
+ * @note Errors in a request are printed to the client if its streams were
+ * received, or else to the server's own
+ */
+static void serve_connection_task(void *argument)
+{
+    server_connection_t *connection = argument;
+    error_capture_t capture;
+    capture_errors(&capture, answer_request, connection);
+    if (capture.failed)
+    {
+        if (connection->output != NULL)
+        {
+            fflush(connection->output); // Keep errors in order
+            write_captured_errors(&capture, connection->output,
+                                  connection->error);
+        }
+        else
+        {
+            print_captured_errors(&capture);
+        }
+        connection->exit_code = capture.exit_code;
+    }
+    put_error_capture(&capture);
+
+    if (connection->output != NULL)
+    { // The client exits once it has its exit code, so output goes first
+        fclose(connection->output);
+        fclose(connection->error);
+        int32_t exit_code = connection->exit_code;
+        // A client which has gone away has nothing to be told
+        (void)send(connection->socket, &exit_code, sizeof(exit_code),
+                   MSG_NOSIGNAL);
+    }
+
+    for (size_t index = 0; index < RequestFdCount; index++)
+    {
+        if (connection->fd[index] >= 0)
+        {
+            close(connection->fd[index]);
+        }
+    }
+    put_batch_files(&connection->batch);
+    free(connection->arguments);
+    close(connection->socket);
+    free(connection);
+    errno = 0;
+}
+
+/**
+ * @brief Accept a client and queue it to be answered
+ * @param[in] listener The listening socket
+ * @param[in] evaluate The function to evaluate each file's AST with
+ * @param[in,out] group The group of connections being answered
+ */
+static void accept_connection(int listener, evaluate_function_t evaluate,
+                              task_group_t *group)
+{
+    int client = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+    if (client < 0 && (errno == EINTR || errno == ECONNABORTED))
+    { // The client gave up before it was accepted
+        errno = 0;
+        return;
+    }
+    ASSERT(client >= 0, "Failed to accept connection\n");
+
+    // A client which stalls mid request only holds up its own thread for
+    // so long
+    struct timeval timeout = {REQUEST_TIMEOUT_SECONDS, 0};
+    ASSERT(setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+                      sizeof(timeout))
+               == 0,
+           "Failed to set socket timeout\n");
+
+    server_connection_t *connection = calloc(1, sizeof(*connection));
+    ASSERT(connection != NULL, "Failed to allocate connection\n");
+    connection->socket = client;
+    connection->evaluate = evaluate;
+    for (size_t index = 0; index < RequestFdCount; index++)
+    {
+        connection->fd[index] = -1;
+    }
+    submit_task(group, serve_connection_task, connection);
+}
+
+/**
+ * @brief Compile requests from clients until interrupted or terminated
+ * @param[in] socket_path The socket file to listen on
+ * @param[in] thread_count The number of threads to compile requests on,
+ * besides the one accepting them
+ * @param[in] evaluate The function to evaluate each file's AST with
+ * @note Requests are compiled concurrently, each as a task on the thread
+ * pool, and the files of each request are compiled as tasks too. On SIGINT
+ * or SIGTERM the socket is removed and requests in progress are finished.
+ */
+void serve_requests(char const *socket_path, size_t thread_count,
+                    evaluate_function_t evaluate)
+{
+    // The signals are blocked before the workers start, so that they are
+    // only seen through the signalfd
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    ASSERT(pthread_sigmask(SIG_BLOCK, &signals, NULL) == 0,
+           "Failed to block signals\n");
+    int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+    ASSERT(signal_fd >= 0, "Failed to open signalfd\n");
+    // Clients can close their streams at any time, which is their concern
+    signal(SIGPIPE, SIG_IGN);
+
+    int listener = listen_on_socket(socket_path);
+    get_thread_pool(thread_count + 1);
+
+    task_group_t group = {0};
+    struct pollfd poll_fd[2] = {
+        {listener, POLLIN, 0},
+        {signal_fd, POLLIN, 0},
+    };
+    while (poll_fd[1].revents == 0)
+    {
+        if (poll(poll_fd, 2, -1) < 0)
+        {
+            ASSERT(errno == EINTR, "Failed to wait for connections\n");
+            errno = 0;
+        }
+        else if (poll_fd[0].revents != 0)
+        {
+            accept_connection(listener, evaluate, &group);
+        }
+    }
+
+    ASSERT(close(listener) == 0, "Failed to close socket\n");
+    ASSERT(unlink(socket_path) == 0, "Failed to remove '%s'\n", socket_path);
+    wait_task_group(&group);
+    ASSERT(close(signal_fd) == 0, "Failed to close signalfd\n");
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Client
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Ask a server to compile files, as if they were given to this
+ * process
+ * @param[in] socket_path The socket file the server listens on
+ * @param[in] argument_count The number of input files
+ * @param[in] arguments The input files, or '@' followed by a file listing
+ * input files
+ * @return The exit code of the request
+ */
+int send_request(char const *socket_path, int argument_count,
+                 char *const arguments[])
+{
+    if (argument_count <= 0)
+    {
+        EXIT_ERROR("No input files given\n");
+    }
+    size_t argument_size = 0;
+    for (int index = 0; index < argument_count; index++)
+    {
+        argument_size += strlen(arguments[index]) + 1;
+    }
+    if (argument_size > REQUEST_ARGUMENT_LIMIT)
+    {
+        EXIT_ERROR("Too many input files for one request\n");
+    }
+    char *buffer = malloc(argument_size);
+    ASSERT(buffer != NULL, "Failed to allocate request\n");
+    char *next = buffer;
+    for (int index = 0; index < argument_count; index++)
+    {
+        size_t length = strlen(arguments[index]) + 1;
+        memcpy(next, arguments[index], length);
+        next += length;
+    }
+
+    struct sockaddr_un address;
+    get_socket_address(&address, socket_path);
+    int server = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    ASSERT(server >= 0, "Failed to open socket\n");
+    ASSERT(connect(server, (struct sockaddr const *)&address,
+                   sizeof(address))
+               == 0,
+           "Failed to connect to a server on '%s'\n", socket_path);
+
+    int fd[RequestFdCount];
+    fd[RequestDirectory] = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    ASSERT(fd[RequestDirectory] >= 0,
+           "Failed to open the working directory\n");
+    fd[RequestOutput] = STDOUT_FILENO;
+    fd[RequestError] = STDERR_FILENO;
+
+    union
+    {
+        char buffer[CMSG_SPACE(sizeof(fd))];
+        struct cmsghdr align;
+    } control;
+    request_header_t header = {REQUEST_MAGIC, (uint32_t)argument_count,
+                               (uint32_t)argument_size};
+    struct iovec vector = {&header, sizeof(header)};
+    struct msghdr message = {0};
+    message.msg_iov = &vector;
+    message.msg_iovlen = 1;
+    message.msg_control = control.buffer;
+    message.msg_controllen = sizeof(control.buffer);
+    struct cmsghdr *item = CMSG_FIRSTHDR(&message);
+    item->cmsg_level = SOL_SOCKET;
+    item->cmsg_type = SCM_RIGHTS;
+    item->cmsg_len = CMSG_LEN(sizeof(fd));
+    memcpy(CMSG_DATA(item), fd, sizeof(fd));
+    ASSERT(sendmsg(server, &message, MSG_NOSIGNAL) == (ssize_t)sizeof(header),
+           "Failed to send request\n");
+    send_all(server, buffer, argument_size);
+    free(buffer);
+    ASSERT(close(fd[RequestDirectory]) == 0, "Failed to close directory\n");
+
+    int32_t exit_code;
+    ssize_t size = recv(server, &exit_code, sizeof(exit_code), MSG_WAITALL);
+    ASSERT(size >= 0, "Failed to receive an answer from '%s'\n",
+           socket_path);
+    if (size != (ssize_t)sizeof(exit_code))
+    {
+        EXIT_ERROR("The server on '%s' closed the connection without an "
+                   "answer\n",
+                   socket_path);
+    }
+    ASSERT(close(server) == 0, "Failed to close socket\n");
+    return exit_code;
+}
@@ -0,0 +1,604 @@
+/** stats.c
+ * @brief Timing and counting each phase of a compile for --stats
+ *
+ * A phase is measured by taking a snapshot of the clocks, the allocation
+ * counters and the hardware counters when it begins and again when it ends.
+ * Only one phase is measured at a time, on the thread which enabled stats,
+ * so phases begun inside another, or on other threads, are ignored. The
+ * same phase may be entered more than once, and adds up.
+ *
+ * Heap allocations are counted by wrapping malloc, calloc and realloc at
+ * link time, along with each block an arena maps.
+ *
+ * STATE: stats, counter_fd, allocations, allocated_bytes
+ */
+
+#include "error_handling.h"
+#include "stats.h"
+
+#include <linux/perf_event.h> // `perf_event_attr`
+#include <stdatomic.h>        // `atomic_size_t`
+#include <stdint.h>           // `uint64_t`
+#include <string.h>           // `memset`
+#include <sys/resource.h>     // `getrusage`
+#include <sys/syscall.h>      // `SYS_perf_event_open`
+#include <time.h>             // `clock_gettime`
+#include <unistd.h>           // `syscall`, `read`, `close`
+
+typedef enum
+{
+    CounterCycles,
+    CounterInstructions,
+    CounterCacheMisses,
+    CounterBranchMisses,
+    CounterCount
+} counter_enum;
+
+/**
+ * @brief The clocks and counters at a point in time
+ */
+typedef struct stats_snapshot_t
+{
+    double wall_seconds;
+    double cpu_seconds; // For every thread in the process
+    size_t allocations;
+    size_t allocated_bytes;
+    uint64_t counter[CounterCount];
+} stats_snapshot_t;
+
+/**
+ * @brief Everything measured for a phase
+ */
+typedef struct phase_stats_t
+{
+    int entered;
+    double wall_seconds;
+    double cpu_seconds;
+    size_t bytes;  // The bytes of input consumed
+    size_t tokens; // The tokens produced
+    size_t node_count[NodeUnknown];
+    size_t allocations;
+    size_t allocated_bytes;
+    long peak_rss_kb; // The peak for the process by the end of the phase
+    uint64_t counter[CounterCount];
+} phase_stats_t;
+
+typedef struct stats_t
+{
+    stats_format_enum format;
+    int measuring;                // Nonzero while a phase is being measured
+    phase_enum open_phase;        // The phase being measured
+    stats_snapshot_t start;       // When stats were enabled
+    stats_snapshot_t phase_start; // When the open phase began
+    phase_stats_t phase[PhaseCount];
+} stats_t;
+
+/**
+ * STATE: Everything measured so far
+ */
+static stats_t stats = {0};
+
+/**
+ * STATE: The hardware counters, or -1 for any the kernel doesn't allow
+ */
+static int counter_fd[CounterCount] = {-1, -1, -1, -1};
+
+/**
+ * STATE: The number of heap allocations, and the bytes they asked for
+ */
+static atomic_size_t allocations = 0;
+static atomic_size_t allocated_bytes = 0;
+
+/**
+ * @brief Nonzero on the thread which enabled stats
+ */
+static _Thread_local int is_stats_thread = 0;
+
+static char const *const phase_name[PhaseCount] = {
+    "read", "lex", "parse", "fold", "evaluate", "batch", "stream", "emit",
+    "cache", "watch",
+};
+
+static char const *const node_type_name[NodeUnknown] = {
+    "unary", "binary", "parenthesis", "literal", "constant", "scope",
+};
+
+static char const *const counter_name[CounterCount] = {
+    "cycles",
+    "instructions",
+    "cache_misses",
+    "branch_misses",
+};
+
+static uint64_t const counter_config[CounterCount] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+//////////////////////////////////////////////////////////////////////////////
+// Measuring
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Read a clock
+ * @param[in] clock The clock to read
+ * @return The time in seconds
+ */
+static double get_clock(clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Take a snapshot of the clocks and counters
+ * @param[out] snapshot The snapshot
+ */
+static void get_snapshot(stats_snapshot_t *snapshot)
+{
+    snapshot->wall_seconds = get_clock(CLOCK_MONOTONIC);
+    snapshot->cpu_seconds = get_clock(CLOCK_PROCESS_CPUTIME_ID);
+    snapshot->allocations
+        = atomic_load_explicit(&allocations, memory_order_relaxed);
+    snapshot->allocated_bytes
+        = atomic_load_explicit(&allocated_bytes, memory_order_relaxed);
+    for (size_t index = 0; index < CounterCount; index++)
+    {
+        uint64_t value = 0;
+        if (counter_fd[index] >= 0
+            && read(counter_fd[index], &value, sizeof(value))
+                   != sizeof(value))
+        {
+            value = 0;
+        }
+        snapshot->counter[index] = value;
+    }
+}
+
+/**
+ * @brief Add the difference between two snapshots to a phase
+ * @param[in,out] phase The phase to add to
+ * @param[in] begin The earlier snapshot
+ * @param[in] end The later snapshot
+ */
+static void add_snapshot_difference(phase_stats_t *phase,
+                                    stats_snapshot_t const *begin,
+                                    stats_snapshot_t const *end)
+{
+    phase->wall_seconds += end->wall_seconds - begin->wall_seconds;
+    phase->cpu_seconds += end->cpu_seconds - begin->cpu_seconds;
+    phase->allocations += end->allocations - begin->allocations;
+    phase->allocated_bytes += end->allocated_bytes - begin->allocated_bytes;
+    for (size_t index = 0; index < CounterCount; index++)
+    {
+        phase->counter[index] += end->counter[index] - begin->counter[index];
+    }
+
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+        phase->peak_rss_kb = usage.ru_maxrss;
+    }
+}
+
+/**
+ * @brief Open a hardware counter for the calling thread
+ * @param[in] config The PERF_COUNT_HW_* event to count
+ * @return The counter, or -1 if the kernel doesn't allow it
+ */
+static int open_counter(uint64_t config)
+{
+    struct perf_event_attr attribute;
+    memset(&attribute, 0, sizeof(attribute));
+    attribute.size = sizeof(attribute);
+    attribute.type = PERF_TYPE_HARDWARE;
+    attribute.config = config;
+    attribute.exclude_kernel = 1;
+    attribute.exclude_hv = 1;
+
+    int fd = (int)syscall(SYS_perf_event_open, &attribute, 0, -1, -1, 0);
+    if (fd < 0)
+    {
+        errno = 0; // Counters are optional, so this isn't an error
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Start measuring, from this thread
+ * @param[in] format How print_stats should print what was measured
+ * @note Hardware counters only count this thread
+ */
+void enable_stats(stats_format_enum format)
+{
+    stats.format = format;
+    is_stats_thread = 1;
+    for (size_t index = 0; index < CounterCount; index++)
+    {
+        counter_fd[index] = open_counter(counter_config[index]);
+    }
+    get_snapshot(&stats.start);
+}
+
+/**
+ * @brief Start measuring a phase
+ * @param[in] phase The phase which is starting
+ * @note This does nothing if stats are off, another phase is being measured
+ * or this isn't the thread which enabled stats
+ */
+void begin_phase(phase_enum phase)
+{
+    if (stats.format == StatsOff || !is_stats_thread || stats.measuring)
+    {
+        return;
+    }
+    stats.measuring = 1;
+    stats.open_phase = phase;
+    stats.phase[phase].entered = 1;
+    get_snapshot(&stats.phase_start);
+}
+
+/**
+ * @brief Stop measuring a phase
+ * @param[in] phase The phase which is ending
+ */
+void end_phase(phase_enum phase)
+{
+    if (stats.format == StatsOff || !is_stats_thread || !stats.measuring
+        || stats.open_phase != phase)
+    {
+        return;
+    }
+    stats_snapshot_t end;
+    get_snapshot(&end);
+    add_snapshot_difference(&stats.phase[phase], &stats.phase_start, &end);
+    stats.measuring = 0;
+}
+
+/**
+ * @brief Add to the bytes of input a phase consumed
+ */
+void record_phase_bytes(phase_enum phase, size_t bytes)
+{
+    if (stats.format != StatsOff && is_stats_thread)
+    {
+        stats.phase[phase].bytes += bytes;
+    }
+}
+
+/**
+ * @brief Add to the tokens a phase produced
+ */
+void record_phase_tokens(phase_enum phase, size_t tokens)
+{
+    if (stats.format != StatsOff && is_stats_thread)
+    {
+        stats.phase[phase].tokens += tokens;
+    }
+}
+
+/**
+ * @brief Add to the AST nodes a phase created
+ * @param[in] phase The phase which created the nodes
+ * @param[in] node_count The number of nodes of each node_type_enum
+ */
+void record_phase_nodes(phase_enum phase, size_t const node_count[])
+{
+    if (stats.format != StatsOff && is_stats_thread)
+    {
+        for (size_t index = 0; index < NodeUnknown; index++)
+        {
+            stats.phase[phase].node_count[index] += node_count[index];
+        }
+    }
+}
+
+/**
+ * @brief Count a heap allocation
+ * @param[in] size The bytes asked for
+ * @note This is safe to call from any thread
+ */
+void record_allocation(size_t size)
+{
+    if (stats.format != StatsOff)
+    {
+        atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&allocated_bytes, size,
+                                  memory_order_relaxed);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Allocation Wrappers
+//////////////////////////////////////////////////////////////////////////////
+
+// These replace malloc, calloc and realloc when linked with
+// -Wl,--wrap=malloc,--wrap=calloc,--wrap=realloc
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *pointer, size_t size);
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t count, size_t size);
+void *__wrap_realloc(void *pointer, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+    record_allocation(size);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    record_allocation(count * size);
+    return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *pointer, size_t size)
+{
+    record_allocation(size);
+    return __real_realloc(pointer, size);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Printing
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Get everything measured since stats were enabled
+ * @param[out] total The totals
+ */
+static void get_total(phase_stats_t *total)
+{
+    *total = (phase_stats_t){0};
+    stats_snapshot_t now;
+    get_snapshot(&now);
+    add_snapshot_difference(total, &stats.start, &now);
+    for (size_t phase = 0; phase < PhaseCount; phase++)
+    {
+        // Phases read the same input, so the total is the most any read
+        if (stats.phase[phase].bytes > total->bytes)
+        {
+            total->bytes = stats.phase[phase].bytes;
+        }
+        total->tokens += stats.phase[phase].tokens;
+        for (size_t index = 0; index < NodeUnknown; index++)
+        {
+            total->node_count[index] += stats.phase[phase].node_count[index];
+        }
+    }
+}
+
+/**
+ * @brief Check whether any hardware counter could be opened
+ */
+static int have_counters(void)
+{
+    for (size_t index = 0; index < CounterCount; index++)
+    {
+        if (counter_fd[index] >= 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Check whether a phase created any AST nodes
+ */
+static int has_nodes(phase_stats_t const *phase)
+{
+    for (size_t index = 0; index < NodeUnknown; index++)
+    {
+        if (phase->node_count[index] != 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Print a phase as a JSON object
+ * @param[in] output The stream to print to
+ * @param[in] name The name of the phase
+ * @param[in] phase What was measured
+ */
+static void print_phase_JSON(FILE *output, char const *name,
+                             phase_stats_t const *phase)
+{
+    fprintf(output,
+            "{\"phase\": \"%s\", \"wall_ms\": %.3f, \"cpu_ms\": %.3f, "
+            "\"bytes\": %zu, \"tokens\": %zu, \"nodes\": {",
+            name, phase->wall_seconds * 1e3, phase->cpu_seconds * 1e3,
+            phase->bytes, phase->tokens);
+    for (size_t index = 0; index < NodeUnknown; index++)
+    {
+        fprintf(output, "%s\"%s\": %zu", index == 0 ? "" : ", ",
+                node_type_name[index], phase->node_count[index]);
+    }
+    fprintf(output,
+            "}, \"allocations\": %zu, \"allocated_bytes\": %zu, "
+            "\"peak_rss_kb\": %ld",
+            phase->allocations, phase->allocated_bytes, phase->peak_rss_kb);
+    for (size_t index = 0; index < CounterCount; index++)
+    {
+        if (counter_fd[index] >= 0)
+        {
+            fprintf(output, ", \"%s\": %llu", counter_name[index],
+                    (unsigned long long)phase->counter[index]);
+        }
+        else
+        {
+            fprintf(output, ", \"%s\": null", counter_name[index]);
+        }
+    }
+    fprintf(output, "}");
+}
+
+/**
+ * @brief Print everything measured as a single line of JSON
+ * @param[in] output The stream to print to
+ * @param[in] total The totals
+ */
+static void print_stats_JSON(FILE *output, phase_stats_t const *total)
+{
+    fprintf(output, "{\"phases\": [");
+    int first = 1;
+    for (size_t phase = 0; phase < PhaseCount; phase++)
+    {
+        if (stats.phase[phase].entered)
+        {
+            fprintf(output, "%s", first ? "" : ", ");
+            print_phase_JSON(output, phase_name[phase], &stats.phase[phase]);
+            first = 0;
+        }
+    }
+    fprintf(output, "], \"total\": ");
+    print_phase_JSON(output, "total", total);
+    fprintf(output, "}\n");
+}
+
+/**
+ * @brief Print a row of the text tables for a phase
+ * @param[in] output The stream to print to
+ * @param[in] name The name of the phase
+ * @param[in] phase What was measured
+ * @param[in] table Which table the row is for
+ */
+static void print_phase_text(FILE *output, char const *name,
+                             phase_stats_t const *phase, int table)
+{
+    fprintf(output, "%-9s", name);
+    switch (table)
+    {
+    case 0:
+        fprintf(output, " %10.3f %10.3f %12zu %12zu %12zu %14zu %12ld\n",
+                phase->wall_seconds * 1e3, phase->cpu_seconds * 1e3,
+                phase->bytes, phase->tokens, phase->allocations,
+                phase->allocated_bytes, phase->peak_rss_kb);
+        break;
+    case 1:
+        for (size_t index = 0; index < NodeUnknown; index++)
+        {
+            fprintf(output, " %12zu", phase->node_count[index]);
+        }
+        fprintf(output, "\n");
+        break;
+    default:
+        for (size_t index = 0; index < CounterCount; index++)
+        {
+            fprintf(output, " %14llu",
+                    (unsigned long long)phase->counter[index]);
+        }
+        fprintf(output, "\n");
+        break;
+    }
+}
+
+/**
+ * @brief Print everything measured as tables
+ * @param[in] output The stream to print to
+ * @param[in] total The totals
+ */
+static void print_stats_text(FILE *output, phase_stats_t const *total)
+{
+    for (int table = 0; table < 3; table++)
+    {
+        if (table == 2 && !have_counters())
+        {
+            fprintf(output, "Hardware counters are unavailable\n");
+            break;
+        }
+        fprintf(output, "%-9s", "phase");
+        switch (table)
+        {
+        case 0:
+            fprintf(output, " %10s %10s %12s %12s %12s %14s %12s\n",
+                    "wall ms", "CPU ms", "bytes", "tokens", "allocations",
+                    "alloc bytes", "peak RSS KB");
+            break;
+        case 1:
+            for (size_t index = 0; index < NodeUnknown; index++)
+            {
+                fprintf(output, " %12s", node_type_name[index]);
+            }
+            fprintf(output, "\n");
+            break;
+        default:
+            for (size_t index = 0; index < CounterCount; index++)
+            {
+                fprintf(output, " %14s", counter_name[index]);
+            }
+            fprintf(output, "\n");
+            break;
+        }
+        for (size_t phase = 0; phase < PhaseCount; phase++)
+        {
+            // Only a few phases create nodes, so the rest are left out
+            if (stats.phase[phase].entered
+                && (table != 1 || has_nodes(&stats.phase[phase])))
+            {
+                print_phase_text(output, phase_name[phase],
+                                 &stats.phase[phase], table);
+            }
+        }
+        print_phase_text(output, "total", total, table);
+    }
+}
+
+/**
+ * @brief Print everything measured, in the format stats were enabled with
+ * @param[in] output The stream to print to
+ */
+void print_stats(FILE *output)
+{
+    if (stats.format == StatsOff)
+    {
+        return;
+    }
+    phase_stats_t total;
+    get_total(&total);
+    if (stats.format == StatsJSON)
+    {
+        print_stats_JSON(output, &total);
+    }
+    else
+    {
+        print_stats_text(output, &total);
+    }
+}
+
+/**
+ * @brief Forget everything measured so far, and measure again from now
+ * @note This is for long running modes, which print stats for each piece of
+ * work rather than once at exit
+ */
+void reset_stats()
+{
+    if (stats.format == StatsOff || !is_stats_thread || stats.measuring)
+    {
+        return;
+    }
+    memset(stats.phase, 0, sizeof(stats.phase));
+    get_snapshot(&stats.start);
+}
+
+/**
+ * @brief Close the hardware counters
+ */
+void put_stats()
+{
+    for (size_t index = 0; index < CounterCount; index++)
+    {
+        if (counter_fd[index] >= 0)
+        {
+            close(counter_fd[index]);
+        }
+        counter_fd[index] = -1;
+    }
+}
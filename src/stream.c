@@ -0,0 +1,103 @@
+/** stream.c
+ * @brief Lexing, parsing and evaluating a file one statement at a time
+ *
+ * Each statement is cut from the file at its semicolon, then lexed, parsed
+ * and evaluated before the next is read. The token stream and the AST are
+ * emptied and reused for every statement, so memory is bounded by the
+ * largest statement rather than the size of the file. Pages of a mapped file
+ * are dropped once every statement in them is done.
+ *
+ * A semicolon is never valid inside parenthesis, so the next semicolon in the
+ * file always ends the current statement.
+ */
+
+#include "error_handling.h"
+#include "stats.h"
+#include "stream.h"
+
+#include <string.h>   // `memchr`
+#include <sys/mman.h> // `madvise`
+#include <unistd.h>   // `sysconf`
+
+#define STREAM_RELEASE_SIZE ((size_t)1 << 24) // Bytes read between drops
+
+/**
+ * @brief Drop the pages of a mapped file which have been read
+ * @param[in] input_file The mapped file
+ * @param[in] released The offset every page before has already been dropped
+ * @param[in] offset The offset every byte before has been read
+ * @return The offset every page before has now been dropped
+ */
+static size_t release_pages(input_file_t const *input_file, size_t released,
+                            size_t offset)
+{
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t page_end = offset & ~(page_size - 1);
+    if (page_end > released)
+    {
+        // This is only advice, and the pages are read back in if touched
+        (void)madvise((char *)(uintptr_t)input_file->data + released,
+                      page_end - released, MADV_DONTNEED);
+        errno = 0;
+        released = page_end;
+    }
+    return released;
+}
+
+/**
+ * @brief Lex, parse and evaluate a file one statement at a time
+ * @param[in] input_file The file to read
+ * @param[in] evaluate The function to evaluate each statement's AST with
+ * @param[in] output Where to print each result
+ */
+void stream_file(input_file_t const *input_file, evaluate_function_t evaluate,
+                 FILE *output)
+{
+    token_stream_t tokens = {NULL, NULL, NULL, NULL, 0, 0};
+    AST_t ast = {NULL, NULL, {NULL}, {0}};
+    source_location_t location = {0, 0, 0};
+    size_t statement_count = 0;
+    size_t released = 0;
+
+    begin_phase(PhaseStream);
+    size_t begin = 0;
+    while (begin < input_file->size)
+    {
+        char const *semicolon = memchr(input_file->data + begin, ';',
+                                       input_file->size - begin);
+        size_t end = semicolon == NULL
+                         ? input_file->size
+                         : (size_t)(semicolon - input_file->data) + 1;
+
+        reset_token_chunk(&tokens);
+        lex_chunk(&tokens, input_file, begin, end);
+        record_phase_tokens(PhaseStream, tokens.token_count);
+
+        reset_standalone_AST(&ast);
+        parse_standalone(&ast, &tokens, input_file, &location);
+        record_phase_nodes(PhaseStream, ast.node_count);
+
+        // Empty statements are skipped, as they are by the parser
+        if (ast.root != ast.scope || ast.scope->list_head != NULL)
+        {
+            evaluate(&ast, output);
+            fflush(output); // Keep answers in order with later errors
+            statement_count += 1;
+        }
+
+        begin = end;
+        if (input_file->is_mapped && begin - released >= STREAM_RELEASE_SIZE)
+        {
+            released = release_pages(input_file, released, begin);
+        }
+    }
+    record_phase_bytes(PhaseStream, input_file->size);
+    end_phase(PhaseStream);
+
+    put_token_chunk(&tokens);
+    put_standalone_AST(&ast);
+    if (statement_count == 0)
+    {
+        EXIT_ERROR("No statements to evaluate\n");
+    }
+}
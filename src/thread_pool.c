@@ -0,0 +1,386 @@
+/** thread_pool.c
+ * @brief A work stealing pool of worker threads
+ *
+ * Each worker owns a deque of tasks. Workers push and pop their own tasks at
+ * the bottom, so recently submitted (and likely cache hot) work runs first,
+ * and steal the oldest task from the top of another worker's deque when
+ * their own is empty. Threads outside the pool spread their tasks across
+ * the workers. A thread waiting on a group helps run that group's tasks,
+ * and sleeps once the rest of them are running elsewhere, so it never picks
+ * up unrelated work which could keep it from returning.
+ *
+ * STATE: thread_pool, worker_index
+ */
+
+#include "error_handling.h"
+#include "thread_pool.h"
+
+#include <pthread.h> // `pthread_create`, `pthread_join`, `pthread_mutex_t`
+
+typedef struct task_deque_t
+{
+    pthread_mutex_t lock;
+    task_t *task;         // A ring buffer of tasks
+    size_t reserve_space; // Always a power of two
+    size_t top;           // The oldest task, which thieves take
+    size_t bottom;        // One past the newest task, which the owner takes
+} task_deque_t;
+
+typedef struct thread_pool_t
+{
+    pthread_t *thread;
+    size_t worker_count;
+    task_deque_t *deque; // One per worker, or one in total with no workers
+    size_t deque_count;
+    atomic_size_t queued;     // The number of tasks in all of the deques
+    atomic_size_t next_deque; // Where outside threads submit to next
+    pthread_mutex_t sleep_lock;
+    pthread_cond_t wake;     // Signalled when a task is queued
+    pthread_cond_t finished; // Broadcast when a group's last task finishes
+    int stopping;
+} thread_pool_t;
+
+/**
+ * STATE: This holds the worker threads and their tasks
+ */
+static thread_pool_t thread_pool
+    = {NULL, 0, NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER,
+       PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, 0};
+
+/**
+ * STATE: The deque owned by this thread, or SIZE_MAX outside the pool
+ */
+static _Thread_local size_t worker_index = SIZE_MAX;
+
+//////////////////////////////////////////////////////////////////////////////
+// Deques
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Add a task to the bottom of a deque
+ * @param[in,out] deque The deque to add to
+ * @param[in] task The task to add
+ */
+static void push_task(task_deque_t *deque, task_t const *task)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom - deque->top == deque->reserve_space)
+    {
+        size_t reserve_space
+            = deque->reserve_space == 0 ? 64 : deque->reserve_space * 2;
+        task_t *tasks = malloc(reserve_space * sizeof(*tasks));
+        ASSERT(tasks != NULL, "Failed to allocate task deque\n");
+        for (size_t index = deque->top; index != deque->bottom; index++)
+        {
+            tasks[index & (reserve_space - 1)]
+                = deque->task[index & (deque->reserve_space - 1)];
+        }
+        free(deque->task);
+        deque->task = tasks;
+        deque->reserve_space = reserve_space;
+    }
+    deque->task[deque->bottom & (deque->reserve_space - 1)] = *task;
+    deque->bottom += 1;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+/**
+ * @brief Take a task from a deque
+ * @param[in,out] deque The deque to take from
+ * @param[out] task The task taken
+ * @param[in] steal Nonzero to take the oldest task, else the newest
+ * @return Nonzero if a task was taken
+ */
+static int pop_task(task_deque_t *deque, task_t *task, int steal)
+{
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->bottom != deque->top)
+    {
+        if (steal)
+        {
+            *task = deque->task[deque->top & (deque->reserve_space - 1)];
+            deque->top += 1;
+        }
+        else
+        {
+            deque->bottom -= 1;
+            *task = deque->task[deque->bottom & (deque->reserve_space - 1)];
+        }
+        found = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+/**
+ * @brief Take the oldest task of a group from a deque
+ * @param[in,out] deque The deque to take from
+ * @param[out] task The task taken
+ * @param[in] group The group the task has to belong to
+ * @return Nonzero if a task was taken
+ * @note Older tasks of other groups move up to fill the gap, so the deque
+ * stays in order
+ */
+static int pop_group_task(task_deque_t *deque, task_t *task,
+                          task_group_t const *group)
+{
+    int found = 0;
+    pthread_mutex_lock(&deque->lock);
+    size_t mask = deque->reserve_space - 1;
+    for (size_t index = deque->top; index != deque->bottom; index++)
+    {
+        if (deque->task[index & mask].group != group)
+        {
+            continue;
+        }
+        *task = deque->task[index & mask];
+        for (; index != deque->top; index--)
+        {
+            deque->task[index & mask] = deque->task[(index - 1) & mask];
+        }
+        deque->top += 1;
+        found = 1;
+        break;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Workers
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Take a task from this thread's deque, or steal one from another
+ * @param[out] task The task taken
+ * @return Nonzero if a task was taken
+ */
+static int take_task(task_t *task)
+{
+    size_t start = 0;
+    if (worker_index != SIZE_MAX)
+    {
+        if (pop_task(&thread_pool.deque[worker_index], task, 0))
+        {
+            atomic_fetch_sub(&thread_pool.queued, 1);
+            return 1;
+        }
+        start = worker_index + 1;
+    }
+
+    for (size_t count = 0; count < thread_pool.deque_count; count++)
+    {
+        size_t index = (start + count) % thread_pool.deque_count;
+        if (index != worker_index
+            && pop_task(&thread_pool.deque[index], task, 1))
+        {
+            atomic_fetch_sub(&thread_pool.queued, 1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Take a queued task of a group from any deque
+ * @param[out] task The task taken
+ * @param[in] group The group the task has to belong to
+ * @return Nonzero if a task was taken
+ */
+static int take_group_task(task_t *task, task_group_t const *group)
+{
+    for (size_t index = 0; index < thread_pool.deque_count; index++)
+    {
+        if (pop_group_task(&thread_pool.deque[index], task, group))
+        {
+            atomic_fetch_sub(&thread_pool.queued, 1);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Run a task and mark it as finished in its group
+ * @param[in] task The task to run
+ */
+static void run_task(task_t const *task)
+{
+    task->function(task->argument);
+    if (atomic_fetch_sub(&task->group->pending, 1) == 1)
+    {
+        pthread_mutex_lock(&thread_pool.sleep_lock);
+        pthread_cond_broadcast(&thread_pool.finished);
+        pthread_mutex_unlock(&thread_pool.sleep_lock);
+    }
+}
+
+/**
+ * @brief The main loop of a worker thread
+ * @param[in] argument The index of the worker's deque
+ * @return NULL
+ */
+static void *worker_main(void *argument)
+{
+    worker_index = (size_t)(uintptr_t)argument;
+
+    for (;;)
+    {
+        task_t task;
+        if (take_task(&task))
+        {
+            run_task(&task);
+            continue;
+        }
+
+        pthread_mutex_lock(&thread_pool.sleep_lock);
+        while (atomic_load(&thread_pool.queued) == 0
+               && !thread_pool.stopping)
+        {
+            pthread_cond_wait(&thread_pool.wake, &thread_pool.sleep_lock);
+        }
+        int stop
+            = thread_pool.stopping && atomic_load(&thread_pool.queued) == 0;
+        pthread_mutex_unlock(&thread_pool.sleep_lock);
+        if (stop)
+        {
+            return NULL;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Pool
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Start the thread pool
+ * @param[in] thread_count The total number of threads to run tasks on,
+ * including the thread which waits on them
+ */
+void get_thread_pool(size_t thread_count)
+{
+    ASSERT(thread_count > 0, "Thread pool needs at least one thread\n");
+    ASSERT(thread_pool.deque == NULL, "Thread pool already started\n");
+
+    thread_pool.worker_count = thread_count - 1;
+    thread_pool.deque_count
+        = thread_pool.worker_count > 0 ? thread_pool.worker_count : 1;
+    thread_pool.deque
+        = calloc(thread_pool.deque_count, sizeof(*thread_pool.deque));
+    ASSERT(thread_pool.deque != NULL, "Failed to allocate thread pool\n");
+    for (size_t index = 0; index < thread_pool.deque_count; index++)
+    {
+        ASSERT(pthread_mutex_init(&thread_pool.deque[index].lock, NULL) == 0,
+               "Failed to initialize thread pool\n");
+    }
+
+    if (thread_pool.worker_count > 0)
+    {
+        thread_pool.thread
+            = malloc(thread_pool.worker_count * sizeof(*thread_pool.thread));
+        ASSERT(thread_pool.thread != NULL, "Failed to allocate thread pool\n");
+    }
+    for (size_t index = 0; index < thread_pool.worker_count; index++)
+    {
+        ASSERT(pthread_create(&thread_pool.thread[index], NULL, worker_main,
+                              (void *)(uintptr_t)index)
+                   == 0,
+               "Failed to start worker thread\n");
+    }
+}
+
+/**
+ * @brief Finish any queued tasks and stop the thread pool
+ */
+void put_thread_pool()
+{
+    if (thread_pool.deque == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&thread_pool.sleep_lock);
+    thread_pool.stopping = 1;
+    pthread_cond_broadcast(&thread_pool.wake);
+    pthread_mutex_unlock(&thread_pool.sleep_lock);
+
+    for (size_t index = 0; index < thread_pool.worker_count; index++)
+    {
+        pthread_join(thread_pool.thread[index], NULL);
+    }
+    for (size_t index = 0; index < thread_pool.deque_count; index++)
+    {
+        pthread_mutex_destroy(&thread_pool.deque[index].lock);
+        free(thread_pool.deque[index].task);
+    }
+    free(thread_pool.deque);
+    free(thread_pool.thread);
+    thread_pool.deque = NULL;
+    thread_pool.thread = NULL;
+    thread_pool.worker_count = 0;
+    thread_pool.deque_count = 0;
+    thread_pool.stopping = 0;
+}
+
+/**
+ * @brief Get the number of threads that run tasks
+ * @return The thread count given to get_thread_pool, or 1 if it isn't running
+ */
+size_t thread_pool_size()
+{
+    return thread_pool.worker_count + 1;
+}
+
+/**
+ * @brief Queue a task on the thread pool
+ * @param[in,out] group The group to add the task to
+ * @param[in] function The function to run
+ * @param[in] argument The argument to pass to the function
+ * @note Tasks submitted by a worker go to its own deque, so tasks may submit
+ * more tasks and wait on them
+ */
+void submit_task(task_group_t *group, task_function_t function,
+                 void *argument)
+{
+    ASSERT(thread_pool.deque != NULL, "Thread pool not started\n");
+
+    task_t task = {function, argument, group};
+    atomic_fetch_add(&group->pending, 1);
+
+    size_t index = worker_index;
+    if (index == SIZE_MAX)
+    {
+        index = atomic_fetch_add(&thread_pool.next_deque, 1)
+                % thread_pool.deque_count;
+    }
+    push_task(&thread_pool.deque[index], &task);
+    atomic_fetch_add(&thread_pool.queued, 1);
+
+    pthread_mutex_lock(&thread_pool.sleep_lock);
+    pthread_cond_signal(&thread_pool.wake);
+    pthread_mutex_unlock(&thread_pool.sleep_lock);
+}
+
+/**
+ * @brief Wait for every task in a group to finish
+ * @param[in,out] group The group to wait on
+ * @note The calling thread runs the group's queued tasks, then sleeps until
+ * those running on other threads finish
+ */
+void wait_task_group(task_group_t *group)
+{
+    task_t task;
+    while (take_group_task(&task, group))
+    {
+        run_task(&task);
+    }
+
+    pthread_mutex_lock(&thread_pool.sleep_lock);
+    while (atomic_load(&group->pending) != 0)
+    {
+        pthread_cond_wait(&thread_pool.finished, &thread_pool.sleep_lock);
+    }
+    pthread_mutex_unlock(&thread_pool.sleep_lock);
+}
@@ -0,0 +1,198 @@
+/** arena_t.c
+ * @brief A bump pointer allocator
+ *
+ * Memory is handed out of large mmap'd blocks and is only ever released all
+ * at once, which makes teardown independent of the number of allocations.
+ *
+ * STATE: huge_pages
+ */
+
+#include "error_handling.h"
+#include "stats.h"
+#include "type/arena_t.h"
+
+#include <string.h>   // `memset`
+#include <sys/mman.h> // `mmap`, `madvise`, `munmap`
+
+#define ARENA_BLOCK_SIZE ((size_t)1 << 21) // One huge page on x86-64
+
+/**
+ * STATE: Nonzero if new blocks should be backed by huge pages
+ */
+static int huge_pages = 0;
+
+/**
+ * @brief Back all arena blocks allocated after this call with huge pages
+ * @note Explicit huge pages are used if any are reserved, else transparent
+ * huge pages are requested
+ */
+void enable_arena_huge_pages()
+{
+    huge_pages = 1;
+}
+
+/**
+ * @brief Round a size up to the arena alignment
+ */
+static size_t align_size(size_t size)
+{
+    return (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+}
+
+/**
+ * @brief Map a new block
+ * @param[in] minimum_size The minimum usable size of the block
+ * @return The new block
+ */
+static arena_block_t *get_arena_block(size_t minimum_size)
+{
+    size_t header_size = align_size(sizeof(arena_block_t));
+    size_t size = header_size + minimum_size;
+    if (size < ARENA_BLOCK_SIZE)
+    {
+        size = ARENA_BLOCK_SIZE;
+    }
+    size = (size + ARENA_BLOCK_SIZE - 1) & ~(ARENA_BLOCK_SIZE - 1);
+
+    void *memory = MAP_FAILED;
+    if (huge_pages)
+    {
+        memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    }
+    if (memory == MAP_FAILED)
+    {
+        memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        ASSERT(memory != MAP_FAILED, "Failed to allocate arena block\n");
+        if (huge_pages)
+        {
+            // This is only a hint, so failure isn't an error
+            (void)madvise(memory, size, MADV_HUGEPAGE);
+        }
+        errno = 0;
+    }
+
+    record_allocation(size);
+    arena_block_t *block = memory;
+    block->next = NULL;
+    block->size = size;
+    block->used = header_size;
+    block->dirty = header_size;
+    return block;
+}
+
+/**
+ * @brief Allocate memory from an arena
+ * @param[in,out] arena The arena to allocate from
+ * @param[in] size The number of bytes to allocate
+ * @return The allocated memory, which is zeroed and aligned to
+ * ARENA_ALIGNMENT
+ */
+void *arena_allocate(arena_t *arena, size_t size)
+{
+    ASSERT(arena != NULL, "Bad call to arena_allocate\n");
+
+    size = align_size(size);
+    if (arena->head == NULL || arena->head->size - arena->head->used < size)
+    {
+        arena_block_t *block = get_arena_block(size);
+        block->next = arena->head;
+        arena->head = block;
+    }
+
+    arena_block_t *block = arena->head;
+    char *memory = (char *)block + block->used;
+    if (block->used < block->dirty)
+    { // Only memory handed out before a reset needs zeroing
+        size_t dirty_size = block->dirty - block->used;
+        memset(memory, 0, dirty_size < size ? dirty_size : size);
+    }
+    block->used += size;
+    return memory;
+}
+
+/**
+ * @brief Release every allocation in an arena, keeping one block for reuse
+ * @param[in,out] arena The arena to reset
+ */
+void reset_arena(arena_t *arena)
+{
+    arena_block_t *block = arena->head;
+    if (block == NULL)
+    {
+        return;
+    }
+
+    // Keep the oldest block, which is at the end of the list
+    while (block->next != NULL)
+    {
+        arena_block_t *next = block->next;
+        ASSERT(munmap(block, block->size) == 0, "Failed to free arena\n");
+        block = next;
+    }
+
+    // Fresh mappings are zeroed, recycled memory is zeroed as it is
+    // allocated again, so a reset doesn't touch what was used
+    if (block->used > block->dirty)
+    {
+        block->dirty = block->used;
+    }
+    block->used = align_size(sizeof(arena_block_t));
+    arena->head = block;
+
+    // Past the first block's worth, the pages are given back, and come back
+    // zeroed if they are used again
+    if (block->dirty > ARENA_BLOCK_SIZE)
+    {
+        (void)madvise((char *)block + ARENA_BLOCK_SIZE,
+                      block->size - ARENA_BLOCK_SIZE, MADV_DONTNEED);
+        block->dirty = ARENA_BLOCK_SIZE;
+    }
+}
+
+/**
+ * @brief Move every allocation in one arena into another
+ * @param[in,out] arena The arena to take ownership of the memory
+ * @param[in,out] other The arena to empty
+ * @note The blocks are linked in behind the current block, so allocation
+ * carries on from the same place in the receiving arena
+ */
+void merge_arena(arena_t *arena, arena_t *other)
+{
+    if (other->head == NULL)
+    {
+        return;
+    }
+    if (arena->head == NULL)
+    {
+        arena->head = other->head;
+        other->head = NULL;
+        return;
+    }
+
+    arena_block_t *tail = other->head;
+    while (tail->next != NULL)
+    {
+        tail = tail->next;
+    }
+    tail->next = arena->head->next;
+    arena->head->next = other->head;
+    other->head = NULL;
+}
+
+/**
+ * @brief Release every allocation in an arena and all of its memory
+ * @param[in,out] arena The arena to free
+ */
+void put_arena(arena_t *arena)
+{
+    arena_block_t *block = arena->head;
+    while (block != NULL)
+    {
+        arena_block_t *next = block->next;
+        ASSERT(munmap(block, block->size) == 0, "Failed to free arena\n");
+        block = next;
+    }
+    arena->head = NULL;
+}
@@ -0,0 +1,266 @@
+/** intern_t.c
+ * @brief A global table which stores each distinct string once
+ *
+ * Strings live in an arena and are found through an open addressing hash
+ * set of handles. Handles index a two level table of entries whose blocks
+ * never move, so a handle can be turned back into its string without
+ * locking, while adding strings takes a lock. Single characters which are
+ * seeded are looked up without locking too.
+ *
+ * STATE: intern_table
+ */
+
+#include "error_handling.h"
+#include "type/arena_t.h"
+#include "type/intern_t.h"
+
+#include <pthread.h> // `pthread_mutex_t`
+#include <string.h>  // `memcmp`, `memcpy`
+
+#define INTERN_BLOCK_BITS 16
+#define INTERN_BLOCK_SIZE ((uint32_t)1 << INTERN_BLOCK_BITS)
+#define INTERN_BLOCK_COUNT ((size_t)1 << (32 - INTERN_BLOCK_BITS))
+
+typedef struct intern_entry_t
+{
+    char const *string; // NULL terminated
+    uint32_t length;
+    uint32_t hash;
+} intern_entry_t;
+
+typedef struct intern_table_t
+{
+    pthread_mutex_t lock; // Held to add strings
+    arena_t arena;        // The text of every string which isn't seeded
+    intern_entry_t *block[INTERN_BLOCK_COUNT]; // Entries by handle
+    uint32_t *slot;       // The hash set of handles, with InternNone empty
+    uint32_t slot_count;  // A power of 2
+    uint32_t count;       // The number of handles given out, including seeds
+} intern_table_t;
+
+/**
+ * STATE: This holds every interned string
+ */
+static intern_table_t intern_table
+    = {PTHREAD_MUTEX_INITIALIZER, {NULL}, {NULL}, NULL, 0, 0};
+
+/**
+ * @brief The text of the seeded strings, by handle
+ */
+static char const *const intern_seed[InternSeedCount] = {
+    [InternNone] = "",
+    [InternPlus] = "+",
+    [InternMinus] = "-",
+    [InternTimes] = "*",
+    [InternDivide] = "/",
+    [InternModulo] = "%",
+    [InternOpenParenthesis] = "(",
+    [InternCloseParenthesis] = ")",
+    [InternSemicolon] = ";",
+    [InternGlobalScope] = "__GLOBAL_SCOPE__",
+};
+
+/**
+ * @brief The handles of the seeded single characters, else InternNone
+ */
+static intern_t const intern_character[256] = {
+    ['+'] = InternPlus,
+    ['-'] = InternMinus,
+    ['*'] = InternTimes,
+    ['/'] = InternDivide,
+    ['%'] = InternModulo,
+    ['('] = InternOpenParenthesis,
+    [')'] = InternCloseParenthesis,
+    [';'] = InternSemicolon,
+};
+
+/**
+ * @brief Hash a string with FNV-1a
+ * @param[in] string The string to hash
+ * @param[in] length The length of the string
+ * @return The hash
+ */
+static uint32_t get_intern_hash(char const *string, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t index = 0; index < length; index++)
+    {
+        hash = (hash ^ (unsigned char)string[index]) * 16777619u;
+    }
+    return hash;
+}
+
+/**
+ * @brief Get the entry for a handle
+ * @param[in] handle A handle given out by the table
+ * @return The entry
+ */
+static intern_entry_t *get_intern_entry(intern_t handle)
+{
+    return &intern_table.block[handle >> INTERN_BLOCK_BITS]
+                              [handle & (INTERN_BLOCK_SIZE - 1)];
+}
+
+/**
+ * @brief Put a handle in the first free slot for its hash
+ * @param[in] handle The handle to place
+ * @param[in] hash The hash of its string
+ */
+static void place_intern_slot(intern_t handle, uint32_t hash)
+{
+    uint32_t mask = intern_table.slot_count - 1;
+    uint32_t index = hash & mask;
+    while (intern_table.slot[index] != InternNone)
+    {
+        index = (index + 1) & mask;
+    }
+    intern_table.slot[index] = handle;
+}
+
+/**
+ * @brief Add an entry for a string, giving it the next handle
+ * @param[in] string The string, which must outlive the table
+ * @param[in] length The length of the string
+ * @param[in] hash The hash of the string
+ * @return The new handle
+ * @note The lock must be held
+ */
+static intern_t add_intern_entry(char const *string, size_t length,
+                                 uint32_t hash)
+{
+    ASSERT(intern_table.count != UINT32_MAX, "Too many interned strings\n");
+    intern_t handle = intern_table.count++;
+    intern_entry_t **block = &intern_table.block[handle >> INTERN_BLOCK_BITS];
+    if (*block == NULL)
+    {
+        *block = malloc(INTERN_BLOCK_SIZE * sizeof(**block));
+        ASSERT(*block != NULL, "Failed to allocate intern table\n");
+    }
+    *get_intern_entry(handle) = (intern_entry_t){string, (uint32_t)length,
+                                                 hash};
+
+    // Keep the set at most half full
+    if (intern_table.count * 2 > intern_table.slot_count)
+    {
+        free(intern_table.slot);
+        intern_table.slot_count
+            = intern_table.slot_count == 0 ? 64 : intern_table.slot_count * 2;
+        intern_table.slot
+            = calloc(intern_table.slot_count, sizeof(*intern_table.slot));
+        ASSERT(intern_table.slot != NULL, "Failed to allocate intern table\n");
+        for (intern_t index = InternNone + 1; index < intern_table.count;
+             index++)
+        {
+            place_intern_slot(index, get_intern_entry(index)->hash);
+        }
+    }
+    else if (handle != InternNone)
+    {
+        place_intern_slot(handle, hash);
+    }
+    return handle;
+}
+
+/**
+ * @brief Get the handle for a string, adding it if it is new
+ * @param[in] string The start of the string, which needn't be NULL
+ * terminated
+ * @param[in] length The number of characters in the string
+ * @return The handle, which is the same for every equal string
+ * @note This is safe to call from any thread
+ */
+intern_t get_intern(char const *string, size_t length)
+{
+    if (length == 1)
+    {
+        intern_t handle = intern_character[(unsigned char)string[0]];
+        if (handle != InternNone)
+        {
+            return handle;
+        }
+    }
+
+    uint32_t hash = get_intern_hash(string, length);
+    ASSERT(pthread_mutex_lock(&intern_table.lock) == 0,
+           "Failed to lock intern table\n");
+    if (intern_table.count == 0)
+    {
+        for (intern_t index = InternNone; index < InternSeedCount; index++)
+        {
+            add_intern_entry(
+                intern_seed[index], strlen(intern_seed[index]),
+                get_intern_hash(intern_seed[index],
+                                strlen(intern_seed[index])));
+        }
+    }
+
+    uint32_t mask = intern_table.slot_count - 1;
+    intern_t handle;
+    for (uint32_t index = hash & mask;
+         (handle = intern_table.slot[index]) != InternNone;
+         index = (index + 1) & mask)
+    {
+        intern_entry_t const *entry = get_intern_entry(handle);
+        if (entry->hash == hash && entry->length == length
+            && memcmp(entry->string, string, length) == 0)
+        {
+            break;
+        }
+    }
+    if (handle == InternNone && length != 0)
+    {
+        char *copy = arena_allocate(&intern_table.arena, length + 1);
+        memcpy(copy, string, length);
+        copy[length] = '\0';
+        handle = add_intern_entry(copy, length, hash);
+    }
+    ASSERT(pthread_mutex_unlock(&intern_table.lock) == 0,
+           "Failed to unlock intern table\n");
+    return handle;
+}
+
+/**
+ * @brief Get the text of an interned string
+ * @param[in] handle The handle of the string
+ * @return The string, NULL terminated, which lives as long as the table
+ */
+char const *get_intern_string(intern_t handle)
+{
+    if (handle < InternSeedCount)
+    {
+        return intern_seed[handle];
+    }
+    return get_intern_entry(handle)->string;
+}
+
+/**
+ * @brief Get the length of an interned string
+ * @param[in] handle The handle of the string
+ * @return The length, not including the NULL terminator
+ */
+size_t get_intern_length(intern_t handle)
+{
+    if (handle < InternSeedCount)
+    {
+        return strlen(intern_seed[handle]);
+    }
+    return get_intern_entry(handle)->length;
+}
+
+/**
+ * @brief Deallocate the intern table
+ * @note Every handle given out is invalid after this
+ */
+void put_intern_table()
+{
+    for (size_t index = 0; index < INTERN_BLOCK_COUNT; index++)
+    {
+        free(intern_table.block[index]);
+        intern_table.block[index] = NULL;
+    }
+    free(intern_table.slot);
+    put_arena(&intern_table.arena);
+    intern_table.slot = NULL;
+    intern_table.slot_count = 0;
+    intern_table.count = 0;
+}
@@ -41,6 +41,27 @@ void get_string(string_t *input_struct, char const *input_string,
     strcpy(input_struct->string, input_string);
 }
 
+/**
+ * @brief Allocate a string_t from an arena
+ * @param[in,out] input_struct A pointer to the struct to allocate
+ * @param[in,out] arena The arena to allocate the 'string' member from
+ * @param[in] input_string The start of the string, which needn't be NULL
+ * terminated
+ * @param[in] input_length The number of characters to copy
+ * @note Don't call put_string on the result, it is released with the arena
+ */
+void get_arena_string(string_t *input_struct, arena_t *arena,
+                      char const *input_string, size_t input_length)
+{
+    ASSERT(input_struct != NULL, "Invalid string allocation\n");
+
+    input_struct->string = arena_allocate(arena, input_length + 1);
+    input_struct->string_length = input_length;
+    input_struct->reserve_space = input_length + 1;
+    memcpy(input_struct->string, input_string, input_length);
+    input_struct->string[input_length] = '\0';
+}
+
 /**
  * @brief Deallocate a string_t
  * @param[in] input_struct A pointer to the struct to deallocate the 'string'
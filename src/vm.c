@@ -0,0 +1,447 @@
+/** vm.c
+ * @brief A bytecode compiler and stack machine for evaluating ASTs
+ *
+ * Each statement is lowered to postfix bytecode, with its literals decoded
+ * once into a constant table. The machine then runs the whole program in a
+ * single loop, dispatching with computed gotos and keeping operands on a
+ * stack sized when the program is compiled.
+ *
+ * When the AST shares subtrees, the first time each shared node is lowered
+ * its value is stored in a memo slot, and later it is loaded from there in
+ * place of its subtree.
+ */
+
+#include "error_handling.h"
+#include "vm.h"
+#include "walk.h"
+
+#include <math.h>   // `fmod`
+#include <string.h> // `memset`
+
+//////////////////////////////////////////////////////////////////////////////
+// Compiling
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Add an instruction to the end of a program
+ * @param[in,out] program The program to add to
+ * @param[in] opcode The instruction to add
+ */
+static void add_instruction(program_t *program, opcode_enum opcode)
+{
+    if (program->code_size == program->code_reserve_space)
+    {
+        program->code_reserve_space = program->code_reserve_space == 0
+                                          ? 256
+                                          : program->code_reserve_space * 2;
+        program->code = realloc(program->code, program->code_reserve_space);
+        ASSERT(program->code != NULL, "Failed to allocate program\n");
+    }
+    program->code[program->code_size++] = (uint8_t)opcode;
+}
+
+/**
+ * @brief Add a constant to the end of a program's constant table
+ * @param[in,out] program The program to add to
+ * @param[in] value The constant to add
+ */
+static void add_constant(program_t *program, double value)
+{
+    if (program->constant_count == program->constant_reserve_space)
+    {
+        program->constant_reserve_space
+            = program->constant_reserve_space == 0
+                  ? 256
+                  : program->constant_reserve_space * 2;
+        program->constant
+            = realloc(program->constant, program->constant_reserve_space
+                                             * sizeof(*program->constant));
+        ASSERT(program->constant != NULL, "Failed to allocate program\n");
+    }
+    program->constant[program->constant_count++] = value;
+}
+
+/**
+ * @brief Add an instruction which pushes a constant
+ * @param[in,out] program The program to add to
+ * @param[in] value The constant to push
+ * @param[in] depth The depth of the operand stack before the push
+ */
+static void add_push(program_t *program, double value, size_t depth)
+{
+    add_constant(program, value);
+    add_instruction(program, OpPush);
+    if (depth + 1 > program->stack_size)
+    {
+        program->stack_size = depth + 1;
+    }
+}
+
+/**
+ * @brief Add an instruction which stores to or loads from a memo slot
+ * @param[in,out] program The program to add to
+ * @param[in] opcode OpStore or OpLoad
+ * @param[in] node The shared node whose value is in the slot
+ */
+static void add_memo_instruction(program_t *program, opcode_enum opcode,
+                                 AST_node_t const *node)
+{
+    if (program->slot_count == program->slot_reserve_space)
+    {
+        program->slot_reserve_space = program->slot_reserve_space == 0
+                                          ? 256
+                                          : program->slot_reserve_space * 2;
+        program->slot = realloc(program->slot, program->slot_reserve_space
+                                                   * sizeof(*program->slot));
+        ASSERT(program->slot != NULL, "Failed to allocate program\n");
+    }
+    program->slot[program->slot_count++] = node->shared;
+    add_instruction(program, opcode);
+    if (node->shared >= program->memo_size)
+    {
+        program->memo_size = (size_t)node->shared + 1;
+    }
+}
+
+/**
+ * @brief Get the instruction for a binary operator
+ * @param[in] symbol The interned operator
+ * @return The instruction which applies the operator
+ */
+static opcode_enum get_operator_opcode(intern_t symbol)
+{
+    switch (symbol)
+    {
+    case InternPlus:
+        return OpAdd;
+    case InternMinus:
+        return OpSubtract;
+    case InternTimes:
+        return OpMultiply;
+    case InternDivide:
+        return OpDivide;
+    case InternModulo:
+        return OpModulo;
+    default:
+        EXIT_ERROR("Unknown AST token in compile\n");
+    }
+}
+
+/**
+ * @brief Check whether a shared node has already been lowered, making room
+ * to record it
+ * @param[in,out] is_lowered Nonzero for each shared number lowered so far
+ * @param[in,out] reserve_space The space allocated for is_lowered
+ * @param[in] node A node which is shared
+ * @return Nonzero if the node's value is in its memo slot
+ */
+static int is_node_lowered(uint8_t **is_lowered, size_t *reserve_space,
+                           AST_node_t const *node)
+{
+    if (node->shared >= *reserve_space)
+    {
+        size_t count = *reserve_space;
+        *reserve_space = (size_t)node->shared * 2;
+        *is_lowered = realloc(*is_lowered, *reserve_space);
+        ASSERT(*is_lowered != NULL, "Failed to allocate program\n");
+        memset(*is_lowered + count, 0, *reserve_space - count);
+    }
+    return (*is_lowered)[node->shared];
+}
+
+/**
+ * @brief Lower an expression to bytecode
+ * @param[in,out] program The program to add to
+ * @param[in] node The root of the expression
+ * @param[in,out] walk A walk to reuse, post-order, or also pre-order if the
+ * AST is shared
+ * @param[in,out] is_lowered Nonzero for each shared number lowered so far
+ * @param[in,out] reserve_space The space allocated for is_lowered
+ * @note The operand stack is empty before each statement
+ */
+static void compile_expression(program_t *program, AST_node_t *node,
+                               AST_walk_t *walk, uint8_t **is_lowered,
+                               size_t *reserve_space)
+{
+    size_t depth = 0; // The depth of the operand stack after the node
+    walk_event_enum event;
+    reset_AST_walk(walk, node);
+    while ((node = next_AST_node(walk, &event)) != NULL)
+    {
+        if (node->shared != 0
+            && is_node_lowered(is_lowered, reserve_space, node))
+        {
+            if (event == WalkPreOrder)
+            {
+                skip_AST_children(walk);
+            }
+            else
+            {
+                add_memo_instruction(program, OpLoad, node);
+                if (++depth > program->stack_size)
+                {
+                    program->stack_size = depth;
+                }
+            }
+            continue;
+        }
+        if (event == WalkPreOrder)
+        {
+            continue;
+        }
+        switch (node->type)
+        {
+        case NodeUnaryOperator:
+            switch (node->string)
+            {
+            case InternPlus:
+                break;
+            case InternMinus:
+                add_instruction(program, OpNegate);
+                break;
+            default:
+                EXIT_ERROR("Unknown AST token in compile\n");
+            }
+            break;
+        case NodeBinaryOperator:
+            add_instruction(program, get_operator_opcode(node->string));
+            depth -= 1;
+            break;
+        case NodeLiteral:
+            add_push(program, get_literal_value(node), depth++);
+            break;
+        case NodeConstant:
+            add_push(program, node->value, depth++);
+            break;
+        case NodeParenthesis:
+            break;
+        default:
+            EXIT_ERROR("Unknown AST token in compile\n");
+        }
+        if (node->shared != 0)
+        {
+            add_memo_instruction(program, OpStore, node);
+            (*is_lowered)[node->shared] = 1;
+        }
+    }
+}
+
+/**
+ * @brief Lower a run of top level statements to bytecode
+ * @param[out] program The program to build, which should be zeroed.
+ * Deallocate it with put_program.
+ * @param[in] first The first statement
+ * @param[in] count The most statements to lower, following next from first
+ */
+void compile_statements(program_t *program, AST_node_t *first, size_t count)
+{
+    AST_walk_t walk;
+    uint8_t *is_lowered = NULL;
+    size_t reserve_space = 0;
+    get_AST_walk(&walk, NULL,
+                 is_AST_sharing_enabled() ? WalkPreOrder | WalkPostOrder
+                                          : WalkPostOrder);
+    for (AST_node_t *statement = first; statement != NULL && count > 0;
+         statement = statement->next, count--)
+    {
+        compile_expression(program, statement, &walk, &is_lowered,
+                           &reserve_space);
+        add_instruction(program, OpStatement);
+    }
+    put_AST_walk(&walk);
+    free(is_lowered);
+    add_instruction(program, OpHalt);
+
+    program->stack = malloc(program->stack_size * sizeof(*program->stack));
+    ASSERT(program->stack != NULL, "Failed to allocate operand stack\n");
+    if (program->memo_size > 0)
+    {
+        program->memo = malloc(program->memo_size * sizeof(*program->memo));
+        ASSERT(program->memo != NULL, "Failed to allocate memo\n");
+    }
+}
+
+/**
+ * @brief Lower an AST to bytecode
+ * @param[out] program The program to build, which should be zeroed.
+ * Deallocate it with put_program.
+ * @param[in] root The root of the AST, usually the global scope
+ */
+void compile_program(program_t *program, AST_node_t *root)
+{
+    if (root->type != NodeScope)
+    {
+        compile_statements(program, root, 1);
+        return;
+    }
+    if (root->list_head == NULL)
+    {
+        EXIT_ERROR("No statements to evaluate\n");
+    }
+    compile_statements(program, root->list_head, SIZE_MAX);
+}
+
+/**
+ * @brief Lower a node pool to bytecode
+ * @param[out] program The program to build, which should be zeroed.
+ * Deallocate it with put_program.
+ * @param[in] pool The pool to lower
+ * @note Each statement is already in postfix order, so this is a single
+ * pass over its nodes
+ */
+void compile_pool(program_t *program, node_pool_t const *pool)
+{
+    uint32_t first = 0;
+    uint32_t statement = 0;
+    if (pool->root != POOL_NONE && pool->statement_count > 0)
+    {
+        first = pool->statement[pool->statement_count - 1] + 1;
+        statement = pool->statement_count;
+    }
+    else if (pool->root == POOL_NONE && pool->statement_count == 0)
+    {
+        EXIT_ERROR("No statements to evaluate\n");
+    }
+
+    size_t depth = 0; // Operands left behind by malformed statements stay
+    for (; statement <= pool->statement_count; statement++)
+    {
+        uint32_t root = statement < pool->statement_count
+                            ? pool->statement[statement]
+                            : pool->root;
+        if (root == POOL_NONE)
+        {
+            break;
+        }
+        for (uint32_t index = first; index <= root; index++)
+        {
+            pool_node_t const *node = &pool->node[index];
+            switch (node->type)
+            {
+            case NodeLiteral:
+                add_push(program, get_pool_literal_value(pool, index),
+                         depth++);
+                break;
+            case NodeConstant:
+                add_push(program, get_pool_constant_value(pool, index),
+                         depth++);
+                break;
+            case NodeUnaryOperator:
+                if (node->symbol == '-')
+                {
+                    add_instruction(program, OpNegate);
+                }
+                break;
+            case NodeBinaryOperator:
+                add_instruction(program, get_operator_opcode(get_intern(
+                                             &node->symbol, 1)));
+                depth -= 1;
+                break;
+            case NodeParenthesis:
+                break;
+            default:
+                EXIT_ERROR("Unknown AST token in compile\n");
+            }
+        }
+        add_instruction(program, OpStatement);
+        depth -= 1;
+        first = root + 1;
+    }
+    add_instruction(program, OpHalt);
+
+    program->stack = malloc(program->stack_size * sizeof(*program->stack));
+    ASSERT(program->stack != NULL, "Failed to allocate operand stack\n");
+}
+
+/**
+ * @brief Deallocate a program
+ * @param[in,out] program The program to deallocate
+ */
+void put_program(program_t *program)
+{
+    free(program->code);
+    free(program->constant);
+    free(program->stack);
+    free(program->slot);
+    free(program->memo);
+    *program
+        = (program_t){NULL, 0, 0, NULL, 0, 0, NULL, 0, NULL, 0, 0, NULL, 0};
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Running
+//////////////////////////////////////////////////////////////////////////////
+
+#define DISPATCH() goto *dispatch_table[*instruction++]
+
+/**
+ * @brief Run a program
+ * @param[in,out] program The program to run
+ * @return The result of the last statement
+ */
+double run_program(program_t *program)
+{
+    static void *const dispatch_table[OpCount] = {
+        [OpPush] = &&push,           [OpNegate] = &&negate,
+        [OpAdd] = &&add,             [OpSubtract] = &&subtract,
+        [OpMultiply] = &&multiply,   [OpDivide] = &&divide,
+        [OpModulo] = &&modulo,       [OpStatement] = &&statement,
+        [OpStore] = &&store,         [OpLoad] = &&load,
+        [OpHalt] = &&halt,
+    };
+
+    uint8_t const *instruction = program->code;
+    double const *constant = program->constant;
+    uint32_t const *slot = program->slot;
+    double *memo = program->memo;
+    double *top = program->stack; // One past the top of the stack
+    double result = 0;
+
+    DISPATCH();
+
+push:
+    *top++ = *constant++;
+    DISPATCH();
+negate:
+    top[-1] = -top[-1];
+    DISPATCH();
+add:
+    top -= 1;
+    top[-1] += top[0];
+    DISPATCH();
+subtract:
+    top -= 1;
+    top[-1] -= top[0];
+    DISPATCH();
+multiply:
+    top -= 1;
+    top[-1] *= top[0];
+    DISPATCH();
+divide:
+    top -= 1;
+    if (top[0] < 0.01 && top[0] > -0.01)
+    {
+        EXIT_ERROR("AST divide by 0 error\n");
+    }
+    top[-1] /= top[0];
+    DISPATCH();
+modulo:
+    top -= 1;
+    if (top[0] < 0.01 && top[0] > -0.01)
+    {
+        EXIT_ERROR("AST divide by 0 error\n");
+    }
+    top[-1] = fmod(top[-1], top[0]);
+    DISPATCH();
+statement:
+    result = *--top;
+    DISPATCH();
+store:
+    memo[*slot++] = top[-1];
+    DISPATCH();
+load:
+    *top++ = memo[*slot++];
+    DISPATCH();
+halt:
+    return result;
+}
@@ -0,0 +1,275 @@
+/** walk.c
+ * @brief Pre, in and post-order walks over an AST without recursion
+ *
+ * The path from the root to the current node is kept in a growable array
+ * of frames rather than on the C stack, so expressions nested hundreds of
+ * thousands deep can be walked, and each step is a short loop rather than
+ * a call.
+ */
+
+#include "error_handling.h"
+#include "walk.h"
+
+/**
+ * @brief The stages of a frame, in the order a walk goes through them
+ */
+enum
+{
+    StagePre,         // The node is about to be visited before its children
+    StageFirstChild,  // The first child is about to be walked
+    StageIn,          // The node is about to be visited between its children
+    StageSecondChild, // The second child is about to be walked
+    StageStatement,   // The next statement of a scope is about to be walked
+    StagePost,        // The node is about to be visited after its children
+    StageDone         // The frame is about to be popped
+};
+
+/**
+ * @brief Make room for more frames in a walk
+ * @param[in,out] walk The walk, which is full
+ */
+static void grow_AST_walk(AST_walk_t *walk)
+{
+    walk->frame_reserve_space
+        = walk->frame_reserve_space == 0 ? 64 : walk->frame_reserve_space * 2;
+    walk->frame = realloc(walk->frame,
+                          walk->frame_reserve_space * sizeof(*walk->frame));
+    ASSERT(walk->frame != NULL, "Failed to allocate AST walk\n");
+}
+
+/**
+ * @brief Start walking a subtree
+ * @param[in,out] walk The walk
+ * @param[in] node The root of the subtree, or NULL for nothing
+ */
+static void push_walk_frame(AST_walk_t *walk, AST_node_t *node)
+{
+    if (node == NULL)
+    {
+        return;
+    }
+    if (walk->frame_count == walk->frame_reserve_space)
+    {
+        grow_AST_walk(walk);
+    }
+    // Skip straight past the visits which aren't stopped at
+    int stage = walk->events & WalkPreOrder ? StagePre : StageFirstChild;
+    walk->frame[walk->frame_count++] = (walk_frame_t){node, NULL, stage};
+}
+
+/**
+ * @brief Start a walk over an AST
+ * @param[out] walk The walk to start. Deallocate it with put_AST_walk.
+ * @param[in] root The root to walk from, or NULL for nothing
+ * @param[in] events The walk_event_enum flags of the visits to stop at
+ */
+void get_AST_walk(AST_walk_t *walk, AST_node_t *root, int events)
+{
+    *walk = (AST_walk_t){NULL, 0, 0, events};
+    push_walk_frame(walk, root);
+}
+
+/**
+ * @brief Start a walk over another AST, keeping the memory of a walk
+ * @param[in,out] walk A walk started by get_AST_walk, which may be part way
+ * @param[in] root The root to walk from, or NULL for nothing
+ */
+void reset_AST_walk(AST_walk_t *walk, AST_node_t *root)
+{
+    walk->frame_count = 0;
+    push_walk_frame(walk, root);
+}
+
+/**
+ * @brief Step a walk which only stops after children to its next visit
+ * @param[in,out] walk The walk
+ * @return The node visited, or NULL once the walk is over
+ * @note This is the common walk, for evaluating and folding, so it skips the
+ * stages and goes straight down to the next node with no unwalked children.
+ * Each frame passed on the way keeps its child which is walked next, or NULL
+ * if there isn't one, so going back up doesn't need to read the node again.
+ * Every frame is StageDone but a root which hasn't been walked yet, as only
+ * the top frame is ever checked, and that is the node last visited.
+ */
+static AST_node_t *next_post_order_node(AST_walk_t *walk)
+{
+    size_t count = walk->frame_count;
+    if (count == 0)
+    {
+        return NULL;
+    }
+    walk_frame_t *frame = &walk->frame[count - 1];
+    AST_node_t *node;
+    if (frame->stage == StageDone)
+    {
+        if (--count == 0)
+        {
+            walk->frame_count = 0;
+            return NULL;
+        }
+        frame -= 1;
+        node = frame->child;
+        if (node == NULL)
+        {
+            walk->frame_count = count;
+            return frame->node;
+        }
+        // Only the statements of a scope have more than one child after the
+        // first
+        frame->child = frame->node->type == NodeScope ? node->next : NULL;
+    }
+    else
+    { // The root is pushed again below, with its child
+        node = frame->node;
+        count -= 1;
+    }
+
+    int right_first = walk->events & WalkRightFirst;
+    for (;;)
+    {
+        AST_node_t *first;
+        AST_node_t *second;
+        if (node->type == NodeScope)
+        {
+            first = node->list_head;
+            second = first != NULL ? first->next : NULL;
+        }
+        else
+        {
+            first = right_first ? node->right : node->left;
+            second = right_first ? node->left : node->right;
+            if (first == NULL)
+            {
+                first = second;
+                second = NULL;
+            }
+        }
+        if (count == walk->frame_reserve_space)
+        {
+            grow_AST_walk(walk);
+        }
+        walk->frame[count++] = (walk_frame_t){node, second, StageDone};
+        if (first == NULL)
+        {
+            walk->frame_count = count;
+            return node;
+        }
+        node = first;
+    }
+}
+
+/**
+ * @brief Step a walk to its next visit
+ * @param[in,out] walk The walk
+ * @param[out] event Which visit this is, or NULL if it isn't needed
+ * @return The node visited, or NULL once the walk is over
+ * @note A node's children may be changed once they have been walked, but
+ * not before. The depth of the node is walk->frame_count, which is 1 for
+ * the root.
+ */
+AST_node_t *next_AST_node(AST_walk_t *walk, walk_event_enum *event)
+{
+    if ((walk->events & ~WalkRightFirst) == WalkPostOrder)
+    {
+        if (event != NULL)
+        {
+            *event = WalkPostOrder;
+        }
+        return next_post_order_node(walk);
+    }
+
+    int right_first = walk->events & WalkRightFirst;
+    while (walk->frame_count > 0)
+    {
+        walk_frame_t *frame = &walk->frame[walk->frame_count - 1];
+        AST_node_t *node = frame->node;
+        walk_event_enum visit;
+        switch (frame->stage)
+        {
+        case StagePre:
+            frame->stage = StageFirstChild;
+            visit = WalkPreOrder;
+            break;
+        case StageFirstChild:
+            if (node->type == NodeScope)
+            {
+                frame->stage = StageStatement;
+                frame->child = node->list_head;
+                push_walk_frame(walk, frame->child);
+                continue;
+            }
+            if (!(walk->events & WalkInOrder))
+            {
+                // Both children can be pushed at once, the first on top, as
+                // nothing is visited between them
+                frame->stage = StagePost;
+                push_walk_frame(walk, right_first ? node->left : node->right);
+                push_walk_frame(walk, right_first ? node->right : node->left);
+                continue;
+            }
+            frame->stage = StageIn;
+            push_walk_frame(walk, right_first ? node->right : node->left);
+            continue;
+        case StageIn:
+            frame->stage = StageSecondChild;
+            visit = WalkInOrder;
+            break;
+        case StageSecondChild:
+            frame->stage = StagePost;
+            push_walk_frame(walk, right_first ? node->left : node->right);
+            continue;
+        case StageStatement:
+            if (frame->child == NULL || frame->child->next == NULL)
+            {
+                frame->stage = StagePost;
+                continue;
+            }
+            frame->child = frame->child->next;
+            push_walk_frame(walk, frame->child);
+            continue;
+        case StagePost:
+            // The frame is only popped on the next step, so the depth is
+            // still right for the visit
+            frame->stage = StageDone;
+            visit = WalkPostOrder;
+            break;
+        default:
+            walk->frame_count -= 1;
+            continue;
+        }
+
+        if (walk->events & (int)visit)
+        {
+            if (event != NULL)
+            {
+                *event = visit;
+            }
+            return node;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Go on from a node without walking its children, as if it had none
+ * @param[in,out] walk A walk which was just stepped to a pre-order visit
+ * @note The node is still visited after its children, if the walk stops
+ * there
+ */
+void skip_AST_children(AST_walk_t *walk)
+{
+    ASSERT(walk->frame_count > 0
+               && walk->frame[walk->frame_count - 1].stage == StageFirstChild,
+           "Can only skip children before they are walked\n");
+    walk->frame[walk->frame_count - 1].stage = StagePost;
+}
+
+/**
+ * @brief Deallocate a walk
+ * @param[in,out] walk The walk to deallocate
+ */
+void put_AST_walk(AST_walk_t *walk)
+{
+    free(walk->frame);
+    *walk = (AST_walk_t){NULL, 0, 0, 0};
+}
@@ -0,0 +1,575 @@
+/** watch.c
+ * @brief Compiling a file again each time it changes, in time proportional
+ * to the change
+ *
+ * The file is kept as a list of statements, each cut at its semicolon as
+ * --stream does, along with its AST and the outcome of evaluating it. When
+ * inotify reports the file was written, its new contents are compared with
+ * the old to find the bytes which changed. Statements wholly before or after
+ * those bytes are kept, moved by the change in size, and only the statements
+ * between are lexed, parsed and evaluated again. Statements have no side
+ * effects, so the answer is the first error, or else the value of the last
+ * statement. A fresh run lexes the whole file before parsing it and parses
+ * it before evaluating anything, so the error kept is the first one from
+ * the earliest of those steps, not simply the first in the file.
+ *
+ * The statements compiled by each update share an AST, which is released
+ * once every one of them has been replaced. A token stream is only needed
+ * until its statement is parsed, so a single one is reused.
+ *
+ * A semicolon is never valid inside parenthesis, so a statement is never
+ * split by a change to the statements around it.
+ */
+
+#include "error_handling.h"
+#include "lexer.h"
+#include "stats.h"
+#include "watch.h"
+
+#include <limits.h>      // `NAME_MAX`
+#include <string.h>      // `memchr`, `memcmp`, `strndup`, `strrchr`
+#include <sys/inotify.h> // `inotify_init1`, `inotify_add_watch`
+#include <unistd.h>      // `read`
+
+#define WATCH_BLOCK_SIZE ((size_t)4096) // Bytes compared at once in a diff
+
+/**
+ * @brief The steps of compiling a statement, in the order a fresh run
+ * reports their errors
+ */
+typedef enum watch_step_enum
+{
+    StepLex,
+    StepParse,
+    StepEvaluate,
+} watch_step_enum;
+
+/**
+ * @brief The AST the statements of one update are parsed into
+ */
+typedef struct watch_region_t
+{
+    AST_t ast;
+    size_t statement_count; // The statements still using the AST
+} watch_region_t;
+
+/**
+ * @brief A statement of the watched file
+ */
+typedef struct watch_statement_t
+{
+    size_t begin;               // The offset of its first byte
+    size_t end;                 // One past its semicolon, or the file's end
+    source_location_t location; // The location of begin
+    watch_region_t *region;     // Where its AST is
+    AST_node_t *root;           // NULL for an empty statement
+    double value;
+    error_capture_t *error;     // Why compiling it failed, or NULL
+    watch_step_enum error_step; // The step which failed, if one did
+} watch_statement_t;
+
+/**
+ * @brief A list of statements, in the order they are in the file
+ */
+typedef struct watch_list_t
+{
+    watch_statement_t *statement;
+    size_t statement_count;
+    size_t reserve_space;
+} watch_list_t;
+
+/**
+ * @brief The statements between the bytes an update kept, being compiled
+ */
+typedef struct watch_update_t
+{
+    input_file_t const *file;
+    size_t begin; // The offset of the next statement to compile
+    size_t end;   // The offset to stop compiling at
+    source_location_t location;
+    token_stream_t *tokens;
+    watch_region_t *region;
+    statement_function_t evaluate;
+    watch_step_enum step; // The step the last statement is at
+    watch_list_t list;    // The statements compiled so far
+} watch_update_t;
+
+//////////////////////////////////////////////////////////////////////////////
+// Statements
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Make room in a statement list
+ * @param[in,out] list The list to grow
+ * @param[in] count The number of statements it must have room for
+ */
+static void reserve_statements(watch_list_t *list, size_t count)
+{
+    if (count <= list->reserve_space)
+    {
+        return;
+    }
+    while (list->reserve_space < count)
+    {
+        list->reserve_space
+            = list->reserve_space == 0 ? 64 : list->reserve_space * 2;
+    }
+    list->statement = realloc(list->statement, list->reserve_space
+                                                   * sizeof(*list->statement));
+    ASSERT(list->statement != NULL, "Failed to allocate statement list\n");
+}
+
+/**
+ * @brief Release a statement which has been replaced, and its AST once no
+ * statement uses it
+ * @param[in,out] statement The statement to release
+ */
+static void put_statement(watch_statement_t *statement)
+{
+    if (statement->error != NULL)
+    {
+        put_error_capture(statement->error);
+        free(statement->error);
+    }
+    watch_region_t *region = statement->region;
+    if (--region->statement_count == 0)
+    {
+        put_standalone_AST(&region->ast);
+        free(region);
+    }
+}
+
+/**
+ * @brief Lex, parse and evaluate the statements of an update, until the end
+ * or the first error
+ * @param[in,out] argument The watch_update_t to compile. Its last statement
+ * is the one which failed, if this didn't return.
+ */
+static void compile_statements_task(void *argument)
+{
+    watch_update_t *update = argument;
+    while (update->begin < update->end)
+    {
+        char const *semicolon = memchr(update->file->data + update->begin,
+                                       ';', update->end - update->begin);
+        size_t end = semicolon == NULL
+                         ? update->end
+                         : (size_t)(semicolon - update->file->data) + 1;
+
+        find_source_location(&update->location, update->file, update->begin);
+        reserve_statements(&update->list, update->list.statement_count + 1);
+        watch_statement_t *statement
+            = &update->list.statement[update->list.statement_count++];
+        *statement
+            = (watch_statement_t){update->begin, end, update->location,
+                                  update->region, NULL, 0, NULL, StepLex};
+        update->region->statement_count += 1;
+        update->begin = end;
+
+        update->step = StepLex;
+        reset_token_chunk(update->tokens);
+        lex_chunk(update->tokens, update->file, statement->begin, end);
+        record_phase_tokens(PhaseWatch, update->tokens->token_count);
+
+        // Each statement gets its own scope in the update's AST
+        AST_t *ast = &update->region->ast;
+        update->step = StepParse;
+        parse_standalone(ast, update->tokens, update->file,
+                         &update->location);
+        // As with --stream, a trailing statement without a semicolon counts
+        // if it has an operator at the top
+        statement->root
+            = ast->root != ast->scope ? ast->root : ast->scope->list_head;
+        if (statement->root != NULL)
+        {
+            update->step = StepEvaluate;
+            statement->value = update->evaluate(statement->root);
+        }
+    }
+}
+
+/**
+ * @brief Compile the statements in part of a file
+ * @param[in,out] update The part to compile, whose list is filled
+ * @note Errors are caught for each statement, and the statements after a
+ * failure are still compiled
+ */
+static void compile_statements(watch_update_t *update)
+{
+    record_phase_bytes(PhaseWatch, update->end - update->begin);
+    while (update->begin < update->end)
+    {
+        error_capture_t capture;
+        capture_errors(&capture, compile_statements_task, update);
+        if (!capture.failed)
+        {
+            put_error_capture(&capture);
+            break;
+        }
+        watch_statement_t *statement
+            = &update->list.statement[update->list.statement_count - 1];
+        statement->root = NULL;
+        statement->error = malloc(sizeof(*statement->error));
+        ASSERT(statement->error != NULL, "Failed to allocate error\n");
+        *statement->error = capture;
+        statement->error_step = update->step;
+    }
+    record_phase_nodes(PhaseWatch, update->region->ast.node_count);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+// Updating
+//////////////////////////////////////////////////////////////////////////////
+
+/**
+ * @brief Find the first statement which ends after an offset
+ * @param[in] list The statements, in order
+ * @param[in] offset The offset to compare with
+ * @return The index of the statement, or the number of statements if none
+ * does
+ */
+static size_t find_statement_ending_after(watch_list_t const *list,
+                                          size_t offset)
+{
+    size_t low = 0;
+    size_t high = list->statement_count;
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (list->statement[middle].end > offset)
+        {
+            high = middle;
+        }
+        else
+        {
+            low = middle + 1;
+        }
+    }
+    return low;
+}
+
+/**
+ * @brief Find the first statement which begins after an offset
+ * @param[in] list The statements, in order
+ * @param[in] offset The offset to compare with
+ * @return The index of the statement, or the number of statements if none
+ * does
+ */
+static size_t find_statement_beginning_after(watch_list_t const *list,
+                                             size_t offset)
+{
+    size_t low = 0;
+    size_t high = list->statement_count;
+    while (low < high)
+    {
+        size_t middle = low + (high - low) / 2;
+        if (list->statement[middle].begin > offset)
+        {
+            high = middle;
+        }
+        else
+        {
+            low = middle + 1;
+        }
+    }
+    return low;
+}
+
+/**
+ * @brief Bring the statements of a file up to date with its new contents
+ * @param[in,out] list The statements of the old contents
+ * @param[in] old_file The old contents
+ * @param[in] new_file The new contents
+ * @param[in,out] tokens A token stream to reuse
+ * @param[in] evaluate The function to evaluate each statement with
+ * @note Only the statements touched by the bytes which differ between the
+ * two are compiled. A statement is kept if the semicolons on either side of
+ * it are outside those bytes.
+ */
+static void update_statements(watch_list_t *list,
+                              input_file_t const *old_file,
+                              input_file_t const *new_file,
+                              token_stream_t *tokens,
+                              statement_function_t evaluate)
+{
+    // The bytes which changed are those after the common prefix and before
+    // the common suffix. Whole blocks are compared first, which memcmp does
+    // far faster than a byte at a time.
+    size_t common = old_file->size < new_file->size ? old_file->size
+                                                    : new_file->size;
+    size_t prefix = 0;
+    while (prefix + WATCH_BLOCK_SIZE <= common
+           && memcmp(old_file->data + prefix, new_file->data + prefix,
+                     WATCH_BLOCK_SIZE)
+                  == 0)
+    {
+        prefix += WATCH_BLOCK_SIZE;
+    }
+    while (prefix < common
+           && old_file->data[prefix] == new_file->data[prefix])
+    {
+        prefix += 1;
+    }
+    char const *old_end_byte = old_file->data + old_file->size;
+    char const *new_end_byte = new_file->data + new_file->size;
+    size_t suffix = 0;
+    while (suffix + WATCH_BLOCK_SIZE <= common - prefix
+           && memcmp(old_end_byte - suffix - WATCH_BLOCK_SIZE,
+                     new_end_byte - suffix - WATCH_BLOCK_SIZE,
+                     WATCH_BLOCK_SIZE)
+                  == 0)
+    {
+        suffix += WATCH_BLOCK_SIZE;
+    }
+    while (suffix < common - prefix
+           && old_end_byte[-1 - (ptrdiff_t)suffix]
+                  == new_end_byte[-1 - (ptrdiff_t)suffix])
+    {
+        suffix += 1;
+    }
+
+    size_t count = list->statement_count;
+    size_t first = find_statement_ending_after(list, prefix);
+    if (first == count && count > 0
+        && old_file->data[list->statement[count - 1].end - 1] != ';')
+    {
+        first = count - 1; // Text after it is part of it
+    }
+    size_t last = find_statement_beginning_after(list,
+                                                 old_file->size - suffix);
+    if (last < first)
+    {
+        last = first;
+    }
+
+    watch_update_t update = {new_file, 0, new_file->size, {0, 0, 0}, tokens,
+                             NULL, evaluate, StepLex, {NULL, 0, 0}};
+    if (first > 0)
+    {
+        watch_statement_t const *previous = &list->statement[first - 1];
+        update.begin = previous->end;
+        update.location = previous->location;
+    }
+    source_location_t old_end = {old_file->size, 0, 0};
+    if (last < count)
+    {
+        old_end = list->statement[last].location;
+        update.end = old_end.offset + new_file->size - old_file->size;
+    }
+
+    update.region = calloc(1, sizeof(*update.region));
+    ASSERT(update.region != NULL, "Failed to allocate AST\n");
+    compile_statements(&update);
+    if (update.region->statement_count == 0)
+    {
+        put_standalone_AST(&update.region->ast);
+        free(update.region);
+    }
+
+    for (size_t index = first; index < last; index++)
+    {
+        put_statement(&list->statement[index]);
+    }
+    size_t added = update.list.statement_count;
+    reserve_statements(list, first + added + count - last);
+    memmove(list->statement + first + added, list->statement + last,
+            (count - last) * sizeof(*list->statement));
+    if (added > 0)
+    {
+        memcpy(list->statement + first, update.list.statement,
+               added * sizeof(*list->statement));
+    }
+    list->statement_count = first + added + count - last;
+    free(update.list.statement);
+
+    // Later statements move with the end of the change, and the ones on the
+    // same line as it move along the line too
+    source_location_t new_end = update.location;
+    find_source_location(&new_end, new_file, update.end);
+    for (size_t index = first + added; index < list->statement_count; index++)
+    {
+        watch_statement_t *statement = &list->statement[index];
+        statement->begin += new_file->size - old_file->size;
+        statement->end += new_file->size - old_file->size;
+        statement->location.offset += new_file->size - old_file->size;
+        if (statement->location.line_number == old_end.line_number)
+        {
+            statement->location.column_number
+                += new_end.column_number - old_end.column_number;
+        }
+        statement->location.line_number
+            += new_end.line_number - old_end.line_number;
+    }
+}
+
+/**
+ * @brief Print the error messages caught while watching
+ * @param[in] capture The messages to print
+ * @note Watching goes on after an error, so the notice that attis is
+ * exiting is left out
+ */
+static void print_watch_errors(error_capture_t const *capture)
+{
+    static char const exiting[] = "Exiting...\n";
+    size_t exiting_size = sizeof(exiting) - 1;
+    error_capture_t shown = *capture;
+    if (shown.output_size >= exiting_size
+        && memcmp(shown.output + shown.output_size - exiting_size, exiting,
+                  exiting_size)
+               == 0)
+    {
+        shown.output_size -= exiting_size;
+    }
+    print_captured_errors(&shown);
+}
+
+/**
+ * @brief Print the answer of a file from its statements
+ * @param[in] list The statements of the file
+ * @param[in] print_answer The function to print the answer with
+ * @param[in] output Where to print the answer
+ */
+static void print_statements_answer(watch_list_t const *list,
+                                    print_answer_function_t print_answer,
+                                    FILE *output)
+{
+    watch_statement_t const *last = NULL;
+    watch_statement_t const *failed = NULL;
+    for (size_t index = 0; index < list->statement_count; index++)
+    {
+        watch_statement_t const *statement = &list->statement[index];
+        if (statement->error != NULL
+            && (failed == NULL || statement->error_step < failed->error_step))
+        {
+            failed = statement;
+        }
+        if (statement->root != NULL)
+        {
+            last = statement;
+        }
+    }
+    if (failed != NULL)
+    {
+        print_watch_errors(failed->error);
+        return;
+    }
+    if (last == NULL)
+    {
+        fprintf(error_output_stream(), "No statements to evaluate\n");
+        return;
+    }
+    print_answer(last->value, output);
+}
+
+/**
+ * @brief The state of a watch, for reading the file under an error trap
+ */
+typedef struct watch_t
+{
+    char const *filename;
+    input_file_t file; // The contents last compiled
+    watch_list_t list; // The statements of the contents last compiled
+    token_stream_t tokens;
+    statement_function_t evaluate;
+} watch_t;
+
+/**
+ * @brief Read the watched file and compile what changed
+ * @param[in,out] argument The watch_t to update
+ * @note If reading fails the old contents are kept
+ */
+static void update_watch_task(void *argument)
+{
+    watch_t *watch = argument;
+    input_file_t new_file = {NULL, 0, 0, InternNone};
+    read_file(&new_file, watch->filename);
+    update_statements(&watch->list, &watch->file, &new_file, &watch->tokens,
+                      watch->evaluate);
+    close_file(&watch->file);
+    watch->file = new_file;
+}
+
+/**
+ * @brief Compile a file, then compile it again each time it is written
+ * @param[in] filename The file to watch
+ * @param[in] evaluate The function to evaluate each statement with
+ * @param[in] print_answer The function to print each answer with
+ * @param[in] output Where to print each answer
+ * @note This never returns. Editors often save by writing a new file and
+ * renaming it over the old one, so the directory is watched rather than
+ * the file.
+ */
+noreturn void watch_file(char const *filename, statement_function_t evaluate,
+                         print_answer_function_t print_answer, FILE *output)
+{
+    int fd = inotify_init1(IN_CLOEXEC);
+    ASSERT(fd >= 0, "Failed to start watching files\n");
+    char const *name = strrchr(filename, '/');
+    char *directory;
+    if (name == NULL)
+    {
+        name = filename;
+        directory = strdup(".");
+    }
+    else
+    {
+        directory = strndup(filename, (size_t)(name - filename));
+        name += 1;
+        if (directory != NULL && directory[0] == '\0')
+        {
+            directory[0] = '/';
+        }
+    }
+    ASSERT(directory != NULL, "Failed to allocate directory name\n");
+    ASSERT(inotify_add_watch(fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO)
+               >= 0,
+           "Failed to watch directory: '%s'\n", directory);
+    free(directory);
+
+    watch_t watch = {filename, {NULL, 0, 0, InternNone}, {NULL, 0, 0},
+                     {NULL, NULL, NULL, NULL, 0, 0}, evaluate};
+    for (;;)
+    {
+        reset_stats();
+        begin_phase(PhaseWatch);
+        error_capture_t capture;
+        capture_errors(&capture, update_watch_task, &watch);
+        end_phase(PhaseWatch);
+        if (capture.failed)
+        {
+            print_watch_errors(&capture);
+        }
+        else
+        {
+            print_statements_answer(&watch.list, print_answer, output);
+        }
+        put_error_capture(&capture);
+        print_stats(stderr);
+        fflush(output);
+        fflush(stderr);
+
+        // Wait for the file to be written or replaced
+        int is_changed = 0;
+        while (!is_changed)
+        {
+            char buffer[sizeof(struct inotify_event) + NAME_MAX + 1]
+                __attribute__((aligned(__alignof__(struct inotify_event))));
+            ssize_t size = read(fd, buffer, sizeof(buffer));
+            if (size < 0 && errno == EINTR)
+            {
+                errno = 0;
+                continue;
+            }
+            ASSERT(size > 0, "Failed to read file changes\n");
+            for (char const *next = buffer; next < buffer + size;)
+            {
+                struct inotify_event const *event = (void const *)next;
+                if (event->len > 0 && strcmp(event->name, name) == 0)
+                {
+                    is_changed = 1;
+                }
+                next += sizeof(*event) + event->len;
+            }
+        }
+    }
+}